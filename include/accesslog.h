@@ -0,0 +1,115 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef ACCESSLOG_H
+#define ACCESSLOG_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define ACCESSLOG_RING_SIZE (128 * 1024)
+#define ACCESSLOG_SEEN 1024
+#define ACCESSLOG_ROUTE_MAX 512
+#define ACCESSLOG_ALIGN 8
+#define ACCESSLOG_FLUSH_MSEC 100
+#define ACCESSLOG_ROTATE_BYTES (64 * 1024 * 1024)
+#define ACCESSLOG_ROTATE_SEC 3600
+#define ACCESSLOG_PEER_SIZE 16
+
+typedef enum
+{
+    ACCESSLOG_ENTRY = 1,
+    ACCESSLOG_ROUTE = 2,
+} accesslog_type;
+
+typedef enum
+{
+    ACCESSLOG_H2  = 1,
+    ACCESSLOG_TLS = 2,
+} accesslog_flags;
+
+typedef enum
+{
+    ACCESSLOG_HTTP_1_0 = 10,
+    ACCESSLOG_HTTP_1_1 = 11,
+    ACCESSLOG_HTTP_2   = 20,
+} accesslog_version;
+
+// Every record starts with its type and its size in bytes, a multiple of ACCESSLOG_ALIGN.
+typedef struct accesslog_header
+{
+    uint16_t type;
+    uint16_t size;
+} accesslog_header;
+
+// One request. The peer is an IPv6 address, IPv4 ones mapped, all zero when unknown; route is the hash
+// of the path without its query, named by an earlier ACCESSLOG_ROUTE record.
+typedef struct accesslog_entry
+{
+    uint16_t type;
+    uint16_t size;
+    uint16_t status;
+    uint8_t  method;
+    uint8_t  version;
+    uint64_t start_nsec;
+    uint8_t  peer[ACCESSLOG_PEER_SIZE];
+    uint16_t peer_port;
+    uint16_t worker;
+    uint32_t route;
+    uint64_t bytes;
+    uint32_t read_usec;
+    uint32_t handle_usec;
+    uint32_t flags;
+    uint32_t reserved;
+} accesslog_entry;
+
+// Names a route: the path follows, NUL padded to the record's size.
+typedef struct accesslog_route
+{
+    uint16_t type;
+    uint16_t size;
+    uint32_t route;
+} accesslog_route;
+
+// One per worker thread, written by it alone and drained by the logger alone. head and tail count bytes
+// ever written and taken; seen remembers which routes this ring has already named.
+typedef struct accesslog_ring
+{
+    _Atomic uint64_t head;
+    _Atomic uint64_t tail;
+    _Atomic uint64_t dropped;
+    uint32_t         seen[ACCESSLOG_SEEN];
+    unsigned char    data[ACCESSLOG_RING_SIZE];
+} accesslog_ring;
+
+typedef struct accesslog_t
+{
+    int              ring_count;
+    int              threads;
+    uint64_t         rotate_bytes;
+    long             rotate_sec;
+    _Atomic uint64_t records;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t rotations;
+    _Atomic uint64_t write_failures;
+    char             path[PATH_MAX];
+    accesslog_ring   rings[];
+} accesslog_t;
+
+accesslog_t *accesslog_create(const char *path, int workers, int threads, uint64_t rotate_bytes, long rotate_sec);
+
+uint32_t accesslog_route_id(const char *path, size_t len);
+
+uint8_t accesslog_method(const char *method);
+
+const char *accesslog_method_name(uint8_t method);
+
+int accesslog_append(accesslog_t *log, int ring, const accesslog_entry *entry, const char *path, size_t path_len);
+
+uint64_t accesslog_dropped(const accesslog_t *log);
+
+_Noreturn void accesslog_writer(accesslog_t *log);
+
+#endif    // ACCESSLOG_H
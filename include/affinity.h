@@ -0,0 +1,25 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+#include <stddef.h>
+
+#define AFFINITY_MAX_CPUS 64
+
+// An ordered CPU list from -C; worker slot i runs on cpus[i % count].
+typedef struct cpu_list
+{
+    int count;
+    int cpus[AFFINITY_MAX_CPUS];
+} cpu_list;
+
+int affinity_parse(const char *str, cpu_list *list);
+
+int affinity_allowed(cpu_list *list);
+
+int affinity_pin(int cpu);
+
+int affinity_pin_set(const cpu_list *list);
+
+int affinity_local_memory(void);
+
+#endif    // AFFINITY_H
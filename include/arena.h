@@ -0,0 +1,41 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct arena_block
+{
+    struct arena_block *next;
+    size_t              size;
+    size_t              used;
+    _Alignas(ARENA_ALIGN) unsigned char data[];
+} arena_block;
+
+// Request-lifetime memory for one worker. Blocks are chained as they fill and kept across resets, so
+// after the first few requests nothing is allocated from the heap at all. last is the offset of the
+// newest allocation in current, which arena_grow can extend in place.
+typedef struct arena_t
+{
+    arena_block *first;
+    arena_block *current;
+    size_t       last;
+} arena_t;
+
+int arena_init(arena_t *arena);
+
+void *arena_alloc(arena_t *arena, size_t size);
+
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size);
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len);
+
+void arena_reset(arena_t *arena);
+
+void arena_free(arena_t *arena);
+
+#endif    // ARENA_H
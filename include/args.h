@@ -3,6 +3,9 @@
 #ifndef ARGS_H
 #define ARGS_H
 
+#include "affinity.h"
+#include "pool.h"
+#include "upgrade.h"
 #include <arpa/inet.h>
 #include <unistd.h>
 #define BUF_SIZE 50
@@ -10,15 +13,63 @@
 
 typedef struct args_t
 {
-    const char *addr;
-    in_port_t   port;
-    int         err;
-    int        *fd;
-    int         sockfd[2];
-    char        buf[BUF_SIZE];
-    int         workers;
-    char       *argv[2];
-    char       *envp[ARGC];
+    const char     *addr;
+    in_port_t       port;
+    int             err;
+    int            *fd;
+    int             sockfd[2];
+    char            buf[BUF_SIZE];
+    int             workers;
+    int             max_workers;
+    size_t          max_body;
+    char           *argv[2];
+    char           *envp[ARGC];
+    struct bloom_t *bloom;
+    struct wal_t   *wal;
+    struct pool_t  *pool;
+    cpu_list        cpus;
+    int             pin;
+    int             reuseport;
+    int             listeners[AFFINITY_MAX_CPUS];
+    const char     *wal_mode;
+    const char     *pack_path;
+    const char     *capture_path;
+    const char     *accesslog_path;
+    const char     *hot_list;
+    in_port_t       tls_port;
+    const char     *tls_cert;
+    const char     *tls_key;
+    long            commit_window;
+    char *const    *command;
+    struct ssl_ctx_st  *tls;
+    struct capture_t   *capture;
+    struct accesslog_t *accesslog;
+    struct respcache_t *respcache;
+    int  bloom_fd;
+    int  wal_fd;
+    int  listener_count;
+    int  tls_fd;
+    int  clients[UPGRADE_MAX_CLIENTS];
+    int  client_count;
+    int  handed_over;
+    long grace_msec;
+    long idle_timeout_msec;
+    int  threads;
+    int  backlog;
+    int  defer_accept;
+    int  channels[POOL_MAX_WORKERS][2];
+    int  drained;
+    int  idle_closed;
+    int  abandoned;
+    long capture_sample;
+    long rotate_mb;
+    long rotate_sec;
+    long rate_limit;
+    long rate_burst;
+    long client_conns;
+    int  limit_prefix4;
+    int  limit_prefix6;
+    long cache_mb;
 } args_t;
 
 void get_arguments(args_t *args, int argc, char *argv[]);
@@ -0,0 +1,43 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define BLOOM_MIN_ITEMS 65536
+#define BLOOM_HEADROOM 4
+#define BLOOM_BITS_PER_ITEM 10
+#define BLOOM_HASHES 7
+
+// Lives in a shared mapping created before fork, so every worker sets and tests the same bits.
+typedef struct bloom_t
+{
+    uint64_t         bits;
+    uint32_t         hashes;
+    _Atomic uint64_t checks;
+    _Atomic uint64_t negatives;
+    _Atomic uint64_t false_positives;
+    _Atomic uint64_t words[];
+} bloom_t;
+
+bloom_t *bloom_create(size_t items, int *fd);
+
+bloom_t *bloom_attach(int fd);
+
+void bloom_destroy(bloom_t *bloom);
+
+bloom_t *bloom_from_database(const char *name, int *fd, int *err);
+
+void bloom_add(bloom_t *bloom, const void *key, size_t size);
+
+int bloom_maybe(bloom_t *bloom, const void *key, size_t size);
+
+void bloom_false_positive(bloom_t *bloom);
+
+double bloom_false_positive_rate(const bloom_t *bloom);
+
+#endif    // BLOOM_H
@@ -0,0 +1,55 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define CAPTURE_RECORD_MAGIC 0x43415054u
+#define CAPTURE_MAX_HEAD (64 * 1024)
+#define CAPTURE_MAX_BODY (64 * 1024 * 1024)
+
+typedef enum
+{
+    CAPTURE_H2      = 1,    // arrived as an HTTP/2 stream; head is the HTTP/1 text it was rebuilt as
+    CAPTURE_CHUNKED = 2,    // the body arrived chunked and is stored decoded
+} capture_flags;
+
+// One request: this header, the request line and headers through the blank line, then the body.
+// Records are appended whole by one write, so workers never interleave inside one.
+typedef struct capture_record
+{
+    uint32_t magic;
+    uint32_t flags;
+    uint32_t head_len;
+    uint32_t body_len;
+    uint64_t arrival_nsec;
+    uint64_t connection;
+} capture_record;
+
+// Shared by every worker. Connection ids start from main's pid in the high bits, so a log appended to
+// by a server and its upgraded successor keeps them apart.
+typedef struct capture_t
+{
+    int              fd;
+    unsigned         sample;
+    _Atomic uint64_t next_connection;
+    _Atomic uint64_t records;
+    _Atomic uint64_t bytes;
+    _Atomic uint64_t failures;
+    char             path[PATH_MAX];
+} capture_t;
+
+capture_t *capture_create(const char *path, unsigned sample);
+
+uint64_t capture_connection(capture_t *capture);
+
+int capture_write(capture_t *capture, uint64_t connection, uint64_t arrival_nsec, uint32_t flags, const char *head, size_t head_len, const char *body, size_t body_len);
+
+ssize_t capture_read(int fd, capture_record *record, char **data, size_t *cap);
+
+#endif    // CAPTURE_H
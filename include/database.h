@@ -3,45 +3,54 @@
 #ifndef DATABASE_H
 #define DATABASE_H
 
-#include <ndbm.h>
+#include <stddef.h>
 #include <sys/types.h>
 
-#ifdef __APPLE__
-typedef size_t datum_size;
-#else
-typedef int datum_size;
-#endif
+#define USER_PK "user_pk"
+#define USER_DB "users"
+#define DB_BACKEND_ENV "DB_BACKEND"
+#define DB_BACKEND_DEFAULT "ndbm"
+
+typedef struct DBO DBO;
 
-#define TO_SIZE_T(x) ((size_t)(x))
+typedef void (*db_key_func)(const void *key, size_t k_size, void *ctx);
 
-typedef struct
+// Storage engine behind the database.h API. fetch returns a malloc'd copy of the value.
+typedef struct db_backend
 {
-    const void *dptr;
-    datum_size  dsize;
-} const_datum;
+    const char *name;
+    ssize_t (*open)(DBO *dbo, int *err);
+    void (*close)(DBO *dbo);
+    int (*store)(DBO *dbo, const void *key, size_t k_size, const void *value, size_t v_size);
+    void *(*fetch)(DBO *dbo, const void *key, size_t k_size, size_t *v_size);
+    int (*foreach)(DBO *dbo, db_key_func func, void *ctx);
+} db_backend;
+
+struct DBO
+{
+    char             *name;
+    void             *db;
+    const db_backend *backend;
+};
 
-#define MAKE_CONST_DATUM(str) ((const_datum){(str), (datum_size)strlen(str) + 1})
+extern const db_backend ndbm_backend;
 
-#define MAKE_CONST_DATUM_BYTE(str, size) ((const_datum){(str), (datum_size)(size)})
+const db_backend *database_backend(const char *name);
 
-#define USER_PK "user_pk"
+ssize_t database_open(DBO *dbo, int *err);
 
-typedef struct DBO
-{
-    char *name;
-    DBM  *db;
-} DBO;
+void database_close(DBO *dbo);
 
-ssize_t database_open(DBO *dbo, int *err);
+int store_string(DBO *dbo, const char *key, const char *value);
 
-int store_string(DBM *db, const char *key, const char *value);
+int store_int(DBO *dbo, const char *key, int value);
 
-int store_int(DBM *db, const char *key, int value);
+char *retrieve_string(DBO *dbo, const char *key);
 
-char *retrieve_string(DBM *db, const char *key);
+int retrieve_int(DBO *dbo, const char *key, int *result);
 
-int retrieve_int(DBM *db, const char *key, int *result);
+int database_foreach_key(DBO *dbo, db_key_func func, void *ctx);
 
-ssize_t verify_user(DBM *db, const void *key, size_t k_size, const void *value, size_t v_size);
+ssize_t verify_user(DBO *dbo, const void *key, size_t k_size, const void *value, size_t v_size);
 
 #endif    // DATABASE_H
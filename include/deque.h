@@ -0,0 +1,29 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef DEQUE_H
+#define DEQUE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define DEQUE_SIZE 256
+#define DEQUE_MASK (DEQUE_SIZE - 1)
+
+// Chase-Lev work-stealing deque: the owning thread pushes and pops at the bottom without locks, any
+// other thread steals the oldest entry from the top.
+typedef struct deque_t
+{
+    _Atomic int64_t  top;
+    _Atomic int64_t  bottom;
+    _Atomic uint64_t items[DEQUE_SIZE];
+} deque_t;
+
+void deque_init(deque_t *deque);
+
+int deque_push(deque_t *deque, uint64_t item);
+
+int deque_pop(deque_t *deque, uint64_t *item);
+
+int deque_steal(deque_t *deque, uint64_t *item);
+
+#endif    // DEQUE_H
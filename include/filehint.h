@@ -0,0 +1,22 @@
+#ifndef FILEHINT_H
+#define FILEHINT_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define FILEHINT_SEQUENTIAL_BYTES (1024 * 1024)
+#define FILEHINT_WINDOW_BYTES (2 * 1024 * 1024)
+#define FILEHINT_DROP_BYTES (16 * 1024 * 1024)
+#define FILEHINT_HOT_HITS 4
+
+void filehint_start(int fd, off_t size);
+
+void filehint_progress(int fd, off_t size, off_t from, off_t to);
+
+int filehint_cold(off_t size, uint32_t hits);
+
+void filehint_drop(int fd, off_t size);
+
+int filehint_warm(const char *list_path, const char *root, uint64_t *bytes);
+
+#endif    // FILEHINT_H
@@ -0,0 +1,124 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef H2_H
+#define H2_H
+
+#include "arena.h"
+#include "hpack.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_SIZE 24
+#define H2_FRAME_HEADER_SIZE 9
+#define H2_MAX_FRAME_SIZE 16384
+#define H2_MAX_STREAMS 100
+#define H2_DEFAULT_WINDOW 65535
+#define H2_STREAM_WINDOW (1024 * 1024)
+#define H2_CONNECTION_WINDOW (16 * 1024 * 1024)
+#define H2_READ_BUFFER_SIZE (64 * 1024)
+#define H2_WRITE_LOW_WATER (64 * 1024)
+#define H2_IDLE_MSEC 10000
+#define H2_POLL_MSEC 250
+
+struct request_t;
+
+typedef enum
+{
+    H2_BODY_HEAP,
+    H2_BODY_MAPPED,
+    H2_BODY_FILE,
+} h2_body_kind;
+
+// One piece of a response body waiting for flow control: bytes copied from the handler, a range of the
+// mapped pack, or a range of a file read as it is sent.
+typedef struct h2_body
+{
+    struct h2_body *next;
+    h2_body_kind    kind;
+    const char     *data;
+    char           *heap;
+    size_t          len;
+    size_t          off;
+    int             fd;
+    int             drop;
+} h2_body;
+
+typedef enum
+{
+    H2_STREAM_IDLE,
+    H2_STREAM_OPEN,
+    H2_STREAM_READY,
+    H2_STREAM_SENDING,
+} h2_stream_state;
+
+// A request arrives as header fields and DATA, is rebuilt as HTTP/1 text for the existing states, and
+// its response is caught from the handler's writes: the status line and headers become a HEADERS frame,
+// everything after them the body queue.
+typedef struct h2_stream
+{
+    uint32_t        id;
+    h2_stream_state state;
+    char           *head;
+    size_t          head_len;
+    size_t          head_cap;
+    char           *body;
+    size_t          body_len;
+    size_t          body_cap;
+    size_t          body_total;
+    char           *method;
+    char           *path;
+    char           *authority;
+    int             bad;
+    char           *response;
+    size_t          response_len;
+    size_t          response_cap;
+    int             head_done;
+    h2_body        *queue;
+    h2_body        *tail;
+    int64_t         send_window;
+    uint32_t        recv_consumed;
+} h2_stream;
+
+typedef struct h2_conn
+{
+    int               fd;
+    struct request_t *request;
+    arena_t           arena;
+    hpack_decoder     decoder;
+    hpack_encoder     encoder;
+    uint8_t          *rbuf;
+    size_t            rlen;
+    uint8_t          *wbuf;
+    size_t            wlen;
+    size_t            woff;
+    size_t            wcap;
+    uint8_t          *block;
+    size_t            block_len;
+    uint32_t          block_stream;
+    int               block_end_stream;
+    uint32_t          last_stream;
+    int64_t           peer_initial_window;
+    int64_t           send_window;
+    uint32_t          recv_consumed;
+    int               preface;
+    int               goaway;
+    int               goaway_sent;
+    int               eof;
+    int               failed;
+    size_t            next_pump;
+    h2_stream         streams[H2_MAX_STREAMS];
+} h2_conn;
+
+int h2_is_preface(const char *buf, size_t len);
+
+void h2_serve(struct request_t *request, const char *settings);
+
+ssize_t h2_write(h2_stream *stream, const void *buf, size_t len);
+
+ssize_t h2_write_mapped(h2_stream *stream, const void *data, size_t len);
+
+ssize_t h2_write_file(h2_stream *stream, int fd, off_t len, int drop);
+
+#endif    // H2_H
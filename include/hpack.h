@@ -0,0 +1,67 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HPACK_TABLE_SIZE 4096
+#define HPACK_ENTRY_OVERHEAD 32
+#define HPACK_MAX_ENTRIES (HPACK_TABLE_SIZE / HPACK_ENTRY_OVERHEAD)
+#define HPACK_STRING_MAX 8192
+#define HPACK_STATIC_ENTRIES 61
+
+// One dynamic table entry: name then value, each NUL terminated, in a single allocation.
+typedef struct hpack_entry
+{
+    char  *data;
+    size_t name_len;
+    size_t value_len;
+} hpack_entry;
+
+// The dynamic table as a ring, newest at head. size counts the RFC 7541 entry sizes, not our bytes.
+typedef struct hpack_table
+{
+    hpack_entry entries[HPACK_MAX_ENTRIES];
+    size_t      head;
+    size_t      count;
+    size_t      size;
+    size_t      max_size;
+} hpack_table;
+
+// A decoder owns the table the peer's encoder indexes into, and the scratch a Huffman string is
+// decoded into before it is handed on.
+typedef struct hpack_decoder
+{
+    hpack_table table;
+    size_t      limit;
+    char       *scratch;
+} hpack_decoder;
+
+// The encoder indexes the response headers that repeat from one response to the next; update is the
+// size change it still has to announce at the start of the next block.
+typedef struct hpack_encoder
+{
+    hpack_table table;
+    size_t      pending_size;
+    int         update;
+} hpack_encoder;
+
+typedef int (*hpack_emit)(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx);
+
+int hpack_decoder_init(hpack_decoder *decoder);
+
+int hpack_decode(hpack_decoder *decoder, const uint8_t *block, size_t len, hpack_emit emit, void *ctx);
+
+void hpack_decoder_free(hpack_decoder *decoder);
+
+void hpack_encoder_init(hpack_encoder *encoder);
+
+void hpack_encoder_resize(hpack_encoder *encoder, size_t max_size);
+
+size_t hpack_encode(hpack_encoder *encoder, uint8_t *out, size_t size, const char *name, size_t name_len, const char *value, size_t value_len);
+
+void hpack_encoder_free(hpack_encoder *encoder);
+
+#endif    // HPACK_H
@@ -4,36 +4,54 @@
 #define HTTP_H
 
 #include "fsm.h"
+#include <stdint.h>
+#include <sys/socket.h>
 #include <time.h>
 #include <unistd.h>
 
+#define DOC_ROOT "./public"
 #define RAW_SIZE 8192
+#define HEADER_MAX_SIZE (64 * 1024)
 #define BUFFER_SIZE 4096
 #define METHOD_SIZE 8
 #define PATH_SIZE 1024
 #define VERSION_SIZE 16
 #define MIME_SIZE 32
 #define PARAMS 10
+#define MAX_BODY_SIZE (1024 * 1024)
+#define CHUNK_LINE_SIZE 256
+#define STREAM_BUFFER_SIZE 4096
+#define HEADER_TIMEOUT_MSEC 3000
+#define BODY_TIMEOUT_MSEC 10000
+#define WRITE_STALL_MSEC 3000
 
 typedef enum
 {
     READ_REQUEST = 2,
     PARSER_REQUEST,
     CHECK_REQUEST,
+    READ_BODY,
     RESPONSE_HANDLER,
     ERROR_HANDLER,
+    HTTP2_CONNECTION,
 } fsm_state_http;
 
 typedef enum
 {
-    OK                    = 200,
-    BAD_REQUEST           = 400,
-    UNAUTHORIZED          = 401,
-    FORBIDDEN             = 403,
-    NOT_FOUND             = 404,
-    METHOD_NOT_ALLOWED    = 405,
-    INTERNAL_SERVER_ERROR = 500,
-    NOT_IMPLEMENTED       = 501,
+    OK                      = 200,
+    NOT_MODIFIED            = 304,
+    BAD_REQUEST             = 400,
+    UNAUTHORIZED            = 401,
+    FORBIDDEN               = 403,
+    NOT_FOUND               = 404,
+    METHOD_NOT_ALLOWED      = 405,
+    REQUEST_TIMEOUT         = 408,
+    LENGTH_REQUIRED         = 411,
+    PAYLOAD_TOO_LARGE       = 413,
+    EXPECTATION_FAILED      = 417,
+    HEADER_FIELDS_TOO_LARGE = 431,
+    INTERNAL_SERVER_ERROR   = 500,
+    NOT_IMPLEMENTED         = 501,
 } status_t;
 
 typedef struct param_t
@@ -44,22 +62,50 @@ typedef struct param_t
 
 typedef struct request_t
 {
-    char    *raw;
-    char     method[METHOD_SIZE];
-    char     path[PATH_SIZE];
-    char     version[VERSION_SIZE];
-    char     mime_type[MIME_SIZE];
-    param_t *params[PARAMS];
-    char    *response;
-    ssize_t  response_len;
-    off_t    content_len;
-    time_t   last_modified_time;
-    status_t status;
-    int      client_fd;
-    int      fd_num;
-    int     *sockfd;
-    int     *worker_id;
-    int      err;
+    char                      *raw;
+    size_t                     raw_len;
+    size_t                     raw_cap;
+    size_t                     header_len;
+    char                      *body;
+    size_t                     body_len;
+    size_t                     body_cap;
+    size_t                     max_body;
+    char                       method[METHOD_SIZE];
+    char                       path[PATH_SIZE];
+    char                       version[VERSION_SIZE];
+    char                       mime_type[MIME_SIZE];
+    param_t                   *params[PARAMS];
+    char                      *response;
+    ssize_t                    response_len;
+    off_t                      content_len;
+    time_t                     last_modified_time;
+    status_t                   status;
+    int                        chunked;
+    int                        client_fd;
+    int                        fd_num;
+    int                       *sockfd;
+    int                       *worker_id;
+    int                        err;
+    struct bloom_t            *bloom;
+    struct wal_t              *wal;
+    struct pool_t             *pool;
+    struct arena_t            *arena;
+    const struct pack_t       *pack;
+    const struct pack_variant *variant;
+    struct pathcache_t        *paths;
+    struct h2_stream          *h2;
+    struct capture_t          *capture;
+    uint64_t                   connection;
+    uint64_t                   arrival_nsec;
+    struct accesslog_t        *accesslog;
+    int                        log_ring;
+    int                        tls;
+    struct sockaddr_storage    peer;
+    uint64_t                   started_nsec;
+    uint64_t                   handler_nsec;
+    uint64_t                   sent;
+    struct respcache_t        *respcache;
+    uint32_t                   file_hits;
 } request_t;
 
 typedef struct
@@ -68,12 +114,6 @@ typedef struct
     const char *name;
 } StatusMapping;
 
-typedef struct
-{
-    const char *mime;
-    const char *name;
-} MimeMapping;
-
 typedef struct funcMapping
 {
     const char *method;
@@ -84,4 +124,6 @@ extern const struct fsm_transition transitions[];
 
 void fsm_run(void *args);
 
+void http_run_stream(request_t *request);
+
 #endif    // HTTP_H
@@ -0,0 +1,17 @@
+#ifndef JSON_H
+#define JSON_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#define JSON_MAX_DEPTH 64
+
+// key and value are NUL terminated views into the parsed buffer; strings arrive unescaped,
+// numbers and literals as written, nested objects and arrays as their raw JSON text.
+typedef int (*json_pair_func)(const char *key, size_t k_size, const char *value, size_t v_size, void *ctx);
+
+// Validates a single top-level object in one pass, decoding strings in place. Returns the number
+// of members, -1 for malformed input or -2 when func returns non-zero.
+ssize_t json_parse_object(char *buf, size_t len, json_pair_func func, void *ctx);
+
+#endif    // JSON_H
@@ -8,11 +8,16 @@
 #include <sys/socket.h>
 #include <unistd.h>
 
+#define MAX_STEERING_CPUS 64
+
 ssize_t convert_port(const char *str, in_port_t *port);
 int     tcp_server(const char *address, in_port_t port, int backlog, int *err);
+int     tcp_server_reuseport(const char *address, in_port_t port, int backlog, int *err);
+int     attach_cpu_steering(int fd, const int *cpus, int count, int *err);
 int     tcp_client(const char *address, in_port_t port, int *err);
 int     setSocketNonBlocking(int socket, int *err);
 int     setSocketBlocking(int socket, int *err);
+int     setSocketDeferAccept(int socket, int seconds, int *err);
 int     send_fd(int socket, int fd, int fd_num);
 int     recv_fd(int socket, int *fd_num);
 ssize_t send_number(int socket, int fd_num);
@@ -0,0 +1,68 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef PACK_H
+#define PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define PACK_MAGIC "TIAPACK1"
+#define PACK_MAGIC_SIZE 8
+#define PACK_VERSION 1
+
+// One way of sending an entry. Offsets are from the start of the pack; headers is every response
+// header after Date, through the blank line, so a hit costs no formatting beyond the status line.
+typedef struct pack_variant
+{
+    uint64_t headers;
+    uint64_t body;
+    uint64_t length;
+    uint64_t etag;
+    uint32_t headers_len;
+    uint32_t etag_len;
+} pack_variant;
+
+// gzip.length is 0 when the builder found nothing worth compressing.
+typedef struct pack_entry
+{
+    uint64_t     path;
+    uint32_t     path_len;
+    uint32_t     reserved;
+    int64_t      mtime;
+    pack_variant plain;
+    pack_variant gzip;
+} pack_entry;
+
+// A pack is the header, buckets seeds, count entries placed by the perfect hash, then the paths,
+// headers and bodies they point into.
+typedef struct pack_header
+{
+    char     magic[PACK_MAGIC_SIZE];
+    uint32_t version;
+    uint32_t count;
+    uint32_t buckets;
+    uint32_t reserved;
+    uint64_t size;
+} pack_header;
+
+// header is a copy; seeds and entries point into the mapping, which is page aligned.
+typedef struct pack_t
+{
+    const unsigned char *base;
+    size_t               size;
+    pack_header          header;
+    const uint32_t      *seeds;
+    const pack_entry    *entries;
+} pack_t;
+
+uint64_t pack_hash(const char *path, size_t len, uint32_t seed);
+
+int pack_open(pack_t *pack, const char *path);
+
+void pack_close(pack_t *pack);
+
+const pack_entry *pack_find(const pack_t *pack, const char *path, size_t len);
+
+const char *pack_data(const pack_t *pack, uint64_t offset);
+
+#endif    // PACK_H
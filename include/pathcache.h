@@ -0,0 +1,47 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef PATHCACHE_H
+#define PATHCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define PATHCACHE_SLOTS 512
+#define PATHCACHE_KEY_SIZE 256
+#define PATHCACHE_TTL_MSEC 10000
+#define PATHCACHE_NEGATIVE_TTL_MSEC 1000
+
+// How one request path resolved: status is the check_dir outcome (200, 403 or 404), index says the
+// path named a directory answered by its index.html. generation is the document root generation it was
+// resolved in; any change under the root moves it on and so invalidates every entry at once. hits
+// counts the requests for the path since it took the slot, carried over when it is resolved again.
+typedef struct pathcache_entry
+{
+    uint64_t generation;
+    uint64_t expires_nsec;
+    off_t    size;
+    time_t   mtime;
+    int      status;
+    int      index;
+    uint32_t hits;
+    size_t   key_len;
+    char     key[PATHCACHE_KEY_SIZE];
+} pathcache_entry;
+
+// Direct mapped and private to one worker thread, so it needs no locking; a colliding path simply
+// replaces the entry.
+typedef struct pathcache_t
+{
+    pathcache_entry *slots;
+} pathcache_t;
+
+int pathcache_init(pathcache_t *cache);
+
+const pathcache_entry *pathcache_find(const pathcache_t *cache, const char *path, uint64_t generation, uint64_t now_nsec);
+
+const pathcache_entry *pathcache_store(pathcache_t *cache, const char *path, uint64_t generation, uint64_t now_nsec, const pathcache_entry *result);
+
+void pathcache_free(pathcache_t *cache);
+
+#endif    // PATHCACHE_H
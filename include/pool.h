@@ -0,0 +1,123 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define POOL_MAX_WORKERS 64
+#define POOL_LATENCY_BUCKETS 32
+#define POOL_TICK_MSEC 250
+#define POOL_BUSY_HIGH 75
+#define POOL_BUSY_LOW 25
+#define POOL_IDLE_TICKS 20
+#define POOL_P99_TARGET_USEC 50000
+#define POOL_CGROUP_CPU_MAX "/sys/fs/cgroup/cpu.max"
+#define POOL_EWMA_SHIFT 3
+#define POOL_EWMA_SEED_NSEC 100000ULL
+
+typedef enum
+{
+    SLOT_FREE,
+    SLOT_IDLE,
+    SLOT_BUSY,
+    SLOT_RETIRING,
+} slot_state;
+
+typedef struct pool_slot
+{
+    pid_t            pid;
+    _Atomic int      state;
+    _Atomic int      busy_threads;
+    _Atomic uint64_t requests;
+    _Atomic uint64_t busy_nsec;
+    _Atomic uint64_t lib_generation;
+    _Atomic uint64_t service_ewma_nsec;
+} pool_slot;
+
+// Shared by main (dispatch count), the workers (busy time, latency) and the monitor, which samples
+// it every tick and publishes what it decided in the last_* fields for the metrics page.
+typedef struct pool_t
+{
+    int              min_workers;
+    int              max_workers;
+    int              threads;
+    _Atomic uint64_t dispatched;
+    _Atomic uint64_t received;
+    _Atomic uint64_t latency[POOL_LATENCY_BUCKETS];
+    _Atomic int      active;
+    _Atomic uint64_t last_queue;
+    _Atomic uint64_t last_busy_percent;
+    _Atomic uint64_t last_p99_usec;
+    _Atomic uint64_t spawned;
+    _Atomic uint64_t retired;
+    _Atomic uint64_t lib_generation;
+    _Atomic uint64_t lib_changed_nsec;
+    _Atomic uint64_t lib_reloads;
+    _Atomic uint64_t lib_reload_failures;
+    _Atomic uint64_t lib_last_reload_usec;
+    _Atomic uint64_t lib_max_reload_usec;
+    _Atomic uint64_t pack_generation;
+    _Atomic uint64_t docroot_generation;
+    _Atomic uint64_t shutdown_deadline_nsec;
+    _Atomic int      shutdown_killed;
+    _Atomic int      retire_requests;
+    _Atomic uint64_t idle_timeouts;
+    _Atomic uint64_t request_timeouts;
+    _Atomic uint64_t tls_handshakes;
+    _Atomic uint64_t tls_resumed;
+    _Atomic uint64_t tls_offloaded;
+    _Atomic uint64_t tls_failures;
+    _Atomic uint64_t h2_connections;
+    _Atomic uint64_t h2_streams;
+    _Atomic uint64_t limited_requests;
+    _Atomic uint64_t limited_connections;
+    _Atomic uint64_t cold_drops;
+    _Atomic uint64_t files_warmed;
+    _Atomic uint64_t bytes_warmed;
+    pool_slot        slots[POOL_MAX_WORKERS];
+} pool_t;
+
+// Main's book of what it has handed each worker and not yet heard back about. Main is the only
+// dispatcher, so this lives in its own memory rather than the shared pool.
+typedef struct pool_dispatch
+{
+    int in_flight[POOL_MAX_WORKERS];
+} pool_dispatch;
+
+// What the monitor remembers between ticks.
+typedef struct pool_sampler
+{
+    uint64_t when_nsec;
+    uint64_t busy_nsec;
+    uint64_t latency[POOL_LATENCY_BUCKETS];
+    int      quiet_ticks;
+} pool_sampler;
+
+pool_t *pool_create(int min_workers, int max_workers);
+
+int pool_cpu_limit(void);
+
+uint64_t pool_now_nsec(void);
+
+void pool_dispatched(pool_t *pool);
+
+uint64_t pool_worker_begin(pool_t *pool, int slot);
+
+void pool_worker_end(pool_t *pool, int slot, uint64_t started_nsec);
+
+void pool_sampler_init(const pool_t *pool, pool_sampler *sampler);
+
+int pool_sample(pool_t *pool, pool_sampler *sampler);
+
+int pool_pick_idle(const pool_t *pool);
+
+int pool_pick_worker(const pool_t *pool, const pool_dispatch *dispatch);
+
+int pool_pick_retiree(pool_t *pool, const pool_dispatch *dispatch);
+
+void pool_lib_reloaded(pool_t *pool, int slot, uint64_t generation, int loaded);
+
+#endif    // POOL_H
@@ -0,0 +1,54 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define RATELIMIT_SLOTS 4096
+#define RATELIMIT_MASK (RATELIMIT_SLOTS - 1)
+#define RATELIMIT_PROBES 8
+#define RATELIMIT_KEY_SIZE 16
+#define RATELIMIT_SCALE 1000
+#define RATELIMIT_PREFIX4 32
+#define RATELIMIT_PREFIX6 64
+
+typedef enum
+{
+    RATELIMIT_PASS,
+    RATELIMIT_RATE,
+    RATELIMIT_CONNECTIONS,
+} ratelimit_verdict;
+
+// One client prefix, IPv4 ones mapped into IPv6 before masking. tokens is in 1/RATELIMIT_SCALE of a
+// request and only catches up with the clock when the client is next seen; refill_nsec is 0 for a free
+// entry.
+typedef struct ratelimit_entry
+{
+    uint8_t  key[RATELIMIT_KEY_SIZE];
+    uint64_t refill_nsec;
+    uint32_t tokens;
+    uint32_t connections;
+} ratelimit_entry;
+
+// Main's alone, like the rest of its client table. A client probes at most RATELIMIT_PROBES entries
+// from its hash; when they are all taken the longest unseen one without open connections is reused.
+typedef struct ratelimit_table
+{
+    uint32_t        rate;
+    uint32_t        burst;
+    uint32_t        max_connections;
+    int             prefix4;
+    int             prefix6;
+    ratelimit_entry entries[RATELIMIT_SLOTS];
+} ratelimit_table;
+
+ratelimit_table *ratelimit_create(uint32_t rate, uint32_t burst, uint32_t max_connections, int prefix4, int prefix6);
+
+ratelimit_verdict ratelimit_admit(ratelimit_table *table, const struct sockaddr_storage *peer, uint64_t now_nsec, int *slot);
+
+void ratelimit_release(ratelimit_table *table, int slot);
+
+#endif    // RATELIMIT_H
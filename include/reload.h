@@ -0,0 +1,30 @@
+#ifndef RELOAD_H
+#define RELOAD_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define LIB_DIR "."
+#define LIB_NAME "libmylib.so"
+#define LIB_SNAPSHOT_FORMAT "./.libmylib.%d.%llu.so"
+#define RELOAD_LIB 1
+#define RELOAD_PACK 2
+
+// Workers never map the deploy path itself: every generation is a private copy, so the deployed file
+// can be rewritten in place and a new generation can be opened while the old one is still loaded.
+// Snapshots are named after the monitor that owns them, so a server handing over to an upgraded
+// binary never unlinks the new one's copies.
+void reload_path(char *buf, size_t size, pid_t owner, uint64_t generation);
+
+int reload_snapshot(pid_t owner, uint64_t generation);
+
+int reload_watch(const char *pack_path, int *pack_wd);
+
+int reload_changed(int fd, int pack_wd, const char *pack_path);
+
+int reload_watch_tree(const char *root);
+
+int reload_tree_changed(int fd, const char *root);
+
+#endif    // RELOAD_H
@@ -0,0 +1,62 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef RESPCACHE_H
+#define RESPCACHE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define RESPCACHE_DATA_SIZE 1000
+#define RESPCACHE_WAYS 8
+#define RESPCACHE_DEFAULT_MB 16
+
+// Guarded by a seqlock like shmdb's slots: odd seq means it is being written. data holds the key
+// followed by the rendered response; response_len is 0 for a free entry.
+typedef struct respcache_entry
+{
+    _Atomic uint32_t seq;
+    _Atomic uint32_t referenced;
+    uint64_t         hash;
+    uint16_t         key_len;
+    uint16_t         date_offset;
+    uint32_t         response_len;
+    char             data[RESPCACHE_DATA_SIZE];
+} respcache_entry;
+
+// A key can only live in the ways of its set, and CLOCK picks the victim among them. Readers take no
+// lock. Writers hold owner (their pid) for a copy at most. version moves on every invalidation in the
+// set, so a response rendered from storage read before it is never stored after it.
+typedef struct respcache_set
+{
+    _Atomic pid_t    owner;
+    uint32_t         hand;
+    _Atomic uint64_t version;
+    respcache_entry  entries[RESPCACHE_WAYS];
+} respcache_set;
+
+// Shared by every worker and the WAL applier, mapped before they fork.
+typedef struct respcache_t
+{
+    size_t           set_count;
+    size_t           size;
+    _Atomic uint64_t hits;
+    _Atomic uint64_t misses;
+    _Atomic uint64_t stores;
+    _Atomic uint64_t evictions;
+    _Atomic uint64_t invalidations;
+    respcache_set    sets[];
+} respcache_t;
+
+respcache_t *respcache_create(size_t bytes);
+
+ssize_t respcache_find(respcache_t *cache, const char *key, char *response, size_t size, size_t *date_offset);
+
+uint64_t respcache_version(respcache_t *cache, const char *key);
+
+void respcache_store(respcache_t *cache, const char *key, uint64_t version, const char *response, size_t len, size_t date_offset);
+
+void respcache_invalidate(respcache_t *cache, const char *key);
+
+#endif    // RESPCACHE_H
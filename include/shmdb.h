@@ -0,0 +1,44 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef SHMDB_H
+#define SHMDB_H
+
+#include "database.h"
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define SHMDB_MAGIC 0x53484442u
+#define SHMDB_VERSION 1
+#define SHMDB_SUFFIX ".shm"
+#define SHMDB_HEADER_SIZE 4096
+#define SHMDB_KEY_SIZE 112
+#define SHMDB_VALUE_SIZE 384
+#define SHMDB_CAPACITY 1024
+
+// Each slot is guarded by a seqlock: odd seq means a write is in progress, 0 means never used.
+typedef struct shmdb_slot
+{
+    _Atomic uint32_t seq;
+    uint32_t         hash;
+    uint16_t         k_size;
+    uint16_t         v_size;
+    uint32_t         reserved;
+    unsigned char    key[SHMDB_KEY_SIZE];
+    unsigned char    value[SHMDB_VALUE_SIZE];
+} shmdb_slot;
+
+// moved is set once a grown table has been renamed over this file; mappers must reopen. writing is
+// the index + 1 of the slot a store is copying into, so the next writer can mend it if that one died.
+typedef struct shmdb_header
+{
+    uint32_t         magic;
+    uint32_t         version;
+    uint64_t         capacity;
+    _Atomic uint64_t count;
+    _Atomic uint32_t moved;
+    _Atomic uint64_t writing;
+} shmdb_header;
+
+extern const db_backend shm_backend;
+
+#endif    // SHMDB_H
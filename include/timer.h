@@ -0,0 +1,46 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_TICK_MSEC 10
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1 << TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS - 1)
+#define TIMER_LEVELS 4
+
+// Lives inside whatever it times; pprev is NULL while it is not armed.
+typedef struct timer_entry
+{
+    struct timer_entry  *next;
+    struct timer_entry **pprev;
+    uint64_t             expires;
+    int                  id;
+} timer_entry;
+
+// Level 0 holds the next TIMER_SLOTS ticks one per slot, each level above covers TIMER_SLOTS times the
+// span of the one below and is cascaded down a slot at a time as the wheel turns. now is the next tick
+// to run, in TIMER_TICK_MSEC units of the caller's monotonic clock.
+typedef struct timer_wheel
+{
+    uint64_t     now;
+    size_t       count;
+    timer_entry *slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel;
+
+typedef void (*timer_func)(timer_entry *entry, void *ctx);
+
+void timer_init(timer_wheel *wheel, uint64_t now_msec);
+
+void timer_add(timer_wheel *wheel, timer_entry *entry, uint64_t expires_msec);
+
+void timer_cancel(timer_wheel *wheel, timer_entry *entry);
+
+size_t timer_advance(timer_wheel *wheel, uint64_t now_msec, timer_func func, void *ctx);
+
+long timer_next_msec(const timer_wheel *wheel, uint64_t now_msec, long limit_msec);
+
+#endif    // TIMER_H
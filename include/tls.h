@@ -0,0 +1,20 @@
+#ifndef TLS_H
+#define TLS_H
+
+#include "utils.h"
+#include <netinet/in.h>
+#include <openssl/ssl.h>
+
+#define TLS_HANDSHAKE_MSEC 3000
+#define TLS_STALL_MSEC 3000
+#define TLS_RELAY_BUFFER_SIZE 16384
+
+// One context for the whole server, made before the monitor forks, so every worker issues and accepts
+// the same session tickets.
+SSL_CTX *tls_context(const char *cert, const char *key);
+
+int tls_is_client(int fd, in_port_t port);
+
+void tls_serve(SSL_CTX *ctx, worker_t *worker, void (*func)(void *));
+
+#endif    // TLS_H
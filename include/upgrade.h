@@ -0,0 +1,27 @@
+#ifndef UPGRADE_H
+#define UPGRADE_H
+
+#include <sys/types.h>
+
+#define UPGRADE_ENV "UPGRADE_FD"
+#define UPGRADE_READY_TIMEOUT_MSEC 5000
+#define UPGRADE_MAX_CLIENTS 64
+
+// Tags sent alongside each descriptor; listeners are tagged with their slot (>= 0).
+#define UPGRADE_CLIENT (-1)
+#define UPGRADE_BLOOM (-2)
+#define UPGRADE_WAL (-3)
+#define UPGRADE_END (-4)
+#define UPGRADE_READY (-5)
+#define UPGRADE_TLS_LISTENER (-6)
+
+// Runs the binary on disk again with the same arguments; the child finds its end of the channel in
+// UPGRADE_ENV. Returns the child's pid, or -1.
+pid_t upgrade_spawn(char *const argv[], int *channel);
+
+// The channel this process was started with by an old generation, or -1 on a normal start.
+int upgrade_channel(void);
+
+int upgrade_wait_ready(int channel, int timeout_msec);
+
+#endif    // UPGRADE_H
@@ -4,6 +4,8 @@
 #define SIG_UTILS_H
 
 #include <signal.h>
+#include <stddef.h>
+#include <sys/socket.h>
 
 // clang-format off
 #define PRINT_VERBOSE(fmt, ...) do { if (verbose >= 1) printf(fmt, __VA_ARGS__); } while (0)
@@ -11,17 +13,40 @@
 // clang-format on
 
 // 1 = Verbose, 2 = Debug
-extern int                   verbose;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
-extern volatile sig_atomic_t running;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+extern int                   verbose;              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+extern volatile sig_atomic_t running;              // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+extern volatile sig_atomic_t upgrade_requested;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
 
-typedef struct
+// peer and tls are only filled in when there is an access log to write them to.
+typedef struct worker_t
 {
-    int sockfd;
-    int worker_id;
-    int fd_num;
-    int client_fd;
+    int                     sockfd;
+    int                     worker_id;
+    int                     thread_id;
+    int                     fd_num;
+    int                     client_fd;
+    int                     tls;
+    size_t                  max_body;
+    struct bloom_t         *bloom;
+    struct wal_t           *wal;
+    struct pool_t          *pool;
+    struct arena_t         *arena;
+    struct pack_t          *pack;
+    struct pathcache_t     *paths;
+    struct capture_t       *capture;
+    struct accesslog_t     *accesslog;
+    struct respcache_t     *respcache;
+    struct sockaddr_storage peer;
 } worker_t;
 
+typedef struct
+{
+    const char *mime;
+    const char *name;
+} MimeMapping;
+
 void setup_signal(void);
 
+const char *mime_to_string(const char *mime);
+
 #endif
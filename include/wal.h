@@ -0,0 +1,82 @@
+// cppcheck-suppress-file unusedStructMember
+
+#ifndef WAL_H
+#define WAL_H
+
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define WAL_SUFFIX ".wal"
+#define WAL_RECORD_MAGIC 0x57414c52u
+#define WAL_WINDOW_USEC 2000
+#define WAL_TRUNCATE_SIZE (1024 * 1024)
+#define WAL_APPLY_INTERVAL_SEC 1
+#define WAL_LEADER_TIMEOUT_SEC 1
+
+typedef enum
+{
+    WAL_NONE,       // append only, the page cache decides when it reaches disk
+    WAL_BATCHED,    // one fdatasync per commit window covers every writer in it
+    WAL_STRICT,     // every record is synced by its own writer
+} wal_mode;
+
+// Offsets are logical sequence numbers; the file holds [base, end) and is truncated once fully applied.
+typedef struct wal_t
+{
+    pthread_mutex_t lock;
+    pthread_cond_t  synced_cond;
+    pthread_cond_t  appended_cond;
+    wal_mode        mode;
+    long            window_usec;
+    int             syncing;
+    uint64_t        base;
+    uint64_t        end_lsn;
+    uint64_t        synced_lsn;
+    uint64_t        applied_lsn;
+    uint64_t        records;
+    uint64_t        syncs;
+    uint64_t        bad_records;      // times the applier stopped at a record it could not read
+    uint64_t        failed_stores;    // logged pairs that never reached the store
+    char            db_name[PATH_MAX];
+    char            path[PATH_MAX];
+} wal_t;
+
+// One POST: header followed by pairs of (uint32 k_size, uint32 v_size, key, value).
+typedef struct wal_record
+{
+    uint32_t magic;
+    uint32_t size;
+    uint32_t checksum;
+    uint32_t pairs;
+} wal_record;
+
+typedef struct wal_batch
+{
+    unsigned char *buf;
+    size_t         len;
+    size_t         cap;
+} wal_batch;
+
+int wal_parse_mode(const char *str, wal_mode *mode);
+
+wal_t *wal_create(const char *db_name, wal_mode mode, long window_usec, int *fd);
+
+wal_t *wal_attach(int fd);
+
+ssize_t wal_recover(wal_t *wal, int *err);
+
+void wal_batch_init(wal_batch *batch);
+
+ssize_t wal_batch_add(wal_batch *batch, const char *key, const char *value);
+
+void wal_batch_free(wal_batch *batch);
+
+ssize_t wal_commit(wal_t *wal, wal_batch *batch, int *err);
+
+struct respcache_t;
+
+_Noreturn void wal_applier(wal_t *wal, struct respcache_t *cache);
+
+#endif    // WAL_H
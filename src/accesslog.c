@@ -0,0 +1,428 @@
+#include "accesslog.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define ROUTE_TABLE_SIZE 65536
+#define ROUTE_TABLE_MASK (ROUTE_TABLE_SIZE - 1)
+#define STAMP_SIZE 32
+#define NSEC_PER_SEC 1000000000L
+#define NSEC_PER_MSEC 1000000L
+
+static const char *const methods[] = {"-", "GET", "HEAD", "POST", "PUT", "DELETE", "PATCH", "OPTIONS", "CONNECT", "TRACE"};
+
+// The logger's own view of every route it has written, so each new file can start with all their names.
+typedef struct route_name
+{
+    uint32_t route;
+    char    *path;
+} route_name;
+
+typedef struct writer_t
+{
+    accesslog_t   *log;
+    int            fd;
+    uint64_t       size;
+    uint64_t       opened_nsec;
+    route_name    *routes;
+    size_t         route_count;
+    unsigned char *buf;
+} writer_t;
+
+static size_t   align_size(size_t size);
+static void     ring_put(accesslog_ring *ring, uint64_t at, const void *data, size_t len);
+static void     ring_take(const accesslog_ring *ring, uint64_t from, void *to, size_t len);
+static uint64_t monotonic_nsec(void);
+static int      write_all(writer_t *writer, const void *buf, size_t len);
+static void     remember_route(writer_t *writer, const unsigned char *record, size_t size);
+static int      write_routes(writer_t *writer);
+static int      open_file(writer_t *writer);
+static void     rotate(writer_t *writer);
+static void     drain(writer_t *writer);
+
+static size_t align_size(size_t size)
+{
+    return (size + ACCESSLOG_ALIGN - 1) & ~(size_t)(ACCESSLOG_ALIGN - 1);
+}
+
+// Rings come before the workers fork, one for every thread of every slot the pool may fill.
+accesslog_t *accesslog_create(const char *path, int workers, int threads, uint64_t rotate_bytes, long rotate_sec)
+{
+    accesslog_t *log;
+    size_t       size;
+    int          fd;
+
+    // the writer opens the file for itself, but a path that cannot be written should stop the server now
+    fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if(fd == -1)
+    {
+        perror(path);
+        return NULL;
+    }
+    close(fd);
+
+    size = sizeof(accesslog_t) + (size_t)workers * (size_t)threads * sizeof(accesslog_ring);
+    log  = (accesslog_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(log == MAP_FAILED)
+    {
+        perror("access log mmap");
+        return NULL;
+    }
+    log->ring_count   = workers * threads;
+    log->threads      = threads;
+    log->rotate_bytes = rotate_bytes;
+    log->rotate_sec   = rotate_sec;
+    snprintf(log->path, sizeof(log->path), "%s", path);
+    return log;
+}
+
+// FNV-1a; 0 is kept for "no route yet" in the rings' seen tables.
+uint32_t accesslog_route_id(const char *path, size_t len)
+{
+    uint32_t hash = FNV_OFFSET;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= FNV_PRIME;
+    }
+    return hash ? hash : 1;
+}
+
+uint8_t accesslog_method(const char *method)
+{
+    for(size_t i = 1; i < sizeof(methods) / sizeof(methods[0]); i++)
+    {
+        if(strcmp(method, methods[i]) == 0)
+        {
+            return (uint8_t)i;
+        }
+    }
+    return 0;
+}
+
+const char *accesslog_method_name(uint8_t method)
+{
+    return method < sizeof(methods) / sizeof(methods[0]) ? methods[method] : methods[0];
+}
+
+static void ring_put(accesslog_ring *ring, uint64_t at, const void *data, size_t len)
+{
+    size_t offset = (size_t)(at % ACCESSLOG_RING_SIZE);
+    size_t first  = ACCESSLOG_RING_SIZE - offset < len ? ACCESSLOG_RING_SIZE - offset : len;
+
+    memcpy(ring->data + offset, data, first);
+    memcpy(ring->data, (const unsigned char *)data + first, len - first);
+}
+
+static void ring_take(const accesslog_ring *ring, uint64_t from, void *to, size_t len)
+{
+    size_t offset = (size_t)(from % ACCESSLOG_RING_SIZE);
+    size_t first  = ACCESSLOG_RING_SIZE - offset < len ? ACCESSLOG_RING_SIZE - offset : len;
+
+    memcpy(to, ring->data + offset, first);
+    memcpy((unsigned char *)to + first, ring->data, len - first);
+}
+
+// Never waits: when the logger has fallen a whole ring behind, the entry is counted and dropped. A route
+// this ring has not named yet goes in just ahead of the entry.
+int accesslog_append(accesslog_t *log, int ring_index, const accesslog_entry *entry, const char *path, size_t path_len)
+{
+    accesslog_ring *ring = &log->rings[ring_index];
+    uint32_t       *seen = &ring->seen[entry->route % ACCESSLOG_SEEN];
+    unsigned char   name[sizeof(accesslog_route) + ACCESSLOG_ROUTE_MAX + ACCESSLOG_ALIGN];
+    size_t          name_size;
+    uint64_t        head;
+
+    name_size = 0;
+    if(*seen != entry->route)
+    {
+        accesslog_route record;
+
+        if(path_len > ACCESSLOG_ROUTE_MAX)
+        {
+            path_len = ACCESSLOG_ROUTE_MAX;
+        }
+        name_size     = align_size(sizeof(record) + path_len + 1);
+        record.type   = ACCESSLOG_ROUTE;
+        record.size   = (uint16_t)name_size;
+        record.route  = entry->route;
+        memset(name, 0, name_size);
+        memcpy(name, &record, sizeof(record));
+        memcpy(name + sizeof(record), path, path_len);
+    }
+
+    head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if(head + name_size + sizeof(*entry) - atomic_load_explicit(&ring->tail, memory_order_acquire) > ACCESSLOG_RING_SIZE)
+    {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return -1;
+    }
+    if(name_size > 0)
+    {
+        ring_put(ring, head, name, name_size);
+        *seen = entry->route;
+    }
+    ring_put(ring, head + name_size, entry, sizeof(*entry));
+    atomic_store_explicit(&ring->head, head + name_size + sizeof(*entry), memory_order_release);
+    return 0;
+}
+
+uint64_t accesslog_dropped(const accesslog_t *log)
+{
+    uint64_t dropped = 0;
+
+    for(int i = 0; i < log->ring_count; i++)
+    {
+        dropped += atomic_load_explicit(&log->rings[i].dropped, memory_order_relaxed);
+    }
+    return dropped;
+}
+
+static uint64_t monotonic_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static int write_all(writer_t *writer, const void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while(done < len)
+    {
+        ssize_t written = write(writer->fd, (const unsigned char *)buf + done, len - done);
+
+        if(written == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            atomic_fetch_add(&writer->log->write_failures, 1);
+            return -1;
+        }
+        done += (size_t)written;
+    }
+    writer->size += len;
+    atomic_fetch_add(&writer->log->bytes, len);
+    return 0;
+}
+
+// record is the raw route record of size bytes, which is larger than accesslog_route.
+static void remember_route(writer_t *writer, const unsigned char *record, size_t size)
+{
+    accesslog_route route;
+    size_t          slot;
+
+    memcpy(&route, record, sizeof(route));
+    slot = route.route & ROUTE_TABLE_MASK;
+
+    // a full table still logs every name as it comes; only the copies at the top of new files stop
+    if(writer->route_count >= ROUTE_TABLE_SIZE / 2)
+    {
+        return;
+    }
+    while(writer->routes[slot].path)
+    {
+        if(writer->routes[slot].route == route.route)
+        {
+            return;
+        }
+        slot = (slot + 1) & ROUTE_TABLE_MASK;
+    }
+    writer->routes[slot].path = strndup((const char *)record + sizeof(route), size - sizeof(route));
+    if(writer->routes[slot].path)
+    {
+        writer->routes[slot].route = route.route;
+        writer->route_count++;
+    }
+}
+
+// A file read on its own still names every route, whichever file first saw it.
+static int write_routes(writer_t *writer)
+{
+    for(size_t i = 0; i < ROUTE_TABLE_SIZE; i++)
+    {
+        unsigned char   name[sizeof(accesslog_route) + ACCESSLOG_ROUTE_MAX + ACCESSLOG_ALIGN];
+        accesslog_route record;
+        size_t          len;
+
+        if(!writer->routes[i].path)
+        {
+            continue;
+        }
+        len          = strlen(writer->routes[i].path);
+        record.type  = ACCESSLOG_ROUTE;
+        record.size  = (uint16_t)align_size(sizeof(record) + len + 1);
+        record.route = writer->routes[i].route;
+        memset(name, 0, record.size);
+        memcpy(name, &record, sizeof(record));
+        memcpy(name + sizeof(record), writer->routes[i].path, len);
+        if(write_all(writer, name, record.size) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int open_file(writer_t *writer)
+{
+    struct stat file_stat;
+
+    writer->fd = open(writer->log->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if(writer->fd == -1)
+    {
+        perror(writer->log->path);
+        return -1;
+    }
+    if(fstat(writer->fd, &file_stat) == -1)
+    {
+        perror(writer->log->path);
+        close(writer->fd);
+        writer->fd = -1;
+        return -1;
+    }
+    writer->size        = (uint64_t)file_stat.st_size;
+    writer->opened_nsec = monotonic_nsec();
+    return write_routes(writer);
+}
+
+// The full file is renamed aside with the time it was closed, numbered if that name is taken.
+static void rotate(writer_t *writer)
+{
+    char      stamp[STAMP_SIZE];
+    char      rotated[PATH_MAX + STAMP_SIZE + STAMP_SIZE];
+    time_t    now;
+    struct tm local;
+
+    now = time(NULL);
+    localtime_r(&now, &local);
+    strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &local);
+    snprintf(rotated, sizeof(rotated), "%s.%s", writer->log->path, stamp);
+    for(int n = 1; access(rotated, F_OK) == 0; n++)
+    {
+        snprintf(rotated, sizeof(rotated), "%s.%s-%d", writer->log->path, stamp, n);
+    }
+
+    if(rename(writer->log->path, rotated) == -1)
+    {
+        perror("access log rotate");
+        writer->opened_nsec = monotonic_nsec();
+        return;
+    }
+    close(writer->fd);
+    atomic_fetch_add(&writer->log->rotations, 1);
+    PRINT_VERBOSE("access log rotated to %s\n", rotated);
+    open_file(writer);
+}
+
+// Takes everything each ring holds in one copy; whole records only ever become visible, so the copy
+// always ends on a record boundary.
+static void drain(writer_t *writer)
+{
+    for(int i = 0; i < writer->log->ring_count; i++)
+    {
+        accesslog_ring *ring = &writer->log->rings[i];
+        uint64_t        tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint64_t        head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        size_t          len  = (size_t)(head - tail);
+        uint64_t        records;
+
+        if(len == 0)
+        {
+            continue;
+        }
+        ring_take(ring, tail, writer->buf, len);
+        atomic_store_explicit(&ring->tail, head, memory_order_release);
+
+        records = 0;
+        for(size_t at = 0; at + sizeof(accesslog_header) <= len;)
+        {
+            accesslog_header header;
+
+            // records are packed by size, so they are read out of the buffer rather than in place
+            memcpy(&header, writer->buf + at, sizeof(header));
+            if(header.size < sizeof(accesslog_header) || header.size > len - at)
+            {
+                break;
+            }
+            if(header.type == ACCESSLOG_ROUTE)
+            {
+                if(header.size > sizeof(accesslog_route))
+                {
+                    remember_route(writer, writer->buf + at, header.size);
+                }
+            }
+            else
+            {
+                records++;
+            }
+            at += header.size;
+        }
+        if(writer->fd >= 0 && write_all(writer, writer->buf, len) == 0)
+        {
+            atomic_fetch_add(&writer->log->records, records);
+        }
+    }
+}
+
+// Runs beside the workers until the monitor stops it, which it does only once they have exited, so
+// the last drain finds everything they logged.
+_Noreturn void accesslog_writer(accesslog_t *log)
+{
+    const struct timespec nap = {0, ACCESSLOG_FLUSH_MSEC * NSEC_PER_MSEC};
+    writer_t              writer;
+
+    memset(&writer, 0, sizeof(writer));
+    writer.log    = log;
+    writer.routes = (route_name *)calloc(ROUTE_TABLE_SIZE, sizeof(route_name));
+    writer.buf    = (unsigned char *)malloc(ACCESSLOG_RING_SIZE);
+    if(!writer.routes || !writer.buf || open_file(&writer) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    PRINT_VERBOSE("access log writer (PID: %d) started\n", getpid());
+
+    while(running)
+    {
+        nanosleep(&nap, NULL);
+        drain(&writer);
+        if(writer.fd == -1 || writer.size >= log->rotate_bytes || (writer.size > 0 && monotonic_nsec() - writer.opened_nsec >= (uint64_t)log->rotate_sec * NSEC_PER_SEC))
+        {
+            if(writer.fd == -1)
+            {
+                open_file(&writer);
+            }
+            else
+            {
+                rotate(&writer);
+            }
+        }
+    }
+    drain(&writer);
+
+    if(writer.fd >= 0)
+    {
+        close(writer.fd);
+    }
+    for(size_t i = 0; i < ROUTE_TABLE_SIZE; i++)
+    {
+        free(writer.routes[i].path);
+    }
+    free(writer.routes);
+    free(writer.buf);
+    exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,132 @@
+#include "affinity.h"
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define BASE_TEN 10
+
+// Accepts "all" or comma separated CPUs and ranges such as "0-3,8,10-11".
+int affinity_parse(const char *str, cpu_list *list)
+{
+    const char *pos = str;
+
+    list->count = 0;
+    if(strcmp(str, "all") == 0)
+    {
+        return affinity_allowed(list);
+    }
+
+    while(*pos)
+    {
+        char *end;
+        long  first;
+        long  last;
+
+        errno = 0;
+        first = strtol(pos, &end, BASE_TEN);
+        if(errno != 0 || end == pos || first < 0 || first >= CPU_SETSIZE)
+        {
+            return -1;
+        }
+        last = first;
+        if(*end == '-')
+        {
+            pos  = end + 1;
+            last = strtol(pos, &end, BASE_TEN);
+            if(errno != 0 || end == pos || last < first || last >= CPU_SETSIZE)
+            {
+                return -1;
+            }
+        }
+
+        for(long cpu = first; cpu <= last; cpu++)
+        {
+            if(list->count == AFFINITY_MAX_CPUS)
+            {
+                return -1;
+            }
+            list->cpus[list->count++] = (int)cpu;
+        }
+
+        if(*end == ',')
+        {
+            end++;
+        }
+        else if(*end != '\0')
+        {
+            return -1;
+        }
+        pos = end;
+    }
+    return list->count > 0 ? 0 : -1;
+}
+
+int affinity_allowed(cpu_list *list)
+{
+    cpu_set_t set;
+
+    list->count = 0;
+    if(sched_getaffinity(0, sizeof(set), &set) == -1)
+    {
+        return -1;
+    }
+    for(int cpu = 0; cpu < CPU_SETSIZE && list->count < AFFINITY_MAX_CPUS; cpu++)
+    {
+        if(CPU_ISSET((size_t)cpu, &set))
+        {
+            list->cpus[list->count++] = cpu;
+        }
+    }
+    return list->count > 0 ? 0 : -1;
+}
+
+int affinity_pin(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET((size_t)cpu, &set);
+    if(sched_setaffinity(0, sizeof(set), &set) == -1)
+    {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+int affinity_pin_set(const cpu_list *list)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    for(int i = 0; i < list->count; i++)
+    {
+        CPU_SET((size_t)list->cpus[i], &set);
+    }
+    if(sched_setaffinity(0, sizeof(set), &set) == -1)
+    {
+        perror("sched_setaffinity");
+        return -1;
+    }
+    return 0;
+}
+
+// Pages first touched from now on come from the node of the CPU doing the touching.
+int affinity_local_memory(void)
+{
+    if(syscall(SYS_set_mempolicy, MPOL_LOCAL, NULL, 0) == -1)
+    {
+        // kernels without NUMA support refuse the call; there is nothing to place then
+        if(errno != ENOSYS && errno != EINVAL)
+        {
+            perror("set_mempolicy");
+        }
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static size_t       align_up(size_t size);
+static arena_block *block_create(size_t size);
+
+static size_t align_up(size_t size)
+{
+    return (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static arena_block *block_create(size_t size)
+{
+    arena_block *block;
+
+    block = (arena_block *)malloc(sizeof(arena_block) + size);
+    if(!block)
+    {
+        perror("arena malloc");
+        return NULL;
+    }
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+int arena_init(arena_t *arena)
+{
+    arena->first   = block_create(ARENA_BLOCK_SIZE);
+    arena->current = arena->first;
+    arena->last    = 0;
+    return arena->first ? 0 : -1;
+}
+
+// Bumps within the current block, moving on to the next kept block when it is big enough, otherwise
+// chaining in a new one sized for the allocation.
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_block *block = arena->current;
+
+    size = align_up(size ? size : 1);
+    if(block->size - block->used < size)
+    {
+        if(block->next && block->next->size >= size)
+        {
+            block       = block->next;
+            block->used = 0;
+        }
+        else
+        {
+            arena_block *fresh = block_create(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+
+            if(!fresh)
+            {
+                return NULL;
+            }
+            // a kept block too small for this takes the fresh one's place, so the chain never grows
+            // longer than the most blocks one request has needed
+            if(block->next)
+            {
+                fresh->next = block->next->next;
+                free(block->next);
+            }
+            block->next = fresh;
+            block       = fresh;
+        }
+        arena->current = block;
+    }
+
+    arena->last = block->used;
+    block->used += size;
+    return block->data + arena->last;
+}
+
+// Extends the newest allocation where it lies when its block has room, otherwise copies it forward.
+void *arena_grow(arena_t *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    arena_block *block = arena->current;
+    void        *grown;
+
+    if(ptr == NULL)
+    {
+        return arena_alloc(arena, new_size);
+    }
+    if((unsigned char *)ptr == block->data + arena->last && block->size - arena->last >= align_up(new_size))
+    {
+        block->used = arena->last + align_up(new_size);
+        return ptr;
+    }
+
+    grown = arena_alloc(arena, new_size);
+    if(grown)
+    {
+        memcpy(grown, ptr, old_size < new_size ? old_size : new_size);
+    }
+    return grown;
+}
+
+char *arena_strndup(arena_t *arena, const char *str, size_t len)
+{
+    char *copy;
+
+    len  = strnlen(str, len);
+    copy = (char *)arena_alloc(arena, len + 1);
+    if(copy)
+    {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+// Only the first block is rewound; the rest are rewound as arena_alloc reaches them again.
+void arena_reset(arena_t *arena)
+{
+    arena->current       = arena->first;
+    arena->current->used = 0;
+    arena->last          = 0;
+}
+
+void arena_free(arena_t *arena)
+{
+    while(arena->first)
+    {
+        arena_block *next = arena->first->next;
+
+        free(arena->first);
+        arena->first = next;
+    }
+    arena->current = NULL;
+}
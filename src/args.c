@@ -1,6 +1,14 @@
 #include "args.h"
+#include "accesslog.h"
+#include "affinity.h"
+#include "database.h"
+#include "http.h"
 #include "networking.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "respcache.h"
 #include "utils.h"
+#include "wal.h"
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
@@ -10,10 +18,17 @@
 
 #define UNKNOWN_OPTION_MESSAGE_LEN 22
 #define BASE_TEN 10
-#define MAX_WORKERS 10
+#define MAX_WORKERS POOL_MAX_WORKERS
 #define INADDRESS "0.0.0.0"
 #define PORT "8080"
 #define WORKERS 3
+#define GRACE_MSEC 10000
+#define IDLE_TIMEOUT_MSEC 10000
+#define MAX_THREADS 64
+#define BYTES_PER_MB (1024 * 1024)
+#define RATE_LIMIT_MAX 1000000
+#define IPV4_BITS 32
+#define IPV6_BITS 128
 
 static _Noreturn void usage(const char *binary_name, int exit_code, const char *message);
 static int            convert_str_t_l(const char *str);
@@ -33,6 +48,33 @@ static _Noreturn void usage(const char *binary_name, int exit_code, const char *
     fputs("  -v <verbose>,    --verbose <verbose>        To show more logs.\n", stderr);
     fputs("  -d <debug>,    --debug <debug>        To show detail logs.\n", stderr);
     fputs("  -w <debug>,    --worker <worker>        worker number.\n", stderr);
+    fputs("  -W <workers>,    --max-workers <workers>        scale up to this many workers under load.\n", stderr);
+    fputs("  -s <store>,    --store <store>        database backend (ndbm or shm).\n", stderr);
+    fputs("  -l <mode>,    --wal <mode>        write-ahead log POSTs (none, batched or strict).\n", stderr);
+    fputs("  -c <usec>,    --commit-window <usec>        batched WAL commit window.\n", stderr);
+    fputs("  -m <bytes>,    --max-body <bytes>        largest request body accepted.\n", stderr);
+    fputs("  -C <cpus>,    --cpus <cpus>        pin workers to these CPUs (e.g. 0-3,6 or all).\n", stderr);
+    fputs("  -R,    --reuseport        per-CPU SO_REUSEPORT listeners, one worker each.\n", stderr);
+    fputs("  -g <msec>,    --grace <msec>        how long shutdown waits for in-flight requests.\n", stderr);
+    fputs("  -b <count>,    --backlog <count>        listen backlog (capped by net.core.somaxconn).\n", stderr);
+    fputs("  -D <sec>,    --defer-accept <sec>        accept only once request bytes arrive (TCP_DEFER_ACCEPT).\n", stderr);
+    fputs("  -i <msec>,    --idle-timeout <msec>        close accepted connections that send nothing for this long.\n", stderr);
+    fputs("  -t <threads>,    --threads <threads>        threads per worker, sharing work through stealing run queues.\n", stderr);
+    fputs("  -k <pack>,    --pack <pack>        serve static files from a pack built by packer, remapped when rebuilt.\n", stderr);
+    fputs("  -S <port>,    --tls-port <port>        also serve HTTPS on this port (needs -E and -K).\n", stderr);
+    fputs("  -E <file>,    --cert <file>        PEM certificate chain for HTTPS.\n", stderr);
+    fputs("  -K <file>,    --key <file>        PEM private key for HTTPS.\n", stderr);
+    fputs("  -x <file>,    --capture <file>        append every request received to this log, for replay.\n", stderr);
+    fputs("  -X <n>,    --sample <n>        capture one connection in n.\n", stderr);
+    fputs("  -L <file>,    --access-log <file>        binary access log, written in the background (see logfmt).\n", stderr);
+    fputs("  -M <mb>,    --rotate-size <mb>        start a new access log after this many megabytes.\n", stderr);
+    fputs("  -T <sec>,    --rotate-time <sec>        start a new access log after this many seconds.\n", stderr);
+    fputs("  -r <n>,    --rate <n>        requests per second allowed from one client (429 beyond it).\n", stderr);
+    fputs("  -B <n>,    --burst <n>        requests a client may send at once before its rate applies.\n", stderr);
+    fputs("  -n <n>,    --client-conns <n>        connections one client may hold open (503 beyond it).\n", stderr);
+    fputs("  -U <mb>,    --user-cache <mb>        memory for rendered /httptest/user responses, 0 turns it off.\n", stderr);
+    fputs("  -H <file>,    --hot <file>        files under the document root to read into the page cache at startup.\n", stderr);
+    fputs("  -N <v4>/<v6>,    --prefix <v4>/<v6>        prefix lengths that count as one client, default 32/64.\n", stderr);
     exit(exit_code);
 }
 
@@ -41,21 +83,80 @@ void get_arguments(args_t *args, int argc, char *argv[])
     int opt;
 
     static struct option long_options[] = {
-        {"address", optional_argument, NULL, 'a'},
-        {"port",    optional_argument, NULL, 'p'},
-        {"verbose", optional_argument, NULL, 'v'},
-        {"debug",   optional_argument, NULL, 'd'},
-        {"worker",  optional_argument, NULL, 'w'},
-        {"help",    no_argument,       NULL, 'h'},
-        {NULL,      0,                 NULL, 0  }
+        {"address",       optional_argument, NULL, 'a'},
+        {"port",          optional_argument, NULL, 'p'},
+        {"verbose",       optional_argument, NULL, 'v'},
+        {"debug",         optional_argument, NULL, 'd'},
+        {"worker",        optional_argument, NULL, 'w'},
+        {"max-workers",   optional_argument, NULL, 'W'},
+        {"store",         optional_argument, NULL, 's'},
+        {"wal",           optional_argument, NULL, 'l'},
+        {"commit-window", optional_argument, NULL, 'c'},
+        {"max-body",      optional_argument, NULL, 'm'},
+        {"cpus",          optional_argument, NULL, 'C'},
+        {"reuseport",     no_argument,       NULL, 'R'},
+        {"grace",         optional_argument, NULL, 'g'},
+        {"backlog",       optional_argument, NULL, 'b'},
+        {"defer-accept",  optional_argument, NULL, 'D'},
+        {"idle-timeout",  optional_argument, NULL, 'i'},
+        {"threads",       optional_argument, NULL, 't'},
+        {"pack",          optional_argument, NULL, 'k'},
+        {"tls-port",      optional_argument, NULL, 'S'},
+        {"cert",          optional_argument, NULL, 'E'},
+        {"key",           optional_argument, NULL, 'K'},
+        {"capture",       optional_argument, NULL, 'x'},
+        {"sample",        optional_argument, NULL, 'X'},
+        {"access-log",    optional_argument, NULL, 'L'},
+        {"rotate-size",   optional_argument, NULL, 'M'},
+        {"rotate-time",   optional_argument, NULL, 'T'},
+        {"rate",          optional_argument, NULL, 'r'},
+        {"burst",         optional_argument, NULL, 'B'},
+        {"client-conns",  optional_argument, NULL, 'n'},
+        {"prefix",        optional_argument, NULL, 'N'},
+        {"user-cache",    optional_argument, NULL, 'U'},
+        {"hot",           optional_argument, NULL, 'H'},
+        {"help",          no_argument,       NULL, 'h'},
+        {NULL,            0,                 NULL, 0  }
     };
 
     args->addr = getenv("ADDR") ? getenv("ADDR") : INADDRESS;
     convert_port(getenv("PORT") ? getenv("PORT") : PORT, &args->port);
+    if(getenv("TLS_PORT"))
+    {
+        convert_port(getenv("TLS_PORT"), &args->tls_port);
+    }
     verbose       = convert_str_t_l(getenv("VERBOSE"));
     args->workers = convert_str_t_l(getenv("WORKERS")) != -1 ? convert_str_t_l(getenv("WORKERS")) : WORKERS;
+    args->max_workers       = convert_str_t_l(getenv("MAX_WORKERS"));
+    args->wal_mode          = getenv("WAL");
+    args->pack_path         = getenv("PACK");
+    args->tls_cert          = getenv("TLS_CERT");
+    args->tls_key           = getenv("TLS_KEY");
+    args->capture_path      = getenv("CAPTURE");
+    args->capture_sample    = convert_str_t_l(getenv("CAPTURE_SAMPLE")) > 0 ? convert_str_t_l(getenv("CAPTURE_SAMPLE")) : 1;
+    args->accesslog_path    = getenv("ACCESS_LOG");
+    args->hot_list          = getenv("HOT_FILES");
+    args->rotate_mb         = ACCESSLOG_ROTATE_BYTES / BYTES_PER_MB;
+    args->rotate_sec        = ACCESSLOG_ROTATE_SEC;
+    args->rate_limit        = getenv("RATE_LIMIT") ? convert_str_t_l(getenv("RATE_LIMIT")) : 0;
+    args->client_conns      = convert_str_t_l(getenv("CLIENT_CONNECTIONS")) > 0 ? convert_str_t_l(getenv("CLIENT_CONNECTIONS")) : 0;
+    args->limit_prefix4     = RATELIMIT_PREFIX4;
+    args->limit_prefix6     = RATELIMIT_PREFIX6;
+    args->cache_mb          = convert_str_t_l(getenv("USER_CACHE_MB")) != -1 ? convert_str_t_l(getenv("USER_CACHE_MB")) : RESPCACHE_DEFAULT_MB;
+    args->commit_window     = WAL_WINDOW_USEC;
+    args->max_body          = MAX_BODY_SIZE;
+    args->grace_msec        = convert_str_t_l(getenv("GRACE_MSEC")) != -1 ? convert_str_t_l(getenv("GRACE_MSEC")) : GRACE_MSEC;
+    args->backlog           = convert_str_t_l(getenv("BACKLOG")) > 0 ? convert_str_t_l(getenv("BACKLOG")) : SOMAXCONN;
+    args->idle_timeout_msec = convert_str_t_l(getenv("IDLE_TIMEOUT_MSEC")) > 0 ? convert_str_t_l(getenv("IDLE_TIMEOUT_MSEC")) : IDLE_TIMEOUT_MSEC;
+    args->threads           = convert_str_t_l(getenv("THREADS")) > 0 ? convert_str_t_l(getenv("THREADS")) : 1;
 
-    while((opt = getopt_long(argc, argv, "ha:p:A:P:w:vd", long_options, NULL)) != -1)
+    // held to the same bound as -r: the token bucket counts rate * RATELIMIT_SCALE in 32 bits
+    if(getenv("RATE_LIMIT") && (args->rate_limit < 1 || args->rate_limit > RATE_LIMIT_MAX))
+    {
+        usage(argv[0], EXIT_FAILURE, "RATE_LIMIT must be a positive number of requests per second");
+    }
+
+    while((opt = getopt_long(argc, argv, "ha:p:A:P:w:W:s:l:c:m:C:Rg:b:D:i:t:k:S:E:K:x:X:L:M:T:r:B:n:N:U:H:vd", long_options, NULL)) != -1)
     {
         switch(opt)
         {
@@ -83,6 +184,166 @@ void get_arguments(args_t *args, int argc, char *argv[])
                     usage(argv[0], EXIT_FAILURE, msg);
                 }
                 break;
+            case 'W':
+                args->max_workers = convert_str_t_l(optarg);
+                if(args->max_workers > MAX_WORKERS || args->max_workers < 1)
+                {
+                    char msg[BUF_SIZE];
+                    snprintf(msg, sizeof(msg), "Max workers must be between 1 and %d", MAX_WORKERS);
+                    usage(argv[0], EXIT_FAILURE, msg);
+                }
+                break;
+            case 's':
+                if(!database_backend(optarg))
+                {
+                    usage(argv[0], EXIT_FAILURE, "Store must be ndbm or shm");
+                }
+                // workers open the database inside libmylib.so, so hand the choice down through the environment
+                setenv(DB_BACKEND_ENV, optarg, 1);
+                break;
+            case 'l':
+                args->wal_mode = optarg;
+                break;
+            case 'c':
+                args->commit_window = convert_str_t_l(optarg);
+                if(args->commit_window < 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Commit window must be a number of microseconds");
+                }
+                break;
+            case 'm':
+                if(convert_str_t_l(optarg) < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Max body must be a positive number of bytes");
+                }
+                args->max_body = (size_t)convert_str_t_l(optarg);
+                break;
+            case 'C':
+                if(affinity_parse(optarg, &args->cpus) == -1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "CPUs must be a list such as 0-3,6 or all");
+                }
+                args->pin = 1;
+                break;
+            case 'R':
+                args->reuseport = 1;
+                break;
+            case 'g':
+                args->grace_msec = convert_str_t_l(optarg);
+                if(args->grace_msec < 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Grace must be a number of milliseconds");
+                }
+                break;
+            case 'b':
+                args->backlog = convert_str_t_l(optarg);
+                if(args->backlog < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Backlog must be a positive number");
+                }
+                break;
+            case 'D':
+                args->defer_accept = convert_str_t_l(optarg);
+                if(args->defer_accept < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Defer accept must be a positive number of seconds");
+                }
+                break;
+            case 'i':
+                args->idle_timeout_msec = convert_str_t_l(optarg);
+                if(args->idle_timeout_msec < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Idle timeout must be a positive number of milliseconds");
+                }
+                break;
+            case 't':
+                args->threads = convert_str_t_l(optarg);
+                if(args->threads > MAX_THREADS || args->threads < 1)
+                {
+                    char msg[BUF_SIZE];
+                    snprintf(msg, sizeof(msg), "Threads must be between 1 and %d", MAX_THREADS);
+                    usage(argv[0], EXIT_FAILURE, msg);
+                }
+                break;
+            case 'k':
+                args->pack_path = optarg;
+                break;
+            case 'S':
+                if(convert_port(optarg, &args->tls_port) != 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "TLS port must be between 1 and 65535");
+                }
+                break;
+            case 'E':
+                args->tls_cert = optarg;
+                break;
+            case 'K':
+                args->tls_key = optarg;
+                break;
+            case 'x':
+                args->capture_path = optarg;
+                break;
+            case 'X':
+                args->capture_sample = convert_str_t_l(optarg);
+                if(args->capture_sample < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Sample must be a positive number of connections");
+                }
+                break;
+            case 'L':
+                args->accesslog_path = optarg;
+                break;
+            case 'M':
+                args->rotate_mb = convert_str_t_l(optarg);
+                if(args->rotate_mb < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Rotate size must be a positive number of megabytes");
+                }
+                break;
+            case 'T':
+                args->rotate_sec = convert_str_t_l(optarg);
+                if(args->rotate_sec < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Rotate time must be a positive number of seconds");
+                }
+                break;
+            case 'r':
+                args->rate_limit = convert_str_t_l(optarg);
+                if(args->rate_limit < 1 || args->rate_limit > RATE_LIMIT_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Rate must be a positive number of requests per second");
+                }
+                break;
+            case 'B':
+                args->rate_burst = convert_str_t_l(optarg);
+                if(args->rate_burst < 1 || args->rate_burst > RATE_LIMIT_MAX)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Burst must be a positive number of requests");
+                }
+                break;
+            case 'n':
+                args->client_conns = convert_str_t_l(optarg);
+                if(args->client_conns < 1)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Client connections must be a positive number");
+                }
+                break;
+            case 'N':
+                if(sscanf(optarg, "%d/%d", &args->limit_prefix4, &args->limit_prefix6) != 2 || args->limit_prefix4 < 0 || args->limit_prefix4 > IPV4_BITS || args->limit_prefix6 < 0 || args->limit_prefix6 > IPV6_BITS)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Prefix must be <0-32>/<0-128>, e.g. 24/56");
+                }
+                break;
+            case 'U':
+                args->cache_mb = convert_str_t_l(optarg);
+                if(args->cache_mb < 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "User cache must be a number of megabytes, 0 for none");
+                }
+                break;
+            case 'H':
+                args->hot_list = optarg;
+                break;
             case 'h':
                 usage(argv[0], EXIT_SUCCESS, NULL);
             case '?':
@@ -98,6 +359,52 @@ void get_arguments(args_t *args, int argc, char *argv[])
                 usage(argv[0], EXIT_FAILURE, NULL);
         }
     }
+
+    if(args->tls_port != 0 && (!args->tls_cert || !args->tls_key))
+    {
+        usage(argv[0], EXIT_FAILURE, "HTTPS needs a certificate (-E) and a key (-K)");
+    }
+    // reuseport workers accept for themselves, and only main's dispatch knows about the second listener
+    if(args->tls_port != 0 && args->reuseport)
+    {
+        usage(argv[0], EXIT_FAILURE, "HTTPS is not available with -R");
+    }
+
+    // each reuseport listener belongs to the worker pinned to its CPU, so the pool is fixed at one per CPU
+    if(args->reuseport)
+    {
+        if(!args->pin && affinity_allowed(&args->cpus) == -1)
+        {
+            usage(argv[0], EXIT_FAILURE, "Unable to read the allowed CPUs");
+        }
+        args->pin         = 1;
+        args->workers     = args->cpus.count < MAX_WORKERS ? args->cpus.count : MAX_WORKERS;
+        args->max_workers = args->workers;
+    }
+
+    // -w is the floor the pool never shrinks below; without -W it may grow to the CPUs we are allowed
+    if(args->max_workers < 1)
+    {
+        args->max_workers = pool_cpu_limit();
+    }
+    if(args->max_workers > MAX_WORKERS)
+    {
+        args->max_workers = MAX_WORKERS;
+    }
+    if(args->max_workers < args->workers)
+    {
+        args->max_workers = args->workers;
+    }
+
+    if(args->wal_mode)
+    {
+        wal_mode mode;
+
+        if(wal_parse_mode(args->wal_mode, &mode) == -1)
+        {
+            usage(argv[0], EXIT_FAILURE, "WAL mode must be none, batched or strict");
+        }
+    }
 }
 
 int convert_str_t_l(const char *str)
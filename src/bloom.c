@@ -0,0 +1,206 @@
+#include "bloom.h"
+#include "database.h"
+#include "utils.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+#define MIX_SHIFT 33
+#define MIX_MULT 0xff51afd7ed558ccdULL
+#define WORD_BITS 64
+#define WORD_SHIFT 6
+
+static size_t   bloom_size(uint64_t bits);
+static uint64_t bloom_hash(const void *key, size_t size);
+static void     count_key(const void *key, size_t k_size, void *ctx);
+static void     add_key(const void *key, size_t k_size, void *ctx);
+
+static size_t bloom_size(uint64_t bits)
+{
+    return sizeof(bloom_t) + (size_t)(bits / WORD_BITS) * sizeof(uint64_t);
+}
+
+static uint64_t bloom_hash(const void *key, size_t size)
+{
+    const unsigned char *p    = (const unsigned char *)key;
+    uint64_t             hash = FNV64_OFFSET;
+
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= FNV64_PRIME;
+    }
+    return hash;
+}
+
+// Backed by a memfd rather than an anonymous mapping so an upgraded server can be handed the same bits.
+bloom_t *bloom_create(size_t items, int *fd)
+{
+    bloom_t *bloom;
+    uint64_t bits;
+
+    bits = WORD_BITS;
+    while(bits < (uint64_t)items * BLOOM_BITS_PER_ITEM)
+    {
+        bits <<= 1;
+    }
+
+    *fd = memfd_create("bloom", MFD_CLOEXEC);
+    if(*fd == -1 || ftruncate(*fd, (off_t)bloom_size(bits)) == -1)
+    {
+        perror("bloom memfd");
+        goto fail;
+    }
+
+    bloom = (bloom_t *)mmap(NULL, bloom_size(bits), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if(bloom == MAP_FAILED)
+    {
+        perror("bloom mmap");
+        goto fail;
+    }
+
+    // a fresh memfd is zero-filled, so only the geometry needs setting
+    bloom->bits   = bits;
+    bloom->hashes = BLOOM_HASHES;
+    return bloom;
+
+fail:
+    if(*fd != -1)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+    return NULL;
+}
+
+bloom_t *bloom_attach(int fd)
+{
+    struct stat st;
+    bloom_t    *bloom;
+
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(bloom_t))
+    {
+        perror("bloom attach");
+        return NULL;
+    }
+
+    bloom = (bloom_t *)mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(bloom == MAP_FAILED)
+    {
+        perror("bloom mmap");
+        return NULL;
+    }
+    return bloom;
+}
+
+void bloom_destroy(bloom_t *bloom)
+{
+    if(bloom)
+    {
+        munmap(bloom, bloom_size(bloom->bits));
+    }
+}
+
+static void count_key(const void *key, size_t k_size, void *ctx)
+{
+    (void)key;
+    (void)k_size;
+    (*(size_t *)ctx)++;
+}
+
+static void add_key(const void *key, size_t k_size, void *ctx)
+{
+    bloom_add((bloom_t *)ctx, key, k_size);
+}
+
+// Sized with headroom over the current key count since it cannot be resized once workers share it.
+bloom_t *bloom_from_database(const char *name, int *fd, int *err)
+{
+    char     db_name[PATH_MAX];
+    DBO      dbo;
+    bloom_t *bloom;
+    size_t   keys;
+
+    // DBO names are writable, so the caller's string is copied rather than cast
+    if(snprintf(db_name, sizeof(db_name), "%s", name) >= (int)sizeof(db_name))
+    {
+        *err = ENAMETOOLONG;
+        return NULL;
+    }
+    dbo.name = db_name;
+    if(database_open(&dbo, err) < 0)
+    {
+        return NULL;
+    }
+
+    keys = 0;
+    database_foreach_key(&dbo, count_key, &keys);
+
+    bloom = bloom_create(keys * BLOOM_HEADROOM > BLOOM_MIN_ITEMS ? keys * BLOOM_HEADROOM : BLOOM_MIN_ITEMS, fd);
+    if(bloom)
+    {
+        database_foreach_key(&dbo, add_key, bloom);
+        PRINT_VERBOSE("bloom filter: %zu keys, %llu bits\n", keys, (unsigned long long)bloom->bits);
+    }
+
+    database_close(&dbo);
+    return bloom;
+}
+
+// Double hashing (Kirsch-Mitzenmacher): bit i = h1 + i * h2, with h2 forced odd.
+void bloom_add(bloom_t *bloom, const void *key, size_t size)
+{
+    uint64_t h1 = bloom_hash(key, size);
+    uint64_t h2 = ((h1 ^ (h1 >> MIX_SHIFT)) * MIX_MULT) | 1u;
+
+    for(uint32_t i = 0; i < bloom->hashes; i++)
+    {
+        uint64_t bit = (h1 + i * h2) & (bloom->bits - 1);
+
+        atomic_fetch_or_explicit(&bloom->words[bit >> WORD_SHIFT], 1ULL << (bit & (WORD_BITS - 1)), memory_order_relaxed);
+    }
+}
+
+int bloom_maybe(bloom_t *bloom, const void *key, size_t size)
+{
+    uint64_t h1 = bloom_hash(key, size);
+    uint64_t h2 = ((h1 ^ (h1 >> MIX_SHIFT)) * MIX_MULT) | 1u;
+
+    atomic_fetch_add_explicit(&bloom->checks, 1, memory_order_relaxed);
+
+    for(uint32_t i = 0; i < bloom->hashes; i++)
+    {
+        uint64_t bit = (h1 + i * h2) & (bloom->bits - 1);
+
+        if(!(atomic_load_explicit(&bloom->words[bit >> WORD_SHIFT], memory_order_relaxed) & (1ULL << (bit & (WORD_BITS - 1)))))
+        {
+            atomic_fetch_add_explicit(&bloom->negatives, 1, memory_order_relaxed);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Called when the filter said "maybe" but storage had nothing.
+void bloom_false_positive(bloom_t *bloom)
+{
+    atomic_fetch_add_explicit(&bloom->false_positives, 1, memory_order_relaxed);
+}
+
+// Fraction of lookups for absent keys that the filter failed to reject.
+double bloom_false_positive_rate(const bloom_t *bloom)
+{
+    uint64_t negatives = atomic_load(&bloom->negatives);
+    uint64_t fp        = atomic_load(&bloom->false_positives);
+
+    if(negatives + fp == 0)
+    {
+        return 0.0;
+    }
+    return (double)fp / (double)(negatives + fp);
+}
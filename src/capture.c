@@ -0,0 +1,160 @@
+#include "capture.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define CONNECTION_SHIFT 32
+#define CAPTURE_IOV 3
+
+static ssize_t read_exactly(int fd, void *buf, size_t len);
+
+// Anonymous shared memory is enough: an upgraded server opens the log again and appends after us.
+capture_t *capture_create(const char *path, unsigned sample)
+{
+    capture_t *capture;
+
+    capture = (capture_t *)mmap(NULL, sizeof(capture_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(capture == MAP_FAILED)
+    {
+        perror("capture mmap");
+        return NULL;
+    }
+
+    capture->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP);
+    if(capture->fd == -1)
+    {
+        perror("capture open");
+        munmap(capture, sizeof(capture_t));
+        return NULL;
+    }
+    capture->sample = sample > 0 ? sample : 1;
+    snprintf(capture->path, sizeof(capture->path), "%s", path);
+    atomic_store(&capture->next_connection, (uint64_t)getpid() << CONNECTION_SHIFT);
+    return capture;
+}
+
+// Sampling is by connection, so every stream of a sampled HTTP/2 connection is kept together. 0 means
+// the connection is not recorded.
+uint64_t capture_connection(capture_t *capture)
+{
+    uint64_t id;
+
+    if(!capture)
+    {
+        return 0;
+    }
+    id = atomic_fetch_add(&capture->next_connection, 1) + 1;
+    return id % capture->sample == 0 ? id : 0;
+}
+
+// O_APPEND makes each writev land whole at the end of the file, whichever worker or thread sends it.
+int capture_write(capture_t *capture, uint64_t connection, uint64_t arrival_nsec, uint32_t flags, const char *head, size_t head_len, const char *body, size_t body_len)
+{
+    capture_record record;
+    struct iovec   iov[CAPTURE_IOV];
+    ssize_t        written;
+    size_t         total;
+
+    if(head_len > CAPTURE_MAX_HEAD || body_len > CAPTURE_MAX_BODY)
+    {
+        atomic_fetch_add(&capture->failures, 1);
+        return -1;
+    }
+
+    record.magic        = CAPTURE_RECORD_MAGIC;
+    record.flags        = flags;
+    record.head_len     = (uint32_t)head_len;
+    record.body_len     = (uint32_t)body_len;
+    record.arrival_nsec = arrival_nsec;
+    record.connection   = connection;
+
+    iov[0].iov_base = &record;
+    iov[0].iov_len  = sizeof(record);
+    iov[1].iov_base = (void *)(uintptr_t)head;
+    iov[1].iov_len  = head_len;
+    iov[2].iov_base = (void *)(uintptr_t)body;
+    iov[2].iov_len  = body_len;
+    total           = sizeof(record) + head_len + body_len;
+
+    do
+    {
+        written = writev(capture->fd, iov, body_len > 0 ? CAPTURE_IOV : CAPTURE_IOV - 1);
+    } while(written == -1 && errno == EINTR);
+
+    // a short append would tear the log for every record after it, so it is counted and never retried
+    if(written != (ssize_t)total)
+    {
+        atomic_fetch_add(&capture->failures, 1);
+        return -1;
+    }
+    atomic_fetch_add(&capture->records, 1);
+    atomic_fetch_add(&capture->bytes, total);
+    return 0;
+}
+
+static ssize_t read_exactly(int fd, void *buf, size_t len)
+{
+    size_t done = 0;
+
+    while(done < len)
+    {
+        ssize_t nread = read(fd, (char *)buf + done, len - done);
+
+        if(nread == 0)
+        {
+            break;
+        }
+        if(nread == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        done += (size_t)nread;
+    }
+    return (ssize_t)done;
+}
+
+// Reads the next record's head and body into *data, grown as needed. Returns 1 for a record, 0 at the
+// end of the log and -1 on a read error or a torn or foreign record.
+ssize_t capture_read(int fd, capture_record *record, char **data, size_t *cap)
+{
+    ssize_t nread;
+    size_t  len;
+
+    nread = read_exactly(fd, record, sizeof(*record));
+    if(nread == 0)
+    {
+        return 0;
+    }
+    if(nread != (ssize_t)sizeof(*record) || record->magic != CAPTURE_RECORD_MAGIC || record->head_len > CAPTURE_MAX_HEAD || record->body_len > CAPTURE_MAX_BODY)
+    {
+        return -1;
+    }
+
+    len = (size_t)record->head_len + record->body_len;
+    if(len + 1 > *cap)
+    {
+        char *grown = (char *)realloc(*data, len + 1);
+        if(!grown)
+        {
+            return -1;
+        }
+        *data = grown;
+        *cap  = len + 1;
+    }
+    if(read_exactly(fd, *data, len) != (ssize_t)len)
+    {
+        return -1;
+    }
+    (*data)[len] = '\0';
+    return 1;
+}
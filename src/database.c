@@ -1,8 +1,10 @@
 #include "database.h"
 #include "args.h"
+#include "shmdb.h"
 #include "utils.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <ndbm.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,7 +12,32 @@
 
 #pragma GCC diagnostic ignored "-Waggregate-return"
 
+#ifdef __APPLE__
+typedef size_t datum_size;
+#else
+typedef int datum_size;
+#endif
+
+#define TO_SIZE_T(x) ((size_t)(x))
+
+typedef struct
+{
+    const void *dptr;
+    datum_size  dsize;
+} const_datum;
+
+#define MAKE_CONST_DATUM_BYTE(str, size) ((const_datum){(str), (datum_size)(size)})
+
 static ssize_t secure_cmp(const void *a, const void *b, size_t size);
+static ssize_t ndbm_open(DBO *dbo, int *err);
+static void    ndbm_close(DBO *dbo);
+static int     ndbm_store(DBO *dbo, const void *key, size_t k_size, const void *value, size_t v_size);
+static void   *ndbm_fetch(DBO *dbo, const void *key, size_t k_size, size_t *v_size);
+static int     ndbm_foreach(DBO *dbo, db_key_func func, void *ctx);
+
+const db_backend ndbm_backend = {"ndbm", ndbm_open, ndbm_close, ndbm_store, ndbm_fetch, ndbm_foreach};
+
+static const db_backend *const backends[] = {&ndbm_backend, &shm_backend};
 
 static ssize_t secure_cmp(const void *a, const void *b, size_t size)
 {
@@ -26,7 +53,7 @@ static ssize_t secure_cmp(const void *a, const void *b, size_t size)
     return diff;    // 0 means equal, nonzero means different
 }
 
-ssize_t database_open(DBO *dbo, int *err)
+static ssize_t ndbm_open(DBO *dbo, int *err)
 {
     dbo->db = dbm_open(dbo->name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR);
     if(!dbo->db)
@@ -38,103 +65,155 @@ ssize_t database_open(DBO *dbo, int *err)
     return 0;
 }
 
-int store_string(DBM *db, const char *key, const char *value)
+static void ndbm_close(DBO *dbo)
+{
+    dbm_close((DBM *)dbo->db);
+    dbo->db = NULL;
+}
+
+static int ndbm_store(DBO *dbo, const void *key, size_t k_size, const void *value, size_t v_size)
 {
-    const_datum key_datum   = MAKE_CONST_DATUM(key);
-    const_datum value_datum = MAKE_CONST_DATUM(value);
+    const_datum key_datum   = MAKE_CONST_DATUM_BYTE(key, k_size);
+    const_datum value_datum = MAKE_CONST_DATUM_BYTE(value, v_size);
 
-    return dbm_store(db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
+    return dbm_store((DBM *)dbo->db, *(datum *)&key_datum, *(datum *)&value_datum, DBM_REPLACE);
 }
 
-int store_int(DBM *db, const char *key, int value)
+static void *ndbm_fetch(DBO *dbo, const void *key, size_t k_size, size_t *v_size)
 {
-    const_datum key_datum = MAKE_CONST_DATUM(key);
-    datum       value_datum;
-    int         result;
+    const_datum key_datum = MAKE_CONST_DATUM_BYTE(key, k_size);
+    datum       result;
+    void       *copy;
 
-    value_datum.dptr = (char *)malloc(TO_SIZE_T(sizeof(int)));
+    result = dbm_fetch((DBM *)dbo->db, *(datum *)&key_datum);
 
-    if(value_datum.dptr == NULL)
+    if(result.dptr == NULL)
     {
-        return -1;
+        return NULL;
     }
 
-    memcpy(value_datum.dptr, &value, sizeof(int));
-    value_datum.dsize = sizeof(int);
+    copy = malloc(TO_SIZE_T(result.dsize));
+
+    if(!copy)
+    {
+        return NULL;
+    }
 
-    result = dbm_store(db, *(datum *)&key_datum, value_datum, DBM_REPLACE);
+    memcpy(copy, result.dptr, TO_SIZE_T(result.dsize));
+    *v_size = TO_SIZE_T(result.dsize);
 
-    free(value_datum.dptr);
-    return result;
+    return copy;
 }
 
-char *retrieve_string(DBM *db, const char *key)
+static int ndbm_foreach(DBO *dbo, db_key_func func, void *ctx)
 {
-    const_datum key_datum;
-    datum       result;
-    char       *retrieved_str;
-
-    key_datum = MAKE_CONST_DATUM(key);
+    DBM *db = (DBM *)dbo->db;
 
-    result = dbm_fetch(db, *(datum *)&key_datum);
+    for(datum key = dbm_firstkey(db); key.dptr != NULL; key = dbm_nextkey(db))
+    {
+        func(key.dptr, TO_SIZE_T(key.dsize), ctx);
+    }
+    return 0;
+}
 
-    if(result.dptr == NULL)
+const db_backend *database_backend(const char *name)
+{
+    if(!name)
     {
-        return NULL;
+        name = DB_BACKEND_DEFAULT;
     }
 
-    retrieved_str = (char *)malloc(TO_SIZE_T(result.dsize));
+    for(size_t i = 0; i < sizeof(backends) / sizeof(backends[0]); i++)
+    {
+        if(strcmp(backends[i]->name, name) == 0)
+        {
+            return backends[i];
+        }
+    }
+    return NULL;
+}
 
-    if(!retrieved_str)
+ssize_t database_open(DBO *dbo, int *err)
+{
+    dbo->backend = database_backend(getenv(DB_BACKEND_ENV));
+    if(!dbo->backend)
     {
-        return NULL;
+        fprintf(stderr, "unknown database backend: %s\n", getenv(DB_BACKEND_ENV));
+        *err = EINVAL;
+        return -1;
     }
+    return dbo->backend->open(dbo, err);
+}
 
-    memcpy(retrieved_str, result.dptr, TO_SIZE_T(result.dsize));
+void database_close(DBO *dbo)
+{
+    dbo->backend->close(dbo);
+}
 
-    return retrieved_str;
+int store_string(DBO *dbo, const char *key, const char *value)
+{
+    return dbo->backend->store(dbo, key, strlen(key) + 1, value, strlen(value) + 1);
+}
+
+int store_int(DBO *dbo, const char *key, int value)
+{
+    return dbo->backend->store(dbo, key, strlen(key) + 1, &value, sizeof(int));
+}
+
+char *retrieve_string(DBO *dbo, const char *key)
+{
+    size_t size;
+
+    return (char *)dbo->backend->fetch(dbo, key, strlen(key) + 1, &size);
 }
 
-int retrieve_int(DBM *db, const char *key, int *result)
+int retrieve_int(DBO *dbo, const char *key, int *result)
 {
-    datum       fetched;
-    const_datum key_datum = MAKE_CONST_DATUM(key);
+    void  *fetched;
+    size_t size;
 
-    fetched = dbm_fetch(db, *(datum *)&key_datum);
+    fetched = dbo->backend->fetch(dbo, key, strlen(key) + 1, &size);
 
-    if(fetched.dptr == NULL || fetched.dsize != sizeof(int))
+    if(fetched == NULL || size != sizeof(int))
     {
+        free(fetched);
         return -1;
     }
 
-    memcpy(result, fetched.dptr, sizeof(int));
+    memcpy(result, fetched, sizeof(int));
+    free(fetched);
 
     return 0;
 }
 
-ssize_t verify_user(DBM *db, const void *key, size_t k_size, const void *value, size_t v_size)
+int database_foreach_key(DBO *dbo, db_key_func func, void *ctx)
 {
-    const_datum key_datum;
-    datum       result;
-    ssize_t     match;
+    return dbo->backend->foreach(dbo, func, ctx);
+}
 
-    key_datum = MAKE_CONST_DATUM_BYTE(key, k_size);
+ssize_t verify_user(DBO *dbo, const void *key, size_t k_size, const void *value, size_t v_size)
+{
+    void   *result;
+    size_t  size;
+    ssize_t match;
 
-    result = dbm_fetch(db, *(datum *)&key_datum);
+    result = dbo->backend->fetch(dbo, key, k_size, &size);
 
-    if(result.dptr == NULL)
+    if(result == NULL)
     {
         return -1;
     }
 
-    printf("result.dsize: %zu\n", TO_SIZE_T(result.dsize));
+    printf("result.dsize: %zu\n", size);
 
-    if(TO_SIZE_T(result.dsize) != v_size)
+    if(size != v_size)
     {
+        free(result);
         return -2;
     }
 
-    match = secure_cmp(result.dptr, value, TO_SIZE_T(result.dsize));
+    match = secure_cmp(result, value, size);
+    free(result);
 
     printf("match: %d\n", (int)match);
     if(match != 0)
@@ -0,0 +1,80 @@
+#include "deque.h"
+
+void deque_init(deque_t *deque)
+{
+    atomic_init(&deque->top, 0);
+    atomic_init(&deque->bottom, 0);
+    for(int i = 0; i < DEQUE_SIZE; i++)
+    {
+        atomic_init(&deque->items[i], 0);
+    }
+}
+
+// Owner only. Returns -1 when full.
+int deque_push(deque_t *deque, uint64_t item)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    int64_t top    = atomic_load_explicit(&deque->top, memory_order_acquire);
+
+    if(bottom - top >= DEQUE_SIZE)
+    {
+        return -1;
+    }
+    atomic_store_explicit(&deque->items[bottom & DEQUE_MASK], item, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return 0;
+}
+
+// Owner only, newest first. Returns -1 when empty, including when a thief took the last entry.
+int deque_pop(deque_t *deque, uint64_t *item)
+{
+    int64_t bottom = atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    int64_t top;
+    int     result;
+
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+
+    if(top > bottom)
+    {
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+        return -1;
+    }
+
+    *item  = atomic_load_explicit(&deque->items[bottom & DEQUE_MASK], memory_order_relaxed);
+    result = 0;
+    if(top == bottom)
+    {
+        // the last entry: race any thief for it through top
+        if(!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+        {
+            result = -1;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    }
+    return result;
+}
+
+// Any thread, oldest first. Returns -1 when empty and -2 when another thread won the entry, in which
+// case the caller may try again.
+int deque_steal(deque_t *deque, uint64_t *item)
+{
+    int64_t top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    int64_t bottom;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    bottom = atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if(top >= bottom)
+    {
+        return -1;
+    }
+
+    *item = atomic_load_explicit(&deque->items[top & DEQUE_MASK], memory_order_relaxed);
+    if(!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1, memory_order_seq_cst, memory_order_relaxed))
+    {
+        return -2;
+    }
+    return 0;
+}
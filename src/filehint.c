@@ -0,0 +1,109 @@
+#include "filehint.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static off_t window_end(off_t size, off_t from);
+
+static off_t window_end(off_t size, off_t from)
+{
+    return size - from < FILEHINT_WINDOW_BYTES ? size : from + FILEHINT_WINDOW_BYTES;
+}
+
+// Small files are left to the page cache. A large one is read sequentially, which doubles the
+// kernel's readahead window, and its first window is asked for before the first byte goes out.
+void filehint_start(int fd, off_t size)
+{
+    if(size < FILEHINT_SEQUENTIAL_BYTES)
+    {
+        return;
+    }
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, window_end(size, 0), POSIX_FADV_WILLNEED);
+}
+
+// For readers that pread a large file piece by piece from an event loop: each time [from, to) crosses
+// into a new window the one after it is asked for, so reads keep finding their pages already in.
+void filehint_progress(int fd, off_t size, off_t from, off_t to)
+{
+    off_t next;
+
+    if(size < FILEHINT_SEQUENTIAL_BYTES || from / FILEHINT_WINDOW_BYTES == to / FILEHINT_WINDOW_BYTES)
+    {
+        return;
+    }
+    next = (to / FILEHINT_WINDOW_BYTES + 1) * FILEHINT_WINDOW_BYTES;
+    if(next < size)
+    {
+        posix_fadvise(fd, next, window_end(size, next) - next, POSIX_FADV_WILLNEED);
+    }
+}
+
+// A huge file this worker has rarely served would otherwise push hot assets out of the page cache.
+int filehint_cold(off_t size, uint32_t hits)
+{
+    return size >= FILEHINT_DROP_BYTES && hits < FILEHINT_HOT_HITS;
+}
+
+// Pages still held by a socket or another reader are skipped by the kernel, so this never cuts a
+// transfer short; at worst the file is read from disk again.
+void filehint_drop(int fd, off_t size)
+{
+    posix_fadvise(fd, 0, size, POSIX_FADV_DONTNEED);
+}
+
+// Reads a list of paths under root, one per line ('#' starts a comment), and asks for each file to be
+// read in. WILLNEED only queues the reads, so a long list does not hold up the caller. Returns how
+// many files were warmed, -1 if the list cannot be read.
+int filehint_warm(const char *list_path, const char *root, uint64_t *bytes)
+{
+    char  line[PATH_MAX];
+    FILE *list;
+    int   warmed = 0;
+
+    *bytes = 0;
+    list   = fopen(list_path, "re");
+    if(!list)
+    {
+        perror("hot list");
+        return -1;
+    }
+
+    // path has room for root and a whole line, so it is never cut; anything past PATH_MAX is skipped
+    while(fgets(line, sizeof(line), list))
+    {
+        char        path[PATH_MAX + sizeof(line)];
+        const char *name = line;
+        struct stat file_stat;
+        int         fd;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        while(*name == '/')
+        {
+            name++;
+        }
+        if(*name == '\0' || *name == '#' || strstr(name, "..") || snprintf(path, sizeof(path), "%s/%s", root, name) >= PATH_MAX)
+        {
+            continue;
+        }
+
+        fd = open(path, O_RDONLY | O_CLOEXEC);
+        if(fd == -1)
+        {
+            fprintf(stderr, "hot list: cannot open %s\n", path);
+            continue;
+        }
+        if(fstat(fd, &file_stat) == 0 && S_ISREG(file_stat.st_mode) && posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED) == 0)
+        {
+            *bytes += (uint64_t)file_stat.st_size;
+            warmed++;
+        }
+        close(fd);
+    }
+
+    fclose(list);
+    return warmed;
+}
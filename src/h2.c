@@ -0,0 +1,1483 @@
+#include "h2.h"
+#include "filehint.h"
+#include "http.h"
+#include "pool.h"
+#include "utils.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define STATUS_SIZE 4
+#define HEADER_NAME_MAX 256
+#define BLOCK_SLACK 64
+#define MAX_WINDOW 0x7fffffffLL
+
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+#define ERROR_NONE 0x0
+#define ERROR_PROTOCOL 0x1
+#define ERROR_INTERNAL 0x2
+#define ERROR_FLOW_CONTROL 0x3
+#define ERROR_STREAM_CLOSED 0x5
+#define ERROR_FRAME_SIZE 0x6
+#define ERROR_REFUSED_STREAM 0x7
+#define ERROR_COMPRESSION 0x9
+
+static const char *const switching_protocols = "HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n";
+
+// Fields that only mean something to one HTTP/1 hop, or that the rebuilt request supplies itself.
+static const char *const dropped_request_headers[]  = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade", "te", "expect", "content-length", "http2-settings"};
+static const char *const dropped_response_headers[] = {"connection", "keep-alive", "proxy-connection", "transfer-encoding", "upgrade"};
+
+static uint64_t   now_nsec(void);
+static uint32_t   get32(const uint8_t *p);
+static void       put_header(uint8_t *out, size_t len, uint8_t type, uint8_t flags, uint32_t id);
+static uint8_t   *reserve(h2_conn *conn, size_t len);
+static void       frame(h2_conn *conn, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len);
+static void       send_u32(h2_conn *conn, uint8_t type, uint32_t id, uint32_t value);
+static void       goaway(h2_conn *conn, uint32_t error);
+static void       reset(h2_conn *conn, h2_stream *stream, uint32_t id, uint32_t error);
+static h2_stream *find_stream(h2_conn *conn, uint32_t id);
+static h2_stream *open_stream(h2_conn *conn, uint32_t id);
+static void       close_stream(h2_stream *stream);
+static int        append(char **buf, size_t *len, size_t *cap, const void *data, size_t size);
+static int        is_listed(const char *const list[], size_t count, const char *name, size_t len);
+static int        emit_field(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx);
+static int        ignore_field(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx);
+static int        apply_settings(h2_conn *conn, const uint8_t *payload, size_t len);
+static int        upgrade_settings(h2_conn *conn, const char *settings);
+static int        upgrade_stream(h2_conn *conn);
+static int        headers_done(h2_conn *conn, uint32_t id, const uint8_t *block, size_t len, int end_stream);
+static int        on_data(h2_conn *conn, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len);
+static int        on_headers(h2_conn *conn, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len);
+static int        on_frame(h2_conn *conn, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len);
+static int        process_frames(h2_conn *conn);
+static void       run_stream(h2_conn *conn, h2_stream *stream);
+static int        send_headers(h2_conn *conn, h2_stream *stream, int end_stream);
+static int        queue_body(h2_stream *stream, h2_body_kind kind, const void *data, size_t len, int fd);
+static int        pump(h2_conn *conn);
+static ssize_t    flush(h2_conn *conn);
+static void       replenish(h2_conn *conn);
+static int        busy(const h2_conn *conn);
+
+static uint64_t now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+// Room for len more bytes at the end of the output, reclaiming what has already been sent first.
+static uint8_t *reserve(h2_conn *conn, size_t len)
+{
+    if(conn->woff == conn->wlen)
+    {
+        conn->woff = 0;
+        conn->wlen = 0;
+    }
+    if(conn->wlen + len > conn->wcap && conn->woff > 0)
+    {
+        memmove(conn->wbuf, conn->wbuf + conn->woff, conn->wlen - conn->woff);
+        conn->wlen -= conn->woff;
+        conn->woff = 0;
+    }
+    if(conn->wlen + len > conn->wcap)
+    {
+        size_t   cap = conn->wcap ? conn->wcap : H2_WRITE_LOW_WATER;
+        uint8_t *wbuf;
+
+        while(cap < conn->wlen + len)
+        {
+            cap *= 2;
+        }
+        wbuf = (uint8_t *)realloc(conn->wbuf, cap);
+        if(!wbuf)
+        {
+            conn->failed = 1;
+            return NULL;
+        }
+        conn->wbuf = wbuf;
+        conn->wcap = cap;
+    }
+    return conn->wbuf + conn->wlen;
+}
+
+static void put_header(uint8_t *out, size_t len, uint8_t type, uint8_t flags, uint32_t id)
+{
+    out[0] = (uint8_t)(len >> 16);
+    out[1] = (uint8_t)(len >> 8);
+    out[2] = (uint8_t)len;
+    out[3] = type;
+    out[4] = flags;
+    out[5] = (uint8_t)(id >> 24 & 0x7f);
+    out[6] = (uint8_t)(id >> 16);
+    out[7] = (uint8_t)(id >> 8);
+    out[8] = (uint8_t)id;
+}
+
+static void frame(h2_conn *conn, uint8_t type, uint8_t flags, uint32_t id, const void *payload, size_t len)
+{
+    uint8_t *out = reserve(conn, H2_FRAME_HEADER_SIZE + len);
+
+    if(!out)
+    {
+        return;
+    }
+    put_header(out, len, type, flags, id);
+    if(len > 0)
+    {
+        memcpy(out + H2_FRAME_HEADER_SIZE, payload, len);
+    }
+    conn->wlen += H2_FRAME_HEADER_SIZE + len;
+}
+
+static void send_u32(h2_conn *conn, uint8_t type, uint32_t id, uint32_t value)
+{
+    uint8_t payload[4] = {(uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value};
+
+    frame(conn, type, 0, id, payload, sizeof(payload));
+}
+
+// Tells the peer which streams were seen, so it knows what it may retry elsewhere.
+static void goaway(h2_conn *conn, uint32_t error)
+{
+    uint8_t payload[8] = {(uint8_t)(conn->last_stream >> 24), (uint8_t)(conn->last_stream >> 16), (uint8_t)(conn->last_stream >> 8), (uint8_t)conn->last_stream, (uint8_t)(error >> 24), (uint8_t)(error >> 16), (uint8_t)(error >> 8), (uint8_t)error};
+
+    if(!conn->goaway_sent)
+    {
+        frame(conn, FRAME_GOAWAY, 0, 0, payload, sizeof(payload));
+    }
+    conn->goaway_sent = 1;
+    conn->goaway      = 1;
+    if(error != ERROR_NONE)
+    {
+        conn->failed = 1;
+    }
+}
+
+static void reset(h2_conn *conn, h2_stream *stream, uint32_t id, uint32_t error)
+{
+    send_u32(conn, FRAME_RST_STREAM, id, error);
+    if(stream)
+    {
+        close_stream(stream);
+    }
+}
+
+static h2_stream *find_stream(h2_conn *conn, uint32_t id)
+{
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(conn->streams[i].state != H2_STREAM_IDLE && conn->streams[i].id == id)
+        {
+            return &conn->streams[i];
+        }
+    }
+    return NULL;
+}
+
+static h2_stream *open_stream(h2_conn *conn, uint32_t id)
+{
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        h2_stream *stream = &conn->streams[i];
+
+        if(stream->state == H2_STREAM_IDLE)
+        {
+            memset(stream, 0, sizeof(*stream));
+            stream->id          = id;
+            stream->state       = H2_STREAM_OPEN;
+            stream->send_window = conn->peer_initial_window;
+            return stream;
+        }
+    }
+    return NULL;
+}
+
+static void close_stream(h2_stream *stream)
+{
+    h2_body *body = stream->queue;
+
+    while(body)
+    {
+        h2_body *next = body->next;
+
+        if(body->kind == H2_BODY_FILE)
+        {
+            close(body->fd);
+        }
+        free(body->heap);
+        free(body);
+        body = next;
+    }
+    free(stream->head);
+    free(stream->body);
+    free(stream->method);
+    free(stream->path);
+    free(stream->authority);
+    free(stream->response);
+    memset(stream, 0, sizeof(*stream));
+}
+
+static int append(char **buf, size_t *len, size_t *cap, const void *data, size_t size)
+{
+    if(*len + size + 1 > *cap)
+    {
+        size_t new_cap = *cap ? *cap : BUFFER_SIZE;
+        char  *grown;
+
+        while(new_cap < *len + size + 1)
+        {
+            new_cap *= 2;
+        }
+        grown = (char *)realloc(*buf, new_cap);
+        if(!grown)
+        {
+            return -1;
+        }
+        *buf = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buf + *len, data, size);
+    *len += size;
+    (*buf)[*len] = '\0';
+    return 0;
+}
+
+static int is_listed(const char *const list[], size_t count, const char *name, size_t len)
+{
+    for(size_t i = 0; i < count; i++)
+    {
+        if(strlen(list[i]) == len && strncasecmp(list[i], name, len) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Collects one request field. Anything that could break the rebuilt HTTP/1 text, or that HTTP/2
+// forbids outright, marks the stream bad rather than failing the connection.
+static int emit_field(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx)
+{
+    h2_stream *stream = (h2_stream *)ctx;
+    char     **pseudo = NULL;
+
+    if(name_len == 0 || memchr(value, '\r', value_len) || memchr(value, '\n', value_len) || memchr(value, '\0', value_len))
+    {
+        stream->bad = 1;
+        return 0;
+    }
+    for(size_t i = 0; i < name_len; i++)
+    {
+        if((name[i] >= 'A' && name[i] <= 'Z') || name[i] == ' ' || name[i] == '\r' || name[i] == '\n' || name[i] == '\0' || (name[i] == ':' && i > 0))
+        {
+            stream->bad = 1;
+            return 0;
+        }
+    }
+
+    if(name[0] == ':')
+    {
+        if(stream->head_len > 0)
+        {
+            stream->bad = 1;    // pseudo-headers come first
+            return 0;
+        }
+        if(name_len == strlen(":method") && memcmp(name, ":method", name_len) == 0)
+        {
+            pseudo = &stream->method;
+        }
+        else if(name_len == strlen(":path") && memcmp(name, ":path", name_len) == 0)
+        {
+            pseudo = &stream->path;
+        }
+        else if(name_len == strlen(":authority") && memcmp(name, ":authority", name_len) == 0)
+        {
+            pseudo = &stream->authority;
+        }
+        else if(name_len != strlen(":scheme") || memcmp(name, ":scheme", name_len) != 0)
+        {
+            stream->bad = 1;
+            return 0;
+        }
+        if(pseudo)
+        {
+            if(*pseudo || value_len == 0 || memchr(value, ' ', value_len))
+            {
+                stream->bad = 1;
+                return 0;
+            }
+            *pseudo = strndup(value, value_len);
+            if(!*pseudo)
+            {
+                return -1;
+            }
+        }
+        return 0;
+    }
+
+    if(is_listed(dropped_request_headers, sizeof(dropped_request_headers) / sizeof(dropped_request_headers[0]), name, name_len))
+    {
+        return 0;
+    }
+    if(append(&stream->head, &stream->head_len, &stream->head_cap, name, name_len) == -1 || append(&stream->head, &stream->head_len, &stream->head_cap, ": ", 2) == -1 || append(&stream->head, &stream->head_len, &stream->head_cap, value, value_len) == -1 || append(&stream->head, &stream->head_len, &stream->head_cap, "\r\n", 2) == -1)
+    {
+        return -1;
+    }
+    if(stream->head_len > HEADER_MAX_SIZE)
+    {
+        stream->bad = 1;
+    }
+    return 0;
+}
+
+// Trailers, and blocks for streams that were refused, still have to pass through the decoder to keep
+// its table in step with the peer's.
+static int ignore_field(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx)
+{
+    (void)name;
+    (void)name_len;
+    (void)value;
+    (void)value_len;
+    (void)ctx;
+    return 0;
+}
+
+static int apply_settings(h2_conn *conn, const uint8_t *payload, size_t len)
+{
+    if(len % 6 != 0)
+    {
+        goaway(conn, ERROR_FRAME_SIZE);
+        return -1;
+    }
+    for(size_t i = 0; i < len; i += 6)
+    {
+        uint16_t id    = (uint16_t)(payload[i] << 8 | payload[i + 1]);
+        uint32_t value = get32(payload + i + 2);
+
+        switch(id)
+        {
+            case SETTINGS_HEADER_TABLE_SIZE:
+                hpack_encoder_resize(&conn->encoder, value);
+                break;
+            case SETTINGS_ENABLE_PUSH:
+                if(value > 1)
+                {
+                    goaway(conn, ERROR_PROTOCOL);
+                    return -1;
+                }
+                break;
+            case SETTINGS_INITIAL_WINDOW_SIZE:
+                if(value > MAX_WINDOW)
+                {
+                    goaway(conn, ERROR_FLOW_CONTROL);
+                    return -1;
+                }
+                // the change applies to every open stream's window, and may take it below zero
+                for(size_t s = 0; s < H2_MAX_STREAMS; s++)
+                {
+                    conn->streams[s].send_window += (int64_t)value - conn->peer_initial_window;
+                }
+                conn->peer_initial_window = value;
+                break;
+            case SETTINGS_MAX_FRAME_SIZE:
+                // we never send frames above the default, which every peer accepts
+                if(value < H2_MAX_FRAME_SIZE || value > 0xffffff)
+                {
+                    goaway(conn, ERROR_PROTOCOL);
+                    return -1;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+// The HTTP2-Settings header is a SETTINGS payload in base64url without padding.
+static int upgrade_settings(h2_conn *conn, const char *settings)
+{
+    uint8_t  payload[BUFFER_SIZE];
+    size_t   len  = 0;
+    uint32_t bits = 0;
+    int      have = 0;
+
+    for(const char *p = settings; *p && *p != '\r' && *p != ' ' && *p != '\t'; p++)
+    {
+        const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+        const char *at       = *p == '=' ? NULL : strchr(alphabet, *p);
+
+        if(*p == '=')
+        {
+            break;
+        }
+        if(!at || len == sizeof(payload))
+        {
+            return -1;
+        }
+        bits = bits << 6 | (uint32_t)(at - alphabet);
+        have += 6;
+        if(have >= 8)
+        {
+            have -= 8;
+            payload[len++] = (uint8_t)(bits >> have);
+        }
+    }
+    return apply_settings(conn, payload, len);
+}
+
+// The request that asked for the upgrade is stream 1, half closed already: its line and headers are
+// taken over, less the ones HTTP/2 would have refused, which here are the upgrade's own.
+static int upgrade_stream(h2_conn *conn)
+{
+    const request_t *request = conn->request;
+    const char      *line_end;
+    const char      *path;
+    const char      *version;
+    const char      *end;
+    h2_stream       *stream;
+
+    line_end = strstr(request->raw, "\r\n");
+    path     = strchr(request->raw, ' ');
+    version  = path ? strchr(path + 1, ' ') : NULL;
+    if(!line_end || !version || version > line_end)
+    {
+        return -1;
+    }
+
+    stream = open_stream(conn, 1);
+    if(!stream)
+    {
+        return -1;
+    }
+    conn->last_stream = 1;
+    stream->state     = H2_STREAM_READY;
+    stream->method    = strndup(request->raw, (size_t)(path - request->raw));
+    stream->path      = strndup(path + 1, (size_t)(version - path - 1));
+    if(!stream->method || !stream->path)
+    {
+        close_stream(stream);
+        return -1;
+    }
+
+    end = request->raw + request->header_len + 2;
+    for(const char *line = line_end + 2; line < end; line = line_end + 2)
+    {
+        const char *colon = (const char *)memchr(line, ':', (size_t)(end - line));
+
+        line_end = strstr(line, "\r\n");
+        if(!line_end || line_end >= end)
+        {
+            break;
+        }
+        if(colon && colon < line_end && is_listed(dropped_request_headers, sizeof(dropped_request_headers) / sizeof(dropped_request_headers[0]), line, (size_t)(colon - line)))
+        {
+            continue;
+        }
+        if(append(&stream->head, &stream->head_len, &stream->head_cap, line, (size_t)(line_end + 2 - line)) == -1)
+        {
+            close_stream(stream);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int headers_done(h2_conn *conn, uint32_t id, const uint8_t *block, size_t len, int end_stream)
+{
+    h2_stream *stream = find_stream(conn, id);
+
+    if(stream)
+    {
+        // trailers: nothing here reads them, but they end the request
+        if(stream->state != H2_STREAM_OPEN || !end_stream)
+        {
+            goaway(conn, ERROR_PROTOCOL);
+            return -1;
+        }
+        if(hpack_decode(&conn->decoder, block, len, ignore_field, NULL) == -1)
+        {
+            goaway(conn, ERROR_COMPRESSION);
+            return -1;
+        }
+        stream->state = H2_STREAM_READY;
+        return 0;
+    }
+    if(id <= conn->last_stream)
+    {
+        goaway(conn, ERROR_PROTOCOL);
+        return -1;
+    }
+    conn->last_stream = id;
+
+    stream = conn->goaway ? NULL : open_stream(conn, id);
+    if(!stream)
+    {
+        if(hpack_decode(&conn->decoder, block, len, ignore_field, NULL) == -1)
+        {
+            goaway(conn, ERROR_COMPRESSION);
+            return -1;
+        }
+        if(!conn->goaway)
+        {
+            send_u32(conn, FRAME_RST_STREAM, id, ERROR_REFUSED_STREAM);
+        }
+        return 0;
+    }
+    if(hpack_decode(&conn->decoder, block, len, emit_field, stream) == -1)
+    {
+        close_stream(stream);
+        goaway(conn, ERROR_COMPRESSION);
+        return -1;
+    }
+    if(stream->bad || !stream->method || !stream->path || stream->path[0] != '/')
+    {
+        reset(conn, stream, id, ERROR_PROTOCOL);
+        return 0;
+    }
+    if(conn->request->pool)
+    {
+        atomic_fetch_add(&conn->request->pool->h2_streams, 1);
+    }
+    if(end_stream)
+    {
+        stream->state = H2_STREAM_READY;
+    }
+    return 0;
+}
+
+// Bodies past max_body are counted but not kept, so the rebuilt request still declares its real
+// length and is refused with 413 as it would be over HTTP/1.
+static int on_data(h2_conn *conn, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len)
+{
+    h2_stream *stream;
+    size_t     frame_len = len;
+
+    if(id == 0)
+    {
+        goaway(conn, ERROR_PROTOCOL);
+        return -1;
+    }
+    if(flags & FLAG_PADDED)
+    {
+        if(len == 0 || payload[0] >= len)
+        {
+            goaway(conn, ERROR_PROTOCOL);
+            return -1;
+        }
+        len -= (size_t)payload[0] + 1;
+        payload++;
+    }
+    // the whole frame, padding included, counts against both windows we advertised (RFC 9113 6.9)
+    if((uint64_t)conn->recv_consumed + frame_len > H2_CONNECTION_WINDOW)
+    {
+        goaway(conn, ERROR_FLOW_CONTROL);
+        return -1;
+    }
+    conn->recv_consumed += (uint32_t)frame_len;
+
+    stream = find_stream(conn, id);
+    if(!stream || stream->state != H2_STREAM_OPEN)
+    {
+        if(id > conn->last_stream)
+        {
+            goaway(conn, ERROR_PROTOCOL);
+            return -1;
+        }
+        reset(conn, stream, id, ERROR_STREAM_CLOSED);
+        return 0;
+    }
+    if((uint64_t)stream->recv_consumed + frame_len > H2_STREAM_WINDOW)
+    {
+        reset(conn, stream, id, ERROR_FLOW_CONTROL);
+        return 0;
+    }
+    stream->recv_consumed += (uint32_t)frame_len;
+    if(stream->body_total + len <= conn->request->max_body && append(&stream->body, &stream->body_len, &stream->body_cap, payload, len) == -1)
+    {
+        reset(conn, stream, id, ERROR_INTERNAL);
+        return 0;
+    }
+    stream->body_total += len;
+    if(flags & FLAG_END_STREAM)
+    {
+        stream->state = H2_STREAM_READY;
+    }
+    return 0;
+}
+
+static int on_headers(h2_conn *conn, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len)
+{
+    size_t skip = 0;
+
+    if(id == 0 || id % 2 == 0)
+    {
+        goaway(conn, ERROR_PROTOCOL);
+        return -1;
+    }
+    if(flags & FLAG_PADDED)
+    {
+        if(len == 0 || payload[0] >= len)
+        {
+            goaway(conn, ERROR_PROTOCOL);
+            return -1;
+        }
+        skip = 1;
+        len -= payload[0];
+    }
+    if(flags & FLAG_PRIORITY)
+    {
+        skip += 5;
+    }
+    if(skip > len || len > HEADER_MAX_SIZE)
+    {
+        goaway(conn, ERROR_PROTOCOL);
+        return -1;
+    }
+    if(flags & FLAG_END_HEADERS)
+    {
+        return headers_done(conn, id, payload + skip, len - skip, flags & FLAG_END_STREAM);
+    }
+
+    // the rest of the block follows in CONTINUATION frames, with nothing else in between
+    conn->block = (uint8_t *)malloc(HEADER_MAX_SIZE);
+    if(!conn->block)
+    {
+        goaway(conn, ERROR_INTERNAL);
+        return -1;
+    }
+    memcpy(conn->block, payload + skip, len - skip);
+    conn->block_len        = len - skip;
+    conn->block_stream     = id;
+    conn->block_end_stream = flags & FLAG_END_STREAM;
+    return 0;
+}
+
+static int on_frame(h2_conn *conn, uint8_t type, uint8_t flags, uint32_t id, const uint8_t *payload, size_t len)
+{
+    h2_stream *stream;
+
+    if(conn->block && (type != FRAME_CONTINUATION || id != conn->block_stream))
+    {
+        goaway(conn, ERROR_PROTOCOL);
+        return -1;
+    }
+
+    switch(type)
+    {
+        case FRAME_DATA:
+            return on_data(conn, flags, id, payload, len);
+        case FRAME_HEADERS:
+            return on_headers(conn, flags, id, payload, len);
+        case FRAME_PRIORITY:
+            // streams are served round robin; the hint is checked and ignored
+            if(id == 0 || len != 5)
+            {
+                goaway(conn, id == 0 ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+                return -1;
+            }
+            return 0;
+        case FRAME_RST_STREAM:
+            if(id == 0 || len != 4)
+            {
+                goaway(conn, id == 0 ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+                return -1;
+            }
+            stream = find_stream(conn, id);
+            if(stream)
+            {
+                close_stream(stream);
+            }
+            return 0;
+        case FRAME_SETTINGS:
+            if(id != 0)
+            {
+                goaway(conn, ERROR_PROTOCOL);
+                return -1;
+            }
+            if(flags & FLAG_ACK && len != 0)
+            {
+                goaway(conn, ERROR_FRAME_SIZE);
+                return -1;
+            }
+            if(flags & FLAG_ACK)
+            {
+                return 0;
+            }
+            if(apply_settings(conn, payload, len) == -1)
+            {
+                return -1;
+            }
+            frame(conn, FRAME_SETTINGS, FLAG_ACK, 0, NULL, 0);
+            return 0;
+        case FRAME_PING:
+            if(id != 0 || len != 8)
+            {
+                goaway(conn, id != 0 ? ERROR_PROTOCOL : ERROR_FRAME_SIZE);
+                return -1;
+            }
+            if(!(flags & FLAG_ACK))
+            {
+                frame(conn, FRAME_PING, FLAG_ACK, 0, payload, len);
+            }
+            return 0;
+        case FRAME_GOAWAY:
+            // what is in flight is finished, nothing new is started
+            conn->goaway = 1;
+            return 0;
+        case FRAME_WINDOW_UPDATE:
+        {
+            int64_t increment;
+
+            if(len != 4)
+            {
+                goaway(conn, ERROR_FRAME_SIZE);
+                return -1;
+            }
+            increment = get32(payload) & 0x7fffffff;
+            if(id == 0)
+            {
+                if(increment == 0 || conn->send_window + increment > MAX_WINDOW)
+                {
+                    goaway(conn, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+                    return -1;
+                }
+                conn->send_window += increment;
+                return 0;
+            }
+            stream = find_stream(conn, id);
+            if(stream && (increment == 0 || stream->send_window + increment > MAX_WINDOW))
+            {
+                reset(conn, stream, id, increment == 0 ? ERROR_PROTOCOL : ERROR_FLOW_CONTROL);
+            }
+            else if(stream)
+            {
+                stream->send_window += increment;
+            }
+            return 0;
+        }
+        case FRAME_CONTINUATION:
+            if(!conn->block)
+            {
+                goaway(conn, ERROR_PROTOCOL);
+                return -1;
+            }
+            if(conn->block_len + len > HEADER_MAX_SIZE)
+            {
+                goaway(conn, ERROR_PROTOCOL);
+                return -1;
+            }
+            memcpy(conn->block + conn->block_len, payload, len);
+            conn->block_len += len;
+            if(flags & FLAG_END_HEADERS)
+            {
+                int result = headers_done(conn, id, conn->block, conn->block_len, conn->block_end_stream);
+
+                free(conn->block);
+                conn->block = NULL;
+                return result;
+            }
+            return 0;
+        case FRAME_PUSH_PROMISE:
+            goaway(conn, ERROR_PROTOCOL);
+            return -1;
+        default:
+            return 0;    // unknown frame types are ignored
+    }
+}
+
+// Handles every complete frame in the read buffer, then moves any partial one to the front.
+static int process_frames(h2_conn *conn)
+{
+    size_t pos = 0;
+
+    if(conn->preface)
+    {
+        if(!h2_is_preface((const char *)conn->rbuf, conn->rlen))
+        {
+            goaway(conn, ERROR_PROTOCOL);
+            return -1;
+        }
+        if(conn->rlen < H2_PREFACE_SIZE)
+        {
+            return 0;
+        }
+        if(memcmp(conn->rbuf, H2_PREFACE, H2_PREFACE_SIZE) != 0)
+        {
+            goaway(conn, ERROR_PROTOCOL);
+            return -1;
+        }
+        conn->preface = 0;
+        pos           = H2_PREFACE_SIZE;
+    }
+
+    while(!conn->failed && conn->rlen - pos >= H2_FRAME_HEADER_SIZE)
+    {
+        const uint8_t *head = conn->rbuf + pos;
+        size_t         len  = (size_t)head[0] << 16 | (size_t)head[1] << 8 | head[2];
+
+        if(len > H2_MAX_FRAME_SIZE)
+        {
+            goaway(conn, ERROR_FRAME_SIZE);
+            return -1;
+        }
+        if(conn->rlen - pos < H2_FRAME_HEADER_SIZE + len)
+        {
+            break;
+        }
+        if(on_frame(conn, head[3], head[4], get32(head + 5) & 0x7fffffff, head + H2_FRAME_HEADER_SIZE, len) == -1)
+        {
+            return -1;
+        }
+        pos += H2_FRAME_HEADER_SIZE + len;
+    }
+
+    memmove(conn->rbuf, conn->rbuf + pos, conn->rlen - pos);
+    conn->rlen -= pos;
+    return 0;
+}
+
+// Rebuilds the stream as an HTTP/1 request in the connection's arena and runs it through the same
+// states as any other; the handler's writes land in the stream instead of on the socket.
+static void run_stream(h2_conn *conn, h2_stream *stream)
+{
+    const request_t *parent = conn->request;
+    request_t        request;
+    char             length[BUFFER_SIZE];
+    size_t           length_len = 0;
+    size_t           host_len;
+    size_t           line_len;
+    size_t           size;
+    char            *pos;
+
+    if(stream->body_total > 0 || strcmp(stream->method, "POST") == 0)
+    {
+        length_len = (size_t)snprintf(length, sizeof(length), "Content-Length: %zu\r\n", stream->body_total);
+    }
+    line_len = strlen(stream->method) + 1 + strlen(stream->path) + strlen(" HTTP/2.0\r\n");
+    host_len = stream->authority ? strlen("Host: ") + strlen(stream->authority) + 2 : 0;
+    size     = line_len + host_len + stream->head_len + length_len + 2 + stream->body_len + 1;
+
+    memset(&request, 0, sizeof(request));
+    request.arena    = &conn->arena;
+    request.response = (char *)arena_alloc(request.arena, BUFFER_SIZE);
+    request.raw      = (char *)arena_alloc(request.arena, size);
+    if(!request.response || !request.raw)
+    {
+        reset(conn, stream, stream->id, ERROR_INTERNAL);
+        arena_reset(&conn->arena);
+        return;
+    }
+
+    pos = request.raw + snprintf(request.raw, size, "%s %s HTTP/2.0\r\n", stream->method, stream->path);
+    if(stream->authority)
+    {
+        pos += snprintf(pos, size - (size_t)(pos - request.raw), "Host: %s\r\n", stream->authority);
+    }
+    memcpy(pos, stream->head, stream->head_len);
+    pos += stream->head_len;
+    memcpy(pos, length, length_len);
+    pos += length_len;
+    request.header_len = (size_t)(pos - request.raw) - 2;
+    memcpy(pos, "\r\n", 2);
+    pos += 2;
+    memcpy(pos, stream->body, stream->body_len);
+    pos += stream->body_len;
+    *pos = '\0';
+
+    request.raw_len    = (size_t)(pos - request.raw);
+    request.raw_cap    = size;
+    request.h2         = stream;
+    request.client_fd  = -1;
+    request.sockfd     = parent->sockfd;
+    request.fd_num     = parent->fd_num;
+    request.worker_id  = parent->worker_id;
+    request.bloom      = parent->bloom;
+    request.wal        = parent->wal;
+    request.pool       = parent->pool;
+    request.max_body   = parent->max_body;
+    request.pack       = parent->pack;
+    request.paths      = parent->paths;
+    request.capture    = parent->capture;
+    request.connection = parent->connection;
+    request.accesslog  = parent->accesslog;
+    request.respcache  = parent->respcache;
+    request.log_ring   = parent->log_ring;
+    request.tls        = parent->tls;
+    request.peer       = parent->peer;
+
+    // the request is finished with, the response is what matters now
+    free(stream->body);
+    stream->body     = NULL;
+    stream->body_len = 0;
+    stream->body_cap = 0;
+    stream->state    = H2_STREAM_SENDING;
+
+    http_run_stream(&request);
+    arena_reset(&conn->arena);
+
+    if(!stream->head_done || send_headers(conn, stream, stream->queue == NULL) == -1)
+    {
+        reset(conn, stream, stream->id, ERROR_INTERNAL);
+        return;
+    }
+    if(!stream->queue)
+    {
+        close_stream(stream);
+    }
+}
+
+// The handler's status line and headers as one HEADERS frame, and CONTINUATION frames if the block
+// is larger than a frame.
+static int send_headers(h2_conn *conn, h2_stream *stream, int end_stream)
+{
+    const char *line = strstr(stream->response, "\r\n");
+    const char *status;
+    uint8_t    *block;
+    size_t      len;
+    size_t      sent = 0;
+
+    status = strchr(stream->response, ' ');
+    if(!line || !status || line - status < STATUS_SIZE)
+    {
+        return -1;
+    }
+    block = (uint8_t *)malloc(stream->response_len + BLOCK_SLACK);
+    if(!block)
+    {
+        return -1;
+    }
+    len = hpack_encode(&conn->encoder, block, stream->response_len + BLOCK_SLACK, ":status", strlen(":status"), status + 1, STATUS_SIZE - 1);
+
+    for(line += 2; len > 0 && line[0] != '\r'; line = strstr(line, "\r\n") + 2)
+    {
+        const char *colon = strchr(line, ':');
+        const char *value;
+        const char *end   = strstr(line, "\r\n");
+        char        name[HEADER_NAME_MAX];
+        size_t      name_len;
+        size_t      part;
+
+        if(!end || !colon || colon > end || (size_t)(colon - line) >= sizeof(name))
+        {
+            free(block);
+            return -1;
+        }
+        name_len = (size_t)(colon - line);
+        for(size_t i = 0; i < name_len; i++)
+        {
+            name[i] = (char)(line[i] >= 'A' && line[i] <= 'Z' ? line[i] - 'A' + 'a' : line[i]);
+        }
+        if(is_listed(dropped_response_headers, sizeof(dropped_response_headers) / sizeof(dropped_response_headers[0]), name, name_len))
+        {
+            continue;
+        }
+        for(value = colon + 1; *value == ' ' || *value == '\t'; value++)
+        {
+        }
+        part = hpack_encode(&conn->encoder, block + len, stream->response_len + BLOCK_SLACK - len, name, name_len, value, (size_t)(end - value));
+        len  = part == 0 ? 0 : len + part;
+    }
+    if(len == 0)
+    {
+        free(block);
+        return -1;
+    }
+
+    do
+    {
+        size_t  chunk = len - sent > H2_MAX_FRAME_SIZE ? H2_MAX_FRAME_SIZE : len - sent;
+        uint8_t flags = sent + chunk == len ? FLAG_END_HEADERS : 0;
+
+        if(sent == 0 && end_stream)
+        {
+            flags |= FLAG_END_STREAM;
+        }
+        frame(conn, sent == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, stream->id, block + sent, chunk);
+        sent += chunk;
+    } while(sent < len);
+
+    free(block);
+    return conn->failed ? -1 : 0;
+}
+
+static int queue_body(h2_stream *stream, h2_body_kind kind, const void *data, size_t len, int fd)
+{
+    h2_body *body;
+
+    if(len == 0)
+    {
+        return 0;
+    }
+    body = (h2_body *)calloc(1, sizeof(*body));
+    if(!body)
+    {
+        return -1;
+    }
+    body->kind = kind;
+    body->len  = len;
+    body->fd   = fd;
+    if(kind == H2_BODY_HEAP)
+    {
+        body->heap = (char *)malloc(len);
+        if(!body->heap)
+        {
+            free(body);
+            return -1;
+        }
+        memcpy(body->heap, data, len);
+        body->data = body->heap;
+    }
+    else
+    {
+        body->data = (const char *)data;
+    }
+    if(stream->tail)
+    {
+        stream->tail->next = body;
+    }
+    else
+    {
+        stream->queue = body;
+    }
+    stream->tail = body;
+    return 0;
+}
+
+// Whether buf could be the start of the preface; a prefix as short as the bytes that end the first
+// HTTP/1 style head is enough to decide.
+int h2_is_preface(const char *buf, size_t len)
+{
+    return memcmp(buf, H2_PREFACE, len < H2_PREFACE_SIZE ? len : H2_PREFACE_SIZE) == 0;
+}
+
+// Until the blank line the handler is writing the response head; after it, body.
+ssize_t h2_write(h2_stream *stream, const void *buf, size_t len)
+{
+    const char *end;
+    size_t      before = stream->response_len;
+    size_t      head;
+
+    if(stream->head_done)
+    {
+        return queue_body(stream, H2_BODY_HEAP, buf, len, -1) == -1 ? -1 : (ssize_t)len;
+    }
+    if(append(&stream->response, &stream->response_len, &stream->response_cap, buf, len) == -1)
+    {
+        return -1;
+    }
+    end = strstr(stream->response + (before > 3 ? before - 3 : 0), "\r\n\r\n");
+    if(!end)
+    {
+        return (ssize_t)len;
+    }
+    head              = (size_t)(end - stream->response) + 4;
+    stream->head_done = 1;
+    if(queue_body(stream, H2_BODY_HEAP, stream->response + head, stream->response_len - head, -1) == -1)
+    {
+        return -1;
+    }
+    stream->response_len = head;
+    return (ssize_t)len;
+}
+
+// The mapped pack outlives every connection, so its bodies are sent from where they lie.
+ssize_t h2_write_mapped(h2_stream *stream, const void *data, size_t len)
+{
+    if(!stream->head_done)
+    {
+        return -1;
+    }
+    return queue_body(stream, H2_BODY_MAPPED, data, len, -1) == -1 ? -1 : (ssize_t)len;
+}
+
+// Files are read as flow control lets them go, from a descriptor of our own. With drop set the file's
+// pages are given back once the last of it has gone out.
+ssize_t h2_write_file(h2_stream *stream, int fd, off_t len, int drop)
+{
+    int own;
+
+    if(!stream->head_done || len < 0)
+    {
+        return -1;
+    }
+    if(len == 0)
+    {
+        return 0;
+    }
+    own = dup(fd);
+    if(own == -1)
+    {
+        return -1;
+    }
+    if(queue_body(stream, H2_BODY_FILE, NULL, (size_t)len, own) == -1)
+    {
+        close(own);
+        return -1;
+    }
+    stream->tail->drop = drop;
+    return 0;
+}
+
+// Moves response bodies into DATA frames one frame per stream per turn, as far as both windows
+// allow, until enough is buffered to keep the socket busy. Returns 1 when it stopped there with more
+// that could go, so the caller comes back as soon as the socket has taken it.
+static int pump(h2_conn *conn)
+{
+    int moved = 1;
+
+    while(moved && !conn->failed && conn->wlen - conn->woff < H2_WRITE_LOW_WATER && conn->send_window > 0)
+    {
+        moved = 0;
+        for(size_t n = 0; n < H2_MAX_STREAMS && conn->send_window > 0; n++)
+        {
+            h2_stream *stream = &conn->streams[(conn->next_pump + n) % H2_MAX_STREAMS];
+            h2_body   *body   = stream->queue;
+            size_t     chunk;
+            uint8_t    flags  = 0;
+            uint8_t   *out;
+
+            if(stream->state != H2_STREAM_SENDING || !body || stream->send_window <= 0)
+            {
+                continue;
+            }
+            chunk = body->len - body->off;
+            if(chunk > H2_MAX_FRAME_SIZE)
+            {
+                chunk = H2_MAX_FRAME_SIZE;
+            }
+            if((int64_t)chunk > stream->send_window)
+            {
+                chunk = (size_t)stream->send_window;
+            }
+            if((int64_t)chunk > conn->send_window)
+            {
+                chunk = (size_t)conn->send_window;
+            }
+            if(!body->next && body->off + chunk == body->len)
+            {
+                flags = FLAG_END_STREAM;
+            }
+
+            out = reserve(conn, H2_FRAME_HEADER_SIZE + chunk);
+            if(!out)
+            {
+                return 0;
+            }
+            if(body->kind == H2_BODY_FILE)
+            {
+                ssize_t got = pread(body->fd, out + H2_FRAME_HEADER_SIZE, chunk, (off_t)body->off);
+
+                // the file shrank under us: the length already promised cannot be kept
+                if(got != (ssize_t)chunk)
+                {
+                    reset(conn, stream, stream->id, ERROR_INTERNAL);
+                    continue;
+                }
+                // the pread runs on the event loop, so the next window is asked for ahead of it
+                filehint_progress(body->fd, (off_t)body->len, (off_t)body->off, (off_t)(body->off + chunk));
+            }
+            else
+            {
+                memcpy(out + H2_FRAME_HEADER_SIZE, body->data + body->off, chunk);
+            }
+            put_header(out, chunk, FRAME_DATA, flags, stream->id);
+            conn->wlen += H2_FRAME_HEADER_SIZE + chunk;
+
+            body->off += chunk;
+            stream->send_window -= (int64_t)chunk;
+            conn->send_window -= (int64_t)chunk;
+            moved = 1;
+            if(body->off == body->len)
+            {
+                stream->queue = body->next;
+                if(!stream->queue)
+                {
+                    stream->tail = NULL;
+                }
+                if(body->kind == H2_BODY_FILE)
+                {
+                    if(body->drop)
+                    {
+                        filehint_drop(body->fd, (off_t)body->len);
+                    }
+                    close(body->fd);
+                }
+                free(body->heap);
+                free(body);
+            }
+            if(flags & FLAG_END_STREAM)
+            {
+                close_stream(stream);
+            }
+        }
+        conn->next_pump = (conn->next_pump + 1) % H2_MAX_STREAMS;
+    }
+    return moved && !conn->failed && conn->send_window > 0;
+}
+
+// Writes what the socket takes now. Returns the bytes written, or -1 once the client has gone.
+static ssize_t flush(h2_conn *conn)
+{
+    ssize_t total = 0;
+
+    while(conn->woff < conn->wlen)
+    {
+        ssize_t sent = send(conn->fd, conn->wbuf + conn->woff, conn->wlen - conn->woff, MSG_NOSIGNAL);
+
+        if(sent > 0)
+        {
+            conn->woff += (size_t)sent;
+            total += sent;
+            continue;
+        }
+        if(sent == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(sent == -1 && errno == EAGAIN)
+        {
+            break;
+        }
+        return -1;
+    }
+    return total;
+}
+
+// Receive windows are topped back up once half of them has been used.
+static void replenish(h2_conn *conn)
+{
+    if(conn->recv_consumed >= H2_CONNECTION_WINDOW / 2)
+    {
+        send_u32(conn, FRAME_WINDOW_UPDATE, 0, conn->recv_consumed);
+        conn->recv_consumed = 0;
+    }
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        h2_stream *stream = &conn->streams[i];
+
+        if(stream->state == H2_STREAM_OPEN && stream->recv_consumed >= H2_STREAM_WINDOW / 2)
+        {
+            send_u32(conn, FRAME_WINDOW_UPDATE, stream->id, stream->recv_consumed);
+            stream->recv_consumed = 0;
+        }
+    }
+}
+
+static int busy(const h2_conn *conn)
+{
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(conn->streams[i].state != H2_STREAM_IDLE)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Serves one connection until the peer is done with it. settings is the HTTP2-Settings value of an
+// h2c upgrade, NULL when the client opened with the preface. The connection is idle when nothing
+// moves in either direction for H2_IDLE_MSEC, and is wound down with GOAWAY when the server is.
+void h2_serve(request_t *request, const char *settings)
+{
+    h2_conn *conn;
+    uint64_t deadline;
+    size_t   pending;
+    int      more = 0;
+
+    conn = (h2_conn *)calloc(1, sizeof(*conn));
+    if(!conn)
+    {
+        perror("h2 calloc");
+        return;
+    }
+    conn->fd                  = request->client_fd;
+    conn->request             = request;
+    conn->preface             = 1;
+    conn->peer_initial_window = H2_DEFAULT_WINDOW;
+    conn->send_window         = H2_DEFAULT_WINDOW;
+    conn->rbuf                = (uint8_t *)malloc(H2_READ_BUFFER_SIZE);
+    if(!conn->rbuf || arena_init(&conn->arena) == -1 || hpack_decoder_init(&conn->decoder) == -1)
+    {
+        perror("h2 setup");
+        free(conn->rbuf);
+        free(conn);
+        return;
+    }
+    hpack_encoder_init(&conn->encoder);
+    if(request->pool)
+    {
+        atomic_fetch_add(&request->pool->h2_connections, 1);
+    }
+
+    if(settings)
+    {
+        size_t      used = request->header_len + 4;
+        const char *rest = request->raw + used;
+
+        uint8_t    *out  = reserve(conn, strlen(switching_protocols));
+
+        if(!out || upgrade_settings(conn, settings) == -1 || upgrade_stream(conn) == -1)
+        {
+            goto cleanup;
+        }
+        memcpy(out, switching_protocols, strlen(switching_protocols));
+        conn->wlen += strlen(switching_protocols);
+        // anything after the upgrade request is already the client's preface
+        conn->rlen = request->raw_len > used ? request->raw_len - used : 0;
+        memcpy(conn->rbuf, rest, conn->rlen);
+    }
+    else
+    {
+        conn->rlen = request->raw_len < H2_READ_BUFFER_SIZE ? request->raw_len : H2_READ_BUFFER_SIZE;
+        memcpy(conn->rbuf, request->raw, conn->rlen);
+    }
+
+    {
+        const uint8_t settings_payload[] = {0, SETTINGS_MAX_CONCURRENT_STREAMS, 0, 0, 0, H2_MAX_STREAMS, 0, SETTINGS_INITIAL_WINDOW_SIZE, (uint8_t)(H2_STREAM_WINDOW >> 24), (uint8_t)(H2_STREAM_WINDOW >> 16), (uint8_t)(H2_STREAM_WINDOW >> 8), (uint8_t)H2_STREAM_WINDOW, 0, SETTINGS_MAX_HEADER_LIST_SIZE, (uint8_t)(HEADER_MAX_SIZE >> 24), (uint8_t)(HEADER_MAX_SIZE >> 16), (uint8_t)(HEADER_MAX_SIZE >> 8), (uint8_t)HEADER_MAX_SIZE};
+
+        frame(conn, FRAME_SETTINGS, 0, 0, settings_payload, sizeof(settings_payload));
+        send_u32(conn, FRAME_WINDOW_UPDATE, 0, H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW);
+    }
+
+    deadline = now_nsec() + H2_IDLE_MSEC * NSEC_PER_MSEC;
+    while(1)
+    {
+        struct pollfd pfd;
+        ssize_t       result;
+        uint64_t      now;
+
+        if(!conn->failed)
+        {
+            process_frames(conn);
+        }
+        // an upgraded request is answered once the client has sent its preface, so the response never
+        // arrives in the same read as the 101
+        if(!conn->failed && !conn->preface)
+        {
+            for(size_t i = 0; i < H2_MAX_STREAMS; i++)
+            {
+                if(conn->streams[i].state == H2_STREAM_READY)
+                {
+                    run_stream(conn, &conn->streams[i]);
+                }
+            }
+            replenish(conn);
+            more = pump(conn);
+        }
+        if(request->pool && atomic_load(&request->pool->shutdown_deadline_nsec) != 0)
+        {
+            goaway(conn, ERROR_NONE);
+        }
+
+        result = flush(conn);
+        if(result == -1)
+        {
+            break;
+        }
+        now = now_nsec();
+        if(result > 0)
+        {
+            deadline = now + H2_IDLE_MSEC * NSEC_PER_MSEC;
+        }
+        pending = conn->wlen - conn->woff;
+        // after EOF nothing can unblock a stream that pump left waiting, nor complete a request
+        if(pending == 0 && (conn->failed || conn->eof || (conn->goaway && !busy(conn))))
+        {
+            break;
+        }
+        if(now >= deadline)
+        {
+            PRINT_VERBOSE("%s\n", "h2 connection idle");
+            goaway(conn, ERROR_NONE);
+            flush(conn);
+            break;
+        }
+
+        pfd.fd     = conn->fd;
+        pfd.events = 0;
+        if(!conn->eof && !conn->failed && pending < H2_WRITE_LOW_WATER && conn->rlen < H2_READ_BUFFER_SIZE)
+        {
+            pfd.events |= POLLIN;
+        }
+        if(pending > 0 || more)
+        {
+            pfd.events |= POLLOUT;
+        }
+        result = poll(&pfd, 1, (int)((deadline - now) / NSEC_PER_MSEC) < H2_POLL_MSEC ? (int)((deadline - now) / NSEC_PER_MSEC) + 1 : H2_POLL_MSEC);
+        if(result <= 0 || !(pfd.revents & (POLLIN | POLLHUP | POLLERR)) || !(pfd.events & POLLIN))
+        {
+            continue;
+        }
+
+        result = read(conn->fd, conn->rbuf + conn->rlen, H2_READ_BUFFER_SIZE - conn->rlen);
+        if(result > 0)
+        {
+            conn->rlen += (size_t)result;
+            deadline = now + H2_IDLE_MSEC * NSEC_PER_MSEC;
+        }
+        else if(result == 0)
+        {
+            conn->eof = 1;
+        }
+        else if(errno != EAGAIN && errno != EINTR)
+        {
+            break;
+        }
+    }
+
+cleanup:
+    for(size_t i = 0; i < H2_MAX_STREAMS; i++)
+    {
+        if(conn->streams[i].state != H2_STREAM_IDLE)
+        {
+            close_stream(&conn->streams[i]);
+        }
+    }
+    free(conn->block);
+    free(conn->rbuf);
+    free(conn->wbuf);
+    hpack_decoder_free(&conn->decoder);
+    hpack_encoder_free(&conn->encoder);
+    arena_free(&conn->arena);
+    free(conn);
+}
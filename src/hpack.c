@@ -0,0 +1,640 @@
+#include "hpack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HUFFMAN_MAX_BITS 30
+#define HUFFMAN_MAX_PADDING 7
+#define INT_MAX_SHIFT 28
+#define INDEXED 0x80
+#define LITERAL_INDEXED 0x40
+#define SIZE_UPDATE 0x20
+#define HUFFMAN_FLAG 0x80
+
+typedef struct hpack_field
+{
+    const char *name;
+    const char *value;
+} hpack_field;
+
+// RFC 7541 Appendix A.
+static const hpack_field static_table[] = {
+    {":authority",                  ""             },
+    {":method",                     "GET"          },
+    {":method",                     "POST"         },
+    {":path",                       "/"            },
+    {":path",                       "/index.html"  },
+    {":scheme",                     "http"         },
+    {":scheme",                     "https"        },
+    {":status",                     "200"          },
+    {":status",                     "204"          },
+    {":status",                     "206"          },
+    {":status",                     "304"          },
+    {":status",                     "400"          },
+    {":status",                     "404"          },
+    {":status",                     "500"          },
+    {"accept-charset",              ""             },
+    {"accept-encoding",             "gzip, deflate"},
+    {"accept-language",             ""             },
+    {"accept-ranges",               ""             },
+    {"accept",                      ""             },
+    {"access-control-allow-origin", ""             },
+    {"age",                         ""             },
+    {"allow",                       ""             },
+    {"authorization",               ""             },
+    {"cache-control",               ""             },
+    {"content-disposition",         ""             },
+    {"content-encoding",            ""             },
+    {"content-language",            ""             },
+    {"content-length",              ""             },
+    {"content-location",            ""             },
+    {"content-range",               ""             },
+    {"content-type",                ""             },
+    {"cookie",                      ""             },
+    {"date",                        ""             },
+    {"etag",                        ""             },
+    {"expect",                      ""             },
+    {"expires",                     ""             },
+    {"from",                        ""             },
+    {"host",                        ""             },
+    {"if-match",                    ""             },
+    {"if-modified-since",           ""             },
+    {"if-none-match",               ""             },
+    {"if-range",                    ""             },
+    {"if-unmodified-since",         ""             },
+    {"last-modified",               ""             },
+    {"link",                        ""             },
+    {"location",                    ""             },
+    {"max-forwards",                ""             },
+    {"proxy-authenticate",          ""             },
+    {"proxy-authorization",         ""             },
+    {"range",                       ""             },
+    {"referer",                     ""             },
+    {"refresh",                     ""             },
+    {"retry-after",                 ""             },
+    {"server",                      ""             },
+    {"set-cookie",                  ""             },
+    {"strict-transport-security",   ""             },
+    {"transfer-encoding",           ""             },
+    {"user-agent",                  ""             },
+    {"vary",                        ""             },
+    {"via",                         ""             },
+    {"www-authenticate",            ""             },
+};
+
+// RFC 7541 Appendix B is a canonical code, so it decodes from the number of codes of each length and
+// the symbols in code order alone.
+static const uint8_t huffman_count[HUFFMAN_MAX_BITS + 1] = {
+    0, 0, 0, 0, 0, 10, 26, 32, 6, 0, 5, 3, 2, 6, 2, 3, 0, 0, 0, 3, 8, 13, 26, 29, 12, 4, 15, 19, 29, 0, 3
+};
+static const uint8_t huffman_symbol[256] = {
+    48, 49, 50, 97, 99, 101, 105, 111, 115, 116, 32, 37, 45, 46, 47, 51, 52, 53, 54, 55, 56, 57, 61, 65, 95,
+    98, 100, 102, 103, 104, 108, 109, 110, 112, 114, 117, 58, 66, 67, 68, 69, 70, 71, 72, 73, 74, 75, 76,
+    77, 78, 79, 80, 81, 82, 83, 84, 85, 86, 87, 89, 106, 107, 113, 118, 119, 120, 121, 122, 38, 42, 44, 59,
+    88, 90, 33, 34, 40, 41, 63, 39, 43, 124, 35, 62, 0, 36, 64, 91, 93, 126, 94, 125, 60, 96, 123, 92, 195,
+    208, 128, 130, 131, 162, 184, 194, 224, 226, 153, 161, 167, 172, 176, 177, 179, 209, 216, 217, 227, 229,
+    230, 129, 132, 133, 134, 136, 146, 154, 156, 160, 163, 164, 169, 170, 173, 178, 181, 185, 186, 187, 189,
+    190, 196, 198, 228, 232, 233, 1, 135, 137, 138, 139, 140, 141, 143, 147, 149, 150, 151, 152, 155, 157,
+    158, 165, 166, 168, 174, 175, 180, 182, 183, 188, 191, 197, 231, 239, 9, 142, 144, 145, 148, 159, 171,
+    206, 215, 225, 236, 237, 199, 207, 234, 235, 192, 193, 200, 201, 202, 205, 210, 213, 218, 219, 238, 240,
+    242, 243, 255, 203, 204, 211, 212, 214, 221, 222, 223, 241, 244, 245, 246, 247, 248, 250, 251, 252, 253,
+    254, 2, 3, 4, 5, 6, 7, 8, 11, 12, 14, 15, 16, 17, 18, 19, 20, 21, 23, 24, 25, 26, 27, 28, 29, 30, 31,
+    127, 220, 249, 10, 13, 22
+};
+
+// Headers whose values change with every response; indexing them would only churn the table.
+static const char *const volatile_headers[] = {"date", "content-length", "last-modified", "etag", "set-cookie"};
+
+static int         decode_int(const uint8_t **pos, const uint8_t *end, int prefix, size_t *value);
+static int         decode_string(const uint8_t **pos, const uint8_t *end, char *scratch, const char **str, size_t *len);
+static int         huffman_decode(const uint8_t *in, size_t len, char *out, size_t *out_len);
+static int         lookup(const hpack_table *table, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len);
+static void        table_init(hpack_table *table, size_t max_size);
+static void        table_evict(hpack_table *table, size_t max_size);
+static int         table_add(hpack_table *table, const char *name, size_t name_len, const char *value, size_t value_len);
+static void        table_free(hpack_table *table);
+static size_t      encode_int(uint8_t *out, size_t size, uint8_t flags, int prefix, size_t value);
+static size_t      encode_string(uint8_t *out, size_t size, const char *str, size_t len);
+static size_t      table_keeps(const hpack_table *table, size_t max_size);
+static size_t      find_field(const hpack_table *table, size_t count, const char *name, size_t name_len, const char *value, size_t value_len, int *exact);
+static int         is_volatile(const char *name, size_t name_len);
+
+static int decode_int(const uint8_t **pos, const uint8_t *end, int prefix, size_t *value)
+{
+    size_t max = ((size_t)1 << prefix) - 1;
+    size_t result;
+
+    if(*pos >= end)
+    {
+        return -1;
+    }
+    result = *(*pos)++ & max;
+    if(result < max)
+    {
+        *value = result;
+        return 0;
+    }
+    for(int shift = 0; *pos < end && shift <= INT_MAX_SHIFT; shift += 7)
+    {
+        uint8_t byte = *(*pos)++;
+
+        result += (size_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80))
+        {
+            *value = result;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// A plain string is used where it lies in the block; a Huffman coded one is decoded into scratch.
+static int decode_string(const uint8_t **pos, const uint8_t *end, char *scratch, const char **str, size_t *len)
+{
+    int    huffman;
+    size_t size;
+
+    if(*pos >= end)
+    {
+        return -1;
+    }
+    huffman = **pos & HUFFMAN_FLAG;
+    if(decode_int(pos, end, 7, &size) == -1 || size > (size_t)(end - *pos))
+    {
+        return -1;
+    }
+    if(!huffman)
+    {
+        if(size > HPACK_STRING_MAX)
+        {
+            return -1;
+        }
+        *str = (const char *)*pos;
+        *len = size;
+    }
+    else
+    {
+        if(huffman_decode(*pos, size, scratch, len) == -1)
+        {
+            return -1;
+        }
+        *str = scratch;
+    }
+    *pos += size;
+    return 0;
+}
+
+// Bit at a time: code grows until it falls inside the codes of its length. What is left at the end
+// must be the most significant bits of EOS, all ones and shorter than a byte.
+static int huffman_decode(const uint8_t *in, size_t len, char *out, size_t *out_len)
+{
+    size_t   written = 0;
+    uint32_t code    = 0;
+    uint32_t first   = 0;
+    uint32_t pending = 0;
+    int      index   = 0;
+    int      bits    = 0;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        for(int bit = 7; bit >= 0; bit--)
+        {
+            uint32_t value = (in[i] >> bit) & 1;
+            uint32_t count;
+
+            code |= value;
+            pending = pending << 1 | value;
+            bits++;
+            count = huffman_count[bits];
+            if(code - first < count)
+            {
+                if(written == HPACK_STRING_MAX)
+                {
+                    return -1;
+                }
+                out[written++] = (char)huffman_symbol[index + (int)(code - first)];
+                code           = 0;
+                first          = 0;
+                pending        = 0;
+                index          = 0;
+                bits           = 0;
+                continue;
+            }
+            if(bits == HUFFMAN_MAX_BITS)
+            {
+                return -1;
+            }
+            index += (int)count;
+            first  = (first + count) << 1;
+            code <<= 1;
+        }
+    }
+    if(bits > HUFFMAN_MAX_PADDING || pending != ((uint32_t)1 << bits) - 1)
+    {
+        return -1;
+    }
+    *out_len = written;
+    return 0;
+}
+
+// index is 1 based across the static table and then the dynamic one, newest first.
+static int lookup(const hpack_table *table, size_t index, const char **name, size_t *name_len, const char **value, size_t *value_len)
+{
+    const hpack_entry *entry;
+
+    if(index == 0)
+    {
+        return -1;
+    }
+    if(index <= HPACK_STATIC_ENTRIES)
+    {
+        *name      = static_table[index - 1].name;
+        *name_len  = strlen(*name);
+        *value     = static_table[index - 1].value;
+        *value_len = strlen(*value);
+        return 0;
+    }
+    index -= HPACK_STATIC_ENTRIES + 1;
+    if(index >= table->count)
+    {
+        return -1;
+    }
+    entry      = &table->entries[(table->head + index) % HPACK_MAX_ENTRIES];
+    *name      = entry->data;
+    *name_len  = entry->name_len;
+    *value     = entry->data + entry->name_len + 1;
+    *value_len = entry->value_len;
+    return 0;
+}
+
+static void table_init(hpack_table *table, size_t max_size)
+{
+    memset(table, 0, sizeof(*table));
+    table->max_size = max_size;
+}
+
+// Drops the oldest entries until the table fits in max_size.
+static void table_evict(hpack_table *table, size_t max_size)
+{
+    while(table->count > 0 && table->size > max_size)
+    {
+        hpack_entry *oldest = &table->entries[(table->head + table->count - 1) % HPACK_MAX_ENTRIES];
+
+        table->size -= oldest->name_len + oldest->value_len + HPACK_ENTRY_OVERHEAD;
+        free(oldest->data);
+        oldest->data = NULL;
+        table->count--;
+    }
+}
+
+// An entry larger than the whole table empties it and is not added, which is not an error. name may
+// point into the oldest entry, so it is copied out before anything is evicted.
+static int table_add(hpack_table *table, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    size_t       size = name_len + value_len + HPACK_ENTRY_OVERHEAD;
+    hpack_entry *entry;
+    char        *data;
+
+    if(size > table->max_size)
+    {
+        table_evict(table, 0);
+        return 0;
+    }
+
+    data = (char *)malloc(name_len + value_len + 2);
+    if(!data)
+    {
+        return -1;
+    }
+    memcpy(data, name, name_len);
+    data[name_len] = '\0';
+    memcpy(data + name_len + 1, value, value_len);
+    data[name_len + 1 + value_len] = '\0';
+    table_evict(table, table->max_size - size);
+
+    table->head      = (table->head + HPACK_MAX_ENTRIES - 1) % HPACK_MAX_ENTRIES;
+    entry            = &table->entries[table->head];
+    entry->data      = data;
+    entry->name_len  = name_len;
+    entry->value_len = value_len;
+    table->count++;
+    table->size += size;
+    return 0;
+}
+
+static void table_free(hpack_table *table)
+{
+    table_evict(table, 0);
+}
+
+int hpack_decoder_init(hpack_decoder *decoder)
+{
+    table_init(&decoder->table, HPACK_TABLE_SIZE);
+    decoder->limit   = HPACK_TABLE_SIZE;
+    decoder->scratch = (char *)malloc(2 * HPACK_STRING_MAX);
+    if(!decoder->scratch)
+    {
+        perror("hpack malloc");
+        return -1;
+    }
+    return 0;
+}
+
+// Calls emit for each field of one complete header block, in order. Any malformed representation is
+// a compression error for the whole connection, since the tables can no longer be trusted.
+int hpack_decode(hpack_decoder *decoder, const uint8_t *block, size_t len, hpack_emit emit, void *ctx)
+{
+    const uint8_t *pos = block;
+    const uint8_t *end = block + len;
+
+    while(pos < end)
+    {
+        const char *name;
+        const char *value;
+        size_t      name_len;
+        size_t      value_len;
+        size_t      index;
+        uint8_t     first = *pos;
+
+        if(first & INDEXED)
+        {
+            if(decode_int(&pos, end, 7, &index) == -1 || lookup(&decoder->table, index, &name, &name_len, &value, &value_len) == -1)
+            {
+                return -1;
+            }
+        }
+        else if((first & 0xe0) == SIZE_UPDATE)
+        {
+            if(decode_int(&pos, end, 5, &index) == -1 || index > decoder->limit)
+            {
+                return -1;
+            }
+            decoder->table.max_size = index;
+            table_evict(&decoder->table, index);
+            continue;
+        }
+        else
+        {
+            int prefix = (first & LITERAL_INDEXED) ? 6 : 4;
+
+            if(decode_int(&pos, end, prefix, &index) == -1)
+            {
+                return -1;
+            }
+            if(index > 0)
+            {
+                const char *unused;
+                size_t      unused_len;
+
+                if(lookup(&decoder->table, index, &name, &name_len, &unused, &unused_len) == -1)
+                {
+                    return -1;
+                }
+            }
+            else if(decode_string(&pos, end, decoder->scratch, &name, &name_len) == -1)
+            {
+                return -1;
+            }
+            if(decode_string(&pos, end, decoder->scratch + HPACK_STRING_MAX, &value, &value_len) == -1)
+            {
+                return -1;
+            }
+            // emit first: adding may evict the entry the name was taken from
+            if(emit(name, name_len, value, value_len, ctx) == -1)
+            {
+                return -1;
+            }
+            if((first & LITERAL_INDEXED) && table_add(&decoder->table, name, name_len, value, value_len) == -1)
+            {
+                return -1;
+            }
+            continue;
+        }
+        if(emit(name, name_len, value, value_len, ctx) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void hpack_decoder_free(hpack_decoder *decoder)
+{
+    table_free(&decoder->table);
+    free(decoder->scratch);
+    decoder->scratch = NULL;
+}
+
+void hpack_encoder_init(hpack_encoder *encoder)
+{
+    table_init(&encoder->table, HPACK_TABLE_SIZE);
+    encoder->pending_size = HPACK_TABLE_SIZE;
+    encoder->update       = 0;
+}
+
+// The peer's SETTINGS_HEADER_TABLE_SIZE. We never use more than HPACK_TABLE_SIZE of it, and a change
+// is announced at the start of the next block.
+void hpack_encoder_resize(hpack_encoder *encoder, size_t max_size)
+{
+    if(max_size > HPACK_TABLE_SIZE)
+    {
+        max_size = HPACK_TABLE_SIZE;
+    }
+    if(max_size != encoder->table.max_size)
+    {
+        encoder->pending_size = max_size;
+        encoder->update       = 1;
+    }
+}
+
+static size_t encode_int(uint8_t *out, size_t size, uint8_t flags, int prefix, size_t value)
+{
+    size_t max = ((size_t)1 << prefix) - 1;
+    size_t n   = 0;
+
+    if(size == 0)
+    {
+        return 0;
+    }
+    if(value < max)
+    {
+        out[0] = (uint8_t)(flags | value);
+        return 1;
+    }
+    out[n++] = (uint8_t)(flags | max);
+    value -= max;
+    while(value >= 0x80)
+    {
+        if(n == size)
+        {
+            return 0;
+        }
+        out[n++] = (uint8_t)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    if(n == size)
+    {
+        return 0;
+    }
+    out[n++] = (uint8_t)value;
+    return n;
+}
+
+// Response headers are short and mostly tokens, so they go out as plain strings.
+static size_t encode_string(uint8_t *out, size_t size, const char *str, size_t len)
+{
+    size_t n = encode_int(out, size, 0, 7, len);
+
+    if(n == 0 || size - n < len)
+    {
+        return 0;
+    }
+    memcpy(out + n, str, len);
+    return n + len;
+}
+
+// How many of the newest entries are left once the table is evicted down to max_size.
+static size_t table_keeps(const hpack_table *table, size_t max_size)
+{
+    size_t size = table->size;
+    size_t keep = table->count;
+
+    while(keep > 0 && size > max_size)
+    {
+        const hpack_entry *oldest = &table->entries[(table->head + keep - 1) % HPACK_MAX_ENTRIES];
+
+        size -= oldest->name_len + oldest->value_len + HPACK_ENTRY_OVERHEAD;
+        keep--;
+    }
+    return keep;
+}
+
+// The best index for a field among the static table and the newest count dynamic entries: an exact
+// match if there is one, otherwise the first entry with its name, otherwise 0.
+static size_t find_field(const hpack_table *table, size_t count, const char *name, size_t name_len, const char *value, size_t value_len, int *exact)
+{
+    size_t named = 0;
+
+    *exact = 0;
+    for(size_t i = 0; i < HPACK_STATIC_ENTRIES; i++)
+    {
+        if(strlen(static_table[i].name) == name_len && memcmp(static_table[i].name, name, name_len) == 0)
+        {
+            if(strlen(static_table[i].value) == value_len && memcmp(static_table[i].value, value, value_len) == 0)
+            {
+                *exact = 1;
+                return i + 1;
+            }
+            if(named == 0)
+            {
+                named = i + 1;
+            }
+        }
+    }
+    for(size_t i = 0; i < count; i++)
+    {
+        const hpack_entry *entry = &table->entries[(table->head + i) % HPACK_MAX_ENTRIES];
+
+        if(entry->name_len == name_len && memcmp(entry->data, name, name_len) == 0)
+        {
+            if(entry->value_len == value_len && memcmp(entry->data + name_len + 1, value, value_len) == 0)
+            {
+                *exact = 1;
+                return HPACK_STATIC_ENTRIES + 1 + i;
+            }
+            if(named == 0)
+            {
+                named = HPACK_STATIC_ENTRIES + 1 + i;
+            }
+        }
+    }
+    return named;
+}
+
+static int is_volatile(const char *name, size_t name_len)
+{
+    for(size_t i = 0; i < sizeof(volatile_headers) / sizeof(volatile_headers[0]); i++)
+    {
+        if(strlen(volatile_headers[i]) == name_len && memcmp(volatile_headers[i], name, name_len) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Appends one field, name already lower case, to a header block. Returns the bytes written, 0 when
+// they did not fit. A pending size update goes first; the table is only shrunk, and the update only
+// counted as sent, once the whole field fits, so a failed call leaves the encoder as it was.
+size_t hpack_encode(hpack_encoder *encoder, uint8_t *out, size_t size, const char *name, size_t name_len, const char *value, size_t value_len)
+{
+    size_t n     = 0;
+    size_t count = encoder->table.count;
+    size_t index;
+    size_t part;
+    int    exact;
+    int    indexing;
+
+    if(encoder->update)
+    {
+        n = encode_int(out, size, SIZE_UPDATE, 5, encoder->pending_size);
+        if(n == 0)
+        {
+            return 0;
+        }
+        count = table_keeps(&encoder->table, encoder->pending_size);
+    }
+
+    index    = find_field(&encoder->table, count, name, name_len, value, value_len, &exact);
+    indexing = !exact && !is_volatile(name, name_len);
+    if(exact)
+    {
+        part = encode_int(out + n, size - n, INDEXED, 7, index);
+        if(part == 0)
+        {
+            return 0;
+        }
+        n += part;
+    }
+    else
+    {
+        part = encode_int(out + n, size - n, indexing ? LITERAL_INDEXED : 0, indexing ? 6 : 4, index);
+        if(part == 0)
+        {
+            return 0;
+        }
+        n += part;
+        if(index == 0)
+        {
+            part = encode_string(out + n, size - n, name, name_len);
+            if(part == 0)
+            {
+                return 0;
+            }
+            n += part;
+        }
+        part = encode_string(out + n, size - n, value, value_len);
+        if(part == 0)
+        {
+            return 0;
+        }
+        n += part;
+    }
+
+    if(encoder->update)
+    {
+        encoder->table.max_size = encoder->pending_size;
+        table_evict(&encoder->table, encoder->pending_size);
+        encoder->update = 0;
+    }
+    if(indexing && table_add(&encoder->table, name, name_len, value, value_len) == -1)
+    {
+        return 0;
+    }
+    return n;
+}
+
+void hpack_encoder_free(hpack_encoder *encoder)
+{
+    table_free(&encoder->table);
+}
@@ -1,18 +1,44 @@
 #include "http.h"
+#include "accesslog.h"
+#include "arena.h"
+#include "bloom.h"
+#include "capture.h"
 #include "database.h"
+#include "filehint.h"
+#include "h2.h"
+#include "json.h"
 #include "networking.h"
+#include "pack.h"
+#include "pathcache.h"
+#include "pool.h"
+#include "respcache.h"
 #include "utils.h"
+#include "wal.h"
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
-#define TIMEOUT 3000
-#define MILLI_SEC 1000
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_MSEC 1000000ULL
+#define BASE_TEN 10
+#define BASE_HEX 16
+#define SENDFILE_CHUNK (1 << 20)
+#define NSEC_PER_USEC 1000ULL
+#define V4_MAPPED_MARK 10
 
 static const char *const Http_methods[]              = {"HEAD", "GET", "POST"};
 static const char *const Unsupported_Http_methods[]  = {"PATCH", "PUT", "DELETE"};
@@ -26,9 +52,61 @@ static const char *const content_type                = "Content-Type: ";
 static const char *const content_len                 = "Content-Length: ";
 static const char *const server                      = "Server: Tia\r\n";
 static const char *const default_type                = "html";
-static const char *const base_path                   = "./public";
+static const char *const base_path                   = DOC_ROOT;
+static const char *const user_route                  = "/httptest/user";
+static const char *const metrics_route               = "/httptest/metrics";
+static const char *const metrics_type                = "txt";
+static const char *const continue_response           = "HTTP/1.1 100 Continue\r\n\r\n";
+static const char *const expect_continue             = "100-continue";
+static const char *const chunked                     = "chunked";
+static const char *const transfer_chunked            = "Transfer-Encoding: chunked\r\n";
+static const char *const connection_close            = "Connection: close\r\n";
+static const char *const date_header                 = "Date: ";
+static const char *const last_chunk                  = "0\r\n\r\n";
+static const char *const hex_digits                  = "0123456789abcdefABCDEF";
+static const char *const h2c_token                   = "h2c";
+
+// Body bytes that arrived with the headers are consumed first, then the socket is read directly.
+typedef struct body_reader
+{
+    int         fd;
+    uint64_t    deadline_nsec;
+    const char *pos;
+    const char *end;
+    char        buf[BUFFER_SIZE];
+} body_reader;
+
+// Where store_pair sends each parsed member of a POST body.
+typedef struct post_ctx
+{
+    DBO         *db;
+    wal_batch   *batch;
+    bloom_t     *bloom;
+    respcache_t *cache;
+} post_ctx;
+
+// Output of unknown length leaves as HTTP/1.1 chunks, or close-delimited for 1.0 clients, through one small buffer.
+typedef struct stream_t
+{
+    request_t *request;
+    size_t     len;
+    char       buf[STREAM_BUFFER_SIZE];
+} stream_t;
+
+static ssize_t stream_begin(request_t *request, stream_t *stream);
+static ssize_t stream_flush(stream_t *stream, const void *data, size_t size);
+static ssize_t stream_write(stream_t *stream, const void *data, size_t size);
+static ssize_t stream_printf(stream_t *stream, const char *format, ...) __attribute__((format(printf, 2, 3)));
+static ssize_t stream_end(stream_t *stream);
+static ssize_t writev_fully(int fd, struct iovec *iov, int count, int *err);
+static ssize_t send_response(request_t *request, const void *buf, ssize_t size);
+static ssize_t send_responsev(request_t *request, struct iovec *iov, int count);
+static ssize_t wait_client(int fd, short events, uint64_t deadline_nsec);
+static ssize_t reader_wait(const body_reader *reader);
+static ssize_t reader_fill(body_reader *reader);
+static ssize_t reader_line(body_reader *reader, char *line, size_t size);
+static ssize_t reader_copy(body_reader *reader, char *to, size_t size);
 
-static const char *mime_to_string(const char *mime);
 static const char *status_to_string(status_t status);
 static ssize_t     header_end(char *buf);
 static ssize_t     check_method(request_t *request);
@@ -38,48 +116,49 @@ static void        process_request(void *args);
 static fsm_state_t read_request(void *args);
 static fsm_state_t parse_request(void *args);
 static fsm_state_t check_request(void *args);
+static fsm_state_t read_body(void *args);
 static fsm_state_t response_handler(void *args);
 static fsm_state_t error_handler(void *args);
-static ssize_t     read_fully(int fd, char *buf, size_t size, int *err);
+static fsm_state_t http2_connection(void *args);
+static void        run(request_t *request, fsm_state_t from_id, fsm_state_t to_id);
+static void        capture_request(const request_t *request);
+static void        log_request(const request_t *request);
+static uint64_t    now_nsec(void);
+static uint64_t    wall_nsec(void);
+static ssize_t     read_fully(request_t *request, uint64_t deadline_nsec);
 static ssize_t     write_fully(int fd, const void *buf, ssize_t size, int *err);
 static ssize_t     copy(int from, int to, int *err);
-
-static const MimeMapping Mime_map[] = {
-    {"txt",  "text/plain; charset=utf-8\r\n"      },
-    {"html", "text/html; charset=utf-8\r\n"       },
-    {"css",  "text/css; charset=utf-8\r\n"        },
-    {"js",   "text/javascript; charset=utf-8\r\n" },
-    {"csv",  "text/csv; charset=utf-8\r\n"        },
-    {"jpeg", "image/jpeg\r\n"                     },
-    {"jpg",  "image/jpeg\r\n"                     },
-    {"png",  "image/png\r\n"                      },
-    {"gif",  "image/gif\r\n"                      },
-    {"json", "application/json; charset=utf-8\r\n"},
-    {"swf",  "application/x-shockwave-flash\r\n"  },
-    {"pdf",  "application/pdf\r\n"                }
-};
-
-static const char *mime_to_string(const char *mime)
-{
-    for(size_t i = 0; i < sizeof(Mime_map) / sizeof(Mime_map[0]); i++)
-    {
-        if(strcmp(Mime_map[i].mime, mime) == 0)
-        {
-            return Mime_map[i].name;
-        }
-    }
-    return "text/plain\r\n";
-}
+static int         is_dynamic(const char *path);
+static const char *find_header(const request_t *request, const char *name);
+static int         header_is(const char *value, const char *token);
+static int         header_has(const char *value, const char *token, size_t len);
+static int         check_pack(request_t *request);
+static ssize_t     check_dir(request_t *request);
+static ssize_t     resolve_path(request_t *request);
+static void        append_index(request_t *request);
+static ssize_t     body_reserve(request_t *request, size_t size);
+static ssize_t     read_chunked(request_t *request, body_reader *reader);
+static ssize_t     metrics(request_t *request);
+static ssize_t     send_user(request_t *request, const char *key, uint64_t version, const char *value);
+static void        stamp_date(char *response, size_t len, size_t date_offset);
+static void        get_timestamp(char *buffer, size_t size);
+static int         store_pair(const char *key, size_t k_size, const char *value, size_t v_size, void *ctx);
 
 static const StatusMapping status_map[] = {
-    {OK,                    "200 OK\r\n"                   },
-    {BAD_REQUEST,           "400 BAD REQUEST\r\n"          },
-    {UNAUTHORIZED,          "401 UNAUTHORIZED\r\n"         },
-    {FORBIDDEN,             "403 Forbidden\r\n"            },
-    {NOT_FOUND,             "404 Not Found\r\n"            },
-    {METHOD_NOT_ALLOWED,    "405 Method Not Allowed\r\n"   },
-    {INTERNAL_SERVER_ERROR, "500 Internal Server Error\r\n"},
-    {NOT_IMPLEMENTED,       "501 Not Implemented\r\n"      }
+    {OK,                      "200 OK\r\n"                             },
+    {NOT_MODIFIED,            "304 Not Modified\r\n"                   },
+    {BAD_REQUEST,             "400 BAD REQUEST\r\n"                    },
+    {UNAUTHORIZED,            "401 UNAUTHORIZED\r\n"                   },
+    {FORBIDDEN,               "403 Forbidden\r\n"                      },
+    {NOT_FOUND,               "404 Not Found\r\n"                      },
+    {METHOD_NOT_ALLOWED,      "405 Method Not Allowed\r\n"             },
+    {REQUEST_TIMEOUT,         "408 Request Timeout\r\n"                },
+    {LENGTH_REQUIRED,         "411 Length Required\r\n"                },
+    {PAYLOAD_TOO_LARGE,       "413 Payload Too Large\r\n"              },
+    {EXPECTATION_FAILED,      "417 Expectation Failed\r\n"             },
+    {HEADER_FIELDS_TOO_LARGE, "431 Request Header Fields Too Large\r\n"},
+    {INTERNAL_SERVER_ERROR,   "500 Internal Server Error\r\n"          },
+    {NOT_IMPLEMENTED,         "501 Not Implemented\r\n"                }
 };
 
 static const char *status_to_string(status_t status)
@@ -120,20 +199,59 @@ static char *strconcat(char *to, const char *from1, size_t len1, const char *fro
 
 static ssize_t head(request_t *request)
 {
-    return write_fully(request->client_fd, request->response, request->response_len, &request->err);
+    return send_response(request, request->response, request->response_len);
 }
 
 static ssize_t get(request_t *request)
 {
-    ssize_t result;
+    stream_t stream;
+    ssize_t  result;
+
+    if(strcmp(request->path, metrics_route) == 0)
+    {
+        return metrics(request);
+    }
 
-    if(strcmp(request->path, "/httptest/user") == 0)
+    if(strcmp(request->path, user_route) == 0)
     {
-        DBO   userDB;
-        char  user_name[] = "users";
-        char *existing;
+        DBO         userDB;
+        char        user_name[] = "users";
+        char       *existing;
+        const char *key;
+        uint64_t    version;
 
         userDB.name = user_name;
+        version     = 0;
+
+        if(!request->params[0] || !request->params[0]->value)
+        {
+            request->status = BAD_REQUEST;
+            process_request(request);
+            return send_response(request, request->response, request->response_len);
+        }
+        key = request->params[0]->value;
+
+        // a hit is the whole response, only its Date brought up to now
+        if(request->respcache)
+        {
+            char    cached[RESPCACHE_DATA_SIZE];
+            size_t  date_offset;
+            ssize_t len = respcache_find(request->respcache, key, cached, sizeof(cached), &date_offset);
+
+            if(len > 0)
+            {
+                stamp_date(cached, (size_t)len, date_offset);
+                return send_response(request, cached, len);
+            }
+            version = respcache_version(request->respcache, key);
+        }
+
+        // A definite miss from the filter is answered exactly like a storage miss, without opening storage.
+        if(request->bloom && !bloom_maybe(request->bloom, key, strlen(key) + 1))
+        {
+            PRINT_DEBUG("bloom filter miss: %s\n", key);
+            return send_response(request, request->response, request->response_len);
+        }
 
         if(database_open(&userDB, &request->err) < 0)
         {
@@ -141,30 +259,66 @@ static ssize_t get(request_t *request)
             request->status = INTERNAL_SERVER_ERROR;
             return -1;
         }
-        printf("%s\n", "yo");
-        printf("%s\n", request->params[0]->value);
+        PRINT_DEBUG("user lookup: %s\n", key);
 
-        existing = retrieve_string(userDB.db, request->params[0]->value);
-        dbm_close(userDB.db);
+        existing = retrieve_string(&userDB, key);
+        database_close(&userDB);
         if(!existing)
         {
-            return write_fully(request->client_fd, request->response, request->response_len, &request->err);
+            if(request->bloom)
+            {
+                bloom_false_positive(request->bloom);
+            }
+            return send_response(request, request->response, request->response_len);
+        }
+        if(request->respcache)
+        {
+            result = send_user(request, key, version, existing);
+            free(existing);
+            return result;
+        }
+        result = stream_begin(request, &stream);
+        if(result == 0)
+        {
+            result = stream_write(&stream, existing, strlen(existing));
+        }
+        if(result == 0)
+        {
+            result = stream_end(&stream);
         }
-        request->content_len = (off_t)strlen(existing);
-        printf("%d\n", (int)request->content_len);
-        process_request(request);
-
-        printf("%s\n", request->response);
-
-        strncpy(request->response + strlen(request->response), existing, strlen(existing));
-
-        printf("%s\n", request->response);
-        write_fully(request->client_fd, request->response, request->response_len + (ssize_t)strlen(existing), &request->err);
         free(existing);
+        return result;
+    }
+
+    // over HTTP/2 the mapped body is framed from where it lies
+    if(request->variant && request->h2)
+    {
+        if(send_response(request, request->response, request->response_len) == -1)
+        {
+            return -1;
+        }
+        if(h2_write_mapped(request->h2, pack_data(request->pack, request->variant->body), (size_t)request->variant->length) == -1)
+        {
+            return -1;
+        }
+        request->sent += request->variant->length;
         return 0;
     }
 
-    result = write_fully(request->client_fd, request->response, request->response_len, &request->err);
+    // headers and the mapped body leave in one call
+    if(request->variant)
+    {
+        struct iovec iov[2];
+        const char  *body = pack_data(request->pack, request->variant->body);
+
+        iov[0].iov_base = request->response;
+        iov[0].iov_len  = (size_t)request->response_len;
+        iov[1].iov_base = (void *)(uintptr_t)body;
+        iov[1].iov_len  = (size_t)request->variant->length;
+        return send_responsev(request, iov, request->variant->length > 0 ? 2 : 1);
+    }
+
+    result = send_response(request, request->response, request->response_len);
     if(result == -1)
     {
         return result;
@@ -173,6 +327,7 @@ static ssize_t get(request_t *request)
     if(request->status == OK)
     {
         int input_fd;
+        int cold;
 
         input_fd = open(request->path, O_RDONLY | O_CLOEXEC);
         if(input_fd < 0)
@@ -182,325 +337,902 @@ static ssize_t get(request_t *request)
             return -1;
         }
 
-        result = copy(input_fd, request->client_fd, &request->err);
+        cold = filehint_cold(request->content_len, request->file_hits);
+        filehint_start(input_fd, request->content_len);
+        result = request->h2 ? h2_write_file(request->h2, input_fd, request->content_len, cold) : copy(input_fd, request->client_fd, &request->err);
+        if(result != -1)
+        {
+            request->sent += (uint64_t)request->content_len;
+        }
+
+        // a stream drops the file itself once its last frame is read
+        if(cold && !request->h2)
+        {
+            filehint_drop(input_fd, request->content_len);
+        }
+        if(cold && request->pool)
+        {
+            atomic_fetch_add(&request->pool->cold_drops, 1);
+        }
 
         close(input_fd);
     }
     return result;
 }
 
-static char *trim(char *str)
+static int store_pair(const char *key, size_t k_size, const char *value, size_t v_size, void *ctx)
 {
-    char *end;
-    // Trim leading
-    while(*str && (*str == ' ' || *str == '\t' || *str == '\n' || *str == '\r'))
+    post_ctx *post = (post_ctx *)ctx;
+    ssize_t   stored;
+
+    (void)k_size;
+    (void)v_size;
+
+    PRINT_DEBUG("pair: %s = %s\n", key, value);
+
+    stored = post->batch ? wal_batch_add(post->batch, key, value) : store_string(post->db, key, value);
+    if(stored == 0 && post->bloom)
     {
-        str++;
+        bloom_add(post->bloom, key, strlen(key) + 1);
     }
-
-    // Trim trailing
-    end = str + strlen(str) - 1;
-    while(end > str && (*end == ' ' || *end == '\t' || *end == '\n' || *end == '\r'))
+    // through the log the applier invalidates, once the value is in storage
+    if(stored == 0 && !post->batch && post->cache)
     {
-        *end-- = '\0';
+        respcache_invalidate(post->cache, key);
     }
-
-    return str;
+    return 0;
 }
 
 static ssize_t post(request_t *request)
 {
-    DBO    userDB;
-    char   user_name[] = "users";
-    char  *saveptr;
-    char  *body;
-    char  *copy_line;
-    size_t len;
-    char  *pair;
+    DBO       userDB;
+    wal_batch batch;
+    post_ctx  ctx;
+    char      user_name[] = "users";
+    ssize_t   pairs;
 
     userDB.name = user_name;
+    wal_batch_init(&batch);
 
-    printf("%s\n", "In POST");
-
-    if(database_open(&userDB, &request->err) < 0)
+    // With a write-ahead log the applier owns the database; this request only appends one record.
+    if(!request->wal && database_open(&userDB, &request->err) < 0)
     {
         perror("database error");
         request->status = INTERNAL_SERVER_ERROR;
         return -1;
     }
 
-    body = strstr(request->raw, terminate);
+    ctx.db    = &userDB;
+    ctx.batch = request->wal ? &batch : NULL;
+    ctx.bloom = request->bloom;
+    ctx.cache = request->respcache;
 
-    body = body + strlen(terminate);
+    // Pairs go to storage as they are parsed; through the log a malformed body commits nothing.
+    pairs = json_parse_object(request->body, request->body_len, store_pair, &ctx);
 
-    // printf("%s\n", body);
-
-    copy_line = strndup(body, strlen(body));
-    if(!copy_line)
+    if(!request->wal)
     {
-        request->status = INTERNAL_SERVER_ERROR;
-        request->err    = errno;
-        return -1;
+        database_close(&userDB);
     }
 
-    printf("copy_line: %s\n", copy_line);
-
-    body = copy_line + 1;
-
-    len = strlen(body);
-
-    // Remove closing '}'
-    body[len - 1] = '\0';
-
-    printf("body: %s\n", body);
-
-    pair = strtok_r(body, ",", &saveptr);
-
-    while(pair)
+    if(pairs < 0)
     {
-        char *colon_ptr = strchr(pair, ':');
-        if(colon_ptr)
-        {
-            char *key   = pair;
-            char *value = colon_ptr + 1;
-
-            printf("Key: %s\n", key);
-            printf("Value: %s\n", value);
-            *colon_ptr = '\0';
-
-            key   = trim(key);
-            value = trim(value);
-
-            printf("clean key: %s\n", key);
-            printf("clean value: %s\n", value);
-
-            if(key[0] == '"')
-            {
-                key++;
-            }
-            if(key[strlen(key) - 1] == '"')
-            {
-                key[strlen(key) - 1] = '\0';
-            }
-
-            if(value[0] == '"')
-            {
-                value++;
-            }
-
-            if(value[strlen(value) - 1] == '"')
-            {
-                value[strlen(value) - 1] = '\0';
-            }
+        wal_batch_free(&batch);
+        request->status = BAD_REQUEST;
+        process_request(request);
+        return send_response(request, request->response, request->response_len);
+    }
 
-            printf("final key: %s\n", key);
-            printf("final value: %s\n", value);
+    if(request->wal)
+    {
+        ssize_t result = wal_commit(request->wal, &batch, &request->err);
 
-            store_string(userDB.db, key, value);
+        wal_batch_free(&batch);
+        if(result == -1)
+        {
+            perror("wal commit");
+            request->status = INTERNAL_SERVER_ERROR;
+            return -1;
         }
-        pair = strtok_r(NULL, ",", &saveptr);
     }
 
-    free(copy_line);
-    dbm_close(userDB.db);
-
-    return write_fully(request->client_fd, request->response, request->response_len, &request->err);
+    return send_response(request, request->response, request->response_len);
 }
 
-static const funcMapping http_func[] = {
-    {"HEAD", head},
-    {"GET",  get },
-    {"POST", post},
-    {NULL,   NULL}  // Null termination for safety
-};
-
-static ssize_t execute_functions(request_t *request, const funcMapping functions[])
+// Renders with a Content-Length so the one copy serves every client, HTTP/2 streams included, and
+// caches it if it fits. version is the set's from before storage was read.
+static ssize_t send_user(request_t *request, const char *key, uint64_t version, const char *value)
 {
-    if(request->status != OK)
-    {
-        return functions[0].func(request);
-    }
+    char         rendered[RESPCACHE_DATA_SIZE];
+    struct iovec iov[2];
+    size_t       value_len = strlen(value);
+    size_t       head_len;
+    const char  *date;
+
+    request->content_len = (off_t)value_len;
+    request->chunked     = 0;
+    process_request(request);
+    head_len = (size_t)request->response_len;
 
-    for(size_t i = 0; functions[i].method != NULL; i++)
+    date = strstr(request->response, date_header);
+    if(date && head_len + value_len <= sizeof(rendered))
     {
-        if(strcmp(request->method, functions[i].method) == 0)
-        {
-            return functions[i].func(request);
-        }
+        memcpy(rendered, request->response, head_len);
+        memcpy(rendered + head_len, value, value_len);
+        respcache_store(request->respcache, key, version, rendered, head_len + value_len, (size_t)(date - request->response));
+        return send_response(request, rendered, (ssize_t)(head_len + value_len));
     }
-    printf("Not builtin command: %s\n", request->method);
-    request->status = NOT_IMPLEMENTED;
-    return 1;
-}
 
-const struct fsm_transition transitions[] = {
-    {START,            READ_REQUEST,     read_request    },
-    {READ_REQUEST,     PARSER_REQUEST,   parse_request   },
-    {PARSER_REQUEST,   CHECK_REQUEST,    check_request   },
-    {CHECK_REQUEST,    RESPONSE_HANDLER, response_handler},
-    {RESPONSE_HANDLER, END,              NULL            },
-    {READ_REQUEST,     ERROR_HANDLER,    error_handler   },
-    {PARSER_REQUEST,   ERROR_HANDLER,    error_handler   },
-    {CHECK_REQUEST,    ERROR_HANDLER,    error_handler   },
-    {RESPONSE_HANDLER, ERROR_HANDLER,    error_handler   },
-    {ERROR_HANDLER,    END,              NULL            },
-    {-1,               -1,               NULL            },
-};
+    iov[0].iov_base = request->response;
+    iov[0].iov_len  = head_len;
+    iov[1].iov_base = (void *)(uintptr_t)value;
+    iov[1].iov_len  = value_len;
+    return send_responsev(request, iov, value_len > 0 ? 2 : 1);
+}
 
-static ssize_t header_end(char *buf)
+// The Date header is the same length whatever the time, so it is overwritten where it lies.
+static void stamp_date(char *response, size_t len, size_t date_offset)
 {
-    const char *pos = strstr(buf, terminate);
+    char   timestamp[PATH_SIZE];
+    size_t stamp_len;
 
-    if(pos)
+    get_timestamp(timestamp, sizeof(timestamp));
+    stamp_len = strlen(timestamp);
+    if(date_offset + stamp_len <= len && memcmp(response + date_offset, date_header, strlen(date_header)) == 0)
     {
-        printf("Found at position: %td\n", pos - buf);
-        return pos - buf;
+        memcpy(response + date_offset, timestamp, stamp_len);
     }
-    printf("Not found\n");
-    return -1;
 }
 
-static ssize_t parse_param(request_t *request)
+static ssize_t metrics(request_t *request)
 {
-    char *qmark;
+    stream_t stream;
+    ssize_t  result;
 
-    qmark = strchr(request->path, '?');
-    if(qmark)
+    memcpy(request->mime_type, metrics_type, strlen(metrics_type) + 1);
+    result = stream_begin(request, &stream);
+    if(result == -1)
     {
-        char *kv;
-        char *saveptr;
-        int   i         = 0;
-        char *query_str = qmark + 1;
-        *qmark          = '\0';    // Null-terminate to isolate path
-
-        // Tokenize query parameters
+        return result;
+    }
 
-        for(kv = strtok_r(query_str, "&", &saveptr); kv != NULL && i < PARAMS; kv = strtok_r(NULL, "&", &saveptr), i++)
+    if(request->bloom)
+    {
+        if(stream_printf(&stream,
+                         "bloom_bits %llu\n"
+                         "bloom_checks %llu\n"
+                         "bloom_negatives %llu\n"
+                         "bloom_false_positives %llu\n"
+                         "bloom_false_positive_rate %.6f\n",
+                         (unsigned long long)request->bloom->bits,
+                         (unsigned long long)atomic_load(&request->bloom->checks),
+                         (unsigned long long)atomic_load(&request->bloom->negatives),
+                         (unsigned long long)atomic_load(&request->bloom->false_positives),
+                         bloom_false_positive_rate(request->bloom)) == -1)
         {
-            param_t *param;
-
-            param = (param_t *)malloc(sizeof(param_t));
-            if(!param)
-            {
-                request->status = INTERNAL_SERVER_ERROR;
-                goto cleanup;
-            }
-
-            kv = strtok_r(query_str, "&", &saveptr);
-
-            param->key = strtok_r(kv, "=", &saveptr);
-
-            param->value = strtok_r(NULL, "=", &saveptr);
-
-            // store key/val as needed
-            request->params[i] = param;
-            printf("%s\n", request->params[i]->key);
-            printf("%s\n", request->params[i]->value);
+            return -1;
         }
     }
-    printf("%s\n", request->path);
-    // free(copy_path);
-    for(int i = 0; i < PARAMS; i++)
+
+    if(request->wal)
     {
-        free(request->params[i]);
+        unsigned long long wal_stats[7];
+
+        pthread_mutex_lock(&request->wal->lock);
+        wal_stats[0] = request->wal->records;
+        wal_stats[1] = request->wal->syncs;
+        wal_stats[2] = request->wal->end_lsn;
+        wal_stats[3] = request->wal->synced_lsn;
+        wal_stats[4] = request->wal->applied_lsn;
+        wal_stats[5] = request->wal->bad_records;
+        wal_stats[6] = request->wal->failed_stores;
+        pthread_mutex_unlock(&request->wal->lock);
+
+        if(stream_printf(&stream,
+                         "wal_records %llu\n"
+                         "wal_syncs %llu\n"
+                         "wal_end_lsn %llu\n"
+                         "wal_synced_lsn %llu\n"
+                         "wal_applied_lsn %llu\n"
+                         "wal_bad_records %llu\n"
+                         "wal_failed_stores %llu\n",
+                         wal_stats[0],
+                         wal_stats[1],
+                         wal_stats[2],
+                         wal_stats[3],
+                         wal_stats[4],
+                         wal_stats[5],
+                         wal_stats[6]) == -1)
+        {
+            return -1;
+        }
     }
-    return 0;
-cleanup:
-    // free(copy_path);
-    for(int i = 0; i < PARAMS; i++)
+
+    if(request->pool)
     {
-        free(request->params[i]);
+        if(stream_printf(&stream,
+                         "pool_workers %d\n"
+                         "pool_min_workers %d\n"
+                         "pool_max_workers %d\n"
+                         "pool_queue %llu\n"
+                         "pool_busy_percent %llu\n"
+                         "pool_p99_usec %llu\n"
+                         "pool_spawned %llu\n"
+                         "pool_retired %llu\n"
+                         "idle_timeouts %llu\n"
+                         "request_timeouts %llu\n",
+                         atomic_load(&request->pool->active),
+                         request->pool->min_workers,
+                         request->pool->max_workers,
+                         (unsigned long long)atomic_load(&request->pool->last_queue),
+                         (unsigned long long)atomic_load(&request->pool->last_busy_percent),
+                         (unsigned long long)atomic_load(&request->pool->last_p99_usec),
+                         (unsigned long long)atomic_load(&request->pool->spawned),
+                         (unsigned long long)atomic_load(&request->pool->retired),
+                         (unsigned long long)atomic_load(&request->pool->idle_timeouts),
+                         (unsigned long long)atomic_load(&request->pool->request_timeouts)) == -1)
+        {
+            return -1;
+        }
     }
-    return -1;
-}
-
-static void url_decode(char *url)
-{
-    const int HEX = 16;
-    char      output;
 
-    while(*url)
+    if(request->pool)
     {
-        if(*url == '%')
+        if(stream_printf(&stream,
+                         "lib_generation %llu\n"
+                         "lib_reloads %llu\n"
+                         "lib_reload_failures %llu\n"
+                         "lib_last_reload_usec %llu\n"
+                         "lib_max_reload_usec %llu\n",
+                         (unsigned long long)atomic_load(&request->pool->lib_generation),
+                         (unsigned long long)atomic_load(&request->pool->lib_reloads),
+                         (unsigned long long)atomic_load(&request->pool->lib_reload_failures),
+                         (unsigned long long)atomic_load(&request->pool->lib_last_reload_usec),
+                         (unsigned long long)atomic_load(&request->pool->lib_max_reload_usec)) == -1)
         {
-            // Handle percent-encoded characters
-            const char hex[3] = {url[1], url[2], '\0'};
-            output            = (char)strtol(hex, NULL, HEX);    // Convert hex to char
-            *url              = output;
-            // 20in%20name.txt
-            // in%20name.txt00
-            strcopy(url + 1, url + 3, strlen(url + 1));
+            return -1;
         }
-        url++;
     }
-}
-
-static void get_timestamp(char *buffer, size_t size)
-{
-    time_t    t = time(NULL);
-    struct tm buf;
-    gmtime_r(&t, &buf);
 
-    strftime(buffer, size, "Date: %a, %d %b %Y %H:%M:%S GMT", &buf);
-}
-
-static ssize_t check_method(request_t *request)
-{
-    PRINT_VERBOSE("%s\n", "check method");
-    for(size_t i = 0; i < sizeof(Http_methods) / sizeof(Http_methods[0]); ++i)
+    if(request->pool)
     {
-        if(strcmp(request->method, Http_methods[i]) == 0)
+        if(stream_printf(&stream,
+                         "tls_handshakes %llu\n"
+                         "tls_resumed %llu\n"
+                         "tls_offloaded %llu\n"
+                         "tls_failures %llu\n",
+                         (unsigned long long)atomic_load(&request->pool->tls_handshakes),
+                         (unsigned long long)atomic_load(&request->pool->tls_resumed),
+                         (unsigned long long)atomic_load(&request->pool->tls_offloaded),
+                         (unsigned long long)atomic_load(&request->pool->tls_failures)) == -1)
         {
-            return 0;
+            return -1;
         }
     }
 
-    for(size_t i = 0; i < sizeof(Unsupported_Http_methods) / sizeof(Unsupported_Http_methods[0]); ++i)
+    if(request->pool)
     {
-        if(strcmp(request->method, Unsupported_Http_methods[i]) == 0)
+        if(stream_printf(&stream,
+                         "h2_connections %llu\n"
+                         "h2_streams %llu\n",
+                         (unsigned long long)atomic_load(&request->pool->h2_connections),
+                         (unsigned long long)atomic_load(&request->pool->h2_streams)) == -1)
         {
-            request->status = METHOD_NOT_ALLOWED;
-            return -2;
+            return -1;
         }
     }
-    request->status = INTERNAL_SERVER_ERROR;
-    return -1;
-}
 
-static ssize_t check_HTTP(request_t *request)
-{
-    PRINT_VERBOSE("%s\n", "check http");
-    for(size_t i = 0; i < sizeof(Http_versions) / sizeof(Http_versions[0]); ++i)
+    if(request->pool)
     {
-        if(strcmp(request->version, Http_versions[i]) == 0)
+        if(stream_printf(&stream,
+                         "limited_requests %llu\n"
+                         "limited_connections %llu\n",
+                         (unsigned long long)atomic_load(&request->pool->limited_requests),
+                         (unsigned long long)atomic_load(&request->pool->limited_connections)) == -1)
         {
-            return 0;
+            return -1;
         }
     }
 
-    for(size_t i = 0; i < sizeof(Unsupported_Http_versions) / sizeof(Unsupported_Http_versions[0]); ++i)
+    if(request->pool)
     {
-        if(strcmp(request->version, Unsupported_Http_versions[i]) == 0)
+        if(stream_printf(&stream,
+                         "cold_drops %llu\n"
+                         "files_warmed %llu\n"
+                         "bytes_warmed %llu\n",
+                         (unsigned long long)atomic_load(&request->pool->cold_drops),
+                         (unsigned long long)atomic_load(&request->pool->files_warmed),
+                         (unsigned long long)atomic_load(&request->pool->bytes_warmed)) == -1)
         {
-            request->status = NOT_IMPLEMENTED;
-            return 0;
+            return -1;
         }
     }
-    request->status = INTERNAL_SERVER_ERROR;
-    return -1;
-}
 
-static ssize_t check_skipping(request_t *request)
-{
-    if(strstr(request->path, "/.."))
+    if(request->respcache)
+    {
+        if(stream_printf(&stream,
+                         "user_cache_hits %llu\n"
+                         "user_cache_misses %llu\n"
+                         "user_cache_stores %llu\n"
+                         "user_cache_evictions %llu\n"
+                         "user_cache_invalidations %llu\n"
+                         "user_cache_bytes %zu\n",
+                         (unsigned long long)atomic_load(&request->respcache->hits),
+                         (unsigned long long)atomic_load(&request->respcache->misses),
+                         (unsigned long long)atomic_load(&request->respcache->stores),
+                         (unsigned long long)atomic_load(&request->respcache->evictions),
+                         (unsigned long long)atomic_load(&request->respcache->invalidations),
+                         request->respcache->size) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if(request->capture)
+    {
+        if(stream_printf(&stream,
+                         "capture_sample %u\n"
+                         "capture_records %llu\n"
+                         "capture_bytes %llu\n"
+                         "capture_failures %llu\n",
+                         request->capture->sample,
+                         (unsigned long long)atomic_load(&request->capture->records),
+                         (unsigned long long)atomic_load(&request->capture->bytes),
+                         (unsigned long long)atomic_load(&request->capture->failures)) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if(request->accesslog)
+    {
+        if(stream_printf(&stream,
+                         "accesslog_records %llu\n"
+                         "accesslog_bytes %llu\n"
+                         "accesslog_dropped %llu\n"
+                         "accesslog_rotations %llu\n"
+                         "accesslog_write_failures %llu\n",
+                         (unsigned long long)atomic_load(&request->accesslog->records),
+                         (unsigned long long)atomic_load(&request->accesslog->bytes),
+                         (unsigned long long)accesslog_dropped(request->accesslog),
+                         (unsigned long long)atomic_load(&request->accesslog->rotations),
+                         (unsigned long long)atomic_load(&request->accesslog->write_failures)) == -1)
+        {
+            return -1;
+        }
+    }
+
+    return stream_end(&stream);
+}
+
+static ssize_t stream_begin(request_t *request, stream_t *stream)
+{
+    stream->request = request;
+    stream->len     = 0;
+
+    request->content_len = -1;
+    request->chunked     = strcmp(request->version, Http_versions[1]) == 0;
+    process_request(request);
+
+    // headers go out now so the first byte does not wait for the body
+    return send_response(request, request->response, request->response_len) == -1 ? -1 : 0;
+}
+
+// Sends the buffered bytes followed by data as one chunk.
+static ssize_t stream_flush(stream_t *stream, const void *data, size_t size)
+{
+    char         head[CHUNK_LINE_SIZE];
+    struct iovec iov[4];
+    int          count = 0;
+    size_t       total = stream->len + size;
+
+    if(total == 0)
+    {
+        return 0;
+    }
+
+    if(stream->request->chunked)
+    {
+        iov[count].iov_base   = head;
+        iov[count++].iov_len = (size_t)snprintf(head, sizeof(head), "%zx\r\n", total);
+    }
+    if(stream->len > 0)
+    {
+        iov[count].iov_base   = stream->buf;
+        iov[count++].iov_len = stream->len;
+    }
+    if(size > 0)
+    {
+        iov[count].iov_base   = (void *)(uintptr_t)data;
+        iov[count++].iov_len = size;
+    }
+    if(stream->request->chunked)
+    {
+        iov[count].iov_base   = (void *)(uintptr_t)new_line;
+        iov[count++].iov_len = strlen(new_line);
+    }
+
+    stream->len = 0;
+    return send_responsev(stream->request, iov, count);
+}
+
+static ssize_t stream_write(stream_t *stream, const void *data, size_t size)
+{
+    if(stream->len + size <= sizeof(stream->buf))
+    {
+        memcpy(stream->buf + stream->len, data, size);
+        stream->len += size;
+        return 0;
+    }
+    // anything that does not fit is sent along with the buffer rather than copied in
+    return stream_flush(stream, data, size);
+}
+
+static ssize_t stream_printf(stream_t *stream, const char *format, ...)
+{
+    va_list args;
+    int     len;
+
+    va_start(args, format);
+    len = vsnprintf(stream->buf + stream->len, sizeof(stream->buf) - stream->len, format, args);
+    va_end(args);
+
+    if(len < 0)
+    {
+        return -1;
+    }
+    if((size_t)len < sizeof(stream->buf) - stream->len)
+    {
+        stream->len += (size_t)len;
+        return 0;
+    }
+
+    // did not fit: empty the buffer and format again, falling back to the heap for oversized output
+    if(stream_flush(stream, NULL, 0) == -1)
+    {
+        return -1;
+    }
+    if((size_t)len < sizeof(stream->buf))
+    {
+        va_start(args, format);
+        vsnprintf(stream->buf, sizeof(stream->buf), format, args);
+        va_end(args);
+        stream->len = (size_t)len;
+        return 0;
+    }
+    else
+    {
+        char *big = (char *)arena_alloc(stream->request->arena, (size_t)len + 1);
+
+        if(!big)
+        {
+            return -1;
+        }
+        va_start(args, format);
+        vsnprintf(big, (size_t)len + 1, format, args);
+        va_end(args);
+        return stream_flush(stream, big, (size_t)len);
+    }
+}
+
+static ssize_t stream_end(stream_t *stream)
+{
+    if(stream_flush(stream, NULL, 0) == -1)
+    {
+        return -1;
+    }
+    if(stream->request->chunked)
+    {
+        return send_response(stream->request, last_chunk, (ssize_t)strlen(last_chunk)) == -1 ? -1 : 0;
+    }
+    return 0;
+}
+
+static ssize_t writev_fully(int fd, struct iovec *iov, int count, int *err)
+{
+    while(count > 0)
+    {
+        ssize_t written = writev(fd, iov, count);
+
+        if(written == -1)
+        {
+            ssize_t result;
+
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            if(errno != EAGAIN)
+            {
+                *err = errno;
+                return -1;
+            }
+            result = wait_client(fd, POLLOUT, now_nsec() + WRITE_STALL_MSEC * NSEC_PER_MSEC);
+            if(result < 0)
+            {
+                *err = result == -2 ? ETIMEDOUT : errno;
+                return -1;
+            }
+            continue;
+        }
+
+        // step past whatever the kernel took, which may end part way through an entry
+        while(count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= (ssize_t)iov->iov_len;
+            iov++;
+            count--;
+        }
+        if(count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= (size_t)written;
+        }
+    }
+    return 0;
+}
+
+// Handlers answer through these: an HTTP/2 stream collects the bytes into frames, anything else is a
+// socket of its own. Either way they count what was sent for the access log.
+static ssize_t send_response(request_t *request, const void *buf, ssize_t size)
+{
+    ssize_t result;
+
+    if(request->h2)
+    {
+        result = h2_write(request->h2, buf, (size_t)size);
+    }
+    else
+    {
+        result = write_fully(request->client_fd, buf, size, &request->err);
+    }
+    if(result != -1)
+    {
+        request->sent += (uint64_t)size;
+    }
+    return result;
+}
+
+static ssize_t send_responsev(request_t *request, struct iovec *iov, int count)
+{
+    uint64_t total = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        total += iov[i].iov_len;
+    }
+
+    if(request->h2)
+    {
+        for(int i = 0; i < count; i++)
+        {
+            if(h2_write(request->h2, iov[i].iov_base, iov[i].iov_len) == -1)
+            {
+                return -1;
+            }
+        }
+    }
+    else if(writev_fully(request->client_fd, iov, count, &request->err) == -1)
+    {
+        return -1;
+    }
+    request->sent += total;
+    return 0;
+}
+
+// Timeouts run on the monotonic clock so they count time the client is silent, not CPU time we spend.
+static uint64_t now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+// Captured arrivals are wall clock so logs from successive servers line up.
+static uint64_t wall_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+// Sleeps in poll until the client is ready or deadline_nsec passes on the monotonic clock. Returns 0
+// when ready, -1 on error and -2 at the deadline.
+static ssize_t wait_client(int fd, short events, uint64_t deadline_nsec)
+{
+    while(1)
+    {
+        uint64_t      now = now_nsec();
+        struct pollfd pfd;
+        int           result;
+
+        if(now >= deadline_nsec)
+        {
+            return -2;
+        }
+        pfd.fd     = fd;
+        pfd.events = events;
+        result     = poll(&pfd, 1, (int)((deadline_nsec - now + NSEC_PER_MSEC - 1) / NSEC_PER_MSEC));
+        if(result > 0)
+        {
+            return 0;
+        }
+        if(result == -1 && errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+static const funcMapping http_func[] = {
+    {"HEAD", head},
+    {"GET",  get },
+    {"POST", post},
+    {NULL,   NULL}  // Null termination for safety
+};
+
+static ssize_t execute_functions(request_t *request, const funcMapping functions[])
+{
+    if(request->status != OK)
+    {
+        return functions[0].func(request);
+    }
+
+    for(size_t i = 0; functions[i].method != NULL; i++)
+    {
+        if(strcmp(request->method, functions[i].method) == 0)
+        {
+            return functions[i].func(request);
+        }
+    }
+    printf("Not builtin command: %s\n", request->method);
+    request->status = NOT_IMPLEMENTED;
+    return 1;
+}
+
+const struct fsm_transition transitions[] = {
+    {START,            READ_REQUEST,     read_request    },
+    {READ_REQUEST,     PARSER_REQUEST,   parse_request   },
+    {PARSER_REQUEST,   CHECK_REQUEST,    check_request   },
+    {CHECK_REQUEST,    RESPONSE_HANDLER, response_handler},
+    {CHECK_REQUEST,    READ_BODY,        read_body       },
+    {READ_BODY,        RESPONSE_HANDLER, response_handler},
+    {RESPONSE_HANDLER, END,              NULL            },
+    {READ_REQUEST,     ERROR_HANDLER,    error_handler   },
+    {PARSER_REQUEST,   ERROR_HANDLER,    error_handler   },
+    {CHECK_REQUEST,    ERROR_HANDLER,    error_handler   },
+    {READ_BODY,        ERROR_HANDLER,    error_handler   },
+    {RESPONSE_HANDLER, ERROR_HANDLER,    error_handler   },
+    {ERROR_HANDLER,    END,              NULL            },
+    {READ_REQUEST,     HTTP2_CONNECTION, http2_connection},
+    {CHECK_REQUEST,    HTTP2_CONNECTION, http2_connection},
+    {HTTP2_CONNECTION, END,              NULL            },
+    {-1,               -1,               NULL            },
+};
+
+static ssize_t header_end(char *buf)
+{
+    const char *pos = strstr(buf, terminate);
+
+    if(pos)
+    {
+        printf("Found at position: %td\n", pos - buf);
+        return pos - buf;
+    }
+    printf("Not found\n");
+    return -1;
+}
+
+static int is_dynamic(const char *path)
+{
+    return strcmp(path, user_route) == 0 || strcmp(path, metrics_route) == 0;
+}
+
+static ssize_t parse_param(request_t *request)
+{
+    char *qmark;
+
+    qmark = strchr(request->path, '?');
+    if(qmark)
+    {
+        char *kv;
+        char *saveptr;
+        int   i         = 0;
+        char *query_str = qmark + 1;
+        *qmark          = '\0';    // Null-terminate to isolate path
+
+        // Tokenize query parameters
+
+        for(kv = strtok_r(query_str, "&", &saveptr); kv != NULL && i < PARAMS; kv = strtok_r(NULL, "&", &saveptr), i++)
+        {
+            param_t *param;
+
+            param = (param_t *)arena_alloc(request->arena, sizeof(param_t));
+            if(!param)
+            {
+                request->status = INTERNAL_SERVER_ERROR;
+                goto cleanup;
+            }
+
+            kv = strtok_r(query_str, "&", &saveptr);
+
+            param->key = strtok_r(kv, "=", &saveptr);
+
+            param->value = strtok_r(NULL, "=", &saveptr);
+
+            // store key/val as needed
+            request->params[i] = param;
+            printf("%s\n", request->params[i]->key);
+            printf("%s\n", request->params[i]->value);
+        }
+    }
+    printf("%s\n", request->path);
+    // params are read by the handlers and released with the arena in fsm_run
+    return 0;
+cleanup:
+    for(int i = 0; i < PARAMS; i++)
+    {
+        request->params[i] = NULL;
+    }
+    return -1;
+}
+
+static void url_decode(char *url)
+{
+    const int HEX = 16;
+    char      output;
+
+    while(*url)
+    {
+        if(*url == '%')
+        {
+            // Handle percent-encoded characters
+            const char hex[3] = {url[1], url[2], '\0'};
+            output            = (char)strtol(hex, NULL, HEX);    // Convert hex to char
+            *url              = output;
+            // 20in%20name.txt
+            // in%20name.txt00
+            strcopy(url + 1, url + 3, strlen(url + 1));
+        }
+        url++;
+    }
+}
+
+static void get_timestamp(char *buffer, size_t size)
+{
+    time_t    t = time(NULL);
+    struct tm buf;
+    gmtime_r(&t, &buf);
+
+    strftime(buffer, size, "Date: %a, %d %b %Y %H:%M:%S GMT", &buf);
+}
+
+static ssize_t check_method(request_t *request)
+{
+    PRINT_VERBOSE("%s\n", "check method");
+    for(size_t i = 0; i < sizeof(Http_methods) / sizeof(Http_methods[0]); ++i)
+    {
+        if(strcmp(request->method, Http_methods[i]) == 0)
+        {
+            return 0;
+        }
+    }
+
+    for(size_t i = 0; i < sizeof(Unsupported_Http_methods) / sizeof(Unsupported_Http_methods[0]); ++i)
+    {
+        if(strcmp(request->method, Unsupported_Http_methods[i]) == 0)
+        {
+            request->status = METHOD_NOT_ALLOWED;
+            return -2;
+        }
+    }
+    request->status = INTERNAL_SERVER_ERROR;
+    return -1;
+}
+
+static ssize_t check_HTTP(request_t *request)
+{
+    PRINT_VERBOSE("%s\n", "check http");
+    if(request->h2 && strcmp(request->version, Unsupported_Http_versions[0]) == 0)
+    {
+        return 0;
+    }
+    for(size_t i = 0; i < sizeof(Http_versions) / sizeof(Http_versions[0]); ++i)
+    {
+        if(strcmp(request->version, Http_versions[i]) == 0)
+        {
+            return 0;
+        }
+    }
+
+    for(size_t i = 0; i < sizeof(Unsupported_Http_versions) / sizeof(Unsupported_Http_versions[0]); ++i)
+    {
+        if(strcmp(request->version, Unsupported_Http_versions[i]) == 0)
+        {
+            request->status = NOT_IMPLEMENTED;
+            return 0;
+        }
+    }
+    request->status = INTERNAL_SERVER_ERROR;
+    return -1;
+}
+
+static ssize_t check_skipping(request_t *request)
+{
+    if(strstr(request->path, "/.."))
     {
         request->status = BAD_REQUEST;
         return -1;
     }
-    return 0;
+    return 0;
+}
+
+static void append_index(request_t *request)
+{
+    size_t path_size = strlen(request->path);
+
+    if(*(request->path + path_size - 1) == '/')
+    {
+        --path_size;
+    }
+    strconcat(request->path, request->path, path_size, default_index, strlen(default_index));
 }
 
+// Repeat lookups, found or not, are answered from the worker's resolution cache; only the first one for
+// a path in each document root generation reaches stat.
 static ssize_t check_dir(request_t *request)
+{
+    const pathcache_entry *hit;
+    pathcache_entry        result;
+    char                   key[PATHCACHE_KEY_SIZE];
+    uint64_t               generation;
+    uint64_t               now;
+    size_t                 key_len;
+    ssize_t                resolved;
+
+    generation = request->pool ? atomic_load(&request->pool->docroot_generation) : 0;
+    now        = now_nsec();
+    hit        = pathcache_find(request->paths, request->path, generation, now);
+    if(hit)
+    {
+        if(hit->index)
+        {
+            append_index(request);
+        }
+        request->content_len        = hit->size;
+        request->last_modified_time = hit->mtime;
+        request->status             = (status_t)hit->status;
+        request->file_hits          = hit->hits;
+        return request->status == OK ? 0 : -1;
+    }
+
+    key_len = strlen(request->path);
+    if(key_len >= sizeof(key))
+    {
+        return resolve_path(request);
+    }
+    memcpy(key, request->path, key_len + 1);
+
+    resolved = resolve_path(request);
+    if(request->status == OK || request->status == NOT_FOUND || request->status == FORBIDDEN)
+    {
+        memset(&result, 0, sizeof(result));
+        result.size   = request->content_len;
+        result.mtime  = request->last_modified_time;
+        result.status = (int)request->status;
+        result.index  = strlen(request->path) != key_len;
+        hit = pathcache_store(request->paths, key, generation, now, &result);
+        if(hit)
+        {
+            request->file_hits = hit->hits;
+        }
+    }
+    return resolved;
+}
+
+static ssize_t resolve_path(request_t *request)
 {
     struct stat file_stat;
 
@@ -521,17 +1253,8 @@ static ssize_t check_dir(request_t *request)
     }
     if(S_ISDIR(file_stat.st_mode))
     {
-        size_t path_size;
-
-        errno     = 0;
-        path_size = (size_t)strlen(request->path);
-
-        if(*(request->path + path_size - 1) == '/')
-        {
-            --path_size;
-        }
-
-        strconcat(request->path, request->path, path_size, default_index, strlen(default_index));
+        errno = 0;
+        append_index(request);
 
         if(stat(request->path, &file_stat) == -1)
         {
@@ -547,112 +1270,531 @@ static ssize_t check_dir(request_t *request)
         }
     }
 
-    request->content_len        = file_stat.st_size;
-    request->last_modified_time = file_stat.st_mtime;
-    request->status             = OK;
-    return 0;
+    request->content_len        = file_stat.st_size;
+    request->last_modified_time = file_stat.st_mtime;
+    request->status             = OK;
+    return 0;
+}
+
+static void parse_mime_type(request_t *request)
+{
+    size_t      count;
+    size_t      index;
+    const char *from;
+    char       *to;
+
+    from  = request->path;
+    to    = request->mime_type;
+    index = 0;
+    count = 0;
+    do
+    {
+        ++count;
+        if(*from == '.')
+        {
+            index = count;
+        }
+    } while(*from++ != '\0');
+
+    if(index == 0)
+    {
+        *to = '\0';
+    }
+    else
+    {
+        from = request->path + index;
+        do
+        {
+            *to++ = *from++;
+        } while(*from != '\0');
+        *to = '\0';
+    }
+
+    if(*request->mime_type == '\0')
+    {
+        memcpy(request->mime_type, default_type, strlen(default_type));
+    }
+
+    printf("request->path: %s\n", request->path);
+    printf("request->mime_type %s\n", request->mime_type);
+}
+
+static const char *find_header(const request_t *request, const char *name)
+{
+    const char *line;
+    const char *end;
+    size_t      name_len;
+
+    name_len = strlen(name);
+    end      = request->raw + request->header_len;
+    line     = strstr(request->raw, new_line);
+
+    while(line && line < end)
+    {
+        line += strlen(new_line);
+        if(strncasecmp(line, name, name_len) == 0 && line[name_len] == ':')
+        {
+            line += name_len + 1;
+            while(*line == ' ' || *line == '\t')
+            {
+                line++;
+            }
+            return line;
+        }
+        line = strstr(line, new_line);
+    }
+    return NULL;
+}
+
+static int header_is(const char *value, const char *token)
+{
+    size_t len = strlen(token);
+
+    return strncasecmp(value, token, len) == 0 && (value[len] == '\r' || value[len] == ' ' || value[len] == '\t');
+}
+
+// Whether token appears anywhere in a list valued header, which is all Accept-Encoding and
+// If-None-Match need here.
+static int header_has(const char *value, const char *token, size_t len)
+{
+    return memmem(value, strcspn(value, "\r\n"), token, len) != NULL;
+}
+
+// A hit is answered from the mapped pack without touching the filesystem. A miss falls through to the
+// document root, so files added since the pack was built are still served.
+static int check_pack(request_t *request)
+{
+    const pack_entry *entry;
+    const char       *path = request->path + strlen(base_path);
+    const char       *accept;
+    const char       *match;
+
+    entry = pack_find(request->pack, path, strlen(path));
+    if(!entry)
+    {
+        return -1;
+    }
+
+    accept           = find_header(request, "Accept-Encoding");
+    request->variant = entry->gzip.length > 0 && accept && header_has(accept, "gzip", strlen("gzip")) ? &entry->gzip : &entry->plain;
+
+    request->content_len        = (off_t)request->variant->length;
+    request->last_modified_time = (time_t)entry->mtime;
+    request->status             = OK;
+
+    match = find_header(request, "If-None-Match");
+    if(match && (*match == '*' || header_has(match, pack_data(request->pack, request->variant->etag), request->variant->etag_len)))
+    {
+        request->status = NOT_MODIFIED;
+    }
+    PRINT_VERBOSE("pack hit %s, %zu bytes\n", path, (size_t)request->variant->length);
+    return 0;
+}
+
+// The whole body shares one deadline, so a client trickling it in a byte at a time still runs out.
+static ssize_t reader_wait(const body_reader *reader)
+{
+    ssize_t result = wait_client(reader->fd, POLLIN, reader->deadline_nsec);
+
+    if(result == -2)
+    {
+        PRINT_VERBOSE("%s\n", "body read timed out");
+        return -4;
+    }
+    return result;
+}
+
+static ssize_t reader_fill(body_reader *reader)
+{
+    while(1)
+    {
+        ssize_t nread = read(reader->fd, reader->buf, sizeof(reader->buf));
+
+        if(nread > 0)
+        {
+            reader->pos = reader->buf;
+            reader->end = reader->buf + nread;
+            return nread;
+        }
+        if(nread == 0)
+        {
+            return -2;    // the client closed before the body was complete
+        }
+        if(errno == EAGAIN)
+        {
+            ssize_t result = reader_wait(reader);
+            if(result < 0)
+            {
+                return result;
+            }
+        }
+        else if(errno != EINTR)
+        {
+            return -1;
+        }
+    }
+}
+
+static ssize_t reader_line(body_reader *reader, char *line, size_t size)
+{
+    size_t len = 0;
+
+    while(1)
+    {
+        char c;
+
+        if(reader->pos == reader->end)
+        {
+            ssize_t result = reader_fill(reader);
+            if(result < 0)
+            {
+                return result;
+            }
+        }
+
+        c = *reader->pos++;
+        if(c == '\n')
+        {
+            break;
+        }
+        if(len + 1 >= size)
+        {
+            return -2;
+        }
+        line[len++] = c;
+    }
+
+    if(len > 0 && line[len - 1] == '\r')
+    {
+        len--;
+    }
+    line[len] = '\0';
+    return (ssize_t)len;
+}
+
+static ssize_t reader_copy(body_reader *reader, char *to, size_t size)
+{
+    size_t buffered = (size_t)(reader->end - reader->pos);
+
+    if(buffered > size)
+    {
+        buffered = size;
+    }
+    if(buffered > 0)
+    {
+        memcpy(to, reader->pos, buffered);
+        reader->pos += buffered;
+        to += buffered;
+        size -= buffered;
+    }
+
+    // Large bodies skip the staging buffer and land straight in the request body.
+    while(size > 0)
+    {
+        ssize_t nread = read(reader->fd, to, size);
+
+        if(nread > 0)
+        {
+            to += nread;
+            size -= (size_t)nread;
+            continue;
+        }
+        if(nread == 0)
+        {
+            return -2;
+        }
+        if(errno == EAGAIN)
+        {
+            ssize_t result = reader_wait(reader);
+            if(result < 0)
+            {
+                return result;
+            }
+        }
+        else if(errno != EINTR)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static ssize_t body_reserve(request_t *request, size_t size)
+{
+    size_t cap;
+    char  *body;
+
+    if(size > request->max_body || request->body_len > request->max_body - size)
+    {
+        return -3;
+    }
+    if(request->body_len + size < request->body_cap)
+    {
+        return 0;
+    }
+
+    cap = request->body_cap ? request->body_cap : BUFFER_SIZE;
+    while(cap <= request->body_len + size)
+    {
+        cap *= 2;
+    }
+
+    body = (char *)arena_grow(request->arena, request->body, request->body_len, cap);
+    if(!body)
+    {
+        request->err = ENOMEM;
+        return -1;
+    }
+    request->body     = body;
+    request->body_cap = cap;
+    return 0;
+}
+
+static ssize_t read_chunked(request_t *request, body_reader *reader)
+{
+    char line[CHUNK_LINE_SIZE];
+
+    while(1)
+    {
+        ssize_t result;
+        char   *end;
+        unsigned long long size;
+
+        result = reader_line(reader, line, sizeof(line));
+        if(result < 0)
+        {
+            return result;
+        }
+
+        // strtoull also takes blanks, a sign or 0x, which a proxy in front may read differently, so
+        // everything it consumed must be hex digits
+        errno = 0;
+        size  = strtoull(line, &end, BASE_HEX);
+        if(errno != 0 || end == line || strspn(line, hex_digits) != (size_t)(end - line) || (*end != '\0' && *end != ';' && *end != ' '))
+        {
+            return -2;
+        }
+
+        if(size == 0)
+        {
+            break;
+        }
+
+        result = body_reserve(request, (size_t)size);
+        if(result < 0)
+        {
+            return result;
+        }
+        result = reader_copy(reader, request->body + request->body_len, (size_t)size);
+        if(result < 0)
+        {
+            return result;
+        }
+        request->body_len += (size_t)size;
+
+        result = reader_line(reader, line, sizeof(line));
+        if(result != 0)
+        {
+            return result < 0 ? result : -2;
+        }
+    }
+
+    // Trailer fields are read and discarded up to the closing empty line.
+    while(1)
+    {
+        ssize_t result = reader_line(reader, line, sizeof(line));
+        if(result <= 0)
+        {
+            return result;
+        }
+    }
+}
+
+// static ssize_t body_parser(request_t *request)
+// {
+
+// }
+
+static void run(request_t *request, fsm_state_t from_id, fsm_state_t to_id)
+{
+    fsm_state_func perform;
+
+    do
+    {
+        perform = fsm_transition(from_id, to_id, transitions);
+        if(perform == NULL)
+        {
+            printf("illegal state %d, %d \n", from_id, to_id);
+            return;
+        }
+        // a request is recorded as it reaches a handler, before one can parse its body in place; a
+        // connection handed to HTTP/2 records its streams instead
+        if((to_id == RESPONSE_HANDLER || to_id == ERROR_HANDLER) && from_id != RESPONSE_HANDLER)
+        {
+            request->handler_nsec = now_nsec();
+            capture_request(request);
+        }
+        // printf("from_id %d\n", from_id);
+        from_id = to_id;
+        to_id   = perform(request);
+    } while(to_id != END);
+
+    if(request->handler_nsec != 0)
+    {
+        log_request(request);
+    }
+    printf("job done!\n");
+}
+
+// Failures are recorded too, so a replay sends them as well. The head runs through the blank line; a
+// chunked body is stored decoded and flagged.
+static void capture_request(const request_t *request)
+{
+    const char *encoding;
+    uint32_t    flags;
+    size_t      head_len;
+
+    if(request->connection == 0 || request->raw_len == 0 || request->header_len >= request->raw_len)
+    {
+        return;
+    }
+    head_len = request->header_len + strlen(terminate);
+    if(head_len > request->raw_len)
+    {
+        head_len = request->raw_len;
+    }
+
+    flags    = request->h2 ? CAPTURE_H2 : 0;
+    encoding = find_header(request, "Transfer-Encoding");
+    if(encoding && header_is(encoding, chunked))
+    {
+        flags |= CAPTURE_CHUNKED;
+    }
+    capture_write(request->capture, request->connection, request->arrival_nsec, flags, request->raw, head_len, request->body, request->body_len);
 }
 
-static void parse_mime_type(request_t *request)
+// The route is the request target up to its query, as the client sent it. Reading is everything up to
+// the handler, including waiting on the client; handling is the handler and writing the response.
+static void log_request(const request_t *request)
 {
-    size_t      count;
-    size_t      index;
-    const char *from;
-    char       *to;
+    accesslog_entry entry;
+    const char     *target;
+    size_t          target_len;
+    uint64_t        now;
 
-    from  = request->path;
-    to    = request->mime_type;
-    index = 0;
-    count = 0;
-    do
+    if(!request->accesslog)
     {
-        ++count;
-        if(*from == '.')
-        {
-            index = count;
-        }
-    } while(*from++ != '\0');
+        return;
+    }
+    now = now_nsec();
+    memset(&entry, 0, sizeof(entry));
 
-    if(index == 0)
+    target     = request->raw_len > 0 ? (const char *)memchr(request->raw, ' ', request->raw_len) : NULL;
+    target_len = 0;
+    if(target)
     {
-        *to = '\0';
+        target++;
+        target_len = strcspn(target, " ?\r\n");
     }
-    else
+    if(target_len == 0)
     {
-        from = request->path + index;
-        do
-        {
-            *to++ = *from++;
-        } while(*from != '\0');
-        *to = '\0';
+        target     = "-";
+        target_len = 1;
     }
 
-    if(*request->mime_type == '\0')
+    entry.type        = ACCESSLOG_ENTRY;
+    entry.size        = sizeof(entry);
+    entry.status      = (uint16_t)request->status;
+    entry.method      = accesslog_method(request->method);
+    entry.version     = (uint8_t)(request->h2 ? ACCESSLOG_HTTP_2 : strcmp(request->version, Http_versions[0]) == 0 ? ACCESSLOG_HTTP_1_0 : ACCESSLOG_HTTP_1_1);
+    entry.start_nsec  = request->arrival_nsec;
+    entry.worker      = (uint16_t)*request->worker_id;
+    entry.route       = accesslog_route_id(target, target_len);
+    entry.bytes       = request->sent;
+    entry.read_usec   = (uint32_t)((request->handler_nsec - request->started_nsec) / NSEC_PER_USEC);
+    entry.handle_usec = (uint32_t)((now - request->handler_nsec) / NSEC_PER_USEC);
+    entry.flags       = (request->h2 ? ACCESSLOG_H2 : 0) | (request->tls ? ACCESSLOG_TLS : 0);
+
+    if(request->peer.ss_family == AF_INET)
     {
-        memcpy(request->mime_type, default_type, strlen(default_type));
-    }
+        const struct sockaddr_in *peer = (const struct sockaddr_in *)&request->peer;
 
-    printf("request->path: %s\n", request->path);
-    printf("request->mime_type %s\n", request->mime_type);
-}
+        // stored as an IPv4-mapped IPv6 address
+        entry.peer[V4_MAPPED_MARK]     = UINT8_MAX;
+        entry.peer[V4_MAPPED_MARK + 1] = UINT8_MAX;
+        memcpy(entry.peer + V4_MAPPED_MARK + 2, &peer->sin_addr, sizeof(peer->sin_addr));
+        entry.peer_port = ntohs(peer->sin_port);
+    }
+    else if(request->peer.ss_family == AF_INET6)
+    {
+        const struct sockaddr_in6 *peer = (const struct sockaddr_in6 *)&request->peer;
 
-// static ssize_t body_parser(request_t *request)
-// {
+        memcpy(entry.peer, &peer->sin6_addr, sizeof(entry.peer));
+        entry.peer_port = ntohs(peer->sin6_port);
+    }
 
-// }
+    accesslog_append(request->accesslog, request->log_ring, &entry, target, target_len);
+}
 
 void fsm_run(void *args)
 {
-    worker_t      *worker_args = (worker_t *)args;
-    request_t      request;
-    fsm_state_func perform;
-    fsm_state_t    from_id;
-    fsm_state_t    to_id;
-
-    from_id = START;
-    to_id   = READ_REQUEST;
+    worker_t *worker_args = (worker_t *)args;
+    request_t request;
 
     memset(&request, 0, sizeof(request_t));
 
-    request.raw = (char *)malloc(RAW_SIZE);
-    if(!request.raw)
-    {
-        perror("failed to malloc");
-        exit(EXIT_FAILURE);
-    }
-    memset(request.raw, 0, RAW_SIZE);
-
-    request.response = (char *)malloc(BUFFER_SIZE);
-    if(!request.response)
+    // raw is allocated last so read_fully can grow it in place
+    request.arena    = worker_args->arena;
+    request.response = (char *)arena_alloc(request.arena, BUFFER_SIZE);
+    request.raw      = (char *)arena_alloc(request.arena, RAW_SIZE);
+    if(!request.response || !request.raw)
     {
-        perror("failed to malloc");
-        free(request.raw);
+        perror("failed to allocate request buffers");
         exit(EXIT_FAILURE);
     }
-    memset(request.response, 0, BUFFER_SIZE);
+    request.raw_cap   = RAW_SIZE;
     request.sockfd    = &worker_args->sockfd;
     request.client_fd = worker_args->client_fd;
     request.fd_num    = worker_args->fd_num;
     request.worker_id = &worker_args->worker_id;
-
-    do
+    request.bloom     = worker_args->bloom;
+    request.wal       = worker_args->wal;
+    request.pool      = worker_args->pool;
+    request.max_body  = worker_args->max_body;
+    request.pack      = worker_args->pack;
+    request.paths     = worker_args->paths;
+    request.capture   = worker_args->capture;
+    request.accesslog = worker_args->accesslog;
+    request.respcache = worker_args->respcache;
+    request.tls       = worker_args->tls;
+
+    request.connection   = capture_connection(request.capture);
+    request.arrival_nsec = wall_nsec();
+    request.started_nsec = now_nsec();
+    if(request.accesslog)
     {
-        perform = fsm_transition(from_id, to_id, transitions);
-        if(perform == NULL)
-        {
-            printf("illegal state %d, %d \n", from_id, to_id);
-            goto cleanup;
-        }
-        // printf("from_id %d\n", from_id);
-        from_id = to_id;
-        to_id   = perform(&request);
-    } while(to_id != END);
+        request.log_ring = worker_args->worker_id * request.accesslog->threads + worker_args->thread_id;
+        request.peer     = worker_args->peer;
+    }
 
-    printf("job done!\n");
+    run(&request, START, READ_REQUEST);
 
-cleanup:
-    free(request.raw);
-    free(request.response);
+    if(request.err == ETIMEDOUT && request.pool)
+    {
+        atomic_fetch_add(&request.pool->request_timeouts, 1);
+    }
+    // everything the request allocated goes at once
+    arena_reset(request.arena);
+}
+
+// One HTTP/2 stream, already read and rebuilt as HTTP/1 text in request->raw, picks up where reading a
+// request off the socket would have left it.
+void http_run_stream(request_t *request)
+{
+    request->status       = OK;
+    request->arrival_nsec = wall_nsec();
+    request->started_nsec = now_nsec();
+    run(request, READ_REQUEST, PARSER_REQUEST);
 }
 
 fsm_state_t read_request(void *args)
@@ -670,7 +1812,18 @@ fsm_state_t read_request(void *args)
         return ERROR_HANDLER;
     }
 
-    result = read_fully(request->client_fd, request->raw, RAW_SIZE, &request->err);
+    result = read_fully(request, now_nsec() + HEADER_TIMEOUT_MSEC * NSEC_PER_MSEC);
+    if(result == -3)
+    {
+        PRINT_VERBOSE("%s\n", "header read timed out");
+        request->status = REQUEST_TIMEOUT;
+        return ERROR_HANDLER;
+    }
+    if(result == -4)
+    {
+        request->status = HEADER_FIELDS_TOO_LARGE;
+        return ERROR_HANDLER;
+    }
     if(result == -1)
     {
         printf("%s\n", "1");
@@ -683,6 +1836,14 @@ fsm_state_t read_request(void *args)
         request->status = BAD_REQUEST;
         return ERROR_HANDLER;
     }
+    request->raw_len    = (size_t)result;
+    request->header_len = (size_t)header_end(request->raw);
+
+    // a client with prior knowledge opens with the HTTP/2 preface instead of a request
+    if(h2_is_preface(request->raw, request->raw_len))
+    {
+        return HTTP2_CONNECTION;
+    }
 
     return PARSER_REQUEST;
 }
@@ -698,20 +1859,17 @@ fsm_state_t parse_request(void *args)
 
     printf("%s\n", "in parse_request");
 
-    copy_raw = strndup(request->raw, RAW_SIZE);
+    copy_raw = arena_strndup(request->arena, request->raw, request->raw_len);
     if(!copy_raw)
     {
         request->status = INTERNAL_SERVER_ERROR;
         return ERROR_HANDLER;
     }
 
-    copy_raw[RAW_SIZE - 1] = '\0';
-
     line = strtok_r(copy_raw, new_line, &saveptr);
 
     if(!line)
     {
-        free(copy_raw);
         return ERROR_HANDLER;
     }
     printf("Line: %s\n", line);
@@ -719,7 +1877,6 @@ fsm_state_t parse_request(void *args)
     if(sscanf(line, "%7s %1023s %15s", request->method, request->path, request->version) != 3)
     {
         request->status = BAD_REQUEST;
-        free(copy_raw);
         return ERROR_HANDLER;
     }
 
@@ -733,16 +1890,14 @@ fsm_state_t parse_request(void *args)
 
     printf("path 1: %s\n", request->path);
 
-    if(strcmp(request->path, "/httptest/user") == 0)
+    if(is_dynamic(request->path))
     {
-        free(copy_raw);
         return CHECK_REQUEST;
     }
 
-    copy_path = (char *)malloc(BUFFER_SIZE);
+    copy_path = (char *)arena_alloc(request->arena, BUFFER_SIZE);
     if(!copy_path)
     {
-        free(copy_raw);
         request->status = INTERNAL_SERVER_ERROR;
         return ERROR_HANDLER;
     }
@@ -752,8 +1907,6 @@ fsm_state_t parse_request(void *args)
 
     printf("path 2: %s\n", copy_path);
 
-    free(copy_path);
-    free(copy_raw);
     return CHECK_REQUEST;
 }
 
@@ -763,6 +1916,16 @@ fsm_state_t check_request(void *args)
 
     printf("%s\n", "in check_request");
 
+    if(!request->h2 && strcmp(request->version, Http_versions[1]) == 0 && strcmp(request->method, Http_methods[2]) != 0)
+    {
+        const char *upgrade = find_header(request, "Upgrade");
+
+        if(upgrade && find_header(request, "HTTP2-Settings") && header_has(upgrade, h2c_token, strlen(h2c_token)))
+        {
+            return HTTP2_CONNECTION;
+        }
+    }
+
     if(check_method(request) < 0 || check_HTTP(request) < 0 || check_skipping(request) < 0)
     {
         return ERROR_HANDLER;
@@ -770,7 +1933,11 @@ fsm_state_t check_request(void *args)
 
     if(strcmp(request->method, Http_methods[0]) == 0 || strcmp(request->method, Http_methods[1]) == 0)
     {
-        if(strcmp(request->path, "/httptest/user") == 0)
+        if(is_dynamic(request->path))
+        {
+            return RESPONSE_HANDLER;
+        }
+        if(check_pack(request) == 0)
         {
             return RESPONSE_HANDLER;
         }
@@ -780,6 +1947,130 @@ fsm_state_t check_request(void *args)
         }
     }
 
+    if(request->status == OK && strcmp(request->method, Http_methods[2]) == 0)
+    {
+        return READ_BODY;
+    }
+
+    return RESPONSE_HANDLER;
+}
+
+fsm_state_t read_body(void *args)
+{
+    request_t  *request = (request_t *)args;
+    const char *length;
+    const char *encoding;
+    const char *expect;
+    body_reader reader;
+    ssize_t     result;
+    unsigned long long size;
+
+    PRINT_DEBUG("%s\n", "in read_body");
+
+    length   = find_header(request, "Content-Length");
+    encoding = find_header(request, "Transfer-Encoding");
+    expect   = find_header(request, "Expect");
+
+    if(length && encoding)
+    {
+        request->status = BAD_REQUEST;
+        return ERROR_HANDLER;
+    }
+    if(encoding && !header_is(encoding, chunked))
+    {
+        request->status = NOT_IMPLEMENTED;
+        return ERROR_HANDLER;
+    }
+    if(!length && !encoding)
+    {
+        request->status = LENGTH_REQUIRED;
+        return ERROR_HANDLER;
+    }
+    if(expect && !header_is(expect, expect_continue))
+    {
+        request->status = EXPECTATION_FAILED;
+        return ERROR_HANDLER;
+    }
+
+    reader.fd            = request->client_fd;
+    reader.deadline_nsec = now_nsec() + BODY_TIMEOUT_MSEC * NSEC_PER_MSEC;
+    reader.pos           = request->raw + request->header_len + strlen(terminate);
+    reader.end           = request->raw + request->raw_len;
+    if(reader.pos > reader.end)
+    {
+        reader.pos = reader.end;
+    }
+
+    size = 0;
+    if(length)
+    {
+        char *end;
+
+        errno = 0;
+        size  = strtoull(length, &end, BASE_TEN);
+        if(errno != 0 || end == length || *length == '-' || (*end != '\r' && *end != ' '))
+        {
+            request->status = BAD_REQUEST;
+            return ERROR_HANDLER;
+        }
+        // Refuse before sending 100 Continue so the client never uploads a body we would throw away.
+        if(size > request->max_body)
+        {
+            request->status = PAYLOAD_TOO_LARGE;
+            return ERROR_HANDLER;
+        }
+    }
+
+    if(expect && strcmp(request->version, Http_versions[1]) == 0 && write_fully(request->client_fd, continue_response, (ssize_t)strlen(continue_response), &request->err) == -1)
+    {
+        request->status = INTERNAL_SERVER_ERROR;
+        return ERROR_HANDLER;
+    }
+
+    if(length)
+    {
+        result = body_reserve(request, (size_t)size);
+        if(result == 0)
+        {
+            result = reader_copy(&reader, request->body, (size_t)size);
+        }
+        if(result == 0)
+        {
+            request->body_len = (size_t)size;
+        }
+    }
+    else
+    {
+        result = read_chunked(request, &reader);
+    }
+
+    if(result == -1)
+    {
+        request->status = INTERNAL_SERVER_ERROR;
+        return ERROR_HANDLER;
+    }
+    if(result == -2)
+    {
+        request->status = BAD_REQUEST;
+        return ERROR_HANDLER;
+    }
+    if(result == -3)
+    {
+        request->status = PAYLOAD_TOO_LARGE;
+        return ERROR_HANDLER;
+    }
+    if(result == -4)
+    {
+        request->err    = ETIMEDOUT;
+        request->status = REQUEST_TIMEOUT;
+        return ERROR_HANDLER;
+    }
+
+    if(request->body)
+    {
+        request->body[request->body_len] = '\0';
+    }
+    PRINT_VERBOSE("body length: %zu\n", request->body_len);
     return RESPONSE_HANDLER;
 }
 
@@ -796,7 +2087,7 @@ static void process_request(void *args)
     printf("%s\n", "in process_request");
 
     ptr    = request->response;
-    ptr    = strcopy(ptr, Http_versions[0], strlen(Http_versions[0]));
+    ptr    = strcopy(ptr, Http_versions[request->chunked], strlen(Http_versions[request->chunked]));
     ptr    = strcopy(ptr, space, strlen(space));
     status = status_to_string(request->status);
     ptr    = strcopy(ptr, status, strlen(status));
@@ -807,16 +2098,39 @@ static void process_request(void *args)
     ptr = strcopy(ptr, timestamp, strlen(timestamp));
     ptr = strcopy(ptr, new_line, strlen(new_line));
 
+    // a pack hit carries the rest of its headers ready made
+    if(request->variant)
+    {
+        ptr  = strcopy(ptr, pack_data(request->pack, request->variant->headers), request->variant->headers_len);
+        *ptr = '\0';
+
+        request->response_len = ptr - request->response;
+        return;
+    }
+
     mime_type = mime_to_string(request->mime_type);
     ptr       = strcopy(ptr, content_type, strlen(content_type));
     ptr       = strcopy(ptr, mime_type, strlen(mime_type));
 
-    memset(size_buf, 0, MIME_SIZE);
-    snprintf(size_buf, MIME_SIZE, "%lld", (long long)request->content_len);
-    ptr    = strcopy(ptr, content_len, strlen(content_len));
-    ptr    = strcopy(ptr, size_buf, strlen(size_buf));
-    ptr    = strcopy(ptr, terminate, strlen(terminate));
-    *++ptr = '\0';
+    // a negative length marks a streamed body: chunked for HTTP/1.1, ended by close otherwise
+    if(request->content_len < 0)
+    {
+        if(request->chunked)
+        {
+            ptr = strcopy(ptr, transfer_chunked, strlen(transfer_chunked));
+        }
+        ptr = strcopy(ptr, connection_close, strlen(connection_close));
+        ptr = strcopy(ptr, new_line, strlen(new_line));
+    }
+    else
+    {
+        memset(size_buf, 0, MIME_SIZE);
+        snprintf(size_buf, MIME_SIZE, "%lld", (long long)request->content_len);
+        ptr = strcopy(ptr, content_len, strlen(content_len));
+        ptr = strcopy(ptr, size_buf, strlen(size_buf));
+        ptr = strcopy(ptr, terminate, strlen(terminate));
+    }
+    *ptr = '\0';
 
     request->response_len = (ssize_t)strlen(request->response);
 }
@@ -837,6 +2151,12 @@ fsm_state_t response_handler(void *args)
         return ERROR_HANDLER;
     }
 
+    // a stream's connection stays with the HTTP/2 loop
+    if(request->h2)
+    {
+        return END;
+    }
+
     if(setSocketBlocking(request->client_fd, &request->err) == -1)
     {
         return ERROR_HANDLER;
@@ -844,12 +2164,14 @@ fsm_state_t response_handler(void *args)
 
     close(request->client_fd);
 
-    send_number(*request->sockfd, request->fd_num);
+    // with per-worker listeners there is no dispatcher waiting to hear the fd is done
+    if(*request->sockfd >= 0)
+    {
+        send_number(*request->sockfd, request->fd_num);
+    }
     printf("%s\n", "fd wrote back to server");
     printf("%s %d\n", "close fd worker side", request->client_fd);
 
-    memset(request->raw, 0, RAW_SIZE);
-
     return END;
 }
 
@@ -863,46 +2185,106 @@ fsm_state_t error_handler(void *args)
 
     execute_functions(request, http_func);
 
+    if(request->h2)
+    {
+        return END;
+    }
+
     close(request->client_fd);
 
-    send_number(*request->sockfd, request->fd_num);
+    // with per-worker listeners there is no dispatcher waiting to hear the fd is done
+    if(*request->sockfd >= 0)
+    {
+        send_number(*request->sockfd, request->fd_num);
+    }
     printf("%s\n", "fd wrote back to server");
     printf("%s %d\n", "close fd worker side", request->client_fd);
 
-    memset(request->raw, 0, RAW_SIZE);
+    return END;
+}
+
+// Serves the rest of the connection as HTTP/2, either after the preface or by upgrading this request,
+// then ends it like any other.
+fsm_state_t http2_connection(void *args)
+{
+    request_t *request = (request_t *)args;
+
+    PRINT_DEBUG("%s\n", "in http2_connection");
+
+    h2_serve(request, h2_is_preface(request->raw, request->raw_len) ? NULL : find_header(request, "HTTP2-Settings"));
+
+    close(request->client_fd);
+
+    if(*request->sockfd >= 0)
+    {
+        send_number(*request->sockfd, request->fd_num);
+    }
+    printf("%s %d\n", "close fd worker side", request->client_fd);
 
     return END;
 }
 
-ssize_t read_fully(int fd, char *buf, size_t size, int *err)
+// Reads until the end of the headers, doubling raw in the arena when it fills, up to HEADER_MAX_SIZE.
+// The deadline covers the whole read, not each wait, so a client sending a byte at a time cannot keep
+// the worker forever. -3 means it passed, -4 that the headers did not fit.
+ssize_t read_fully(request_t *request, uint64_t deadline_nsec)
 {
     size_t bytes_read = 0;
-    time_t current;
-    time_t end;
-
-    current = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
-    end     = current + TIMEOUT;
 
-    while(bytes_read < size && current <= end)
+    while(1)
     {
-        ssize_t result = read(fd, buf + bytes_read, size - bytes_read);
-        current        = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
+        ssize_t result;
+
+        // the last byte is kept for a terminator so the header scans never run off the buffer
+        if(bytes_read + 1 >= request->raw_cap)
+        {
+            char *raw;
+
+            if(request->raw_cap >= HEADER_MAX_SIZE)
+            {
+                return -4;
+            }
+            raw = (char *)arena_grow(request->arena, request->raw, bytes_read, request->raw_cap * 2);
+            if(!raw)
+            {
+                request->err = ENOMEM;
+                return -1;
+            }
+            request->raw = raw;
+            request->raw_cap *= 2;
+        }
+
+        result = read(request->client_fd, request->raw + bytes_read, request->raw_cap - 1 - bytes_read);
         if(result == 0)
         {
             break;    // EOF reached
         }
         if(result == -1)
         {
-            if(errno == EINTR || errno == EAGAIN)
+            if(errno == EINTR)
             {
                 continue;
             }
-            *err = errno;
+            if(errno == EAGAIN)
+            {
+                result = wait_client(request->client_fd, POLLIN, deadline_nsec);
+                if(result == -2)
+                {
+                    request->err = ETIMEDOUT;
+                    return -3;
+                }
+                if(result == 0)
+                {
+                    continue;
+                }
+            }
+            request->err = errno;
             return -1;
         }
         bytes_read += (size_t)result;
+        request->raw[bytes_read] = '\0';
 
-        if(header_end(buf) > 0)
+        if(header_end(request->raw) > 0)
         {
             return (ssize_t)bytes_read;
         }
@@ -910,25 +2292,32 @@ ssize_t read_fully(int fd, char *buf, size_t size, int *err)
     return -2;
 }
 
+// Gives up once the client has taken nothing for WRITE_STALL_MSEC.
 ssize_t write_fully(int fd, const void *buf, ssize_t size, int *err)
 {
     size_t bytes_written = 0;
-    time_t current;
-    time_t end;
 
-    current = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
-    end     = current + TIMEOUT;
-
-    while(bytes_written < (size_t)size && current <= end)
+    while(bytes_written < (size_t)size)
     {
         ssize_t result = write(fd, (const char *)buf + bytes_written, (size_t)size - bytes_written);
-        current        = (time_t)(clock() * MILLI_SEC / CLOCKS_PER_SEC);
         if(result == -1)
         {
-            if(errno == EINTR || errno == EAGAIN)
+            if(errno == EINTR)
             {
                 continue;
             }
+            if(errno == EAGAIN)
+            {
+                result = wait_client(fd, POLLOUT, now_nsec() + WRITE_STALL_MSEC * NSEC_PER_MSEC);
+                if(result == 0)
+                {
+                    continue;
+                }
+                if(result == -2)
+                {
+                    errno = ETIMEDOUT;
+                }
+            }
             *err = errno;
             return -1;
         }
@@ -937,12 +2326,50 @@ ssize_t write_fully(int fd, const void *buf, ssize_t size, int *err)
     return (ssize_t)bytes_written;
 }
 
+// sendfile keeps the body in the kernel, on a kTLS socket the encryption too. It advances the file
+// offset, so a target that refuses it partway is finished by the read and write loop below.
 ssize_t copy(int from, int to, int *err)
 {
     char    buf[BUFFER_SIZE];
     ssize_t nread;
     ssize_t bytes_wrote;
 
+    while(1)
+    {
+        ssize_t sent = sendfile(to, from, NULL, SENDFILE_CHUNK);
+
+        if(sent > 0)
+        {
+            continue;
+        }
+        if(sent == 0)
+        {
+            return 0;
+        }
+        if(errno == EINTR)
+        {
+            continue;
+        }
+        if(errno == EAGAIN)
+        {
+            ssize_t result = wait_client(to, POLLOUT, now_nsec() + WRITE_STALL_MSEC * NSEC_PER_MSEC);
+            if(result == 0)
+            {
+                continue;
+            }
+            if(result == -2)
+            {
+                errno = ETIMEDOUT;
+            }
+            goto error;
+        }
+        if(errno != EINVAL && errno != ENOSYS)
+        {
+            goto error;
+        }
+        break;
+    }
+
     memset(&buf, 0, BUFFER_SIZE);
     do
     {
@@ -959,7 +2386,7 @@ ssize_t copy(int from, int to, int *err)
         }
         if(nread < 0)
         {
-            if(errno == EAGAIN)
+            if(errno == EAGAIN || errno == EINTR)
             {
                 continue;
             }
@@ -978,11 +2405,23 @@ ssize_t copy(int from, int to, int *err)
             twrote    = write(to, buf + bytes_wrote, remaining);
             if(twrote < 0)
             {
-                if(errno == EAGAIN)
+                if(errno == EINTR)
                 {
                     errno = 0;
                     continue;
                 }
+                if(errno == EAGAIN)
+                {
+                    ssize_t result = wait_client(to, POLLOUT, now_nsec() + WRITE_STALL_MSEC * NSEC_PER_MSEC);
+                    if(result == 0)
+                    {
+                        continue;
+                    }
+                    if(result == -2)
+                    {
+                        errno = ETIMEDOUT;
+                    }
+                }
                 goto error;
             }
 
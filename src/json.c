@@ -0,0 +1,539 @@
+#include "json.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#if defined(__SSE2__)
+    #include <emmintrin.h>
+    #define SIMD_WIDTH 16
+#else
+    #define SWAR_ONES 0x0101010101010101ULL
+    #define SWAR_HIGHS 0x8080808080808080ULL
+    // Non-zero when some byte of the word is zero, or below n (n <= 128).
+    #define has_zero(word) (((word) - SWAR_ONES) & ~(word) & SWAR_HIGHS)
+    #define has_below(word, n) (((word) - SWAR_ONES * (n)) & ~(word) & SWAR_HIGHS)
+#endif
+
+#define CONTROL_LIMIT 0x20
+#define HEX_DIGITS 4
+#define HEX_SHIFT 4
+#define HEX_ALPHA 10
+#define SURROGATE_HIGH 0xD800u
+#define SURROGATE_LOW 0xDC00u
+#define SURROGATE_END 0xE000u
+#define SURROGATE_SHIFT 10
+#define SUPPLEMENTARY_BASE 0x10000u
+#define UTF8_ONE 0x80u
+#define UTF8_TWO 0x800u
+#define UTF8_CONT 0x80u
+#define UTF8_CONT_MASK 0x3Fu
+#define UTF8_LEAD2 0xC0u
+#define UTF8_LEAD3 0xE0u
+#define UTF8_LEAD4 0xF0u
+#define UTF8_SHIFT 6
+
+typedef struct json_parser
+{
+    char       *pos;
+    const char *end;
+} json_parser;
+
+static void    skip_space(json_parser *p);
+static char   *find_special(char *pos, const char *end);
+static char   *skip_digits(char *pos, const char *end);
+static int     hex_value(const char *pos, const char *end, uint32_t *out);
+static char   *put_utf8(char *to, uint32_t code);
+static ssize_t parse_escape(json_parser *p, char **read, char **write, int decode);
+static ssize_t parse_string(json_parser *p, int decode, char **start, size_t *size);
+static ssize_t parse_number(json_parser *p);
+static ssize_t parse_literal(json_parser *p);
+static ssize_t parse_scalar(json_parser *p, int decode, char **start, size_t *size);
+static ssize_t parse_key(json_parser *p);
+static ssize_t skip_nested(json_parser *p);
+
+static void skip_space(json_parser *p)
+{
+    while(p->pos < p->end && (*p->pos == ' ' || *p->pos == '\t' || *p->pos == '\n' || *p->pos == '\r'))
+    {
+        p->pos++;
+    }
+}
+
+// First byte that ends a plain run inside a string: a quote, a backslash or a control character.
+static char *find_special(char *pos, const char *end)
+{
+#if defined(__SSE2__)
+    const __m128i quote     = _mm_set1_epi8('"');
+    const __m128i backslash = _mm_set1_epi8('\\');
+    const __m128i control   = _mm_set1_epi8(CONTROL_LIMIT - 1);
+
+    while(end - pos >= SIMD_WIDTH)
+    {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(const void *)pos);
+        __m128i hits  = _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash));
+        int     mask;
+
+        // min(c, 0x1f) == c exactly when the unsigned byte is below 0x20
+        hits = _mm_or_si128(hits, _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+        mask = _mm_movemask_epi8(hits);
+        if(mask != 0)
+        {
+            return pos + __builtin_ctz((unsigned int)mask);
+        }
+        pos += SIMD_WIDTH;
+    }
+#else
+    // Without SSE2 eight bytes are tested at once; any hit drops to the byte loop to locate it.
+    while(end - pos >= (ptrdiff_t)sizeof(uint64_t))
+    {
+        uint64_t word;
+
+        memcpy(&word, pos, sizeof(word));
+        if((has_zero(word ^ (SWAR_ONES * '"')) | has_zero(word ^ (SWAR_ONES * '\\')) | has_below(word, CONTROL_LIMIT)) != 0)
+        {
+            break;
+        }
+        pos += sizeof(word);
+    }
+#endif
+    while(pos < end && *pos != '"' && *pos != '\\' && (unsigned char)*pos >= CONTROL_LIMIT)
+    {
+        pos++;
+    }
+    return pos;
+}
+
+static char *skip_digits(char *pos, const char *end)
+{
+    while(pos < end && *pos >= '0' && *pos <= '9')
+    {
+        pos++;
+    }
+    return pos;
+}
+
+static int hex_value(const char *pos, const char *end, uint32_t *out)
+{
+    uint32_t value = 0;
+
+    if(end - pos < HEX_DIGITS)
+    {
+        return -1;
+    }
+
+    for(int i = 0; i < HEX_DIGITS; i++)
+    {
+        char c = pos[i];
+
+        value <<= HEX_SHIFT;
+        if(c >= '0' && c <= '9')
+        {
+            value |= (uint32_t)(c - '0');
+        }
+        else if(c >= 'a' && c <= 'f')
+        {
+            value |= (uint32_t)(c - 'a' + HEX_ALPHA);
+        }
+        else if(c >= 'A' && c <= 'F')
+        {
+            value |= (uint32_t)(c - 'A' + HEX_ALPHA);
+        }
+        else
+        {
+            return -1;
+        }
+    }
+    *out = value;
+    return 0;
+}
+
+static char *put_utf8(char *to, uint32_t code)
+{
+    if(code < UTF8_ONE)
+    {
+        *to++ = (char)code;
+    }
+    else if(code < UTF8_TWO)
+    {
+        *to++ = (char)(UTF8_LEAD2 | (code >> UTF8_SHIFT));
+        *to++ = (char)(UTF8_CONT | (code & UTF8_CONT_MASK));
+    }
+    else if(code < SUPPLEMENTARY_BASE)
+    {
+        *to++ = (char)(UTF8_LEAD3 | (code >> (2 * UTF8_SHIFT)));
+        *to++ = (char)(UTF8_CONT | ((code >> UTF8_SHIFT) & UTF8_CONT_MASK));
+        *to++ = (char)(UTF8_CONT | (code & UTF8_CONT_MASK));
+    }
+    else
+    {
+        *to++ = (char)(UTF8_LEAD4 | (code >> (3 * UTF8_SHIFT)));
+        *to++ = (char)(UTF8_CONT | ((code >> (2 * UTF8_SHIFT)) & UTF8_CONT_MASK));
+        *to++ = (char)(UTF8_CONT | ((code >> UTF8_SHIFT) & UTF8_CONT_MASK));
+        *to++ = (char)(UTF8_CONT | (code & UTF8_CONT_MASK));
+    }
+    return to;
+}
+
+// read points at a backslash. The decoded form is never longer than the escape, so write can trail read.
+static ssize_t parse_escape(json_parser *p, char **read, char **write, int decode)
+{
+    char    *pos = *read + 1;
+    uint32_t code;
+
+    if(pos >= p->end)
+    {
+        return -1;
+    }
+
+    switch(*pos)
+    {
+        case '"':
+        case '\\':
+        case '/':
+            code = (unsigned char)*pos;
+            break;
+        case 'b':
+            code = '\b';
+            break;
+        case 'f':
+            code = '\f';
+            break;
+        case 'n':
+            code = '\n';
+            break;
+        case 'r':
+            code = '\r';
+            break;
+        case 't':
+            code = '\t';
+            break;
+        case 'u':
+            if(hex_value(pos + 1, p->end, &code) < 0)
+            {
+                return -1;
+            }
+            pos += HEX_DIGITS;
+            if(code >= SURROGATE_HIGH && code < SURROGATE_END)
+            {
+                uint32_t low;
+
+                if(code >= SURROGATE_LOW || p->end - pos < 3 || pos[1] != '\\' || pos[2] != 'u' || hex_value(pos + 3, p->end, &low) < 0 || low < SURROGATE_LOW || low >= SURROGATE_END)
+                {
+                    return -1;
+                }
+                code = SUPPLEMENTARY_BASE + ((code - SURROGATE_HIGH) << SURROGATE_SHIFT) + (low - SURROGATE_LOW);
+                pos += 2 + HEX_DIGITS;
+            }
+            // values are handed to storage as C strings, so an embedded NUL cannot be represented
+            if(code == 0)
+            {
+                return -1;
+            }
+            break;
+        default:
+            return -1;
+    }
+
+    if(decode)
+    {
+        *write = put_utf8(*write, code);
+    }
+    *read = pos + 1;
+    return 0;
+}
+
+static ssize_t parse_string(json_parser *p, int decode, char **start, size_t *size)
+{
+    char *read  = p->pos + 1;
+    char *write = read;
+
+    *start = read;
+    while(1)
+    {
+        char *special = find_special(read, p->end);
+
+        if(special == p->end || (unsigned char)*special < CONTROL_LIMIT)
+        {
+            return -1;
+        }
+
+        // strings without escapes are never copied
+        if(decode && write != read)
+        {
+            memmove(write, read, (size_t)(special - read));
+        }
+        write += special - read;
+        read = special;
+
+        if(*read == '"')
+        {
+            break;
+        }
+        if(parse_escape(p, &read, &write, decode) < 0)
+        {
+            return -1;
+        }
+    }
+
+    if(decode)
+    {
+        *write = '\0';
+    }
+    *size  = (size_t)(write - *start);
+    p->pos = read + 1;
+    return 0;
+}
+
+static ssize_t parse_number(json_parser *p)
+{
+    char *pos = p->pos;
+
+    if(pos < p->end && *pos == '-')
+    {
+        pos++;
+    }
+    if(pos >= p->end || *pos < '0' || *pos > '9')
+    {
+        return -1;
+    }
+    pos = *pos == '0' ? pos + 1 : skip_digits(pos, p->end);
+
+    if(pos < p->end && *pos == '.')
+    {
+        char *digits = ++pos;
+
+        pos = skip_digits(pos, p->end);
+        if(pos == digits)
+        {
+            return -1;
+        }
+    }
+
+    if(pos < p->end && (*pos == 'e' || *pos == 'E'))
+    {
+        char *digits;
+
+        pos++;
+        if(pos < p->end && (*pos == '+' || *pos == '-'))
+        {
+            pos++;
+        }
+        digits = pos;
+        pos    = skip_digits(pos, p->end);
+        if(pos == digits)
+        {
+            return -1;
+        }
+    }
+
+    p->pos = pos;
+    return 0;
+}
+
+static ssize_t parse_literal(json_parser *p)
+{
+    static const char *const literals[] = {"true", "false", "null"};
+
+    for(size_t i = 0; i < sizeof(literals) / sizeof(literals[0]); i++)
+    {
+        size_t len = strlen(literals[i]);
+
+        if((size_t)(p->end - p->pos) >= len && memcmp(p->pos, literals[i], len) == 0)
+        {
+            p->pos += len;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static ssize_t parse_scalar(json_parser *p, int decode, char **start, size_t *size)
+{
+    ssize_t result;
+
+    if(*p->pos == '"')
+    {
+        return parse_string(p, decode, start, size);
+    }
+
+    *start = p->pos;
+    result = (*p->pos == '-' || (*p->pos >= '0' && *p->pos <= '9')) ? parse_number(p) : parse_literal(p);
+    *size  = (size_t)(p->pos - *start);
+    return result;
+}
+
+static ssize_t parse_key(json_parser *p)
+{
+    char  *start;
+    size_t size;
+
+    skip_space(p);
+    if(p->pos == p->end || *p->pos != '"' || parse_string(p, 0, &start, &size) < 0)
+    {
+        return -1;
+    }
+    skip_space(p);
+    if(p->pos == p->end || *p->pos != ':')
+    {
+        return -1;
+    }
+    p->pos++;
+    return 0;
+}
+
+// Validates a nested object or array without recursion or decoding; it is passed on as raw text.
+static ssize_t skip_nested(json_parser *p)
+{
+    char   closers[JSON_MAX_DEPTH];
+    size_t depth = 0;
+
+    do
+    {
+        skip_space(p);
+        if(p->pos == p->end)
+        {
+            return -1;
+        }
+
+        if(*p->pos == '{' || *p->pos == '[')
+        {
+            if(depth == JSON_MAX_DEPTH)
+            {
+                return -1;
+            }
+            closers[depth++] = *p->pos == '{' ? '}' : ']';
+            p->pos++;
+            skip_space(p);
+            if(p->pos == p->end || *p->pos != closers[depth - 1])
+            {
+                if(closers[depth - 1] == '}' && parse_key(p) < 0)
+                {
+                    return -1;
+                }
+                continue;
+            }
+            p->pos++;
+            depth--;
+        }
+        else
+        {
+            char  *start;
+            size_t size;
+
+            if(parse_scalar(p, 0, &start, &size) < 0)
+            {
+                return -1;
+            }
+        }
+
+        // close every container the value completes, then step to the next element
+        while(depth > 0)
+        {
+            char c;
+
+            skip_space(p);
+            if(p->pos == p->end)
+            {
+                return -1;
+            }
+            c = *p->pos++;
+            if(c == ',')
+            {
+                if(closers[depth - 1] == '}' && parse_key(p) < 0)
+                {
+                    return -1;
+                }
+                break;
+            }
+            if(c != closers[depth - 1])
+            {
+                return -1;
+            }
+            depth--;
+        }
+    } while(depth > 0);
+
+    return 0;
+}
+
+ssize_t json_parse_object(char *buf, size_t len, json_pair_func func, void *ctx)
+{
+    json_parser p;
+    ssize_t     count = 0;
+
+    p.pos = buf;
+    p.end = buf + len;
+
+    skip_space(&p);
+    if(p.pos == p.end || *p.pos != '{')
+    {
+        return -1;
+    }
+    p.pos++;
+    skip_space(&p);
+
+    if(p.pos < p.end && *p.pos == '}')
+    {
+        p.pos++;
+    }
+    else
+    {
+        char delimiter;
+
+        do
+        {
+            char  *key;
+            char  *value;
+            size_t k_size;
+            size_t v_size;
+
+            skip_space(&p);
+            if(p.pos == p.end || *p.pos != '"' || parse_string(&p, 1, &key, &k_size) < 0)
+            {
+                return -1;
+            }
+            skip_space(&p);
+            if(p.pos == p.end || *p.pos != ':')
+            {
+                return -1;
+            }
+            p.pos++;
+            skip_space(&p);
+            if(p.pos == p.end)
+            {
+                return -1;
+            }
+
+            if(*p.pos == '{' || *p.pos == '[')
+            {
+                value = p.pos;
+                if(skip_nested(&p) < 0)
+                {
+                    return -1;
+                }
+                v_size = (size_t)(p.pos - value);
+            }
+            else if(parse_scalar(&p, 1, &value, &v_size) < 0)
+            {
+                return -1;
+            }
+
+            skip_space(&p);
+            if(p.pos == p.end || (*p.pos != ',' && *p.pos != '}'))
+            {
+                return -1;
+            }
+            // the delimiter is saved before the terminator may overwrite it
+            delimiter = *p.pos++;
+            value[v_size] = '\0';
+
+            count++;
+            if(func && func(key, k_size, value, v_size, ctx) != 0)
+            {
+                return -2;
+            }
+        } while(delimiter == ',');
+    }
+
+    skip_space(&p);
+    return p.pos == p.end ? count : -1;
+}
@@ -0,0 +1,295 @@
+#include "accesslog.h"
+#include <arpa/inet.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ROUTE_TABLE_SIZE (1 << 17)
+#define ROUTE_TABLE_MASK (ROUTE_TABLE_SIZE - 1)
+#define RECORD_MAX 65536
+#define ROUTE_NAME_SIZE 16
+#define DATE_SIZE 64
+#define V4_MAPPED_MARK 10
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000ULL
+#define CONTROL_LIMIT 0x20
+
+static const unsigned char v4_mapped_prefix[] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+typedef struct route_name
+{
+    uint32_t route;
+    char    *path;
+} route_name;
+
+static _Noreturn void usage(const char *binary_name, int exit_code, const char *message);
+static void           remember_route(route_name *routes, const unsigned char *record, size_t size);
+static const char    *find_route(const route_name *routes, uint32_t route, char *unknown, size_t size);
+static const char    *version_name(uint8_t version);
+static void           format_peer(const accesslog_entry *entry, char *out, size_t size);
+static void           print_json_string(const char *str);
+static void           print_common(const accesslog_entry *entry, const char *route);
+static void           print_json(const accesslog_entry *entry, const char *route);
+static int            format_file(const char *path, route_name *routes, int json);
+
+static _Noreturn void usage(const char *binary_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-j] <log>...\n", binary_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h  Display this help message\n", stderr);
+    fputs("  -j  One JSON object per request instead of Common Log Format.\n", stderr);
+    exit(exit_code);
+}
+
+// record is the raw route record of size bytes, which is larger than accesslog_route.
+static void remember_route(route_name *routes, const unsigned char *record, size_t size)
+{
+    accesslog_route route;
+    size_t          slot;
+    size_t          tries = 0;
+
+    memcpy(&route, record, sizeof(route));
+    slot = route.route & ROUTE_TABLE_MASK;
+    while(routes[slot].path && routes[slot].route != route.route && ++tries < ROUTE_TABLE_SIZE)
+    {
+        slot = (slot + 1) & ROUTE_TABLE_MASK;
+    }
+    if(tries == ROUTE_TABLE_SIZE || routes[slot].path)
+    {
+        return;
+    }
+    routes[slot].route = route.route;
+    routes[slot].path  = strndup((const char *)record + sizeof(route), size - sizeof(route));
+}
+
+// A route whose name never made it into the log is shown by its id.
+static const char *find_route(const route_name *routes, uint32_t route, char *unknown, size_t size)
+{
+    size_t slot = route & ROUTE_TABLE_MASK;
+
+    for(size_t tries = 0; routes[slot].path && tries < ROUTE_TABLE_SIZE; tries++)
+    {
+        if(routes[slot].route == route)
+        {
+            return routes[slot].path;
+        }
+        slot = (slot + 1) & ROUTE_TABLE_MASK;
+    }
+    snprintf(unknown, size, "#%08x", route);
+    return unknown;
+}
+
+static const char *version_name(uint8_t version)
+{
+    switch(version)
+    {
+        case ACCESSLOG_HTTP_1_0:
+            return "HTTP/1.0";
+        case ACCESSLOG_HTTP_2:
+            return "HTTP/2.0";
+        default:
+            return "HTTP/1.1";
+    }
+}
+
+static void format_peer(const accesslog_entry *entry, char *out, size_t size)
+{
+    static const unsigned char none[ACCESSLOG_PEER_SIZE] = {0};
+
+    if(memcmp(entry->peer, none, sizeof(none)) == 0)
+    {
+        snprintf(out, size, "-");
+    }
+    else if(memcmp(entry->peer, v4_mapped_prefix, sizeof(v4_mapped_prefix)) == 0)
+    {
+        inet_ntop(AF_INET, entry->peer + V4_MAPPED_MARK + 2, out, (socklen_t)size);
+    }
+    else
+    {
+        inet_ntop(AF_INET6, entry->peer, out, (socklen_t)size);
+    }
+}
+
+static void print_json_string(const char *str)
+{
+    putchar('"');
+    for(; *str; str++)
+    {
+        unsigned char c = (unsigned char)*str;
+
+        if(c == '"' || c == '\\')
+        {
+            printf("\\%c", c);
+        }
+        else if(c < CONTROL_LIMIT)
+        {
+            printf("\\u%04x", c);
+        }
+        else
+        {
+            putchar(c);
+        }
+    }
+    putchar('"');
+}
+
+static void print_common(const accesslog_entry *entry, const char *route)
+{
+    char      peer[INET6_ADDRSTRLEN];
+    char      date[DATE_SIZE];
+    time_t    when;
+    struct tm local;
+
+    when = (time_t)(entry->start_nsec / NSEC_PER_SEC);
+    localtime_r(&when, &local);
+    strftime(date, sizeof(date), "%d/%b/%Y:%H:%M:%S %z", &local);
+    format_peer(entry, peer, sizeof(peer));
+
+    printf("%s - - [%s] \"%s %s %s\" %u ", peer, date, accesslog_method_name(entry->method), route, version_name(entry->version), entry->status);
+    if(entry->bytes > 0)
+    {
+        printf("%llu\n", (unsigned long long)entry->bytes);
+    }
+    else
+    {
+        puts("-");
+    }
+}
+
+static void print_json(const accesslog_entry *entry, const char *route)
+{
+    char      peer[INET6_ADDRSTRLEN];
+    char      date[DATE_SIZE];
+    time_t    when;
+    struct tm utc;
+
+    when = (time_t)(entry->start_nsec / NSEC_PER_SEC);
+    gmtime_r(&when, &utc);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S", &utc);
+    format_peer(entry, peer, sizeof(peer));
+
+    printf("{\"time\":\"%s.%06lluZ\",\"peer\":\"%s\",\"port\":%u,\"worker\":%u,\"method\":\"%s\",\"route\":",
+           date,
+           (unsigned long long)(entry->start_nsec % NSEC_PER_SEC / NSEC_PER_USEC),
+           peer,
+           entry->peer_port,
+           entry->worker,
+           accesslog_method_name(entry->method));
+    print_json_string(route);
+    printf(",\"version\":\"%s\",\"status\":%u,\"bytes\":%llu,\"read_usec\":%u,\"handle_usec\":%u,\"h2\":%s,\"tls\":%s}\n",
+           version_name(entry->version),
+           entry->status,
+           (unsigned long long)entry->bytes,
+           entry->read_usec,
+           entry->handle_usec,
+           (entry->flags & ACCESSLOG_H2) ? "true" : "false",
+           (entry->flags & ACCESSLOG_TLS) ? "true" : "false");
+}
+
+// Route names carry over from one file to the next, so rotated files are best given oldest first.
+static int format_file(const char *path, route_name *routes, int json)
+{
+    unsigned char    record[RECORD_MAX];
+    accesslog_header header;
+    FILE            *file;
+    int              result = 0;
+
+    file = fopen(path, "rbe");
+    if(!file)
+    {
+        perror(path);
+        return -1;
+    }
+
+    while(fread(&header, sizeof(header), 1, file) == 1)
+    {
+        if(header.size < sizeof(header) || fread(record + sizeof(header), header.size - sizeof(header), 1, file) != 1)
+        {
+            fprintf(stderr, "%s: truncated record\n", path);
+            result = -1;
+            break;
+        }
+        memcpy(record, &header, sizeof(header));
+
+        if(header.type == ACCESSLOG_ROUTE && header.size > sizeof(accesslog_route))
+        {
+            remember_route(routes, record, header.size);
+        }
+        else if(header.type == ACCESSLOG_ENTRY && header.size >= sizeof(accesslog_entry))
+        {
+            accesslog_entry entry;
+            char            unknown[ROUTE_NAME_SIZE];
+            const char     *route;
+
+            memcpy(&entry, record, sizeof(entry));
+            route = find_route(routes, entry.route, unknown, sizeof(unknown));
+            if(json)
+            {
+                print_json(&entry, route);
+            }
+            else
+            {
+                print_common(&entry, route);
+            }
+        }
+    }
+
+    fclose(file);
+    return result;
+}
+
+int main(int argc, char *argv[])
+{
+    route_name *routes;
+    int         json   = 0;
+    int         result = EXIT_SUCCESS;
+    int         opt;
+
+    while((opt = getopt(argc, argv, "hj")) != -1)
+    {
+        switch(opt)
+        {
+            case 'j':
+                json = 1;
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            default:
+                usage(argv[0], EXIT_FAILURE, NULL);
+        }
+    }
+    if(optind == argc)
+    {
+        usage(argv[0], EXIT_FAILURE, "At least one access log is required");
+    }
+
+    routes = (route_name *)calloc(ROUTE_TABLE_SIZE, sizeof(route_name));
+    if(!routes)
+    {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for(int i = optind; i < argc; i++)
+    {
+        if(format_file(argv[i], routes, json) == -1)
+        {
+            result = EXIT_FAILURE;
+        }
+    }
+
+    for(size_t i = 0; i < ROUTE_TABLE_SIZE; i++)
+    {
+        free(routes[i].path);
+    }
+    free(routes);
+    return result;
+}
@@ -1,6 +1,8 @@
 #include "networking.h"
 #include <errno.h>
 #include <fcntl.h>
+#include <linux/filter.h>
+#include <netinet/tcp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,7 +15,7 @@
 #define ERR_INVALID_CHARS 3
 
 static void setup_network_address(struct sockaddr_storage *addr, socklen_t *addr_len, const char *address, in_port_t port, int *err);
-static int  setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int *err);
+static int  setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int reuseport, int *err);
 static int  connect_to_server(struct sockaddr_storage *addr, socklen_t addr_len, int *err);
 
 int tcp_server(const char *address, in_port_t port, int backlog, int *err)
@@ -30,12 +32,62 @@ int tcp_server(const char *address, in_port_t port, int backlog, int *err)
         goto done;
     }
 
-    fd = setup_tcp_server(&addr, addr_len, backlog, err);
+    fd = setup_tcp_server(&addr, addr_len, backlog, 0, err);
 
 done:
     return fd;
 }
 
+// One member of a SO_REUSEPORT group; the kernel spreads connections over every socket bound this way.
+int tcp_server_reuseport(const char *address, in_port_t port, int backlog, int *err)
+{
+    struct sockaddr_storage addr;
+    socklen_t               addr_len;
+
+    setup_network_address(&addr, &addr_len, address, port, err);
+
+    if(*err != 0)
+    {
+        return -1;
+    }
+
+    return setup_tcp_server(&addr, addr_len, backlog, 1, err);
+}
+
+// Picks the group member by the CPU that handled the packet: the member at the index of that CPU in
+// cpus, or cpu % count for CPUs outside the list. Members are indexed in the order they were bound.
+int attach_cpu_steering(int fd, const int *cpus, int count, int *err)
+{
+    struct sock_filter code[2 * MAX_STEERING_CPUS + 3];
+    struct sock_fprog  prog;
+    unsigned short     len = 0;
+
+    if(count < 1 || count > MAX_STEERING_CPUS)
+    {
+        *err = EINVAL;
+        return -1;
+    }
+
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (uint32_t)(SKF_AD_OFF + SKF_AD_CPU));
+    for(int i = 0; i < count; i++)
+    {
+        code[len++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, (uint32_t)cpus[i], 0, 1);
+        code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, (uint32_t)i);
+    }
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)count);
+    code[len++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_A, 0);
+
+    prog.len    = len;
+    prog.filter = code;
+
+    if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog)) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+    return 0;
+}
+
 int tcp_client(const char *address, in_port_t port, int *err)
 {
     struct sockaddr_storage addr;
@@ -123,6 +175,18 @@ int setSocketBlocking(int socket, int *err)
     return 0;
 }
 
+// The listener only becomes readable once a request's first bytes are in, so main never wakes for
+// (or dispatches) a connection that has nothing to read yet. The kernel gives up waiting after seconds.
+int setSocketDeferAccept(int socket, int seconds, int *err)
+{
+    if(setsockopt(socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &seconds, sizeof(seconds)) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+    return 0;
+}
+
 static int setSockReuse(int fd, int *err)
 {
     int opt;
@@ -135,7 +199,7 @@ static int setSockReuse(int fd, int *err)
     return 0;
 }
 
-static int setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int *err)
+static int setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_len, int backlog, int reuseport, int *err)
 {
     int fd;
     int result;
@@ -161,6 +225,18 @@ static int setup_tcp_server(const struct sockaddr_storage *addr, socklen_t addr_
         goto done;
     }
 
+    if(reuseport)
+    {
+        int opt = 1;
+
+        result = setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        if(result == -1)
+        {
+            *err = errno;
+            goto done;
+        }
+    }
+
     result = bind(fd, (const struct sockaddr *)addr, addr_len);
 
     if(result == -1)
@@ -257,10 +333,11 @@ int send_fd(int socket, int fd, int fd_num)
 
     memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
 
-    if(sendmsg(socket, &msg, 0) < 0)
+    // MSG_NOSIGNAL: a receiver that died (say, a new server that failed to start) must not take us with it
+    if(sendmsg(socket, &msg, MSG_NOSIGNAL) < 0)
     {
         perror("sendmsg");
-        exit(EXIT_FAILURE);
+        return -1;
     }
     return 0;
 }
@@ -271,6 +348,7 @@ int recv_fd(int socket, int *fd_num)
     struct iovec    io;
     struct cmsghdr *cmsg;
     char            control[CMSG_SPACE(sizeof(int))];
+    ssize_t         received;
     int             fd;
 
     io.iov_base    = fd_num;
@@ -281,11 +359,22 @@ int recv_fd(int socket, int *fd_num)
     msg.msg_control    = control;
     msg.msg_controllen = sizeof(control);
 
-    if(recvmsg(socket, &msg, 0) < 0)
+    received = recvmsg(socket, &msg, 0);
+    if(received < 0)
     {
+        if(errno == EINTR)
+        {
+            return -1;
+        }
         perror("recvmsg");
         exit(EXIT_FAILURE);
     }
+    if(received == 0)
+    {
+        // the sender is gone and nothing more will arrive
+        errno = EPIPE;
+        return -1;
+    }
 
     cmsg = CMSG_FIRSTHDR(&msg);
 
@@ -300,7 +389,12 @@ int recv_fd(int socket, int *fd_num)
 
 ssize_t send_number(int socket, int fd_num)
 {
-    ssize_t sent = send(socket, &fd_num, sizeof(fd_num), 0);
+    ssize_t sent;
+
+    do
+    {
+        sent = send(socket, &fd_num, sizeof(fd_num), MSG_NOSIGNAL);
+    } while(sent == -1 && errno == EINTR);
     if(sent <= 0)
     {
         perror("send");
@@ -0,0 +1,150 @@
+#include "pack.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+#define SEED_MULT 0x9e3779b97f4a7c15ULL
+#define MIX_SHIFT 33
+#define MIX_MULT 0xff51afd7ed558ccdULL
+
+// The seeds are padded to an even count, so both tables start aligned in the page-aligned mapping.
+_Static_assert(sizeof(pack_header) % _Alignof(pack_entry) == 0, "pack header must keep the tables aligned");
+
+static int fits(const pack_t *pack, uint64_t offset, uint64_t len);
+static int check_entries(const pack_t *pack);
+
+// FNV-1a from a seeded start, finished with a multiply-shift so nearby seeds scatter independently.
+uint64_t pack_hash(const char *path, size_t len, uint32_t seed)
+{
+    uint64_t hash = FNV64_OFFSET ^ (seed * SEED_MULT);
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= FNV64_PRIME;
+    }
+    hash ^= hash >> MIX_SHIFT;
+    hash *= MIX_MULT;
+    hash ^= hash >> MIX_SHIFT;
+    return hash;
+}
+
+static int fits(const pack_t *pack, uint64_t offset, uint64_t len)
+{
+    return offset <= pack->size && len <= pack->size - offset;
+}
+
+// Every offset is checked once here so lookups and sends can trust them.
+static int check_entries(const pack_t *pack)
+{
+    for(uint32_t i = 0; i < pack->header.count; i++)
+    {
+        const pack_entry   *entry      = &pack->entries[i];
+        const pack_variant *variants[] = {&entry->plain, &entry->gzip};
+
+        if(!fits(pack, entry->path, entry->path_len))
+        {
+            return -1;
+        }
+        for(size_t v = 0; v < sizeof(variants) / sizeof(variants[0]); v++)
+        {
+            if(variants[v]->length == 0 && variants[v] == &entry->gzip)
+            {
+                continue;
+            }
+            if(variants[v]->headers_len == 0 || !fits(pack, variants[v]->headers, variants[v]->headers_len) || !fits(pack, variants[v]->body, variants[v]->length) || !fits(pack, variants[v]->etag, variants[v]->etag_len))
+            {
+                return -1;
+            }
+        }
+    }
+    return 0;
+}
+
+// Maps the whole pack read-only. The builder always renames a finished pack into place, so this mapping
+// stays valid after a rebuild replaces the file; callers reopen to pick the new one up.
+int pack_open(pack_t *pack, const char *path)
+{
+    struct stat st;
+    void       *addr;
+    int         fd;
+    size_t      tables;
+
+    memset(pack, 0, sizeof(*pack));
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        perror("open pack");
+        return -1;
+    }
+    if(fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(pack_header))
+    {
+        fprintf(stderr, "pack %s is too short\n", path);
+        close(fd);
+        return -1;
+    }
+
+    addr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED)
+    {
+        perror("pack mmap");
+        return -1;
+    }
+    // the pack is the document root's hot set; fault it in ahead of the first requests
+    madvise(addr, (size_t)st.st_size, MADV_WILLNEED);
+
+    pack->base    = (const unsigned char *)addr;
+    pack->size    = (size_t)st.st_size;
+    memcpy(&pack->header, addr, sizeof(pack_header));
+    pack->seeds   = (const uint32_t *)(const void *)(pack->base + sizeof(pack_header));
+    pack->entries = (const pack_entry *)(const void *)(pack->seeds + pack->header.buckets + (pack->header.buckets & 1));
+
+    tables = sizeof(pack_header) + ((size_t)pack->header.buckets + (pack->header.buckets & 1)) * sizeof(uint32_t) + (size_t)pack->header.count * sizeof(pack_entry);
+    if(memcmp(pack->header.magic, PACK_MAGIC, PACK_MAGIC_SIZE) != 0 || pack->header.version != PACK_VERSION || pack->header.size != pack->size || pack->header.count == 0 || pack->header.buckets == 0 || tables > pack->size || check_entries(pack) == -1)
+    {
+        fprintf(stderr, "pack %s is not a valid version %d pack\n", path, PACK_VERSION);
+        pack_close(pack);
+        return -1;
+    }
+    return 0;
+}
+
+void pack_close(pack_t *pack)
+{
+    if(pack->base)
+    {
+        munmap((void *)(uintptr_t)pack->base, pack->size);
+    }
+    memset(pack, 0, sizeof(*pack));
+}
+
+// One hash picks the bucket, the bucket's seed picks the slot; a slot holds at most one path, so a hit
+// is a single comparison.
+const pack_entry *pack_find(const pack_t *pack, const char *path, size_t len)
+{
+    const pack_entry *entry;
+    uint32_t          seed;
+
+    if(!pack || !pack->base)
+    {
+        return NULL;
+    }
+    seed  = pack->seeds[pack_hash(path, len, 0) % pack->header.buckets];
+    entry = &pack->entries[pack_hash(path, len, seed) % pack->header.count];
+    if(entry->path_len != len || memcmp(pack->base + entry->path, path, len) != 0)
+    {
+        return NULL;
+    }
+    return entry;
+}
+
+const char *pack_data(const pack_t *pack, uint64_t offset)
+{
+    return (const char *)pack->base + offset;
+}
@@ -0,0 +1,644 @@
+#include "pack.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#define WALK_FDS 16
+#define HEADERS_SIZE 512
+#define ETAG_SIZE 64
+#define DATE_SIZE 64
+#define MAX_SEED (1U << 24)
+#define BODY_ALIGN 16
+#define GZIP_WINDOW (15 + 16)
+#define GZIP_MEMLEVEL 8
+#define GZIP_KEEP_PERCENT 90
+#define PERCENT 100
+#define KEYS_PER_BUCKET 2
+#define INDEX_NAME "index.html"
+#define DEFAULT_TYPE "html"
+
+// One path the pack answers. Directory keys share their index.html's file.
+typedef struct pack_key
+{
+    char    *path;
+    size_t   len;
+    size_t   file;
+    uint32_t bucket;
+    uint32_t slot;
+} pack_key;
+
+typedef struct pack_file
+{
+    char        *source;
+    off_t        size;
+    time_t       mtime;
+    pack_variant plain;
+    pack_variant gzip;
+} pack_file;
+
+// Paths, headers and bodies collect in blob; their offsets are relative to it until write_pack places
+// it after the tables.
+typedef struct pack_build
+{
+    pack_key      *keys;
+    size_t         key_count;
+    pack_file     *files;
+    size_t         file_count;
+    unsigned char *blob;
+    size_t         blob_len;
+    size_t         blob_cap;
+    uint64_t      *key_paths;
+    int            compress;
+} pack_build;
+
+static _Noreturn void usage(const char *binary_name, int exit_code, const char *message);
+static int            walk_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf);
+static int            add_key(pack_build *build, const char *path, size_t len, size_t file);
+static int            add_index_keys(pack_build *build);
+static int            compare_buckets(const void *a, const void *b);
+static int            place_keys(pack_build *build, uint32_t buckets, uint32_t *seeds);
+static int            blob_append(pack_build *build, const void *data, size_t len, size_t align, uint64_t *offset);
+static int            read_file(const char *path, unsigned char *data, size_t size);
+static int            gzip_body(const unsigned char *data, size_t size, unsigned char **out, size_t *out_len);
+static int            add_variant(pack_build *build, const pack_file *file, pack_variant *variant, const unsigned char *body, size_t len, int gzip, int vary);
+static int            add_file(pack_build *build, pack_file *file);
+static int            write_pack(const pack_build *build, uint32_t buckets, const uint32_t *seeds, const char *out);
+static void           free_build(pack_build *build);
+
+// nftw and qsort take no context argument
+static pack_build     *walking;         // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static size_t          root_len;        // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+static const uint32_t *bucket_sizes;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static _Noreturn void usage(const char *binary_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-n] <root> <pack>\n", binary_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h  Display this help message\n", stderr);
+    fputs("  -n  Skip the gzip variants of text files.\n", stderr);
+    exit(exit_code);
+}
+
+static int walk_file(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    pack_build *build = walking;
+    pack_file  *files;
+    pack_file  *file;
+
+    (void)ftwbuf;
+    if(typeflag != FTW_F || !S_ISREG(sb->st_mode))
+    {
+        return 0;
+    }
+
+    files = (pack_file *)realloc(build->files, (build->file_count + 1) * sizeof(pack_file));
+    if(!files)
+    {
+        perror("realloc");
+        return -1;
+    }
+    build->files = files;
+    file         = &files[build->file_count];
+    memset(file, 0, sizeof(pack_file));
+    file->source = strdup(fpath);
+    file->size   = sb->st_size;
+    file->mtime  = sb->st_mtime;
+    if(!file->source)
+    {
+        perror("strdup");
+        return -1;
+    }
+    build->file_count++;
+    // keys are request paths: what follows the root, which always starts with a slash
+    return add_key(build, fpath + root_len, strlen(fpath + root_len), build->file_count - 1);
+}
+
+static int add_key(pack_build *build, const char *path, size_t len, size_t file)
+{
+    pack_key *keys;
+    pack_key *key;
+
+    keys = (pack_key *)realloc(build->keys, (build->key_count + 1) * sizeof(pack_key));
+    if(!keys)
+    {
+        perror("realloc");
+        return -1;
+    }
+    build->keys = keys;
+    key         = &keys[build->key_count];
+    memset(key, 0, sizeof(pack_key));
+    key->path = strndup(path, len);
+    key->len  = len;
+    key->file = file;
+    if(!key->path)
+    {
+        perror("strndup");
+        return -1;
+    }
+    build->key_count++;
+    return 0;
+}
+
+// The server answers a directory, with or without its slash, with the index.html inside it.
+static int add_index_keys(pack_build *build)
+{
+    size_t count = build->key_count;
+    size_t name  = strlen(INDEX_NAME);
+
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t dir;
+
+        if(build->keys[i].len <= name || strcmp(build->keys[i].path + build->keys[i].len - name, INDEX_NAME) != 0 || build->keys[i].path[build->keys[i].len - name - 1] != '/')
+        {
+            continue;
+        }
+        dir = build->keys[i].len - name;
+        if(add_key(build, build->keys[i].path, dir, build->keys[i].file) == -1)
+        {
+            return -1;
+        }
+        if(dir > 1 && add_key(build, build->keys[i].path, dir - 1, build->keys[i].file) == -1)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int compare_buckets(const void *a, const void *b)
+{
+    uint32_t left  = bucket_sizes[*(const uint32_t *)a];
+    uint32_t right = bucket_sizes[*(const uint32_t *)b];
+
+    return (left < right) - (left > right);
+}
+
+// Hash and displace: keys are grouped into buckets by one hash, then, biggest bucket first, each bucket
+// gets the first seed that sends all of its keys to free slots. Every slot ends up with exactly one key.
+static int place_keys(pack_build *build, uint32_t buckets, uint32_t *seeds)
+{
+    uint32_t  count   = (uint32_t)build->key_count;
+    uint32_t *sizes   = (uint32_t *)calloc(buckets, sizeof(uint32_t));
+    uint32_t *first   = (uint32_t *)calloc(buckets + 1, sizeof(uint32_t));
+    uint32_t *order   = (uint32_t *)calloc(buckets, sizeof(uint32_t));
+    uint32_t *members = (uint32_t *)calloc(count, sizeof(uint32_t));
+    uint32_t *slots   = (uint32_t *)calloc(count, sizeof(uint32_t));
+    char     *taken   = (char *)calloc(count, 1);
+    int       result  = -1;
+
+    if(!sizes || !first || !order || !members || !slots || !taken)
+    {
+        perror("calloc");
+        goto cleanup;
+    }
+
+    // group the keys by bucket: first[b] is where bucket b's keys start in members
+    for(uint32_t i = 0; i < count; i++)
+    {
+        build->keys[i].bucket = (uint32_t)(pack_hash(build->keys[i].path, build->keys[i].len, 0) % buckets);
+        sizes[build->keys[i].bucket]++;
+    }
+    for(uint32_t b = 0; b < buckets; b++)
+    {
+        first[b + 1] = first[b] + sizes[b];
+        order[b]     = b;
+    }
+    for(uint32_t i = 0; i < count; i++)
+    {
+        members[first[build->keys[i].bucket + 1] - sizes[build->keys[i].bucket]--] = i;
+    }
+    for(uint32_t b = 0; b < buckets; b++)
+    {
+        sizes[b] = first[b + 1] - first[b];
+    }
+    bucket_sizes = sizes;
+    qsort(order, buckets, sizeof(uint32_t), compare_buckets);
+
+    for(uint32_t b = 0; b < buckets && sizes[order[b]] > 0; b++)
+    {
+        const uint32_t *keys = members + first[order[b]];
+        uint32_t        size = sizes[order[b]];
+        uint32_t        placed;
+        uint32_t        seed;
+
+        for(seed = 1, placed = 0; seed < MAX_SEED && placed < size; seed++)
+        {
+            for(placed = 0; placed < size; placed++)
+            {
+                const pack_key *key   = &build->keys[keys[placed]];
+                uint32_t        slot  = (uint32_t)(pack_hash(key->path, key->len, seed) % count);
+                int             clash = taken[slot];
+
+                for(uint32_t p = 0; p < placed && !clash; p++)
+                {
+                    clash = slots[p] == slot;
+                }
+                if(clash)
+                {
+                    break;
+                }
+                slots[placed] = slot;
+            }
+        }
+        if(placed < size)
+        {
+            fprintf(stderr, "no seed places bucket %u\n", order[b]);
+            goto cleanup;
+        }
+        for(uint32_t p = 0; p < size; p++)
+        {
+            taken[slots[p]]           = 1;
+            build->keys[keys[p]].slot = slots[p];
+        }
+        seeds[order[b]] = seed - 1;
+    }
+    result = 0;
+
+cleanup:
+    bucket_sizes = NULL;
+    free(sizes);
+    free(first);
+    free(order);
+    free(members);
+    free(slots);
+    free(taken);
+    return result;
+}
+
+static int blob_append(pack_build *build, const void *data, size_t len, size_t align, uint64_t *offset)
+{
+    size_t start = (build->blob_len + align - 1) & ~(align - 1);
+
+    if(start + len > build->blob_cap)
+    {
+        size_t         cap = build->blob_cap ? build->blob_cap : HEADERS_SIZE;
+        unsigned char *blob;
+
+        while(cap < start + len)
+        {
+            cap *= 2;
+        }
+        blob = (unsigned char *)realloc(build->blob, cap);
+        if(!blob)
+        {
+            perror("realloc");
+            return -1;
+        }
+        build->blob     = blob;
+        build->blob_cap = cap;
+    }
+    memset(build->blob + build->blob_len, 0, start - build->blob_len);
+    if(len > 0)
+    {
+        memcpy(build->blob + start, data, len);
+    }
+    build->blob_len = start + len;
+    *offset         = start;
+    return 0;
+}
+
+static int read_file(const char *path, unsigned char *data, size_t size)
+{
+    size_t done = 0;
+    int    fd   = open(path, O_RDONLY | O_CLOEXEC);
+
+    if(fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+    while(done < size)
+    {
+        ssize_t nread = read(fd, data + done, size - done);
+
+        if(nread == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if(nread <= 0)
+        {
+            fprintf(stderr, "%s changed while it was packed\n", path);
+            close(fd);
+            return -1;
+        }
+        done += (size_t)nread;
+    }
+    close(fd);
+    return 0;
+}
+
+// Returns 1 with out set when gzip saves enough to be worth a second copy, 0 when it does not.
+static int gzip_body(const unsigned char *data, size_t size, unsigned char **out, size_t *out_len)
+{
+    z_stream stream;
+    uLong    bound;
+    int      result;
+
+    memset(&stream, 0, sizeof(stream));
+    if(deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, GZIP_WINDOW, GZIP_MEMLEVEL, Z_DEFAULT_STRATEGY) != Z_OK)
+    {
+        fprintf(stderr, "deflateInit2 failed\n");
+        return -1;
+    }
+    bound = deflateBound(&stream, (uLong)size);
+    *out  = (unsigned char *)malloc(bound);
+    if(!*out)
+    {
+        perror("malloc");
+        deflateEnd(&stream);
+        return -1;
+    }
+
+    stream.next_in   = (Bytef *)(uintptr_t)data;
+    stream.avail_in  = (uInt)size;
+    stream.next_out  = *out;
+    stream.avail_out = (uInt)bound;
+    result           = deflate(&stream, Z_FINISH);
+    *out_len         = (size_t)stream.total_out;
+    deflateEnd(&stream);
+
+    if(result != Z_STREAM_END || *out_len * PERCENT > size * GZIP_KEEP_PERCENT)
+    {
+        free(*out);
+        *out = NULL;
+        return result == Z_STREAM_END ? 0 : -1;
+    }
+    return 1;
+}
+
+// Renders the headers process_request would have, minus the status line, Server and Date, which stay
+// per response.
+static int add_variant(pack_build *build, const pack_file *file, pack_variant *variant, const unsigned char *body, size_t len, int gzip, int vary)
+{
+    char        headers[HEADERS_SIZE];
+    char        etag[ETAG_SIZE];
+    char        date[DATE_SIZE];
+    const char *dot;
+    struct tm   tm;
+    int         etag_len;
+    int         headers_len;
+
+    dot = strrchr(file->source, '.');
+    gmtime_r(&file->mtime, &tm);
+    strftime(date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+    etag_len    = snprintf(etag, sizeof(etag), "\"%llx-%llx%s\"", (unsigned long long)file->mtime, (unsigned long long)file->size, gzip ? "-gz" : "");
+    headers_len = snprintf(headers,
+                           sizeof(headers),
+                           "Content-Type: %sContent-Length: %zu\r\nLast-Modified: %s\r\nETag: %s\r\n%s%s\r\n",
+                           mime_to_string(dot && !strchr(dot, '/') ? dot + 1 : DEFAULT_TYPE),
+                           len,
+                           date,
+                           etag,
+                           gzip ? "Content-Encoding: gzip\r\n" : "",
+                           vary ? "Vary: Accept-Encoding\r\n" : "");
+
+    variant->length      = len;
+    variant->headers_len = (uint32_t)headers_len;
+    variant->etag_len    = (uint32_t)etag_len;
+    if(blob_append(build, headers, (size_t)headers_len, 1, &variant->headers) == -1 || blob_append(build, etag, (size_t)etag_len, 1, &variant->etag) == -1 || blob_append(build, body, len, BODY_ALIGN, &variant->body) == -1)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+static int add_file(pack_build *build, pack_file *file)
+{
+    unsigned char *data;
+    unsigned char *gzip = NULL;
+    size_t         gzip_len;
+    int            compressed = 0;
+    int            result     = -1;
+
+    data = (unsigned char *)malloc((size_t)file->size + 1);
+    if(!data)
+    {
+        perror("malloc");
+        return -1;
+    }
+    if(read_file(file->source, data, (size_t)file->size) == -1)
+    {
+        goto cleanup;
+    }
+
+    // only text types carry a charset, and only they compress well
+    if(build->compress && file->size > 0)
+    {
+        const char *dot = strrchr(file->source, '.');
+
+        if(strstr(mime_to_string(dot && !strchr(dot, '/') ? dot + 1 : DEFAULT_TYPE), "charset"))
+        {
+            compressed = gzip_body(data, (size_t)file->size, &gzip, &gzip_len);
+            if(compressed == -1)
+            {
+                goto cleanup;
+            }
+        }
+    }
+
+    if(add_variant(build, file, &file->plain, data, (size_t)file->size, 0, compressed) == -1)
+    {
+        goto cleanup;
+    }
+    if(compressed && add_variant(build, file, &file->gzip, gzip, gzip_len, 1, 1) == -1)
+    {
+        goto cleanup;
+    }
+    result = 0;
+
+cleanup:
+    free(gzip);
+    free(data);
+    return result;
+}
+
+// Written beside the destination and renamed over it, so a server never maps a half written pack and
+// the one it has mapped stays intact.
+static int write_pack(const pack_build *build, uint32_t buckets, const uint32_t *seeds, const char *out)
+{
+    pack_header header;
+    pack_entry *entries;
+    char        tmp[PATH_MAX];
+    FILE       *file;
+    uint32_t    padding = buckets & 1;
+    uint64_t    tables;
+    int         result = -1;
+
+    tables  = sizeof(pack_header) + (buckets + padding) * sizeof(uint32_t) + build->key_count * sizeof(pack_entry);
+    entries = (pack_entry *)calloc(build->key_count, sizeof(pack_entry));
+    if(!entries)
+    {
+        perror("calloc");
+        return -1;
+    }
+    for(size_t i = 0; i < build->key_count; i++)
+    {
+        const pack_key  *key    = &build->keys[i];
+        const pack_file *source = &build->files[key->file];
+        pack_entry      *entry  = &entries[key->slot];
+
+        entry->path     = tables + build->key_paths[i];
+        entry->path_len = (uint32_t)key->len;
+        entry->mtime    = (int64_t)source->mtime;
+        entry->plain    = source->plain;
+        entry->gzip     = source->gzip;
+        entry->plain.headers += tables;
+        entry->plain.body += tables;
+        entry->plain.etag += tables;
+        if(entry->gzip.length > 0)
+        {
+            entry->gzip.headers += tables;
+            entry->gzip.body += tables;
+            entry->gzip.etag += tables;
+        }
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, PACK_MAGIC, PACK_MAGIC_SIZE);
+    header.version = PACK_VERSION;
+    header.count   = (uint32_t)build->key_count;
+    header.buckets = buckets;
+    header.size    = tables + build->blob_len;
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    file = fopen(tmp, "wbe");
+    if(!file)
+    {
+        perror(tmp);
+        free(entries);
+        return -1;
+    }
+    if(fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(seeds, sizeof(uint32_t), buckets + padding, file) == buckets + padding && fwrite(entries, sizeof(pack_entry), build->key_count, file) == build->key_count && fwrite(build->blob, 1, build->blob_len, file) == build->blob_len && fflush(file) == 0 && fsync(fileno(file)) == 0)
+    {
+        result = 0;
+    }
+    if(fclose(file) != 0 || result == -1 || rename(tmp, out) == -1)
+    {
+        perror(out);
+        unlink(tmp);
+        result = -1;
+    }
+    free(entries);
+    return result;
+}
+
+static void free_build(pack_build *build)
+{
+    for(size_t i = 0; i < build->key_count; i++)
+    {
+        free(build->keys[i].path);
+    }
+    for(size_t i = 0; i < build->file_count; i++)
+    {
+        free(build->files[i].source);
+    }
+    free(build->keys);
+    free(build->files);
+    free(build->blob);
+    free(build->key_paths);
+}
+
+int main(int argc, char *argv[])
+{
+    pack_build build;
+    uint32_t  *seeds = NULL;
+    uint32_t   buckets;
+    char       root[PATH_MAX];
+    int        opt;
+    int        result = EXIT_FAILURE;
+
+    memset(&build, 0, sizeof(build));
+    build.compress = 1;
+    while((opt = getopt(argc, argv, "hn")) != -1)
+    {
+        switch(opt)
+        {
+            case 'n':
+                build.compress = 0;
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            default:
+                usage(argv[0], EXIT_FAILURE, NULL);
+        }
+    }
+    if(argc - optind != 2)
+    {
+        usage(argv[0], EXIT_FAILURE, "A root directory and a pack path are required");
+    }
+
+    // drop trailing slashes so every key starts at the slash after the root
+    snprintf(root, sizeof(root), "%s", argv[optind]);
+    root_len = strlen(root);
+    while(root_len > 1 && root[root_len - 1] == '/')
+    {
+        root[--root_len] = '\0';
+    }
+
+    walking = &build;
+    if(nftw(root, walk_file, WALK_FDS, FTW_PHYS) != 0 || add_index_keys(&build) == -1)
+    {
+        fprintf(stderr, "unable to walk %s\n", root);
+        goto cleanup;
+    }
+    if(build.key_count == 0 || build.key_count > UINT32_MAX)
+    {
+        fprintf(stderr, "%s has no files to pack\n", root);
+        goto cleanup;
+    }
+
+    build.key_paths = (uint64_t *)calloc(build.key_count, sizeof(uint64_t));
+    if(!build.key_paths)
+    {
+        perror("calloc");
+        goto cleanup;
+    }
+    for(size_t i = 0; i < build.key_count; i++)
+    {
+        if(blob_append(&build, build.keys[i].path, build.keys[i].len, 1, &build.key_paths[i]) == -1)
+        {
+            goto cleanup;
+        }
+    }
+    for(size_t i = 0; i < build.file_count; i++)
+    {
+        if(add_file(&build, &build.files[i]) == -1)
+        {
+            goto cleanup;
+        }
+    }
+
+    buckets = (uint32_t)(build.key_count / KEYS_PER_BUCKET + 1);
+    seeds   = (uint32_t *)calloc(buckets + 1, sizeof(uint32_t));
+    if(!seeds)
+    {
+        perror("calloc");
+        goto cleanup;
+    }
+    if(place_keys(&build, buckets, seeds) == -1 || write_pack(&build, buckets, seeds, argv[optind + 1]) == -1)
+    {
+        goto cleanup;
+    }
+    printf("packed %zu files as %zu paths into %s\n", build.file_count, build.key_count, argv[optind + 1]);
+    result = EXIT_SUCCESS;
+
+cleanup:
+    free(seeds);
+    free_build(&build);
+    return result;
+}
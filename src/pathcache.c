@@ -0,0 +1,83 @@
+#include "pathcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+#define NSEC_PER_MSEC 1000000ULL
+
+static pathcache_entry *slot_for(const pathcache_t *cache, const char *path, size_t len);
+
+static pathcache_entry *slot_for(const pathcache_t *cache, const char *path, size_t len)
+{
+    uint64_t hash = FNV64_OFFSET;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)path[i];
+        hash *= FNV64_PRIME;
+    }
+    return &cache->slots[hash % PATHCACHE_SLOTS];
+}
+
+int pathcache_init(pathcache_t *cache)
+{
+    cache->slots = (pathcache_entry *)calloc(PATHCACHE_SLOTS, sizeof(pathcache_entry));
+    if(!cache->slots)
+    {
+        perror("pathcache calloc");
+        return -1;
+    }
+    return 0;
+}
+
+// Generation 0 is never published, so zeroed slots never match.
+const pathcache_entry *pathcache_find(const pathcache_t *cache, const char *path, uint64_t generation, uint64_t now_nsec)
+{
+    pathcache_entry *entry;
+    size_t           len = strlen(path);
+
+    if(!cache || !cache->slots || len >= PATHCACHE_KEY_SIZE)
+    {
+        return NULL;
+    }
+    entry = slot_for(cache, path, len);
+    if(entry->generation != generation || entry->expires_nsec <= now_nsec || entry->key_len != len || memcmp(entry->key, path, len) != 0)
+    {
+        return NULL;
+    }
+    entry->hits++;
+    return entry;
+}
+
+// Misses expire quickly whatever the generation: a scanner's paths are not worth keeping, and a file
+// created moments later must not stay hidden if its event is lost. Returns the stored entry.
+const pathcache_entry *pathcache_store(pathcache_t *cache, const char *path, uint64_t generation, uint64_t now_nsec, const pathcache_entry *result)
+{
+    pathcache_entry *entry;
+    uint32_t         hits;
+    size_t           len = strlen(path);
+
+    if(!cache || !cache->slots || len >= PATHCACHE_KEY_SIZE || generation == 0)
+    {
+        return NULL;
+    }
+    entry = slot_for(cache, path, len);
+
+    // an expired or outdated entry for the same path keeps its count
+    hits                = entry->key_len == len && memcmp(entry->key, path, len) == 0 ? entry->hits + 1 : 1;
+    *entry              = *result;
+    entry->hits         = hits;
+    entry->generation   = generation;
+    entry->expires_nsec = now_nsec + (result->status == 200 ? PATHCACHE_TTL_MSEC : PATHCACHE_NEGATIVE_TTL_MSEC) * NSEC_PER_MSEC;
+    entry->key_len      = len;
+    memcpy(entry->key, path, len);
+    return entry;
+}
+
+void pathcache_free(pathcache_t *cache)
+{
+    free(cache->slots);
+    cache->slots = NULL;
+}
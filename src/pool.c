@@ -0,0 +1,316 @@
+#include "pool.h"
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#define NSEC_PER_SEC 1000000000ULL
+#define NSEC_PER_USEC 1000ULL
+#define PERCENT 100
+#define P99 99
+#define BITS_64 64
+
+static int      latency_bucket(uint64_t usec);
+static uint64_t busy_total(const pool_t *pool);
+
+static int latency_bucket(uint64_t usec)
+{
+    int bucket = BITS_64 - 1 - __builtin_clzll(usec | 1);
+
+    return bucket < POOL_LATENCY_BUCKETS ? bucket : POOL_LATENCY_BUCKETS - 1;
+}
+
+static uint64_t busy_total(const pool_t *pool)
+{
+    uint64_t total = 0;
+
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        total += atomic_load(&pool->slots[i].busy_nsec);
+    }
+    return total;
+}
+
+pool_t *pool_create(int min_workers, int max_workers)
+{
+    pool_t *pool;
+
+    pool = (pool_t *)mmap(NULL, sizeof(pool_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(pool == MAP_FAILED)
+    {
+        perror("pool mmap");
+        return NULL;
+    }
+
+    pool->min_workers = min_workers;
+    pool->max_workers = max_workers < min_workers ? min_workers : max_workers;
+    pool->threads     = 1;
+    return pool;
+}
+
+// CPUs this process may run on, further limited by a cgroup v2 quota when one is set.
+int pool_cpu_limit(void)
+{
+    cpu_set_t set;
+    int       cpus;
+    FILE     *file;
+
+    cpus = 1;
+    if(sched_getaffinity(0, sizeof(set), &set) == 0)
+    {
+        cpus = CPU_COUNT(&set);
+    }
+
+    file = fopen(POOL_CGROUP_CPU_MAX, "re");
+    if(file)
+    {
+        char quota[BITS_64];
+        unsigned long long period;
+
+        if(fscanf(file, "%63s %llu", quota, &period) == 2 && strcmp(quota, "max") != 0 && period > 0)
+        {
+            unsigned long long limit = (strtoull(quota, NULL, 10) + period - 1) / period;    // NOLINT(cppcoreguidelines-avoid-magic-numbers,readability-magic-numbers)
+
+            if(limit > 0 && limit < (unsigned long long)cpus)
+            {
+                cpus = (int)limit;
+            }
+        }
+        fclose(file);
+    }
+    return cpus;
+}
+
+uint64_t pool_now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+void pool_dispatched(pool_t *pool)
+{
+    atomic_fetch_add_explicit(&pool->dispatched, 1, memory_order_relaxed);
+}
+
+uint64_t pool_worker_begin(pool_t *pool, int slot)
+{
+    atomic_fetch_add_explicit(&pool->received, 1, memory_order_relaxed);
+    atomic_fetch_add(&pool->slots[slot].busy_threads, 1);
+    atomic_store(&pool->slots[slot].state, SLOT_BUSY);
+    return pool_now_nsec();
+}
+
+void pool_worker_end(pool_t *pool, int slot, uint64_t started_nsec)
+{
+    uint64_t elapsed = pool_now_nsec() - started_nsec;
+    uint64_t ewma    = atomic_load_explicit(&pool->slots[slot].service_ewma_nsec, memory_order_relaxed);
+    int      idle    = SLOT_BUSY;
+
+    // only this worker's threads write its average, which stays approximate if two finish together;
+    // main reads it when choosing where to dispatch
+    ewma = ewma ? ewma - (ewma >> POOL_EWMA_SHIFT) + (elapsed >> POOL_EWMA_SHIFT) : elapsed;
+    atomic_store_explicit(&pool->slots[slot].service_ewma_nsec, ewma, memory_order_relaxed);
+
+    atomic_fetch_add_explicit(&pool->slots[slot].busy_nsec, elapsed, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->slots[slot].requests, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pool->latency[latency_bucket(elapsed / NSEC_PER_USEC)], 1, memory_order_relaxed);
+
+    // a slot the monitor has marked for retirement stays that way, and one with other threads still
+    // serving stays busy
+    if(atomic_fetch_sub(&pool->slots[slot].busy_threads, 1) == 1)
+    {
+        atomic_compare_exchange_strong(&pool->slots[slot].state, &idle, SLOT_IDLE);
+    }
+}
+
+void pool_sampler_init(const pool_t *pool, pool_sampler *sampler)
+{
+    memset(sampler, 0, sizeof(*sampler));
+    sampler->when_nsec = pool_now_nsec();
+    sampler->busy_nsec = busy_total(pool);
+    for(int i = 0; i < POOL_LATENCY_BUCKETS; i++)
+    {
+        sampler->latency[i] = atomic_load(&pool->latency[i]);
+    }
+}
+
+// Returns how many workers to add, -1 to retire one, or 0 to leave the pool alone.
+int pool_sample(pool_t *pool, pool_sampler *sampler)
+{
+    uint64_t now;
+    uint64_t busy;
+    uint64_t queue;
+    uint64_t busy_percent;
+    uint64_t p99_usec;
+    uint64_t counts[POOL_LATENCY_BUCKETS];
+    uint64_t total;
+    int      active;
+
+    now    = pool_now_nsec();
+    busy   = busy_total(pool);
+    active = atomic_load(&pool->active);
+
+    queue = atomic_load(&pool->dispatched) - atomic_load(&pool->received);
+    if(queue > (uint64_t)INT32_MAX)
+    {
+        queue = 0;    // received is bumped by the worker right after dispatch, so the difference can briefly wrap
+    }
+
+    busy_percent = 0;
+    if(now > sampler->when_nsec && active > 0)
+    {
+        busy_percent = (busy - sampler->busy_nsec) * PERCENT / ((now - sampler->when_nsec) * (uint64_t)active * (uint64_t)pool->threads);
+    }
+
+    total = 0;
+    for(int i = 0; i < POOL_LATENCY_BUCKETS; i++)
+    {
+        uint64_t seen = atomic_load(&pool->latency[i]);
+
+        counts[i]           = seen - sampler->latency[i];
+        sampler->latency[i] = seen;
+        total += counts[i];
+    }
+
+    // upper bound of the bucket holding the 99th percentile of this tick's requests
+    p99_usec = 0;
+    if(total > 0)
+    {
+        uint64_t seen = 0;
+
+        for(int i = 0; i < POOL_LATENCY_BUCKETS; i++)
+        {
+            seen += counts[i];
+            if(seen * PERCENT >= total * P99)
+            {
+                p99_usec = 1ULL << (i + 1);
+                break;
+            }
+        }
+    }
+
+    sampler->when_nsec = now;
+    sampler->busy_nsec = busy;
+    atomic_store(&pool->last_queue, queue);
+    atomic_store(&pool->last_busy_percent, busy_percent);
+    atomic_store(&pool->last_p99_usec, p99_usec);
+
+    if(active < pool->max_workers && (queue > 1 || busy_percent >= POOL_BUSY_HIGH || p99_usec > POOL_P99_TARGET_USEC))
+    {
+        uint64_t room = (uint64_t)(pool->max_workers - active);
+
+        sampler->quiet_ticks = 0;
+        if(queue <= 1)
+        {
+            return 1;
+        }
+        return (int)(queue < room ? queue : room);
+    }
+
+    if(active > pool->min_workers && queue == 0 && busy_percent < POOL_BUSY_LOW)
+    {
+        if(++sampler->quiet_ticks >= POOL_IDLE_TICKS)
+        {
+            sampler->quiet_ticks = 0;
+            return -1;
+        }
+        return 0;
+    }
+
+    sampler->quiet_ticks = 0;
+    return 0;
+}
+
+int pool_pick_idle(const pool_t *pool)
+{
+    for(int i = POOL_MAX_WORKERS - 1; i >= 0; i--)
+    {
+        if(atomic_load(&pool->slots[i].state) == SLOT_IDLE)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Least expected wait: what is already queued at a worker plus the new request, each costed at that
+// worker's recent service time, so a worker stuck on large files stops drawing small ones. Until the
+// monitor has started any worker, requests queue on the slots it is about to fill.
+int pool_pick_worker(const pool_t *pool, const pool_dispatch *dispatch)
+{
+    uint64_t best_cost = UINT64_MAX;
+    int      best      = -1;
+
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        int      state = atomic_load(&pool->slots[i].state);
+        uint64_t ewma;
+        uint64_t cost;
+
+        if(state != SLOT_IDLE && state != SLOT_BUSY)
+        {
+            continue;
+        }
+        ewma = atomic_load_explicit(&pool->slots[i].service_ewma_nsec, memory_order_relaxed);
+        // a threaded worker serves pool->threads connections at once
+        cost = (uint64_t)(dispatch->in_flight[i] / pool->threads + 1) * (ewma ? ewma : (uint64_t)POOL_EWMA_SEED_NSEC);
+        if(cost < best_cost)
+        {
+            best_cost = cost;
+            best      = i;
+        }
+    }
+
+    if(best == -1)
+    {
+        best = 0;
+        for(int i = 1; i < pool->min_workers; i++)
+        {
+            if(dispatch->in_flight[i] < dispatch->in_flight[best])
+            {
+                best = i;
+            }
+        }
+    }
+    return best;
+}
+
+// Only a worker with nothing queued is retired, and main sends it nothing more once it is marked, so
+// no connection can be left behind in a retired worker's channel.
+int pool_pick_retiree(pool_t *pool, const pool_dispatch *dispatch)
+{
+    for(int i = POOL_MAX_WORKERS - 1; i >= 0; i--)
+    {
+        int idle = SLOT_IDLE;
+
+        if(dispatch->in_flight[i] == 0 && atomic_compare_exchange_strong(&pool->slots[i].state, &idle, SLOT_RETIRING))
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Records one worker finishing a reload attempt; latency runs from the monitor seeing the new file.
+void pool_lib_reloaded(pool_t *pool, int slot, uint64_t generation, int loaded)
+{
+    uint64_t usec = (pool_now_nsec() - atomic_load(&pool->lib_changed_nsec)) / NSEC_PER_USEC;
+    uint64_t max  = atomic_load(&pool->lib_max_reload_usec);
+
+    atomic_store(&pool->slots[slot].lib_generation, generation);
+    if(!loaded)
+    {
+        atomic_fetch_add(&pool->lib_reload_failures, 1);
+        return;
+    }
+
+    atomic_fetch_add(&pool->lib_reloads, 1);
+    atomic_store(&pool->lib_last_reload_usec, usec);
+    while(usec > max && !atomic_compare_exchange_weak(&pool->lib_max_reload_usec, &max, usec))
+    {
+    }
+}
@@ -0,0 +1,189 @@
+#include "ratelimit.h"
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+#define NSEC_PER_SEC 1000000000ULL
+#define BITS_PER_BYTE 8
+#define V4_MAPPED_PREFIX 96
+#define V4_MAPPED_MARK 10
+
+static void              make_key(const ratelimit_table *table, const struct sockaddr_storage *peer, uint8_t *key);
+static ratelimit_entry  *find_entry(ratelimit_table *table, const uint8_t *key, uint64_t now_nsec);
+static void              refill(const ratelimit_table *table, ratelimit_entry *entry, uint64_t now_nsec);
+
+ratelimit_table *ratelimit_create(uint32_t rate, uint32_t burst, uint32_t max_connections, int prefix4, int prefix6)
+{
+    ratelimit_table *table;
+
+    table = (ratelimit_table *)calloc(1, sizeof(ratelimit_table));
+    if(!table)
+    {
+        perror("ratelimit calloc");
+        return NULL;
+    }
+    table->rate            = rate;
+    table->burst           = burst > 0 ? burst : rate;
+    table->max_connections = max_connections;
+    table->prefix4         = prefix4;
+    table->prefix6         = prefix6;
+    return table;
+}
+
+// Clients are grouped by prefix, so a host cannot escape its limit by walking through its /64.
+static void make_key(const ratelimit_table *table, const struct sockaddr_storage *peer, uint8_t *key)
+{
+    int bits;
+
+    memset(key, 0, RATELIMIT_KEY_SIZE);
+    if(peer->ss_family == AF_INET)
+    {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)peer;
+
+        key[V4_MAPPED_MARK]     = 0xff;
+        key[V4_MAPPED_MARK + 1] = 0xff;
+        memcpy(key + V4_MAPPED_MARK + 2, &in->sin_addr, sizeof(in->sin_addr));
+        bits = V4_MAPPED_PREFIX + table->prefix4;
+    }
+    else if(peer->ss_family == AF_INET6)
+    {
+        memcpy(key, &((const struct sockaddr_in6 *)peer)->sin6_addr, RATELIMIT_KEY_SIZE);
+        bits = table->prefix6;
+    }
+    else
+    {
+        return;
+    }
+
+    for(int i = 0; i < RATELIMIT_KEY_SIZE; i++)
+    {
+        int keep = bits - i * BITS_PER_BYTE;
+
+        if(keep <= 0)
+        {
+            key[i] = 0;
+        }
+        else if(keep < BITS_PER_BYTE)
+        {
+            key[i] &= (uint8_t)(0xff << (BITS_PER_BYTE - keep));
+        }
+    }
+}
+
+static ratelimit_entry *find_entry(ratelimit_table *table, const uint8_t *key, uint64_t now_nsec)
+{
+    ratelimit_entry *victim = NULL;
+    uint64_t         hash   = FNV64_OFFSET;
+
+    for(int i = 0; i < RATELIMIT_KEY_SIZE; i++)
+    {
+        hash ^= key[i];
+        hash *= FNV64_PRIME;
+    }
+
+    for(int probe = 0; probe < RATELIMIT_PROBES; probe++)
+    {
+        ratelimit_entry *entry = &table->entries[(hash + (uint64_t)probe) & RATELIMIT_MASK];
+
+        // entries are reused but never freed, so a client is never stored past a free one
+        if(entry->refill_nsec == 0)
+        {
+            victim = entry;
+            break;
+        }
+        if(memcmp(entry->key, key, RATELIMIT_KEY_SIZE) == 0)
+        {
+            return entry;
+        }
+        if(entry->connections == 0 && (!victim || entry->refill_nsec < victim->refill_nsec))
+        {
+            victim = entry;
+        }
+    }
+
+    // every probed entry has connections open: let the client through untracked rather than refuse it
+    if(!victim)
+    {
+        return NULL;
+    }
+    memcpy(victim->key, key, RATELIMIT_KEY_SIZE);
+    victim->refill_nsec = now_nsec;
+    victim->tokens      = table->burst * RATELIMIT_SCALE;
+    victim->connections = 0;
+    return victim;
+}
+
+// Lazy: the bucket is only topped up when its client comes back, by however long it stayed away.
+static void refill(const ratelimit_table *table, ratelimit_entry *entry, uint64_t now_nsec)
+{
+    uint64_t full    = (uint64_t)table->burst * RATELIMIT_SCALE;
+    uint64_t elapsed = now_nsec - entry->refill_nsec;
+    uint64_t added;
+
+    if(elapsed >= (full - entry->tokens) * NSEC_PER_SEC / RATELIMIT_SCALE / table->rate + 1)
+    {
+        entry->tokens      = (uint32_t)full;
+        entry->refill_nsec = now_nsec;
+        return;
+    }
+
+    // the clock only moves on by what was turned into tokens, so a client retrying every few
+    // microseconds does not lose the remainder each time
+    added = elapsed * table->rate / (NSEC_PER_SEC / RATELIMIT_SCALE);
+    entry->tokens += (uint32_t)added;
+    entry->refill_nsec += added * (NSEC_PER_SEC / RATELIMIT_SCALE) / table->rate;
+}
+
+// A refused connection costs no token. *slot is what ratelimit_release takes back once the connection
+// closes, -1 when the client is not tracked.
+ratelimit_verdict ratelimit_admit(ratelimit_table *table, const struct sockaddr_storage *peer, uint64_t now_nsec, int *slot)
+{
+    uint8_t          key[RATELIMIT_KEY_SIZE];
+    ratelimit_entry *entry;
+
+    *slot = -1;
+    if(peer->ss_family != AF_INET && peer->ss_family != AF_INET6)
+    {
+        return RATELIMIT_PASS;
+    }
+    make_key(table, peer, key);
+    entry = find_entry(table, key, now_nsec);
+    if(!entry)
+    {
+        return RATELIMIT_PASS;
+    }
+
+    if(table->max_connections > 0 && entry->connections >= table->max_connections)
+    {
+        return RATELIMIT_CONNECTIONS;
+    }
+    if(table->rate > 0)
+    {
+        refill(table, entry, now_nsec);
+        if(entry->tokens < RATELIMIT_SCALE)
+        {
+            return RATELIMIT_RATE;
+        }
+        entry->tokens -= RATELIMIT_SCALE;
+    }
+    else
+    {
+        entry->refill_nsec = now_nsec;
+    }
+
+    entry->connections++;
+    *slot = (int)(entry - table->entries);
+    return RATELIMIT_PASS;
+}
+
+// Entries with open connections are never reused, so the slot still names the same client.
+void ratelimit_release(ratelimit_table *table, int slot)
+{
+    if(table && slot >= 0 && table->entries[slot].connections > 0)
+    {
+        table->entries[slot].connections--;
+    }
+}
@@ -0,0 +1,257 @@
+#include "reload.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define COPY_SIZE 65536
+#define EVENT_BUFFER_SIZE 4096
+#define WALK_FDS 16
+#define TREE_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF)
+#define TREE_CHANGED 1
+#define TREE_REWALK 2
+
+// The pack's directory watch and file name, for telling its events apart from the library's.
+typedef struct pack_watch
+{
+    int         wd;
+    const char *name;
+} pack_watch;
+
+typedef int (*event_func)(const struct inotify_event *event, const void *ctx);
+
+static int drain_events(int fd, event_func classify, const void *ctx);
+static int classify_lib(const struct inotify_event *event, const void *ctx);
+static int classify_tree(const struct inotify_event *event, const void *ctx);
+static int watch_dir(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf);
+
+// nftw has no context argument
+static int tree_fd = -1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+void reload_path(char *buf, size_t size, pid_t owner, uint64_t generation)
+{
+    snprintf(buf, size, LIB_SNAPSHOT_FORMAT, (int)owner, (unsigned long long)generation);
+}
+
+// Copies the deployed library to the generation's path through a temporary name, so a worker never
+// opens a half written snapshot.
+int reload_snapshot(pid_t owner, uint64_t generation)
+{
+    char    path[PATH_MAX];
+    char    tmp[PATH_MAX + sizeof(".tmp")];
+    char    buf[COPY_SIZE];
+    int     from;
+    int     to;
+    ssize_t nread;
+    int     result;
+
+    reload_path(path, sizeof(path), owner, generation);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+    from = open(LIB_DIR "/" LIB_NAME, O_RDONLY | O_CLOEXEC);
+    if(from == -1)
+    {
+        perror("open " LIB_NAME);
+        return -1;
+    }
+    to = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IXUSR);
+    if(to == -1)
+    {
+        perror("open snapshot");
+        close(from);
+        return -1;
+    }
+
+    result = 0;
+    while((nread = read(from, buf, sizeof(buf))) != 0)
+    {
+        ssize_t written = 0;
+
+        if(nread == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            result = -1;
+            break;
+        }
+        while(written < nread)
+        {
+            ssize_t n = write(to, buf + written, (size_t)(nread - written));
+
+            if(n == -1 && errno != EINTR)
+            {
+                result = -1;
+                break;
+            }
+            written += n > 0 ? n : 0;
+        }
+        if(result == -1)
+        {
+            break;
+        }
+    }
+
+    close(from);
+    if(close(to) == -1 || result == -1 || rename(tmp, path) == -1)
+    {
+        perror("snapshot " LIB_NAME);
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+// With a pack, its directory is watched too; pack_wd is how its events are told apart.
+int reload_watch(const char *pack_path, int *pack_wd)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    *pack_wd = -1;
+    if(fd == -1)
+    {
+        perror("inotify_init1");
+        return -1;
+    }
+
+    // watch the directory: deploys either rewrite the file or rename a new one over it
+    if(inotify_add_watch(fd, LIB_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) == -1)
+    {
+        perror("inotify_add_watch");
+        close(fd);
+        return -1;
+    }
+
+    if(pack_path)
+    {
+        char        dir[PATH_MAX];
+        const char *slash = strrchr(pack_path, '/');
+        int         len   = slash ? (int)(slash - pack_path) + 1 : 1;
+
+        if(len >= (int)sizeof(dir) || snprintf(dir, sizeof(dir), "%.*s", len, slash ? pack_path : ".") != len)
+        {
+            fprintf(stderr, "pack directory of %s is too long to watch\n", pack_path);
+            return fd;
+        }
+        *pack_wd = inotify_add_watch(fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO);
+        if(*pack_wd == -1)
+        {
+            perror("inotify_add_watch pack");
+        }
+    }
+    return fd;
+}
+
+// Reads until the descriptor is empty and returns the bits classify gave the events, or'ed together.
+static int drain_events(int fd, event_func classify, const void *ctx)
+{
+    char buf[EVENT_BUFFER_SIZE] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int  result = 0;
+
+    while(1)
+    {
+        ssize_t len = read(fd, buf, sizeof(buf));
+
+        if(len <= 0)
+        {
+            return result;
+        }
+
+        // the kernel pads each name so the next event starts aligned
+        for(const char *pos = buf; pos < buf + len;)
+        {
+            const struct inotify_event *event = (const struct inotify_event *)(const void *)pos;
+
+            result |= classify(event, ctx);
+            pos += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+static int classify_lib(const struct inotify_event *event, const void *ctx)
+{
+    const pack_watch *pack    = (const pack_watch *)ctx;
+    int               changed = 0;
+
+    if(event->len > 0 && strcmp(event->name, LIB_NAME) == 0)
+    {
+        changed |= RELOAD_LIB;
+    }
+    if(event->len > 0 && event->wd == pack->wd && strcmp(event->name, pack->name) == 0)
+    {
+        changed |= RELOAD_PACK;
+    }
+    return changed;
+}
+
+// Drains pending events; returns RELOAD_LIB and RELOAD_PACK for whichever of the two they touched.
+int reload_changed(int fd, int pack_wd, const char *pack_path)
+{
+    pack_watch pack;
+
+    pack.wd   = pack_wd;
+    pack.name = pack_path && strrchr(pack_path, '/') ? strrchr(pack_path, '/') + 1 : pack_path;
+    return drain_events(fd, classify_lib, &pack);
+}
+
+static int watch_dir(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf)
+{
+    (void)sb;
+    (void)ftwbuf;
+    if(typeflag == FTW_D && inotify_add_watch(tree_fd, fpath, TREE_EVENTS) == -1)
+    {
+        perror("inotify_add_watch tree");
+    }
+    return 0;
+}
+
+// inotify is not recursive, so every directory under root gets its own watch on a descriptor of its own.
+// Symlinks are followed, root included, since that is what requests are served through.
+int reload_watch_tree(const char *root)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+
+    if(fd == -1)
+    {
+        perror("inotify_init1 tree");
+        return -1;
+    }
+    tree_fd = fd;
+    if(nftw(root, watch_dir, WALK_FDS, 0) != 0)
+    {
+        perror("watch tree");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int classify_tree(const struct inotify_event *event, const void *ctx)
+{
+    (void)ctx;
+    if((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO)))
+    {
+        return TREE_CHANGED | TREE_REWALK;
+    }
+    return TREE_CHANGED;
+}
+
+// Drains pending events; returns 1 when anything under root changed. A new directory is walked again so
+// its files are watched too; re-adding a watched directory is harmless.
+int reload_tree_changed(int fd, const char *root)
+{
+    int changed = drain_events(fd, classify_tree, NULL);
+
+    if(changed & TREE_REWALK)
+    {
+        tree_fd = fd;
+        nftw(root, watch_dir, WALK_FDS, 0);
+    }
+    return (changed & TREE_CHANGED) != 0;
+}
@@ -0,0 +1,509 @@
+#include "capture.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_ADDRESS "127.0.0.1"
+#define DEFAULT_PORT 8080
+#define DEFAULT_CONNECTIONS 16
+#define MAX_CONNECTIONS 1024
+#define ROUTE_SIZE 128
+#define RESPONSE_SIZE (64 * 1024)
+#define CHUNK_SIZE_LEN 32
+#define SEND_IOV 4
+#define STATUS_OFFSET 9
+#define STATUS_CLASSES 6
+#define RECEIVE_TIMEOUT_SEC 30
+#define PERCENT 100
+#define P50 50
+#define P99 99
+#define BASE_TEN 10
+#define MAX_PORT 65535
+#define NSEC_PER_SEC 1000000000L
+#define NSEC_PER_MSEC 1000000.0
+#define BYTES_PER_MB (1024.0 * 1024.0)
+#define H2_VERSION " HTTP/2.0"
+#define H1_VERSION " HTTP/1.1"
+
+// ends the single chunk a body is resent as; without the leading CRLF it is a whole empty body
+static const char *const last_chunk = "\r\n0\r\n\r\n";
+
+// One captured request and what replaying it came to. status is 0 when no response line came back.
+typedef struct replay_entry
+{
+    capture_record record;
+    char          *data;
+    char           route[ROUTE_SIZE];
+    uint64_t       latency_nsec;
+    size_t         received;
+    int            status;
+} replay_entry;
+
+typedef struct replay_t
+{
+    replay_entry      *entries;
+    size_t             count;
+    size_t             cap;
+    struct sockaddr_in addr;
+    double             speed;
+    uint64_t           start_nsec;
+    uint64_t           first_arrival;
+    _Atomic size_t     next;
+} replay_t;
+
+static _Noreturn void usage(const char *binary_name, int exit_code, const char *message);
+static uint64_t       now_nsec(void);
+static int            load_log(replay_t *replay, const char *path);
+static void           set_route(replay_entry *entry);
+static int            compare_arrival(const void *a, const void *b);
+static int            compare_route(const void *a, const void *b);
+static void           wait_until(uint64_t when_nsec);
+static ssize_t        send_request(int fd, const replay_entry *entry);
+static void           play(const replay_t *replay, replay_entry *entry);
+static void          *player(void *arg);
+static void           report(replay_t *replay, uint64_t elapsed_nsec);
+static uint64_t       percentile(replay_entry *const *group, size_t count, int percent);
+
+static _Noreturn void usage(const char *binary_name, int exit_code, const char *message)
+{
+    if(message)
+    {
+        fprintf(stderr, "%s\n\n", message);
+    }
+
+    fprintf(stderr, "Usage: %s [-h] [-a <address>] [-p <port>] [-s <speed>] [-c <connections>] <log>\n", binary_name);
+    fputs("Options:\n", stderr);
+    fputs("  -h  Display this help message\n", stderr);
+    fputs("  -a  Server address (default 127.0.0.1).\n", stderr);
+    fputs("  -p  Server port (default 8080).\n", stderr);
+    fputs("  -s  1 replays at the captured pace, 2 twice as fast, 0 as fast as the server answers.\n", stderr);
+    fputs("  -c  Requests in flight at most (default 16).\n", stderr);
+    exit(exit_code);
+}
+
+static uint64_t now_nsec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * NSEC_PER_SEC + (uint64_t)now.tv_nsec;
+}
+
+static int load_log(replay_t *replay, const char *path)
+{
+    capture_record record;
+    char          *data;
+    size_t         cap;
+    ssize_t        result;
+    int            fd;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1)
+    {
+        perror(path);
+        return -1;
+    }
+
+    while(1)
+    {
+        data   = NULL;
+        cap    = 0;
+        result = capture_read(fd, &record, &data, &cap);
+        if(result <= 0)
+        {
+            free(data);
+            break;
+        }
+        if(replay->count == replay->cap)
+        {
+            size_t        grown_cap = replay->cap ? replay->cap * 2 : BASE_TEN * BASE_TEN;
+            replay_entry *grown     = (replay_entry *)realloc(replay->entries, grown_cap * sizeof(replay_entry));
+            if(!grown)
+            {
+                perror("realloc");
+                free(data);
+                result = -1;
+                break;
+            }
+            replay->entries = grown;
+            replay->cap     = grown_cap;
+        }
+        memset(&replay->entries[replay->count], 0, sizeof(replay_entry));
+        replay->entries[replay->count].record = record;
+        replay->entries[replay->count].data   = data;
+        set_route(&replay->entries[replay->count]);
+        replay->count++;
+    }
+    close(fd);
+
+    // a server killed mid-append leaves a torn record at the end; everything before it still replays
+    if(result == -1)
+    {
+        fprintf(stderr, "%s: stopped at a damaged record after %zu requests\n", path, replay->count);
+    }
+    return replay->count > 0 ? 0 : -1;
+}
+
+// The route is the method and the path without its query, so /user?user=a and /user?user=b add up.
+static void set_route(replay_entry *entry)
+{
+    size_t len = strcspn(entry->data, " ");
+    size_t end;
+
+    end = len < entry->record.head_len ? len + 1 + strcspn(entry->data + len + 1, " ?\r\n") : len;
+    if(end >= sizeof(entry->route))
+    {
+        end = sizeof(entry->route) - 1;
+    }
+    memcpy(entry->route, entry->data, end);
+    entry->route[end] = '\0';
+}
+
+// Ties keep the order they were logged in, so the same log always replays in the same order.
+static int compare_arrival(const void *a, const void *b)
+{
+    const replay_entry *left  = (const replay_entry *)a;
+    const replay_entry *right = (const replay_entry *)b;
+
+    if(left->record.arrival_nsec != right->record.arrival_nsec)
+    {
+        return left->record.arrival_nsec < right->record.arrival_nsec ? -1 : 1;
+    }
+    return left->data < right->data ? -1 : left->data > right->data;
+}
+
+static int compare_route(const void *a, const void *b)
+{
+    const replay_entry *left  = *(replay_entry *const *)a;
+    const replay_entry *right = *(replay_entry *const *)b;
+    int                 result;
+
+    result = strcmp(left->route, right->route);
+    if(result != 0)
+    {
+        return result;
+    }
+    return (left->latency_nsec > right->latency_nsec) - (left->latency_nsec < right->latency_nsec);
+}
+
+static void wait_until(uint64_t when_nsec)
+{
+    struct timespec when;
+
+    when.tv_sec  = (time_t)(when_nsec / NSEC_PER_SEC);
+    when.tv_nsec = (long)(when_nsec % NSEC_PER_SEC);
+    while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &when, NULL) == EINTR)
+    {
+    }
+}
+
+// Streams captured off HTTP/2 go out as HTTP/1.1 with the same headers, and a chunked body as one chunk.
+static ssize_t send_request(int fd, const replay_entry *entry)
+{
+    char          head[CAPTURE_MAX_HEAD];
+    char          chunk[CHUNK_SIZE_LEN];
+    struct iovec  iov[SEND_IOV];
+    struct msghdr msg;
+    const char   *line_end;
+    size_t        head_len = entry->record.head_len;
+    int           count    = 0;
+
+    memcpy(head, entry->data, head_len);
+    line_end = (const char *)memmem(head, head_len, "\r\n", 2);
+    if((entry->record.flags & CAPTURE_H2) && line_end && (size_t)(line_end - head) >= strlen(H2_VERSION))
+    {
+        memcpy(head + (line_end - head) - strlen(H2_VERSION), H1_VERSION, strlen(H1_VERSION));
+    }
+
+    iov[count].iov_base  = head;
+    iov[count++].iov_len = head_len;
+    if((entry->record.flags & CAPTURE_CHUNKED) && entry->record.body_len > 0)
+    {
+        iov[count].iov_base  = chunk;
+        iov[count++].iov_len = (size_t)snprintf(chunk, sizeof(chunk), "%x\r\n", (unsigned)entry->record.body_len);
+    }
+    if(entry->record.body_len > 0)
+    {
+        iov[count].iov_base  = entry->data + head_len;
+        iov[count++].iov_len = entry->record.body_len;
+    }
+    if(entry->record.flags & CAPTURE_CHUNKED)
+    {
+        const char *last = entry->record.body_len > 0 ? last_chunk : last_chunk + 2;
+
+        iov[count].iov_base  = (void *)(uintptr_t)last;
+        iov[count++].iov_len = strlen(last);
+    }
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = (size_t)count;
+    while(msg.msg_iovlen > 0)
+    {
+        ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if(sent == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        while(msg.msg_iovlen > 0 && (size_t)sent >= msg.msg_iov->iov_len)
+        {
+            sent -= (ssize_t)msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if(msg.msg_iovlen > 0)
+        {
+            msg.msg_iov->iov_base = (char *)msg.msg_iov->iov_base + sent;
+            msg.msg_iov->iov_len -= (size_t)sent;
+        }
+    }
+    return 0;
+}
+
+// Latency runs from when the request was due, not when a connection got round to it, so a server that
+// falls behind the captured pace is charged for the queue it built.
+static void play(const replay_t *replay, replay_entry *entry)
+{
+    char           response[RESPONSE_SIZE];
+    struct timeval timeout;
+    uint64_t       due;
+    ssize_t        nread;
+    int            fd;
+
+    due = replay->start_nsec;
+    if(replay->speed > 0)
+    {
+        due += (uint64_t)((double)(entry->record.arrival_nsec - replay->first_arrival) / replay->speed);
+        wait_until(due);
+    }
+    else
+    {
+        due = now_nsec();
+    }
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+    {
+        goto done;
+    }
+    timeout.tv_sec  = RECEIVE_TIMEOUT_SEC;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if(connect(fd, (const struct sockaddr *)&replay->addr, sizeof(replay->addr)) == -1 || send_request(fd, entry) == -1)
+    {
+        goto done;
+    }
+
+    // the server closes after each HTTP/1 response, so the response ends where the stream does
+    while((nread = read(fd, response, sizeof(response))) != 0)
+    {
+        if(nread == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        if(entry->received == 0 && nread > STATUS_OFFSET)
+        {
+            entry->status = atoi(response + STATUS_OFFSET);
+        }
+        entry->received += (size_t)nread;
+    }
+
+done:
+    entry->latency_nsec = now_nsec() - due;
+    if(fd != -1)
+    {
+        close(fd);
+    }
+}
+
+static void *player(void *arg)
+{
+    replay_t *replay = (replay_t *)arg;
+    size_t    index;
+
+    while((index = atomic_fetch_add(&replay->next, 1)) < replay->count)
+    {
+        play(replay, &replay->entries[index]);
+    }
+    return NULL;
+}
+
+static uint64_t percentile(replay_entry *const *group, size_t count, int percent)
+{
+    size_t index = count * (size_t)percent / PERCENT;
+
+    return group[index < count ? index : count - 1]->latency_nsec;
+}
+
+static void report(replay_t *replay, uint64_t elapsed_nsec)
+{
+    replay_entry **sorted;
+    size_t         bytes   = 0;
+    size_t         failed  = 0;
+    double         seconds = (double)elapsed_nsec / NSEC_PER_SEC;
+
+    sorted = (replay_entry **)calloc(replay->count, sizeof(replay_entry *));
+    if(!sorted)
+    {
+        perror("calloc");
+        return;
+    }
+    for(size_t i = 0; i < replay->count; i++)
+    {
+        sorted[i] = &replay->entries[i];
+        bytes += replay->entries[i].received;
+        failed += replay->entries[i].status == 0;
+    }
+    qsort(sorted, replay->count, sizeof(replay_entry *), compare_route);
+
+    printf("%-40s %8s %6s %6s %6s %6s %6s %10s %10s %10s\n", "route", "requests", "2xx", "3xx", "4xx", "5xx", "failed", "p50 ms", "p99 ms", "max ms");
+    for(size_t start = 0; start < replay->count;)
+    {
+        size_t   classes[STATUS_CLASSES] = {0};
+        size_t   end                     = start;
+        uint64_t p50;
+        uint64_t p99;
+
+        while(end < replay->count && strcmp(sorted[end]->route, sorted[start]->route) == 0)
+        {
+            int status = sorted[end]->status / PERCENT;
+
+            classes[status > 0 && status < STATUS_CLASSES ? status : 0]++;
+            end++;
+        }
+        p50 = percentile(sorted + start, end - start, P50);
+        p99 = percentile(sorted + start, end - start, P99);
+        printf("%-40s %8zu %6zu %6zu %6zu %6zu %6zu %10.2f %10.2f %10.2f\n",
+               sorted[start]->route,
+               end - start,
+               classes[2],
+               classes[3],
+               classes[4],
+               classes[5],
+               classes[0],
+               (double)p50 / NSEC_PER_MSEC,
+               (double)p99 / NSEC_PER_MSEC,
+               (double)sorted[end - 1]->latency_nsec / NSEC_PER_MSEC);
+        start = end;
+    }
+    printf("\n%zu requests (%zu failed) in %.3fs: %.0f req/s, %.2f MB/s received\n", replay->count, failed, seconds, (double)replay->count / seconds, (double)bytes / BYTES_PER_MB / seconds);
+    free(sorted);
+}
+
+int main(int argc, char *argv[])
+{
+    replay_t    replay;
+    pthread_t   threads[MAX_CONNECTIONS];
+    const char *address     = DEFAULT_ADDRESS;
+    long        port        = DEFAULT_PORT;
+    long        connections = DEFAULT_CONNECTIONS;
+    long        started     = 0;
+    char       *end;
+    int         opt;
+    int         result = EXIT_FAILURE;
+
+    memset(&replay, 0, sizeof(replay));
+    replay.speed = 1;
+    while((opt = getopt(argc, argv, "ha:p:s:c:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'a':
+                address = optarg;
+                break;
+            case 'p':
+                port = strtol(optarg, &end, BASE_TEN);
+                if(*end != '\0' || port < 1 || port > MAX_PORT)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Port must be between 1 and 65535");
+                }
+                break;
+            case 's':
+                replay.speed = strtod(optarg, &end);
+                if(*end != '\0' || replay.speed < 0)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Speed must be 0 or a positive factor");
+                }
+                break;
+            case 'c':
+                connections = strtol(optarg, &end, BASE_TEN);
+                if(*end != '\0' || connections < 1 || connections > MAX_CONNECTIONS)
+                {
+                    usage(argv[0], EXIT_FAILURE, "Connections must be between 1 and 1024");
+                }
+                break;
+            case 'h':
+                usage(argv[0], EXIT_SUCCESS, NULL);
+            default:
+                usage(argv[0], EXIT_FAILURE, NULL);
+        }
+    }
+    if(argc - optind != 1)
+    {
+        usage(argv[0], EXIT_FAILURE, "A capture log is required");
+    }
+
+    replay.addr.sin_family = AF_INET;
+    replay.addr.sin_port   = htons((uint16_t)port);
+    if(inet_pton(AF_INET, address, &replay.addr.sin_addr) != 1)
+    {
+        usage(argv[0], EXIT_FAILURE, "Address must be an IPv4 address");
+    }
+
+    if(load_log(&replay, argv[optind]) == -1)
+    {
+        fprintf(stderr, "%s has no requests to replay\n", argv[optind]);
+        goto cleanup;
+    }
+    qsort(replay.entries, replay.count, sizeof(replay_entry), compare_arrival);
+    replay.first_arrival = replay.entries[0].record.arrival_nsec;
+    printf("replaying %zu requests spanning %.3fs\n", replay.count, (double)(replay.entries[replay.count - 1].record.arrival_nsec - replay.first_arrival) / NSEC_PER_SEC);
+
+    replay.start_nsec = now_nsec();
+    for(; started < connections; started++)
+    {
+        if(pthread_create(&threads[started], NULL, player, &replay) != 0)
+        {
+            perror("pthread_create");
+            break;
+        }
+    }
+    for(long i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    if(started > 0)
+    {
+        report(&replay, now_nsec() - replay.start_nsec);
+        result = EXIT_SUCCESS;
+    }
+
+cleanup:
+    for(size_t i = 0; i < replay.count; i++)
+    {
+        free(replay.entries[i].data);
+    }
+    free(replay.entries);
+    return result;
+}
@@ -0,0 +1,277 @@
+#include "respcache.h"
+#include <errno.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define FNV64_OFFSET 14695981039346656037ULL
+#define FNV64_PRIME 1099511628211ULL
+#define SPIN_LIMIT 64
+#define SPINS_BEFORE_CHECK 1024
+
+static uint64_t       hash_key(const char *key, size_t len);
+static respcache_set *set_for(respcache_t *cache, uint64_t hash);
+static void           lock_set(respcache_set *set);
+static void           unlock_set(respcache_set *set);
+static void           repair_set(respcache_set *set);
+static void           write_entry(respcache_entry *entry, uint64_t hash, const char *key, size_t key_len, const char *response, size_t len, size_t date_offset);
+static void           clear_entry(respcache_entry *entry);
+
+// Anonymous shared memory: a cache only means anything to the generation that filled it.
+respcache_t *respcache_create(size_t bytes)
+{
+    respcache_t *cache;
+    size_t       set_count = bytes / sizeof(respcache_set);
+    size_t       size;
+
+    if(set_count == 0)
+    {
+        set_count = 1;
+    }
+    size  = sizeof(respcache_t) + set_count * sizeof(respcache_set);
+    cache = (respcache_t *)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if(cache == MAP_FAILED)
+    {
+        perror("respcache mmap");
+        return NULL;
+    }
+    cache->set_count = set_count;
+    cache->size      = size;
+    return cache;
+}
+
+static uint64_t hash_key(const char *key, size_t len)
+{
+    uint64_t hash = FNV64_OFFSET;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= (unsigned char)key[i];
+        hash *= FNV64_PRIME;
+    }
+    return hash;
+}
+
+static respcache_set *set_for(respcache_t *cache, uint64_t hash)
+{
+    return &cache->sets[hash % cache->set_count];
+}
+
+// Held only while entries are copied, so waiters spin. A writer killed while holding it is noticed by
+// the next one, which takes the set over and frees whatever was left half written.
+static void lock_set(respcache_set *set)
+{
+    pid_t    self  = getpid();
+    unsigned spins = 0;
+
+    while(1)
+    {
+        pid_t owner = 0;
+
+        if(atomic_compare_exchange_weak(&set->owner, &owner, self))
+        {
+            return;
+        }
+        if(++spins % SPINS_BEFORE_CHECK == 0 && owner != 0 && owner != self && kill(owner, 0) == -1 && errno == ESRCH &&
+           atomic_compare_exchange_strong(&set->owner, &owner, self))
+        {
+            repair_set(set);
+            return;
+        }
+        sched_yield();
+    }
+}
+
+static void unlock_set(respcache_set *set)
+{
+    atomic_store_explicit(&set->owner, 0, memory_order_release);
+}
+
+static void repair_set(respcache_set *set)
+{
+    for(int i = 0; i < RESPCACHE_WAYS; i++)
+    {
+        respcache_entry *entry = &set->entries[i];
+
+        if(atomic_load_explicit(&entry->seq, memory_order_relaxed) & 1u)
+        {
+            entry->response_len = 0;
+            atomic_fetch_add_explicit(&entry->seq, 1, memory_order_release);
+        }
+    }
+    // an invalidation may have died before its version got out
+    atomic_fetch_add(&set->version, 1);
+}
+
+static void write_entry(respcache_entry *entry, uint64_t hash, const char *key, size_t key_len, const char *response, size_t len, size_t date_offset)
+{
+    uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    entry->hash         = hash;
+    entry->key_len      = (uint16_t)key_len;
+    entry->date_offset  = (uint16_t)date_offset;
+    entry->response_len = (uint32_t)len;
+    memcpy(entry->data, key, key_len);
+    memcpy(entry->data + key_len, response, len);
+    atomic_store_explicit(&entry->referenced, 0, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+
+static void clear_entry(respcache_entry *entry)
+{
+    uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&entry->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    entry->response_len = 0;
+    atomic_store_explicit(&entry->seq, seq + 2, memory_order_release);
+}
+
+// Copies the response out under the entry's seqlock and returns its length, or -1 on a miss.
+// date_offset is where the Date header starts, to be stamped with the time of sending.
+ssize_t respcache_find(respcache_t *cache, const char *key, char *response, size_t size, size_t *date_offset)
+{
+    size_t         key_len = strlen(key);
+    uint64_t       hash    = hash_key(key, key_len);
+    respcache_set *set     = set_for(cache, hash);
+
+    for(int i = 0; i < RESPCACHE_WAYS; i++)
+    {
+        respcache_entry *entry = &set->entries[i];
+
+        for(int spins = 0; spins < SPIN_LIMIT; spins++)
+        {
+            uint32_t seq = atomic_load_explicit(&entry->seq, memory_order_acquire);
+            size_t   len;
+            size_t   offset;
+            int      match;
+
+            if(seq & 1u)
+            {
+                continue;
+            }
+            len    = entry->response_len;
+            offset = entry->date_offset;
+            if(len == 0 || entry->hash != hash || entry->key_len != key_len || len > size || key_len + len > RESPCACHE_DATA_SIZE)
+            {
+                break;
+            }
+            match = memcmp(entry->data, key, key_len) == 0;
+            if(match)
+            {
+                memcpy(response, entry->data + key_len, len);
+            }
+
+            atomic_thread_fence(memory_order_acquire);
+            if(atomic_load_explicit(&entry->seq, memory_order_relaxed) != seq)
+            {
+                continue;
+            }
+            if(!match)
+            {
+                break;
+            }
+
+            // written only when it changes, so hot entries do not bounce their line between workers
+            if(!atomic_load_explicit(&entry->referenced, memory_order_relaxed))
+            {
+                atomic_store_explicit(&entry->referenced, 1, memory_order_relaxed);
+            }
+            atomic_fetch_add_explicit(&cache->hits, 1, memory_order_relaxed);
+            *date_offset = offset;
+            return (ssize_t)len;
+        }
+    }
+    atomic_fetch_add_explicit(&cache->misses, 1, memory_order_relaxed);
+    return -1;
+}
+
+// Taken before storage is read; respcache_store only keeps the response if nothing in the set was
+// invalidated since.
+uint64_t respcache_version(respcache_t *cache, const char *key)
+{
+    return atomic_load(&set_for(cache, hash_key(key, strlen(key)))->version);
+}
+
+void respcache_store(respcache_t *cache, const char *key, uint64_t version, const char *response, size_t len, size_t date_offset)
+{
+    size_t           key_len = strlen(key);
+    uint64_t         hash    = hash_key(key, key_len);
+    respcache_set   *set     = set_for(cache, hash);
+    respcache_entry *victim  = NULL;
+
+    if(len == 0 || key_len + len > RESPCACHE_DATA_SIZE || date_offset > UINT16_MAX)
+    {
+        return;
+    }
+
+    lock_set(set);
+    if(atomic_load(&set->version) != version)
+    {
+        unlock_set(set);
+        return;
+    }
+
+    // another worker may have stored it first; otherwise a free way
+    for(int i = 0; i < RESPCACHE_WAYS; i++)
+    {
+        respcache_entry *entry = &set->entries[i];
+
+        if(entry->response_len != 0 && entry->hash == hash && entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0)
+        {
+            victim = entry;
+            break;
+        }
+        if(entry->response_len == 0 && !victim)
+        {
+            victim = entry;
+        }
+    }
+
+    // CLOCK: an entry read since the hand last passed it gets a second chance
+    while(!victim)
+    {
+        respcache_entry *entry = &set->entries[set->hand];
+
+        set->hand = (set->hand + 1) % RESPCACHE_WAYS;
+        if(atomic_exchange_explicit(&entry->referenced, 0, memory_order_relaxed) == 0)
+        {
+            victim = entry;
+            atomic_fetch_add_explicit(&cache->evictions, 1, memory_order_relaxed);
+        }
+    }
+
+    write_entry(victim, hash, key, key_len, response, len, date_offset);
+    unlock_set(set);
+    atomic_fetch_add_explicit(&cache->stores, 1, memory_order_relaxed);
+}
+
+// Called once the new value is in storage. The version moves even when nothing is cached, since a
+// response rendered from the old value may be on its way to respcache_store.
+void respcache_invalidate(respcache_t *cache, const char *key)
+{
+    size_t         key_len = strlen(key);
+    uint64_t       hash    = hash_key(key, key_len);
+    respcache_set *set     = set_for(cache, hash);
+
+    lock_set(set);
+    atomic_fetch_add(&set->version, 1);
+    for(int i = 0; i < RESPCACHE_WAYS; i++)
+    {
+        respcache_entry *entry = &set->entries[i];
+
+        if(entry->response_len != 0 && entry->hash == hash && entry->key_len == key_len && memcmp(entry->data, key, key_len) == 0)
+        {
+            clear_entry(entry);
+            atomic_fetch_add_explicit(&cache->invalidations, 1, memory_order_relaxed);
+        }
+    }
+    unlock_set(set);
+}
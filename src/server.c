@@ -1,10 +1,31 @@
 #include "args.h"
+#include "accesslog.h"
+#include "affinity.h"
+#include "arena.h"
+#include "bloom.h"
+#include "capture.h"
+#include "database.h"
+#include "deque.h"
+#include "filehint.h"
 #include "fsm.h"
+#include "http.h"
 #include "networking.h"
+#include "pack.h"
+#include "pathcache.h"
+#include "pool.h"
+#include "ratelimit.h"
+#include "reload.h"
+#include "respcache.h"
+#include "timer.h"
+#include "tls.h"
+#include "upgrade.h"
 #include "utils.h"
+#include "wal.h"
 #include <dlfcn.h>
 #include <errno.h>
+#include <limits.h>
 #include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,171 +33,1528 @@
 #include <sys/wait.h>
 #include <time.h>
 
-#define BACKLOG 5
 #define MAX_CLIENTS 64
-#define MAX_FDS (MAX_CLIENTS + 2)
+#define LISTENER_TLS 2
+#define FIRST_CLIENT 3
+#define MAX_FDS (MAX_CLIENTS + FIRST_CLIENT)
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+#define DRAIN_POLL_NSEC 10000000L
+#define MSEC_PER_SEC 1000ULL
+#define BYTES_PER_MB (1024ULL * 1024ULL)
+#define REFUSED_DRAIN_SIZE 4096
 
-static void load_lib(const char *lib_path, void **handle, void (**func)(void *))
+// Main's clients, as expire_idle and the limits need them: limit_slot[i] is the rate limit entry fds[i]
+// is counted against, -1 for none.
+typedef struct client_set
 {
-    PRINT_DEBUG("%s\n", "loading lib...");
+    const args_t    *args;
+    struct pollfd   *fds;
+    ratelimit_table *limits;
+    int             *limit_slot;
+} client_set;
 
-    *handle = dlopen(lib_path, RTLD_LAZY);
+// Prebuilt so a client over its limit costs one send; nothing it sent is parsed.
+static const char too_many_requests[]    = "HTTP/1.1 429 Too Many Requests\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+static const char too_many_connections[] = "HTTP/1.1 503 Service Unavailable\r\nRetry-After: 1\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+
+// State shared by the threads of one -t worker. Each thread serves from its own deque and steals the
+// oldest entries of the others when it runs dry; whichever finds nothing anywhere takes the receiving
+// role and drains the channel into its deque. work_seq moves whenever there may be something new to
+// take, so sleepers never miss it.
+typedef struct thread_pool
+{
+    const args_t         *args;
+    struct worker_thread *threads;
+    deque_t              *deques;
+    int                   count;
+    int                   worker_id;
+    int                   channel;
+    int                   listener;
+    _Atomic int           stop;
+    _Atomic int           receiving;
+    _Atomic uint64_t      work_seq;
+    pthread_rwlock_t      lib_lock;
+    pthread_mutex_t       idle_lock;
+    pthread_cond_t        idle_cond;
+    void (*func)(void *);
+} thread_pool;
+
+typedef struct worker_thread
+{
+    thread_pool *pool;
+    pthread_t    thread;
+    int          index;
+    worker_t     worker;
+    arena_t      arena;
+    pathcache_t  paths;
+} worker_thread;
+
+static int load_lib(const char *lib_path, void **handle, void (**func)(void *))
+{
+    PRINT_DEBUG("loading lib %s...\n", lib_path);
+
+    *handle = dlopen(lib_path, RTLD_NOW | RTLD_LOCAL);
     if(!*handle)
     {
         printf("dlopen failed: %s\n", dlerror());
+        return -1;
+    }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#pragma GCC diagnostic ignored "-Wstrict-prototypes"
+    *func = (void (*)(void *))dlsym(*handle, "fsm_run");
+#pragma GCC diagnostic pop
+    if(!*func)
+    {
+        fprintf(stderr, "dlsym failed: %s\n", dlerror());
+        dlclose(*handle);
+        return -1;
+    }
+    return 0;
+}
+
+// Runs between requests only, so nothing is executing in the old library when it is closed.
+static void swap_lib(const args_t *args, pid_t owner, int worker_id, void **handle, void (**func)(void *))
+{
+    uint64_t generation = atomic_load(&args->pool->lib_generation);
+    char     path[PATH_MAX];
+    void    *new_handle;
+    void (*new_func)(void *);
+
+    reload_path(path, sizeof(path), owner, generation);
+    if(load_lib(path, &new_handle, &new_func) == -1)
+    {
+        fprintf(stderr, "worker %d keeps the previous library\n", worker_id);
+        pool_lib_reloaded(args->pool, worker_id, generation, 0);
+        return;
+    }
+
+    dlclose(*handle);
+    *handle = new_handle;
+    *func   = new_func;
+    pool_lib_reloaded(args->pool, worker_id, generation, 1);
+    PRINT_VERBOSE("worker %d now on library generation %llu\n", worker_id, (unsigned long long)generation);
+}
+
+// Also runs between requests only. A rebuilt pack that fails to open leaves the mapped one serving.
+static void swap_pack(const args_t *args, int worker_id, pack_t *pack, uint64_t *generation)
+{
+    pack_t fresh;
+
+    *generation = atomic_load(&args->pool->pack_generation);
+    if(pack_open(&fresh, args->pack_path) == -1)
+    {
+        fprintf(stderr, "worker %d keeps the previous pack\n", worker_id);
+        return;
+    }
+    pack_close(pack);
+    *pack = fresh;
+    PRINT_VERBOSE("worker %d mapped pack %s, %u paths\n", worker_id, args->pack_path, pack->header.count);
+}
+
+static _Noreturn void worker_process(const args_t *args, int worker_id);
+static pid_t          spawn_applier(wal_t *wal, respcache_t *cache);
+static pid_t          spawn_logger(accesslog_t *log);
+static void           spawn_worker(const args_t *args, int slot);
+static void           grow_pool(const args_t *args, int count);
+static void           retire_worker(const args_t *args);
+static void           reap_workers(const args_t *args, pid_t *applier_pid, pid_t *logger_pid);
+static void           stop_children(const args_t *args, pid_t applier_pid, pid_t logger_pid);
+static int            workers_alive(const args_t *args);
+static _Noreturn void monitor_process(const args_t *args);
+static void           publish_lib(const args_t *args, uint64_t *generation);
+static void           publish_pack(const args_t *args);
+static void           wake_workers(const args_t *args);
+static void           warm_hot_set(const args_t *args);
+static void           remove_snapshots(const args_t *args, uint64_t *oldest, uint64_t generation);
+static int            open_listeners(args_t *args);
+static int            take_over(args_t *args, int channel);
+static void           announce_ready(int *channel);
+static int            hand_over(args_t *args, struct pollfd *fds);
+static void           drain_generation(const args_t *args);
+static void           drain_connections(args_t *args, struct pollfd *fds, const sigset_t *waiting);
+static void           start_deadline(const args_t *args);
+static void           stop_monitor(args_t *args, pid_t monitor_pid);
+static void           accept_burst(const client_set *clients, int listener, timer_wheel *wheel, timer_entry *timers);
+static int            admit_client(const client_set *clients, int slot, int client_fd, const struct sockaddr_storage *peer, int tls);
+static void           close_client(const client_set *clients, int i);
+static void           expire_idle(timer_entry *entry, void *ctx);
+static void           retire_dispatch(const args_t *args, const pool_dispatch *dispatch);
+static void           run_threads(const args_t *args, const worker_t *base, int channel, int listener, pid_t owner, void **handle, void (**func)(void *), uint64_t *pack_generation);
+static void          *thread_main(void *arg);
+static int            steal_work(thread_pool *tp, int index, uint64_t *item);
+static int            receive_work(thread_pool *tp, int index);
+static void           serve_item(worker_thread *self, uint64_t item);
+static void           wake_threads(thread_pool *tp);
+static void           serve_client(const args_t *args, worker_t *worker, void (*func)(void *));
+
+static _Noreturn void worker_process(const args_t *args, int worker_id)
+{
+    worker_t    worker_args;
+    arena_t     arena;
+    pack_t      pack;
+    pathcache_t paths;
+    char        lib_path[PATH_MAX];
+    uint64_t    generation;
+    uint64_t    pack_generation;
+    void       *handle;
+    pid_t       owner;
+    int         listener;
+    int         channel;
+    void (*func)(void *);
+
+    memset(&worker_args, 0, sizeof(worker_args));
+    worker_args.sockfd    = args->sockfd[0];
+    worker_args.worker_id = worker_id;
+    worker_args.bloom     = args->bloom;
+    worker_args.wal       = args->wal;
+    worker_args.pool      = args->pool;
+    worker_args.max_body  = args->max_body;
+    worker_args.arena     = &arena;
+    worker_args.pack      = &pack;
+    worker_args.paths     = &paths;
+    worker_args.capture   = args->capture;
+    worker_args.accesslog = args->accesslog;
+    worker_args.respcache = args->respcache;
+    handle                = NULL;
+    func                  = NULL;
+
+    PRINT_VERBOSE("%s\n", "workers spawned");
+
+    if(args->pin)
+    {
+        affinity_pin(args->cpus.cpus[worker_id % args->cpus.count]);
+    }
+
+    // main hands this slot its connections on its own channel; completions still go back on sockfd
+    channel = args->channels[worker_id][0];
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        if(i != worker_id && args->channels[i][0] >= 0)
+        {
+            close(args->channels[i][0]);
+        }
+    }
+
+    // a reuseport worker accepts on its own listener and keeps none of its siblings'
+    listener = -1;
+    if(args->reuseport)
+    {
+        listener              = args->listeners[worker_id];
+        worker_args.sockfd    = -1;
+        for(int i = 0; i < args->workers; i++)
+        {
+            if(i != worker_id)
+            {
+                close(args->listeners[i]);
+            }
+        }
+    }
+
+    // snapshots carry the monitor's pid, and it is still our parent this early
+    owner      = getppid();
+    generation = atomic_load(&args->pool->lib_generation);
+    reload_path(lib_path, sizeof(lib_path), owner, generation);
+    if(load_lib(lib_path, &handle, &func) == -1)
+    {
         exit(EXIT_FAILURE);
     }
+    atomic_store(&args->pool->slots[worker_id].lib_generation, generation);
+
+    // without a pack, or until one opens, every static file comes from the document root
+    memset(&pack, 0, sizeof(pack));
+    pack_generation = 0;
+    if(args->pack_path)
+    {
+        swap_pack(args, worker_id, &pack, &pack_generation);
+    }
+
+    if(args->threads > 1)
+    {
+        run_threads(args, &worker_args, channel, listener, owner, &handle, &func, &pack_generation);
+        PRINT_DEBUG("%s\n", "worker exiting, unloading lib...");
+        pack_close(&pack);
+        dlclose(handle);
+        exit(EXIT_SUCCESS);
+    }
+
+    // request memory comes from here and is reset after each connection, so it outlives library swaps
+    if(arena_init(&arena) == -1 || pathcache_init(&paths) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    while(running && atomic_load(&args->pool->slots[worker_id].state) != SLOT_RETIRING)
+    {
+        uint64_t started;
+
+        // the monitor's SIGUSR1 breaks the wait below so an idle worker swaps right away
+        if(atomic_load(&args->pool->lib_generation) != atomic_load(&args->pool->slots[worker_id].lib_generation))
+        {
+            swap_lib(args, owner, worker_id, &handle, &func);
+        }
+        if(args->pack_path && atomic_load(&args->pool->pack_generation) != pack_generation)
+        {
+            swap_pack(args, worker_id, &pack, &pack_generation);
+        }
+
+        if(listener >= 0)
+        {
+            worker_args.client_fd = accept(listener, NULL, NULL);
+            worker_args.fd_num    = worker_args.client_fd;
+            if(worker_args.client_fd >= 0)
+            {
+                pool_dispatched(args->pool);
+            }
+        }
+        else
+        {
+            worker_args.client_fd = recv_fd(channel, &worker_args.fd_num);
+            if(worker_args.client_fd < 0 && errno == EPIPE)
+            {
+                // main is gone, so nothing more will be dispatched
+                break;
+            }
+        }
+        if(worker_args.client_fd <= 0)
+        {
+            // interrupted by the monitor retiring us or by shutdown; the loop condition decides
+            continue;
+        }
+        started = pool_worker_begin(args->pool, worker_id);
+        PRINT_VERBOSE("Worker %d (PID: %d) started\n", worker_id, getpid());
+        PRINT_VERBOSE("%s fd: %d num: %d\n", "receiving fd from monitor...", worker_args.client_fd, worker_args.fd_num);
+
+        serve_client(args, &worker_args, func);
+        pool_worker_end(args->pool, worker_id, started);
+    }
+    PRINT_DEBUG("%s\n", "worker exiting, unloading lib...");
+    arena_free(&arena);
+    pathcache_free(&paths);
+    pack_close(&pack);
+    dlclose(handle);
+    exit(EXIT_SUCCESS);
+}
+
+// The process's own thread only swaps libraries and packs and takes signals; the pool threads never see
+// either, so a swap waits on lib_lock for the requests in flight instead of interrupting them.
+static void run_threads(const args_t *args, const worker_t *base, int channel, int listener, pid_t owner, void **handle, void (**func)(void *), uint64_t *pack_generation)
+{
+    thread_pool         tp;
+    pthread_rwlockattr_t attr;
+    sigset_t             all;
+    sigset_t             old;
+    int                  started;
+    int                  worker_id = base->worker_id;
+
+    memset(&tp, 0, sizeof(tp));
+    tp.args      = args;
+    tp.count     = args->threads;
+    tp.worker_id = worker_id;
+    tp.channel   = channel;
+    tp.listener  = listener;
+    tp.func      = *func;
+    tp.threads   = (worker_thread *)calloc((size_t)tp.count, sizeof(worker_thread));
+    tp.deques    = (deque_t *)calloc((size_t)tp.count, sizeof(deque_t));
+    if(!tp.threads || !tp.deques)
+    {
+        perror("calloc");
+        free(tp.threads);
+        free(tp.deques);
+        return;
+    }
+
+    // a pending swap holds off new readers, otherwise a busy worker would never let it in
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&tp.lib_lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_mutex_init(&tp.idle_lock, NULL);
+    pthread_cond_init(&tp.idle_cond, NULL);
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    for(started = 0; started < tp.count; started++)
+    {
+        worker_thread *self = &tp.threads[started];
+
+        deque_init(&tp.deques[started]);
+        self->pool         = &tp;
+        self->index        = started;
+        self->worker           = *base;
+        self->worker.arena     = &self->arena;
+        self->worker.paths     = &self->paths;
+        self->worker.thread_id = started;
+        if(arena_init(&self->arena) == -1)
+        {
+            break;
+        }
+        if(pathcache_init(&self->paths) == -1)
+        {
+            arena_free(&self->arena);
+            break;
+        }
+        if(pthread_create(&self->thread, NULL, thread_main, self) != 0)
+        {
+            perror("pthread_create");
+            arena_free(&self->arena);
+            pathcache_free(&self->paths);
+            break;
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    PRINT_VERBOSE("worker %d serving on %d threads\n", worker_id, started);
+
+    while(started > 0 && running && !atomic_load(&tp.stop) && atomic_load(&args->pool->slots[worker_id].state) != SLOT_RETIRING)
+    {
+        struct timespec tick = {0, POOL_TICK_MSEC * (long)NSEC_PER_MSEC};
+
+        if(atomic_load(&args->pool->lib_generation) != atomic_load(&args->pool->slots[worker_id].lib_generation))
+        {
+            pthread_rwlock_wrlock(&tp.lib_lock);
+            swap_lib(args, owner, worker_id, handle, func);
+            tp.func = *func;
+            pthread_rwlock_unlock(&tp.lib_lock);
+        }
+        if(args->pack_path && atomic_load(&args->pool->pack_generation) != *pack_generation)
+        {
+            pthread_rwlock_wrlock(&tp.lib_lock);
+            swap_pack(args, worker_id, base->pack, pack_generation);
+            pthread_rwlock_unlock(&tp.lib_lock);
+        }
+        // SIGUSR1 and the shutdown signals cut this short
+        nanosleep(&tick, NULL);
+    }
+
+    // threads finish what they hold; anything still queued is closed with the process
+    atomic_store(&tp.stop, 1);
+    wake_threads(&tp);
+    for(int i = 0; i < started; i++)
+    {
+        pthread_join(tp.threads[i].thread, NULL);
+        arena_free(&tp.threads[i].arena);
+        pathcache_free(&tp.threads[i].paths);
+    }
+    pthread_cond_destroy(&tp.idle_cond);
+    pthread_mutex_destroy(&tp.idle_lock);
+    pthread_rwlock_destroy(&tp.lib_lock);
+    free(tp.deques);
+    free(tp.threads);
+}
+
+static void *thread_main(void *arg)
+{
+    worker_thread *self = (worker_thread *)arg;
+    thread_pool   *tp   = self->pool;
+
+    while(!atomic_load(&tp->stop))
+    {
+        uint64_t seq = atomic_load(&tp->work_seq);
+        uint64_t item;
+
+        if(deque_pop(&tp->deques[self->index], &item) == 0 || steal_work(tp, self->index, &item) == 0)
+        {
+            serve_item(self, item);
+            continue;
+        }
+
+        if(!atomic_exchange(&tp->receiving, 1))
+        {
+            receive_work(tp, self->index);
+            atomic_store(&tp->receiving, 0);
+            // what arrived is stealable now, and someone else may have to take over the channel
+            wake_threads(tp);
+            continue;
+        }
+
+        pthread_mutex_lock(&tp->idle_lock);
+        if(atomic_load(&tp->work_seq) == seq && !atomic_load(&tp->stop))
+        {
+            struct timespec deadline;
+
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += POOL_TICK_MSEC * (long)NSEC_PER_MSEC;
+            if(deadline.tv_nsec >= (long)NSEC_PER_SEC)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= (long)NSEC_PER_SEC;
+            }
+            pthread_cond_timedwait(&tp->idle_cond, &tp->idle_lock, &deadline);
+        }
+        pthread_mutex_unlock(&tp->idle_lock);
+    }
+    return NULL;
+}
+
+// Starts with the next thread along so thieves spread over their victims.
+static int steal_work(thread_pool *tp, int index, uint64_t *item)
+{
+    for(int i = 1; i < tp->count; i++)
+    {
+        deque_t *victim = &tp->deques[(index + i) % tp->count];
+        int      result;
+
+        while((result = deque_steal(victim, item)) == -2)
+        {
+        }
+        if(result == 0)
+        {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// Waits up to a tick for the channel, or the listener with reuseport, then takes whatever else is
+// already queued there without waiting. The deque was empty when this began and only thieves touch it
+// meanwhile, so DEQUE_SIZE entries always fit.
+static int receive_work(thread_pool *tp, int index)
+{
+    struct pollfd pfd;
+    int           received = 0;
+
+    pfd.fd     = tp->listener >= 0 ? tp->listener : tp->channel;
+    pfd.events = POLLIN;
+    for(int timeout = POOL_TICK_MSEC; received < DEQUE_SIZE && poll(&pfd, 1, timeout) > 0; timeout = 0)
+    {
+        int client_fd;
+        int fd_num;
+
+        if(tp->listener >= 0)
+        {
+            client_fd = accept4(tp->listener, NULL, NULL, SOCK_CLOEXEC);
+            fd_num    = client_fd;
+            if(client_fd >= 0)
+            {
+                pool_dispatched(tp->args->pool);
+            }
+        }
+        else
+        {
+            client_fd = recv_fd(tp->channel, &fd_num);
+            if(client_fd < 0 && errno == EPIPE)
+            {
+                // main is gone, so nothing more will be dispatched
+                atomic_store(&tp->stop, 1);
+                break;
+            }
+        }
+        if(client_fd <= 0)
+        {
+            // the monitor's wake-up for a retiring worker, or an accept lost to a sibling
+            if(atomic_load(&tp->args->pool->slots[tp->worker_id].state) == SLOT_RETIRING)
+            {
+                atomic_store(&tp->stop, 1);
+                break;
+            }
+            continue;
+        }
+        deque_push(&tp->deques[index], (uint64_t)(uint32_t)client_fd << 32 | (uint32_t)fd_num);
+        received++;
+    }
+    return received;
+}
+
+static void serve_item(worker_thread *self, uint64_t item)
+{
+    thread_pool *tp = self->pool;
+    uint64_t     started;
+
+    self->worker.client_fd = (int)(item >> 32);
+    self->worker.fd_num    = (int)(uint32_t)item;
+
+    pthread_rwlock_rdlock(&tp->lib_lock);
+    started = pool_worker_begin(tp->args->pool, tp->worker_id);
+    PRINT_VERBOSE("%s fd: %d num: %d thread: %d\n", "receiving fd from monitor...", self->worker.client_fd, self->worker.fd_num, self->index);
+    serve_client(tp->args, &self->worker, tp->func);
+    pool_worker_end(tp->args->pool, tp->worker_id, started);
+    pthread_rwlock_unlock(&tp->lib_lock);
+}
+
+static void wake_threads(thread_pool *tp)
+{
+    pthread_mutex_lock(&tp->idle_lock);
+    atomic_fetch_add(&tp->work_seq, 1);
+    pthread_cond_broadcast(&tp->idle_cond);
+    pthread_mutex_unlock(&tp->idle_lock);
+}
+
+// HTTPS connections come down the same channel; the port they were accepted on tells them apart.
+static void serve_client(const args_t *args, worker_t *worker, void (*func)(void *))
+{
+    worker->tls = args->tls && tls_is_client(worker->client_fd, args->tls_port);
+
+    // taken here because a TLS connection reaches the library as one end of a socketpair
+    if(args->accesslog)
+    {
+        socklen_t len = sizeof(worker->peer);
+
+        if(getpeername(worker->client_fd, (struct sockaddr *)&worker->peer, &len) == -1)
+        {
+            worker->peer.ss_family = AF_UNSPEC;
+        }
+    }
+
+    if(worker->tls)
+    {
+        tls_serve(args->tls, worker, func);
+        return;
+    }
+    func(worker);
+}
+
+static void spawn_worker(const args_t *args, int slot)
+{
+    pool_slot *worker = &args->pool->slots[slot];
+    pid_t      pid;
+
+    atomic_store(&worker->state, SLOT_IDLE);
+    atomic_store(&worker->lib_generation, 0);
+    pid = fork();
+    if(pid < 0)
+    {
+        perror("fork failed");
+        atomic_store(&worker->state, SLOT_FREE);
+        return;
+    }
+    if(pid == 0)
+    {
+        worker_process(args, slot);
+    }
+    worker->pid = pid;
+    atomic_fetch_add(&args->pool->active, 1);
+    atomic_fetch_add(&args->pool->spawned, 1);
+}
+
+static void grow_pool(const args_t *args, int count)
+{
+    for(int i = 0; i < POOL_MAX_WORKERS && count > 0; i++)
+    {
+        if(atomic_load(&args->pool->slots[i].state) == SLOT_FREE)
+        {
+            spawn_worker(args, i);
+            count--;
+        }
+    }
+}
+
+static void retire_worker(const args_t *args)
+{
+    int slot;
+    int idle = SLOT_IDLE;
+
+    // main picks the worker, since only it knows which channels still hold connections
+    if(!args->reuseport)
+    {
+        atomic_store(&args->pool->retire_requests, 1);
+        return;
+    }
+
+    slot = pool_pick_idle(args->pool);
+
+    // only a worker still idle when we flip it is signalled; a busy one would have its request cut short
+    if(slot >= 0 && atomic_compare_exchange_strong(&args->pool->slots[slot].state, &idle, SLOT_RETIRING))
+    {
+        PRINT_VERBOSE("retiring idle worker %d (PID: %d)\n", slot, args->pool->slots[slot].pid);
+        kill(args->pool->slots[slot].pid, SIGTERM);
+    }
+}
+
+static void reap_workers(const args_t *args, pid_t *applier_pid, pid_t *logger_pid)
+{
+    pid_t exited_pid;
+    int   status;
+
+    while((exited_pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+        if(exited_pid == *applier_pid)
+        {
+            PRINT_VERBOSE("WAL applier (PID: %d) exited. Restarting...\n", exited_pid);
+            *applier_pid = spawn_applier(args->wal, args->respcache);
+            continue;
+        }
+        if(exited_pid == *logger_pid)
+        {
+            PRINT_VERBOSE("access log writer (PID: %d) exited. Restarting...\n", exited_pid);
+            *logger_pid = spawn_logger(args->accesslog);
+            continue;
+        }
+
+        for(int i = 0; i < POOL_MAX_WORKERS; i++)
+        {
+            pool_slot *worker = &args->pool->slots[i];
+
+            if(worker->pid != exited_pid)
+            {
+                continue;
+            }
+            worker->pid = 0;
+            atomic_fetch_sub(&args->pool->active, 1);
+            if(atomic_exchange(&worker->state, SLOT_FREE) == SLOT_RETIRING)
+            {
+                atomic_fetch_add(&args->pool->retired, 1);
+            }
+            else if(running)
+            {
+                PRINT_VERBOSE("Worker (PID: %d) exited. Restarting...\n", exited_pid);
+                spawn_worker(args, i);
+            }
+            break;
+        }
+    }
+}
+
+// Snapshots the new library as the next generation and wakes every worker to move onto it.
+static void publish_lib(const args_t *args, uint64_t *generation)
+{
+    atomic_store(&args->pool->lib_changed_nsec, pool_now_nsec());
+    if(reload_snapshot(getpid(), *generation + 1) == -1)
+    {
+        return;
+    }
+    (*generation)++;
+    atomic_store(&args->pool->lib_generation, *generation);
+    PRINT_VERBOSE("library generation %llu published\n", (unsigned long long)*generation);
+    wake_workers(args);
+}
+
+// The packer renames a finished pack into place, so workers can map it as soon as they hear.
+static void publish_pack(const args_t *args)
+{
+    uint64_t generation = atomic_fetch_add(&args->pool->pack_generation, 1) + 1;
+
+    PRINT_VERBOSE("pack generation %llu published\n", (unsigned long long)generation);
+    wake_workers(args);
+}
+
+// The hot list is read again whenever the document root changes, so replaced files come back in too.
+static void warm_hot_set(const args_t *args)
+{
+    uint64_t bytes;
+    int      warmed = filehint_warm(args->hot_list, DOC_ROOT, &bytes);
+
+    if(warmed == -1)
+    {
+        return;
+    }
+    atomic_store(&args->pool->files_warmed, (uint64_t)warmed);
+    atomic_store(&args->pool->bytes_warmed, bytes);
+    PRINT_VERBOSE("warming %d hot files, %llu bytes\n", warmed, (unsigned long long)bytes);
+}
+
+static void wake_workers(const args_t *args)
+{
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        if(atomic_load(&args->pool->slots[i].state) != SLOT_FREE && args->pool->slots[i].pid > 0)
+        {
+            kill(args->pool->slots[i].pid, SIGUSR1);
+        }
+    }
+}
+
+// A snapshot can go once no live worker can still be about to open it.
+static void remove_snapshots(const args_t *args, uint64_t *oldest, uint64_t generation)
+{
+    while(*oldest < generation)
+    {
+        char path[PATH_MAX];
+
+        for(int i = 0; i < POOL_MAX_WORKERS; i++)
+        {
+            if(atomic_load(&args->pool->slots[i].state) != SLOT_FREE && atomic_load(&args->pool->slots[i].lib_generation) <= *oldest)
+            {
+                return;
+            }
+        }
+        reload_path(path, sizeof(path), getpid(), *oldest);
+        unlink(path);
+        (*oldest)++;
+    }
+}
+
+static _Noreturn void monitor_process(const args_t *args)
+{
+    pool_sampler sampler;
+    pid_t        applier_pid;
+    pid_t        logger_pid;
+    uint64_t     next_tick;
+    uint64_t     generation;
+    uint64_t     oldest;
+    pid_t        parent;
+    int          watch;
+    int          pack_wd;
+    int          tree;
+
+    PRINT_VERBOSE("%s\n", "monitor");
+
+    // Ctrl+C reaches the whole process group; main alone acts on it and stops us in order
+    signal(SIGINT, SIG_IGN);
+    parent = getppid();
+
+    applier_pid = args->wal ? spawn_applier(args->wal, args->respcache) : -1;
+    logger_pid  = args->accesslog ? spawn_logger(args->accesslog) : -1;
+
+    generation = 1;
+    oldest     = 1;
+    if(reload_snapshot(getpid(), generation) == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+    atomic_store(&args->pool->lib_generation, generation);
+    watch = reload_watch(args->pack_path, &pack_wd);
+
+    // workers cache how request paths resolve until anything under the document root changes
+    atomic_store(&args->pool->docroot_generation, 1);
+    tree = reload_watch_tree(DOC_ROOT);
+    if(args->hot_list)
+    {
+        warm_hot_set(args);
+    }
+
+    PRINT_VERBOSE("creating %d %s (up to %d)\n", args->workers, "workers...", args->max_workers);
+    grow_pool(args, args->workers);
+    pool_sampler_init(args->pool, &sampler);
+
+    next_tick = pool_now_nsec() + (uint64_t)POOL_TICK_MSEC * NSEC_PER_MSEC;
+
+    while(running)
+    {
+        struct pollfd pfds[2];
+        uint64_t      now;
+        int           change;
+        int           reloads;
+
+        now            = pool_now_nsec();
+        pfds[0].fd     = watch;
+        pfds[0].events = POLLIN;
+        pfds[1].fd     = tree;
+        pfds[1].events = POLLIN;
+        reloads        = 0;
+        if(poll(pfds, 2, now < next_tick ? (int)((next_tick - now) / NSEC_PER_MSEC) : 0) > 0)
+        {
+            reloads = (pfds[0].revents & POLLIN) ? reload_changed(watch, pack_wd, args->pack_path) : 0;
+            if((pfds[1].revents & POLLIN) && reload_tree_changed(tree, DOC_ROOT))
+            {
+                atomic_fetch_add(&args->pool->docroot_generation, 1);
+                if(args->hot_list)
+                {
+                    warm_hot_set(args);
+                }
+            }
+        }
+        if(reloads & RELOAD_LIB)
+        {
+            publish_lib(args, &generation);
+        }
+        if(reloads & RELOAD_PACK)
+        {
+            publish_pack(args);
+        }
+
+        reap_workers(args, &applier_pid, &logger_pid);
+        if(!running)
+        {
+            break;
+        }
+        if(pool_now_nsec() < next_tick)
+        {
+            continue;
+        }
+        next_tick += (uint64_t)POOL_TICK_MSEC * NSEC_PER_MSEC;
+
+        // main died without stopping us (SIGKILL, crash); nobody is dispatching any more
+        if(getppid() != parent)
+        {
+            break;
+        }
+
+        remove_snapshots(args, &oldest, generation);
+
+        change = pool_sample(args->pool, &sampler);
+        if(change > 0)
+        {
+            PRINT_VERBOSE("pool: queue %llu busy %llu%% p99 %lluus, adding %d\n",
+                          (unsigned long long)atomic_load(&args->pool->last_queue),
+                          (unsigned long long)atomic_load(&args->pool->last_busy_percent),
+                          (unsigned long long)atomic_load(&args->pool->last_p99_usec),
+                          change);
+            grow_pool(args, change);
+        }
+        else if(change < 0)
+        {
+            retire_worker(args);
+        }
+    }
+
+    stop_children(args, applier_pid, logger_pid);
+
+    while(oldest <= generation)
+    {
+        char path[PATH_MAX];
+
+        reload_path(path, sizeof(path), getpid(), oldest++);
+        unlink(path);
+    }
+    exit(EXIT_SUCCESS);
+}
+
+// Busy workers are only marked, so they leave after the request in hand instead of having a read or
+// write interrupted; idle ones and the applier are signalled. Whatever is left at the deadline is killed.
+// The access log writer is stopped last, once no worker is left to log anything.
+static void stop_children(const args_t *args, pid_t applier_pid, pid_t logger_pid)
+{
+    uint64_t deadline = atomic_load(&args->pool->shutdown_deadline_nsec);
+    int      killed   = 0;
+
+    if(deadline == 0)
+    {
+        deadline = pool_now_nsec() + (uint64_t)args->grace_msec * NSEC_PER_MSEC;
+    }
+
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        pool_slot *worker = &args->pool->slots[i];
+
+        if(worker->pid > 0 && atomic_exchange(&worker->state, SLOT_RETIRING) != SLOT_BUSY)
+        {
+            kill(worker->pid, SIGTERM);
+        }
+    }
+    if(applier_pid > 0)
+    {
+        kill(applier_pid, SIGTERM);
+    }
+
+    while(1)
+    {
+        const struct timespec nap = {0, DRAIN_POLL_NSEC};
+        pid_t                 exited_pid;
+
+        if(logger_pid > 0 && !workers_alive(args))
+        {
+            kill(logger_pid, SIGTERM);
+            logger_pid = -1;
+        }
+
+        exited_pid = waitpid(-1, NULL, WNOHANG);
+        if(exited_pid > 0)
+        {
+            for(int i = 0; i < POOL_MAX_WORKERS; i++)
+            {
+                if(args->pool->slots[i].pid == exited_pid)
+                {
+                    args->pool->slots[i].pid = 0;
+                }
+            }
+            continue;
+        }
+        if(exited_pid == -1 && errno != EINTR)
+        {
+            break;
+        }
+        if(pool_now_nsec() >= deadline && killed == 0)
+        {
+            for(int i = 0; i < POOL_MAX_WORKERS; i++)
+            {
+                if(args->pool->slots[i].pid > 0)
+                {
+                    kill(args->pool->slots[i].pid, SIGKILL);
+                    killed++;
+                }
+            }
+            // the applier keeps no state of its own; the log is replayed on the next start
+            if(applier_pid > 0 && kill(applier_pid, SIGKILL) == 0)
+            {
+                killed++;
+            }
+            atomic_store(&args->pool->shutdown_killed, killed);
+        }
+        nanosleep(&nap, NULL);
+    }
+}
+
+static int workers_alive(const args_t *args)
+{
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        if(args->pool->slots[i].pid > 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static pid_t spawn_logger(accesslog_t *log)
+{
+    pid_t pid = fork();
+
+    if(pid < 0)
+    {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if(pid == 0)
+    {
+        accesslog_writer(log);
+    }
+    return pid;
+}
+
+static pid_t spawn_applier(wal_t *wal, respcache_t *cache)
+{
+    pid_t pid = fork();
+
+    if(pid < 0)
+    {
+        perror("fork failed");
+        exit(EXIT_FAILURE);
+    }
+    if(pid == 0)
+    {
+        wal_applier(wal, cache);
+    }
+    return pid;
+}
+
+static fsm_state_t event_loop(void *args);
+
+// Listener i belongs to worker slot i. Main and the monitor keep every one open, so a respawned worker
+// finds its socket, and the group's member order (which the steering program indexes) never changes.
+static int open_listeners(args_t *args)
+{
+    for(int i = 0; i < args->workers; i++)
+    {
+        args->listeners[i] = tcp_server_reuseport(args->addr, args->port, args->backlog, &args->err);
+        if(args->listeners[i] < 0 || args->err != 0)
+        {
+            return -1;
+        }
+        if(args->defer_accept > 0 && setSocketDeferAccept(args->listeners[i], args->defer_accept, &args->err) == -1)
+        {
+            return -1;
+        }
+    }
+
+    if(attach_cpu_steering(args->listeners[0], args->cpus.cpus, args->workers, &args->err) == -1)
+    {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+        return -1;
+    }
+    return 0;
+}
+
+// The new generation's side of an upgrade: everything the old server sent arrives before UPGRADE_END.
+static int take_over(args_t *args, int channel)
+{
+    while(1)
+    {
+        int tag = 0;
+        int fd  = recv_fd(channel, &tag);
+
+        if(fd < 0)
+        {
+            return tag == UPGRADE_END ? 0 : -1;
+        }
+
+        if(tag >= 0 && tag < AFFINITY_MAX_CPUS)
+        {
+            args->listeners[tag] = fd;
+            args->listener_count++;
+        }
+        else if(tag == UPGRADE_BLOOM)
+        {
+            args->bloom_fd = fd;
+            args->bloom    = bloom_attach(fd);
+        }
+        else if(tag == UPGRADE_WAL)
+        {
+            args->wal_fd = fd;
+            args->wal    = wal_attach(fd);
+            if(!args->wal)
+            {
+                return -1;
+            }
+        }
+        else if(tag == UPGRADE_TLS_LISTENER)
+        {
+            args->tls_fd = fd;
+        }
+        else if(tag == UPGRADE_CLIENT && args->client_count < UPGRADE_MAX_CLIENTS)
+        {
+            args->clients[args->client_count++] = fd;
+        }
+        else
+        {
+            close(fd);
+        }
+    }
+}
+
+// Sent once this generation is serving, which is what lets the old one close its listeners.
+static void announce_ready(int *channel)
+{
+    if(*channel >= 0)
+    {
+        send_number(*channel, UPGRADE_READY);
+        close(*channel);
+        *channel = -1;
+    }
+}
+
+// Starts the binary on disk and passes it the listeners, the shared bloom filter and WAL state, and the
+// connections waiting for their next request. Ones already dispatched stay with our workers. The
+// listening sockets are never closed: the new server holds them before we drop our copies.
+static int hand_over(args_t *args, struct pollfd *fds)
+{
+    pid_t pid;
+    int   channel;
+    int   idle;
+
+    upgrade_requested = 0;
+    pid               = upgrade_spawn(args->command, &channel);
+    if(pid == -1)
+    {
+        return -1;
+    }
+
+    if(args->reuseport)
+    {
+        for(int i = 0; i < args->workers; i++)
+        {
+            send_fd(channel, args->listeners[i], i);
+        }
+    }
+    else
+    {
+        send_fd(channel, *args->fd, 0);
+    }
+    if(args->tls_fd >= 0)
+    {
+        send_fd(channel, args->tls_fd, UPGRADE_TLS_LISTENER);
+    }
+    if(args->bloom)
+    {
+        send_fd(channel, args->bloom_fd, UPGRADE_BLOOM);
+    }
+    if(args->wal)
+    {
+        send_fd(channel, args->wal_fd, UPGRADE_WAL);
+    }
+
+    idle = 0;
+    for(int i = FIRST_CLIENT; fds && i < MAX_FDS; i++)
+    {
+        if(fds[i].fd != -1 && fds[i].events == POLLIN)
+        {
+            send_fd(channel, fds[i].fd, UPGRADE_CLIENT);
+            idle++;
+        }
+    }
+    send_number(channel, UPGRADE_END);
+
+    if(upgrade_wait_ready(channel, UPGRADE_READY_TIMEOUT_MSEC) == -1)
+    {
+        fprintf(stderr, "new server (PID: %d) did not take over, keeping this one\n", pid);
+        close(channel);
+        kill(pid, SIGTERM);
+        while(waitpid(pid, NULL, 0) == -1 && errno == EINTR)
+        {
+        }
+        return -1;
+    }
+    close(channel);
+
+    // dispatched connections are held by the worker (or the message in flight to it), so closing our
+    // copies now lets them finish without waiting on this process
+    for(int i = FIRST_CLIENT; fds && i < MAX_FDS; i++)
+    {
+        if(fds[i].fd != -1)
+        {
+            close(fds[i].fd);
+            fds[i].fd = -1;
+        }
+    }
+    printf("Handed over to new server (PID: %d) with %d idle connections\n", pid, idle);
+    args->handed_over = 1;
+    return 0;
+}
+
+// One deadline for the whole shutdown, shared with the monitor through the pool.
+static void start_deadline(const args_t *args)
+{
+    atomic_store(&args->pool->shutdown_deadline_nsec, pool_now_nsec() + (uint64_t)args->grace_msec * NSEC_PER_MSEC);
+}
+
+// After a hand over our copies of the connections are closed, so all that is left is for the workers to
+// pick up what was already dispatched before the monitor stops them.
+static void drain_generation(const args_t *args)
+{
+    uint64_t deadline = atomic_load(&args->pool->shutdown_deadline_nsec);
 
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wpedantic"
-#pragma GCC diagnostic ignored "-Wstrict-prototypes"
-    *func = (void (*)(void *))dlsym(*handle, "fsm_run");
-#pragma GCC diagnostic pop
-    if(!*func)
+    while(atomic_load(&args->pool->received) < atomic_load(&args->pool->dispatched) && pool_now_nsec() < deadline)
     {
-        fprintf(stderr, "dlsym failed: %s\n", dlerror());
-        dlclose(*handle);
-        exit(EXIT_FAILURE);
+        const struct timespec nap = {0, DRAIN_POLL_NSEC};
+
+        nanosleep(&nap, NULL);
     }
 }
 
-static ssize_t is_new_lib(const char *lib_path, time_t *last_modified_time)
+// Stops accepting, closes connections that are between requests and waits, up to the deadline, for the
+// workers to report back on the ones they hold.
+static void drain_connections(args_t *args, struct pollfd *fds, const sigset_t *waiting)
 {
-    struct stat file_stat;
+    uint64_t deadline;
+    int      in_flight;
+
+    start_deadline(args);
+    deadline = atomic_load(&args->pool->shutdown_deadline_nsec);
 
-    if(stat(lib_path, &file_stat) == -1)
+    close(*args->fd);
+    *args->fd = -1;
+    if(args->tls_fd >= 0)
     {
-        perror("check dir is dir");
-        exit(EXIT_FAILURE);
+        close(args->tls_fd);
+        args->tls_fd = -1;
     }
 
-    if(*last_modified_time < file_stat.st_mtime)
+    in_flight = 0;
+    for(int i = FIRST_CLIENT; i < MAX_FDS; i++)
     {
-        *last_modified_time = file_stat.st_mtime;
-        return 1;
+        if(fds[i].fd == -1)
+        {
+            continue;
+        }
+        if(fds[i].events == POLLIN)
+        {
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            args->idle_closed++;
+            continue;
+        }
+        in_flight++;
     }
-    return 0;
+
+    while(in_flight > 0)
+    {
+        uint64_t        now = pool_now_nsec();
+        struct timespec timeout;
+        int             fd_num;
+
+        if(now >= deadline)
+        {
+            break;
+        }
+        timeout.tv_sec  = (time_t)((deadline - now) / (NSEC_PER_MSEC * MSEC_PER_SEC));
+        timeout.tv_nsec = (long)((deadline - now) % (NSEC_PER_MSEC * MSEC_PER_SEC));
+
+        if(ppoll(&fds[1], 1, &timeout, waiting) <= 0 || !(fds[1].revents & POLLIN))
+        {
+            continue;
+        }
+        if(recv_number(fds[1].fd, &fd_num) < 0)
+        {
+            break;
+        }
+        for(int i = FIRST_CLIENT; i < MAX_FDS; i++)
+        {
+            if(fds[i].fd == fd_num)
+            {
+                close(fds[i].fd);
+                fds[i].fd = -1;
+                args->drained++;
+                in_flight--;
+                break;
+            }
+        }
+    }
+
+    // a worker still holds its own copy of these and may yet finish before the monitor's deadline
+    for(int i = FIRST_CLIENT; i < MAX_FDS; i++)
+    {
+        if(fds[i].fd != -1)
+        {
+            close(fds[i].fd);
+            fds[i].fd = -1;
+        }
+    }
+    args->abandoned = in_flight;
 }
 
-static void worker_process(int sockfd, int worker_id)
+// The monitor stops the workers and the applier, killing whatever outlives the deadline.
+static void stop_monitor(args_t *args, pid_t monitor_pid)
 {
-    worker_t   worker_args;
-    time_t     last_modified_time;
-    const char lib_path[] = "./libmylib.so";
-    void      *handle;
-    void (*func)(void *);
+    uint64_t started;
+    int      busy;
+    int      killed;
 
-    memset(&worker_args, 0, sizeof(worker_args));
-    worker_args.sockfd    = sockfd;
-    worker_args.worker_id = worker_id;
-    last_modified_time    = 0;
-    handle                = NULL;
-    func                  = NULL;
+    if(atomic_load(&args->pool->shutdown_deadline_nsec) == 0)
+    {
+        start_deadline(args);
+    }
+    started = atomic_load(&args->pool->shutdown_deadline_nsec) - (uint64_t)args->grace_msec * NSEC_PER_MSEC;
 
-    PRINT_VERBOSE("%s\n", "workers spawned");
+    // without main tracking connections (reuseport), in flight is whatever the workers are serving now
+    busy = 0;
+    for(int i = 0; args->reuseport && i < POOL_MAX_WORKERS; i++)
+    {
+        busy += atomic_load(&args->pool->slots[i].state) == SLOT_BUSY;
+    }
 
-    PRINT_DEBUG("Last modified: %s", ctime(&last_modified_time));
+    kill(monitor_pid, SIGTERM);
+    while(waitpid(monitor_pid, NULL, 0) == -1 && errno == EINTR)
+    {
+    }
 
-    is_new_lib(lib_path, &last_modified_time);
-    load_lib(lib_path, &handle, &func);
+    killed = atomic_load(&args->pool->shutdown_killed);
+    if(args->reuseport)
+    {
+        args->drained   = busy > killed ? busy - killed : 0;
+        args->abandoned = busy - args->drained;
+    }
+    printf("Stopped in %llu ms: %d in-flight requests finished, %d idle connections closed, %d abandoned, %d processes killed at the deadline\n",
+           (unsigned long long)((pool_now_nsec() - started) / NSEC_PER_MSEC),
+           args->drained,
+           args->idle_closed,
+           args->abandoned,
+           killed);
+}
 
-    PRINT_DEBUG("Last modified: %s", ctime(&last_modified_time));
+// Takes everything the kernel has queued rather than one connection per wakeup, so a burst is moved
+// out of the backlog before it can overflow. With every client slot taken the rest stay queued and both
+// listeners are parked until one frees up.
+static void accept_burst(const client_set *clients, int listener, timer_wheel *wheel, timer_entry *timers)
+{
+    struct pollfd *fds     = clients->fds;
+    uint64_t       expires = pool_now_nsec() / NSEC_PER_MSEC + (uint64_t)clients->args->idle_timeout_msec;
+    int            slot    = FIRST_CLIENT;
 
-    while(running)
+    while(1)
     {
-        worker_args.client_fd = recv_fd(sockfd, &worker_args.fd_num);
-        if(worker_args.client_fd <= 0)
+        struct sockaddr_storage peer;
+        socklen_t               peer_len = sizeof(peer);
+        int                     client_fd;
+
+        while(slot < MAX_FDS && fds[slot].fd != -1)
         {
-            perror("recv_fd error");
+            slot++;
+        }
+        if(slot == MAX_FDS)
+        {
+            fds[0].events            = 0;
+            fds[LISTENER_TLS].events = 0;
+            return;
         }
-        PRINT_VERBOSE("Worker %d (PID: %d) started\n", worker_id, getpid());
-        PRINT_VERBOSE("%s fd: %d num: %d\n", "receiving fd from monitor...", worker_args.client_fd, worker_args.fd_num);
 
-        if(is_new_lib(lib_path, &last_modified_time))
+        // no SOCK_NONBLOCK: the worker's reads and writes on the client expect a blocking socket
+        // the peer is only asked for when there are limits to check it against
+        client_fd = accept4(fds[listener].fd, clients->limits ? (struct sockaddr *)&peer : NULL, clients->limits ? &peer_len : NULL, SOCK_CLOEXEC);
+        if(client_fd < 0)
         {
-            PRINT_DEBUG("%s %s", "new lib found! Unloading lib...", ctime(&last_modified_time));
-            dlclose(handle);
+            if(errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if(errno != EAGAIN && errno != EINTR)
+            {
+                perror("Accept failed");
+            }
+            return;
+        }
 
-            load_lib(lib_path, &handle, &func);
+        clients->limit_slot[slot] = -1;
+        if(clients->limits && admit_client(clients, slot, client_fd, &peer, listener == LISTENER_TLS) == -1)
+        {
+            continue;
         }
 
-        func(&worker_args);
+        fds[slot].fd     = client_fd;
+        fds[slot].events = POLLIN;
+        timer_add(wheel, &timers[slot], expires);
     }
-    PRINT_DEBUG("%s\n", "worker exiting, unloading lib...");
-    dlclose(handle);
 }
 
-static fsm_state_t event_loop(void *args);
+// Checked before the connection takes a client slot. Whatever the client already sent is read and
+// dropped so the close does not turn into a reset that loses the answer; a TLS client gets no answer
+// since it expects a handshake.
+static int admit_client(const client_set *clients, int slot, int client_fd, const struct sockaddr_storage *peer, int tls)
+{
+    char              discard[REFUSED_DRAIN_SIZE];
+    ratelimit_verdict verdict;
+    const char       *response;
+    size_t            len;
+
+    verdict = ratelimit_admit(clients->limits, peer, pool_now_nsec(), &clients->limit_slot[slot]);
+    if(verdict == RATELIMIT_PASS)
+    {
+        return 0;
+    }
+
+    if(verdict == RATELIMIT_RATE)
+    {
+        response = too_many_requests;
+        len      = sizeof(too_many_requests) - 1;
+        atomic_fetch_add(&clients->args->pool->limited_requests, 1);
+    }
+    else
+    {
+        response = too_many_connections;
+        len      = sizeof(too_many_connections) - 1;
+        atomic_fetch_add(&clients->args->pool->limited_connections, 1);
+    }
+    if(!tls)
+    {
+        recv(client_fd, discard, sizeof(discard), MSG_DONTWAIT);
+        send(client_fd, response, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    }
+    close(client_fd);
+    return -1;
+}
+
+static void close_client(const client_set *clients, int i)
+{
+    close(clients->fds[i].fd);
+    clients->fds[i].fd     = -1;
+    clients->fds[i].events = 0;
+    ratelimit_release(clients->limits, clients->limit_slot[i]);
+    clients->limit_slot[i] = -1;
+}
+
+// The connection has sat in our poll set for the whole idle timeout without sending a byte.
+static void expire_idle(timer_entry *entry, void *ctx)
+{
+    const client_set *clients = (const client_set *)ctx;
+
+    PRINT_VERBOSE("%s fd: %d\n", "idle timeout, closing", clients->fds[entry->id].fd);
+    close_client(clients, entry->id);
+    atomic_fetch_add(&clients->args->pool->idle_timeouts, 1);
+}
+
+// The monitor asked for one fewer worker. The one chosen has nothing queued, is never sent anything
+// again, and is woken by an empty message to notice it is retiring.
+static void retire_dispatch(const args_t *args, const pool_dispatch *dispatch)
+{
+    int slot;
+
+    atomic_store(&args->pool->retire_requests, 0);
+    slot = pool_pick_retiree(args->pool, dispatch);
+    if(slot >= 0)
+    {
+        PRINT_VERBOSE("retiring idle worker %d (PID: %d)\n", slot, args->pool->slots[slot].pid);
+        send_number(args->channels[slot][1], -1);
+    }
+}
 
 static fsm_state_t event_loop(void *args)
 {
-    args_t       *server_args = (args_t *)args;
-    struct pollfd fds[MAX_FDS];
-    int           client_fd;
-    int           added;
+    args_t         *server_args = (args_t *)args;
+    struct pollfd   fds[MAX_FDS];
+    int             owner[MAX_FDS];
+    pool_dispatch   dispatch;
+    timer_wheel     wheel;
+    timer_entry     timers[MAX_FDS];
+    int             limit_slot[MAX_FDS];
+    client_set      clients;
+    struct timespec tick;
+    sigset_t        upgrade_mask;
+    sigset_t        waiting;
 
     PRINT_DEBUG("%s%d\n", "event loop: ", running);
 
+    memset(&dispatch, 0, sizeof(dispatch));
+    memset(owner, 0, sizeof(owner));
+    memset(timers, 0, sizeof(timers));
+    timer_init(&wheel, pool_now_nsec() / NSEC_PER_MSEC);
+    clients.args       = server_args;
+    clients.fds        = fds;
+    clients.limit_slot = limit_slot;
+    clients.limits     = NULL;
+    if(server_args->rate_limit > 0 || server_args->client_conns > 0)
+    {
+        clients.limits = ratelimit_create((uint32_t)server_args->rate_limit, (uint32_t)server_args->rate_burst, (uint32_t)server_args->client_conns, server_args->limit_prefix4, server_args->limit_prefix6);
+    }
+
+    // SIGUSR2 is only let in while waiting, so a request arriving between checks is never missed
+    sigemptyset(&upgrade_mask);
+    sigaddset(&upgrade_mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &upgrade_mask, &waiting);
+
     fds[0].fd     = *server_args->fd;
     fds[0].events = POLLIN;
 
     fds[1].fd     = server_args->sockfd[1];
     fds[1].events = POLLIN;
 
-    for(int i = 2; i < MAX_FDS; i++)
+    // -1 without HTTPS, which poll skips
+    fds[LISTENER_TLS].fd     = server_args->tls_fd;
+    fds[LISTENER_TLS].events = POLLIN;
+
+    for(int i = FIRST_CLIENT; i < MAX_FDS; i++)
+    {
+        fds[i].fd     = -1;
+        fds[i].events = 0;
+        timers[i].id  = i;
+        limit_slot[i] = -1;
+    }
+
+    // idle connections handed over by the generation we replaced, given a fresh idle timeout
+    for(int i = 0; i < server_args->client_count; i++)
     {
-        fds[i].fd = -1;
+        fds[i + FIRST_CLIENT].fd     = server_args->clients[i];
+        fds[i + FIRST_CLIENT].events = POLLIN;
+        timer_add(&wheel, &timers[i + FIRST_CLIENT], pool_now_nsec() / NSEC_PER_MSEC + (uint64_t)server_args->idle_timeout_msec);
     }
 
     while(running)
     {
         ssize_t retval;
+        long    msec;
 
-        retval = poll(fds, MAX_FDS, -1);
-        if(retval == -1)
+        if(upgrade_requested && hand_over(server_args, fds) == 0)
         {
-            if(errno == EINTR)
-            {
-                break;
-            }
-            perror("poll error");
             break;
         }
-        if(fds[0].revents & POLLIN)
-        {
-            client_fd = accept(*server_args->fd, NULL, NULL);
-            if(client_fd < 0)
-            {
-                if(errno == EINTR)
-                {
-                    break;
-                }
-                perror("Accept failed");
-                continue;
-            }
 
-            // Add new client to poll list
-            added = 0;
-            for(int i = 1; i < MAX_FDS; i++)
+        // the listeners were parked by accept_burst with every client slot taken
+        for(int i = FIRST_CLIENT; fds[0].events == 0 && i < MAX_FDS; i++)
+        {
+            if(fds[i].fd == -1)
             {
-                if(fds[i].fd == -1)
-                {
-                    fds[i].fd     = client_fd;
-                    fds[i].events = POLLIN;
-                    added         = 1;
-                    break;
-                }
+                fds[0].events            = POLLIN;
+                fds[LISTENER_TLS].events = POLLIN;
             }
-            if(!added)
-            {
-                const char too_many[] = "Too many clients, rejecting connection\n";
+        }
 
-                printf("%s", too_many);
-                // write_fully(client_fd, &too_many, (ssize_t)strlen(too_many), &server_args->err);
+        if(atomic_load(&server_args->pool->retire_requests) > 0)
+        {
+            retire_dispatch(server_args, &dispatch);
+        }
 
-                close(client_fd);
+        // woken at least once a tick so a retire request is not held up by a quiet listener, and
+        // sooner when the wheel has a connection due to time out
+        msec         = timer_next_msec(&wheel, pool_now_nsec() / NSEC_PER_MSEC, POOL_TICK_MSEC);
+        tick.tv_sec  = msec / (long)MSEC_PER_SEC;
+        tick.tv_nsec = (long)((uint64_t)(msec % (long)MSEC_PER_SEC) * NSEC_PER_MSEC);
+        retval       = ppoll(fds, MAX_FDS, &tick, &waiting);
+        if(retval == -1)
+        {
+            if(errno == EINTR)
+            {
                 continue;
             }
+            perror("poll error");
+            break;
+        }
+        if(fds[0].revents & POLLIN)
+        {
+            accept_burst(&clients, 0, &wheel, timers);
+        }
+        if(fds[LISTENER_TLS].revents & POLLIN)
+        {
+            accept_burst(&clients, LISTENER_TLS, &wheel, timers);
         }
         if(fds[1].revents & POLLIN)
         {
@@ -189,52 +1567,74 @@ static fsm_state_t event_loop(void *args)
 
             PRINT_VERBOSE("%s fd: %d \n", "receiving fd from worker...", fd_num);
 
-            for(int i = 2; i < MAX_CLIENTS; i++)
+            for(int i = FIRST_CLIENT; i < MAX_FDS; i++)
             {
-                if(fds[i].fd == fd_num)
+                if(fds[i].fd == fd_num && fds[i].events == 0)
                 {
                     PRINT_VERBOSE("%s fd: %d \n", "closing fd server side...", fds[i].fd);
-                    close(fds[i].fd);
-                    fds[i].fd     = -1;
-                    fds[i].events = 0;
+                    dispatch.in_flight[owner[i]]--;
+                    close_client(&clients, i);
                     continue;
                 }
             }
         }
         // Check existing clients for data
-        for(int i = 2; i < MAX_FDS; i++)
+        for(int i = FIRST_CLIENT; i < MAX_FDS; i++)
         {
             if(fds[i].fd != -1)
             {
-                if(fds[i].revents & POLLIN)
+                if(fds[i].events != 0 && fds[i].revents & POLLIN)
                 {
-                    PRINT_VERBOSE("%s fd: %d num: %d\n", "Dispatching to workers...", fds[i].fd, fds[i].fd);
+                    int slot = pool_pick_worker(server_args->pool, &dispatch);
+
+                    PRINT_VERBOSE("%s fd: %d num: %d worker: %d\n", "Dispatching to workers...", fds[i].fd, fds[i].fd, slot);
 
                     fds[i].events = 0;
-                    send_fd(server_args->sockfd[1], fds[i].fd, fds[i].fd);
+                    timer_cancel(&wheel, &timers[i]);
+                    if(send_fd(server_args->channels[slot][1], fds[i].fd, fds[i].fd) == -1)
+                    {
+                        close_client(&clients, i);
+                        continue;
+                    }
+                    owner[i] = slot;
+                    dispatch.in_flight[slot]++;
+                    pool_dispatched(server_args->pool);
+                    continue;
                 }
 
-                if(fds[i].revents & (POLLHUP | POLLERR))
+                // a dispatched connection is the worker's until it reports back
+                if(fds[i].events != 0 && fds[i].revents & (POLLHUP | POLLERR))
                 {
                     // Client disconnected or error, close and clean up
                     printf("oops...\n");
-                    close(fds[i].fd);
-                    fds[i].fd     = -1;
-                    fds[i].events = 0;
+                    timer_cancel(&wheel, &timers[i]);
+                    close_client(&clients, i);
                     continue;
                 }
             }
         }
+
+        // after the events, so a request arriving on its last tick is still served
+        timer_advance(&wheel, pool_now_nsec() / NSEC_PER_MSEC, expire_idle, &clients);
     }
+
+    if(!server_args->handed_over)
+    {
+        drain_connections(server_args, fds, &waiting);
+    }
+    free(clients.limits);
     return END;
 }
 
 int main(int argc, char *argv[], const char *envp[])
 {
-    int    retval;
-    args_t args;
-    int    server_fd;
-    pid_t  monitor_pid;
+    int      retval;
+    args_t   args;
+    int      server_fd;
+    pid_t    monitor_pid;
+    int      channel;
+    sigset_t upgrade_mask;
+    sigset_t waiting;
 
     while(*envp)
     {
@@ -249,20 +1649,139 @@ int main(int argc, char *argv[], const char *envp[])
     retval = EXIT_SUCCESS;
 
     memset(&args, 0, sizeof(args_t));
+    args.bloom_fd = -1;
+    args.wal_fd   = -1;
+    args.tls_fd   = -1;
 
     get_arguments(&args, argc, argv);
+    args.command = argv;
 
     printf("verbose: %d\n", verbose);
     printf("running: %d\n", running);
     PRINT_VERBOSE("%s\n", "verbose on");
     PRINT_DEBUG("%s\n", "debug on");
 
+    // started by an older server handing over: its listeners and shared state replace our own setup
+    channel = upgrade_channel();
+    if(channel >= 0)
+    {
+        if(take_over(&args, channel) == -1)
+        {
+            fprintf(stderr, "%s\n", "Failed to take over from the previous server");
+            exit(EXIT_FAILURE);
+        }
+        printf("Taking over %d listeners and %d idle connections\n", args.listener_count, args.client_count);
+        if(args.reuseport && args.listener_count > 0)
+        {
+            args.workers     = args.listener_count;
+            args.max_workers = args.listener_count;
+        }
+    }
+
+    // an inherited log is live: the old generation is still committing to it, so it is not replayed
+    if(args.wal_mode && !args.wal)
+    {
+        wal_mode mode;
+
+        wal_parse_mode(args.wal_mode, &mode);
+        args.wal = wal_create(USER_DB, mode, args.commit_window, &args.wal_fd);
+        if(!args.wal || wal_recover(args.wal, &args.err) < 0)
+        {
+            fprintf(stderr, "Error recovering write-ahead log: %s\n", strerror(args.err));
+            exit(EXIT_FAILURE);
+        }
+        PRINT_VERBOSE("write-ahead log: %s (%s)\n", args.wal->path, args.wal_mode);
+    }
+
+    // Built before forking so the monitor and every worker share the same bits.
+    if(!args.bloom)
+    {
+        args.bloom = bloom_from_database(USER_DB, &args.bloom_fd, &args.err);
+    }
+    if(!args.bloom)
+    {
+        fprintf(stderr, "bloom filter unavailable, every lookup will hit the database\n");
+        args.err = 0;
+    }
+
+    args.pool = pool_create(args.workers, args.max_workers);
+    if(!args.pool)
+    {
+        exit(EXIT_FAILURE);
+    }
+    args.pool->threads = args.threads;
+
+    // opened before forking so every worker appends through the same descriptor
+    if(args.capture_path)
+    {
+        args.capture = capture_create(args.capture_path, (unsigned)args.capture_sample);
+        if(!args.capture)
+        {
+            exit(EXIT_FAILURE);
+        }
+        PRINT_VERBOSE("capturing one connection in %ld to %s\n", args.capture_sample, args.capture->path);
+    }
+    if(args.accesslog_path)
+    {
+        args.accesslog = accesslog_create(args.accesslog_path, args.max_workers, args.threads, (uint64_t)args.rotate_mb * BYTES_PER_MB, args.rotate_sec);
+        if(!args.accesslog)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if(args.cache_mb > 0)
+    {
+        args.respcache = respcache_create((size_t)args.cache_mb * BYTES_PER_MB);
+        if(!args.respcache)
+        {
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // before any worker forks, so all of them share the session ticket keys
+    if(args.tls_port != 0)
+    {
+        args.tls = tls_context(args.tls_cert, args.tls_key);
+        if(!args.tls)
+        {
+            fprintf(stderr, "main::tls_context: Failed to load %s and %s\n", args.tls_cert, args.tls_key);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // The placement is inherited by the monitor and every worker; workers then narrow it to one CPU.
+    if(args.pin)
+    {
+        affinity_pin_set(&args.cpus);
+        affinity_local_memory();
+    }
+
+    if(args.reuseport && args.listener_count == 0 && open_listeners(&args) == -1)
+    {
+        fprintf(stderr, "main::open_listeners: Failed to create reuseport listeners. %s\n", strerror(args.err));
+        return EXIT_FAILURE;
+    }
+
     if(socketpair(AF_UNIX, SOCK_STREAM, 0, args.sockfd) == -1)
     {
         fprintf(stderr, "Error creating socket pair\n");
         retval = EXIT_FAILURE;
     }
 
+    // one dispatch channel per slot the pool may ever fill, so a worker only ever receives what main
+    // chose to give it; reuseport workers accept for themselves and need none
+    for(int i = 0; i < POOL_MAX_WORKERS; i++)
+    {
+        args.channels[i][0] = -1;
+        args.channels[i][1] = -1;
+        if(!args.reuseport && i < args.max_workers && socketpair(AF_UNIX, SOCK_STREAM, 0, args.channels[i]) == -1)
+        {
+            perror("dispatch channel");
+            exit(EXIT_FAILURE);
+        }
+    }
+
     monitor_pid = fork();
 
     if(monitor_pid == -1)
@@ -274,85 +1793,111 @@ int main(int argc, char *argv[], const char *envp[])
     // monitor
     if(monitor_pid == 0)
     {
-        pid_t *pids;
-
-        pids = (pid_t *)malloc((size_t)args.workers * sizeof(pid_t));
-        if(!pids)
+        // inherited sockets belong to main; a copy here would keep them open after main closes them
+        if(channel >= 0)
         {
-            fprintf(stderr, "failed to malloc\n");
-            exit(EXIT_FAILURE);
+            close(channel);
         }
-
-        PRINT_VERBOSE("%s\n", "monitor");
-
-        PRINT_VERBOSE("creating %d %s\n", args.workers, "workers...");
-        // workers
-        for(int i = 0; i < args.workers; i++)
+        // and so do main's ends of the channels, which workers must see close if main goes away
+        close(args.sockfd[1]);
+        for(int i = 0; i < POOL_MAX_WORKERS; i++)
         {
-            pids[i] = fork();
-            if(pids[i] < 0)
-            {
-                perror("fork failed");
-                exit(EXIT_FAILURE);
-            }
-            else if(pids[i] == 0)
+            if(args.channels[i][1] >= 0)
             {
-                worker_process(args.sockfd[0], i);
+                close(args.channels[i][1]);
             }
         }
+        for(int i = 0; i < args.client_count; i++)
+        {
+            close(args.clients[i]);
+        }
+        if(!args.reuseport && args.listener_count > 0)
+        {
+            close(args.listeners[0]);
+        }
+        if(args.tls_fd >= 0)
+        {
+            close(args.tls_fd);
+        }
+        monitor_process(&args);
+    }
+    else if(args.reuseport)
+    {
+        printf("Listening on %s:%d with %d per-CPU listeners\n", args.addr, args.port, args.workers);
+        announce_ready(&channel);
 
+        // the kernel hands connections to the workers directly; main only holds the group open
+        sigemptyset(&upgrade_mask);
+        sigaddset(&upgrade_mask, SIGUSR2);
+        sigprocmask(SIG_BLOCK, &upgrade_mask, &waiting);
         while(running)
         {
-            int status;
-
-            pid_t exited_pid = waitpid(-1, &status, 0);
-
-            if(exited_pid > 0)
+            if(upgrade_requested && hand_over(&args, NULL) == 0)
             {
-                PRINT_VERBOSE("Worker (PID: %d) exited. Restarting...\n", exited_pid);
-
-                PRINT_VERBOSE("%s\n", "creating workers...");
-                for(int i = 0; i < args.workers; i++)
-                {
-                    if(pids[i] == exited_pid)
-                    {
-                        pids[i] = fork();
-                        if(pids[i] < 0)
-                        {
-                            perror("fork failed");
-                            exit(EXIT_FAILURE);
-                        }
-                        else if(pids[i] == 0)
-                        {
-                            worker_process(args.sockfd[0], i);
-                        }
-                        break;
-                    }
-                }
+                break;
             }
+            sigsuspend(&waiting);
         }
 
-        free(pids);
-        exit(EXIT_SUCCESS);
+        for(int i = 0; i < args.workers; i++)
+        {
+            close(args.listeners[i]);
+        }
     }
     else
     {
-        server_fd = tcp_server(args.addr, args.port, BACKLOG, &args.err);
+        server_fd = args.listener_count > 0 ? args.listeners[0] : tcp_server(args.addr, args.port, args.backlog, &args.err);
         if(server_fd < 0)
         {
             fprintf(stderr, "main::tcp_server: Failed to create TCP server. %d\n", args.err);
             return EXIT_FAILURE;
         }
 
+        // accept_burst drains the queue until EAGAIN
+        if(setSocketNonBlocking(server_fd, &args.err) == -1 || (args.defer_accept > 0 && setSocketDeferAccept(server_fd, args.defer_accept, &args.err) == -1))
+        {
+            fprintf(stderr, "main::tcp_server: Failed to set up the listener. %s\n", strerror(args.err));
+            return EXIT_FAILURE;
+        }
+
+        if(args.tls_port != 0 && args.tls_fd < 0)
+        {
+            args.tls_fd = tcp_server(args.addr, args.tls_port, args.backlog, &args.err);
+            if(args.tls_fd < 0 || setSocketNonBlocking(args.tls_fd, &args.err) == -1 || (args.defer_accept > 0 && setSocketDeferAccept(args.tls_fd, args.defer_accept, &args.err) == -1))
+            {
+                fprintf(stderr, "main::tcp_server: Failed to create the HTTPS listener. %s\n", strerror(args.err));
+                return EXIT_FAILURE;
+            }
+        }
+
         printf("Listening on %s:%d\n", args.addr, args.port);
+        if(args.tls_fd >= 0)
+        {
+            printf("Listening for HTTPS on %s:%d\n", args.addr, args.tls_port);
+        }
 
         args.fd = &server_fd;
+        announce_ready(&channel);
 
         event_loop(&args);
 
         memset(args.buf, 0, BUF_SIZE);
-        close(server_fd);
+        if(server_fd >= 0)
+        {
+            close(server_fd);
+        }
+        if(args.tls_fd >= 0)
+        {
+            close(args.tls_fd);
+        }
+    }
+
+    if(args.handed_over)
+    {
+        start_deadline(&args);
+        drain_generation(&args);
     }
+    stop_monitor(&args, monitor_pid);
 
     return retval;
 }
@@ -0,0 +1,620 @@
+#include "shmdb.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define LOAD_NUM 7
+#define LOAD_DEN 10
+#define SPIN_LIMIT 1000000
+#define SPINS_BEFORE_CHECK 1024
+#define TMP_SUFFIX ".tmp"
+
+_Static_assert(SHMDB_HEADER_SIZE % _Alignof(shmdb_slot) == 0, "slots must start aligned after the header");
+
+typedef struct shmdb_table
+{
+    char          path[PATH_MAX];
+    int           fd;
+    pid_t         pid;
+    size_t        size;
+    shmdb_header *header;
+    shmdb_slot   *slots;
+} shmdb_table;
+
+// One mapping per process, kept across requests so lookups never touch the filesystem. pid is the
+// process that opened fd: a forked child shares the open file description, and with it the flock, so
+// it must open its own before it can lock against its parent or siblings.
+static shmdb_table table = {.path = {0}, .fd = -1, .pid = 0, .size = 0, .header = NULL, .slots = NULL};
+
+// Threads of a worker share the mapping: lookups hold it shared, while stores and remaps hold it
+// exclusively, since flock cannot tell threads of one process apart.
+static pthread_rwlock_t table_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static uint32_t shmdb_hash(const void *key, size_t size);
+static size_t   shmdb_file_size(uint64_t capacity);
+static ssize_t  shmdb_map(shmdb_table *t, int fd, uint64_t capacity, int *err);
+static void     shmdb_unmap(shmdb_table *t);
+static ssize_t  shmdb_attach(const char *path, int *err);
+static int      shmdb_current(const char *path);
+static int      shmdb_replaced(int fd, const char *path);
+static ssize_t  shmdb_ensure(const char *name, int *err);
+static ssize_t  shmdb_share(const char *name, int *err);
+static ssize_t  shmdb_lock(int *err);
+static void     shmdb_repair(const shmdb_table *t);
+static int      shmdb_wait(const shmdb_slot *slot, uint32_t *seq, int *spins);
+static ssize_t  shmdb_grow(int *err);
+static void     shmdb_write_slot(shmdb_slot *slot, uint32_t hash, const void *key, size_t k_size, const void *value, size_t v_size);
+static ssize_t  shmdb_open(DBO *dbo, int *err);
+static void     shmdb_close(DBO *dbo);
+static int      shmdb_store(DBO *dbo, const void *key, size_t k_size, const void *value, size_t v_size);
+static void    *shmdb_fetch(DBO *dbo, const void *key, size_t k_size, size_t *v_size);
+static void    *shmdb_lookup(const void *key, size_t k_size, size_t *v_size);
+static int      shmdb_foreach(DBO *dbo, db_key_func func, void *ctx);
+
+const db_backend shm_backend = {"shm", shmdb_open, shmdb_close, shmdb_store, shmdb_fetch, shmdb_foreach};
+
+static uint32_t shmdb_hash(const void *key, size_t size)
+{
+    const unsigned char *p    = (const unsigned char *)key;
+    uint32_t             hash = FNV_OFFSET;
+
+    for(size_t i = 0; i < size; i++)
+    {
+        hash ^= p[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static size_t shmdb_file_size(uint64_t capacity)
+{
+    return SHMDB_HEADER_SIZE + (size_t)capacity * sizeof(shmdb_slot);
+}
+
+// Maps fd into t, sizing it for capacity slots if the file is empty. Caller holds an exclusive flock.
+static ssize_t shmdb_map(shmdb_table *t, int fd, uint64_t capacity, int *err)
+{
+    struct stat file_stat;
+    void       *addr;
+    int         fresh;
+
+    if(fstat(fd, &file_stat) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    fresh = file_stat.st_size == 0;
+    if(fresh)
+    {
+        if(ftruncate(fd, (off_t)shmdb_file_size(capacity)) == -1)
+        {
+            *err = errno;
+            return -1;
+        }
+        file_stat.st_size = (off_t)shmdb_file_size(capacity);
+    }
+
+    addr = mmap(NULL, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(addr == MAP_FAILED)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    t->fd     = fd;
+    t->pid    = getpid();
+    t->size   = (size_t)file_stat.st_size;
+    t->header = (shmdb_header *)addr;
+    t->slots  = (shmdb_slot *)(void *)((char *)addr + SHMDB_HEADER_SIZE);
+
+    if(fresh)
+    {
+        t->header->magic    = SHMDB_MAGIC;
+        t->header->version  = SHMDB_VERSION;
+        t->header->capacity = capacity;
+        atomic_store(&t->header->count, 0);
+        atomic_store(&t->header->moved, 0);
+        atomic_store(&t->header->writing, 0);
+    }
+
+    if(t->header->magic != SHMDB_MAGIC || t->header->version != SHMDB_VERSION || shmdb_file_size(t->header->capacity) != t->size)
+    {
+        fprintf(stderr, "shmdb: %s is not a valid table\n", t->path);
+        munmap(addr, t->size);
+        t->header = NULL;
+        t->slots  = NULL;
+        *err      = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+static void shmdb_unmap(shmdb_table *t)
+{
+    if(t->header)
+    {
+        munmap(t->header, t->size);
+    }
+    if(t->fd != -1)
+    {
+        close(t->fd);
+    }
+    t->fd     = -1;
+    t->size   = 0;
+    t->header = NULL;
+    t->slots  = NULL;
+}
+
+static ssize_t shmdb_attach(const char *path, int *err)
+{
+    int fd;
+
+    shmdb_unmap(&table);
+    strncpy(table.path, path, sizeof(table.path) - 1);
+
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd == -1)
+    {
+        perror("shmdb open");
+        *err = errno;
+        return -1;
+    }
+
+    if(flock(fd, LOCK_EX) == -1)
+    {
+        *err = errno;
+        close(fd);
+        return -1;
+    }
+
+    if(shmdb_map(&table, fd, SHMDB_CAPACITY, err) == -1)
+    {
+        close(fd);
+        table.fd = -1;
+        return -1;
+    }
+
+    flock(fd, LOCK_UN);
+    PRINT_DEBUG("shmdb: mapped %s (%llu slots)\n", path, (unsigned long long)table.header->capacity);
+    return 0;
+}
+
+// Fast path: same file, opened by this process, and nobody has grown it since we mapped it.
+static int shmdb_current(const char *path)
+{
+    return table.header && table.pid == getpid() && strcmp(table.path, path) == 0 && !atomic_load_explicit(&table.header->moved, memory_order_acquire);
+}
+
+// Caller holds table_lock exclusively.
+static ssize_t shmdb_ensure(const char *name, int *err)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s%s", name, SHMDB_SUFFIX);
+
+    if(shmdb_current(path))
+    {
+        return 0;
+    }
+    return shmdb_attach(path, err);
+}
+
+// Returns holding table_lock shared over a current mapping, remapping first if it has moved.
+static ssize_t shmdb_share(const char *name, int *err)
+{
+    char path[PATH_MAX];
+
+    snprintf(path, sizeof(path), "%s%s", name, SHMDB_SUFFIX);
+
+    while(1)
+    {
+        ssize_t result;
+
+        pthread_rwlock_rdlock(&table_lock);
+        if(shmdb_current(path))
+        {
+            return 0;
+        }
+        pthread_rwlock_unlock(&table_lock);
+
+        pthread_rwlock_wrlock(&table_lock);
+        result = shmdb_ensure(name, err);
+        pthread_rwlock_unlock(&table_lock);
+        if(result == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+// Whether path no longer names the file open on fd, because a grown table was renamed over it.
+static int shmdb_replaced(int fd, const char *path)
+{
+    struct stat mapped;
+    struct stat named;
+
+    if(fstat(fd, &mapped) == -1 || stat(path, &named) == -1)
+    {
+        return 1;
+    }
+    return mapped.st_ino != named.st_ino || mapped.st_dev != named.st_dev;
+}
+
+// Single writer: flock the current file, chasing renames until we hold the live one. moved is only a
+// hint; a grower that died between its rename and setting it leaves the inode as the sole witness,
+// and the flag is then set here for the other processes still on the old file.
+static ssize_t shmdb_lock(int *err)
+{
+    char path[PATH_MAX];
+
+    memcpy(path, table.path, sizeof(path));
+
+    while(1)
+    {
+        if(flock(table.fd, LOCK_EX) == -1)
+        {
+            *err = errno;
+            return -1;
+        }
+        if(!atomic_load_explicit(&table.header->moved, memory_order_acquire))
+        {
+            if(!shmdb_replaced(table.fd, path))
+            {
+                shmdb_repair(&table);
+                return 0;
+            }
+            atomic_store_explicit(&table.header->moved, 1, memory_order_release);
+        }
+        flock(table.fd, LOCK_UN);
+        if(shmdb_attach(path, err) == -1)
+        {
+            return -1;
+        }
+    }
+}
+
+// A store that died mid-copy leaves its slot odd, and readers skip over it until this closes it. A
+// key that was new is dropped; one that was being rewritten keeps its key but not the torn value.
+// Caller holds the flock.
+static void shmdb_repair(const shmdb_table *t)
+{
+    uint64_t    writing = atomic_load(&t->header->writing);
+    shmdb_slot *slot;
+    uint32_t    seq;
+
+    if(writing == 0 || writing > t->header->capacity)
+    {
+        return;
+    }
+    slot = &t->slots[writing - 1];
+    seq  = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if(seq & 1u)
+    {
+        if(seq == 1)
+        {
+            atomic_store_explicit(&slot->seq, 0, memory_order_release);
+        }
+        else
+        {
+            slot->v_size = 0;
+            atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+        }
+        fprintf(stderr, "shmdb: repaired slot %llu left open by a dead writer\n", (unsigned long long)(writing - 1));
+    }
+    atomic_store(&t->header->writing, 0);
+}
+
+// Waits for a slot to leave a write. Returns 0 once *seq is even, -1 when the writer looks dead (no
+// flock is held on the table) or the wait has gone on too long; the slot is then skipped.
+static int shmdb_wait(const shmdb_slot *slot, uint32_t *seq, int *spins)
+{
+    while(*seq & 1u)
+    {
+        if(++*spins > SPIN_LIMIT)
+        {
+            return -1;
+        }
+        if(*spins % SPINS_BEFORE_CHECK == 0)
+        {
+            // readers hold table_lock, so no thread of ours is the writer
+            if(flock(table.fd, LOCK_SH | LOCK_NB) == 0)
+            {
+                flock(table.fd, LOCK_UN);
+                return -1;
+            }
+            sched_yield();
+        }
+        *seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    }
+    return 0;
+}
+
+// Rehash into a temp file twice the size, sync it, rename it into place, then flag the old one.
+// A crash at any point leaves either the old or the complete new table under the real name.
+static ssize_t shmdb_grow(int *err)
+{
+    shmdb_table grown;
+    char        tmp_path[PATH_MAX + sizeof(TMP_SUFFIX)];
+    uint64_t    capacity;
+    int         fd;
+
+    capacity = table.header->capacity * 2;
+    snprintf(tmp_path, sizeof(tmp_path), "%s%s", table.path, TMP_SUFFIX);
+
+    fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    if(fd == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    if(flock(fd, LOCK_EX) == -1)
+    {
+        *err = errno;
+        close(fd);
+        return -1;
+    }
+
+    memcpy(grown.path, table.path, sizeof(grown.path));
+    grown.header = NULL;
+    if(shmdb_map(&grown, fd, capacity, err) == -1)
+    {
+        close(fd);
+        return -1;
+    }
+
+    for(uint64_t i = 0; i < table.header->capacity; i++)
+    {
+        const shmdb_slot *old = &table.slots[i];
+        uint64_t          j;
+
+        if(atomic_load_explicit(&old->seq, memory_order_relaxed) == 0)
+        {
+            continue;
+        }
+
+        j = old->hash & (capacity - 1);
+        while(atomic_load_explicit(&grown.slots[j].seq, memory_order_relaxed) != 0)
+        {
+            j = (j + 1) & (capacity - 1);
+        }
+        shmdb_write_slot(&grown.slots[j], old->hash, old->key, old->k_size, old->value, old->v_size);
+    }
+    atomic_store(&grown.header->count, atomic_load(&table.header->count));
+
+    if(msync(grown.header, grown.size, MS_SYNC) == -1 || rename(tmp_path, table.path) == -1)
+    {
+        *err = errno;
+        shmdb_unmap(&grown);
+        unlink(tmp_path);
+        return -1;
+    }
+
+    atomic_store_explicit(&table.header->moved, 1, memory_order_release);
+    PRINT_VERBOSE("shmdb: grew %s to %llu slots\n", table.path, (unsigned long long)capacity);
+
+    // Still holding the new file's lock, so nobody else can write to it before we do.
+    shmdb_unmap(&table);
+    table = grown;
+    return 0;
+}
+
+static void shmdb_write_slot(shmdb_slot *slot, uint32_t hash, const void *key, size_t k_size, const void *value, size_t v_size)
+{
+    uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    slot->hash   = hash;
+    slot->k_size = (uint16_t)k_size;
+    slot->v_size = (uint16_t)v_size;
+    memcpy(slot->key, key, k_size);
+    memcpy(slot->value, value, v_size);
+
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+static ssize_t shmdb_open(DBO *dbo, int *err)
+{
+    ssize_t result;
+
+    pthread_rwlock_wrlock(&table_lock);
+    result = shmdb_ensure(dbo->name, err);
+    pthread_rwlock_unlock(&table_lock);
+    if(result == -1)
+    {
+        return -1;
+    }
+    dbo->db = &table;
+    return 0;
+}
+
+static void shmdb_close(DBO *dbo)
+{
+    // The mapping is reused by the next request; it is released when the process exits.
+    dbo->db = NULL;
+}
+
+static int shmdb_store(DBO *dbo, const void *key, size_t k_size, const void *value, size_t v_size)
+{
+    uint32_t hash;
+    uint64_t mask;
+    uint64_t i;
+    int      err;
+
+    if(k_size > SHMDB_KEY_SIZE || v_size > SHMDB_VALUE_SIZE)
+    {
+        return -1;
+    }
+
+    err = 0;
+    pthread_rwlock_wrlock(&table_lock);
+    if(shmdb_ensure(dbo->name, &err) == -1 || shmdb_lock(&err) == -1)
+    {
+        pthread_rwlock_unlock(&table_lock);
+        return -1;
+    }
+
+    if((atomic_load(&table.header->count) + 1) * LOAD_DEN > table.header->capacity * LOAD_NUM && shmdb_grow(&err) == -1)
+    {
+        perror("shmdb grow");
+        flock(table.fd, LOCK_UN);
+        pthread_rwlock_unlock(&table_lock);
+        return -1;
+    }
+
+    hash = shmdb_hash(key, k_size);
+    mask = table.header->capacity - 1;
+    for(i = hash & mask;; i = (i + 1) & mask)
+    {
+        shmdb_slot *slot = &table.slots[i];
+        uint32_t    seq  = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+
+        if(seq == 0 || (slot->hash == hash && slot->k_size == k_size && memcmp(slot->key, key, k_size) == 0))
+        {
+            atomic_store(&table.header->writing, i + 1);
+            shmdb_write_slot(slot, hash, key, k_size, value, v_size);
+            atomic_store(&table.header->writing, 0);
+            if(seq == 0)
+            {
+                atomic_fetch_add(&table.header->count, 1);
+            }
+            break;
+        }
+    }
+
+    flock(table.fd, LOCK_UN);
+    pthread_rwlock_unlock(&table_lock);
+    return 0;
+}
+
+static void *shmdb_fetch(DBO *dbo, const void *key, size_t k_size, size_t *v_size)
+{
+    void *copy;
+    int   err;
+
+    err = 0;
+    if(k_size > SHMDB_KEY_SIZE || shmdb_share(dbo->name, &err) == -1)
+    {
+        return NULL;
+    }
+    copy = shmdb_lookup(key, k_size, v_size);
+    pthread_rwlock_unlock(&table_lock);
+    return copy;
+}
+
+// Caller holds table_lock shared.
+static void *shmdb_lookup(const void *key, size_t k_size, size_t *v_size)
+{
+    unsigned char value[SHMDB_VALUE_SIZE];
+    uint32_t      hash;
+    uint64_t      mask;
+    uint64_t      i;
+    int           spins;
+
+    hash  = shmdb_hash(key, k_size);
+    mask  = table.header->capacity - 1;
+    spins = 0;
+    for(i = hash & mask;;)
+    {
+        const shmdb_slot *slot = &table.slots[i];
+        uint32_t          seq  = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        size_t            size;
+        int               match;
+
+        if(seq == 0)
+        {
+            return NULL;
+        }
+
+        if(shmdb_wait(slot, &seq, &spins) == -1)
+        {
+            i = (i + 1) & mask;
+            continue;
+        }
+        if(seq == 0)
+        {
+            return NULL;
+        }
+
+        match = slot->hash == hash && slot->k_size == k_size && memcmp(slot->key, key, k_size) == 0;
+        size  = slot->v_size;
+        if(match)
+        {
+            memcpy(value, slot->value, size);
+        }
+
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+        {
+            continue;
+        }
+
+        if(match)
+        {
+            void *copy = malloc(size);
+
+            if(copy)
+            {
+                memcpy(copy, value, size);
+                *v_size = size;
+            }
+            return copy;
+        }
+        i = (i + 1) & mask;
+    }
+}
+
+// Keys never move once published, so a key copied under a stable seq is safe to hand out.
+static int shmdb_foreach(DBO *dbo, db_key_func func, void *ctx)
+{
+    int err;
+
+    err = 0;
+    if(shmdb_share(dbo->name, &err) == -1)
+    {
+        return -1;
+    }
+
+    for(uint64_t i = 0; i < table.header->capacity; i++)
+    {
+        const shmdb_slot *slot = &table.slots[i];
+        unsigned char     key[SHMDB_KEY_SIZE];
+        uint32_t          seq;
+        size_t            size  = 0;
+        int               spins = 0;
+
+        do
+        {
+            seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+            if(shmdb_wait(slot, &seq, &spins) == -1)
+            {
+                break;
+            }
+            size = slot->k_size;
+            memcpy(key, slot->key, size);
+            atomic_thread_fence(memory_order_acquire);
+        } while(atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq);
+
+        if(seq != 0 && !(seq & 1u))
+        {
+            func(key, size, ctx);
+        }
+    }
+    pthread_rwlock_unlock(&table_lock);
+    return 0;
+}
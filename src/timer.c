@@ -0,0 +1,160 @@
+#include "timer.h"
+#include <string.h>
+
+static void link_entry(timer_wheel *wheel, timer_entry *entry);
+static void unlink_entry(timer_entry *entry);
+static int  cascade(timer_wheel *wheel, int level);
+
+// Files the entry by how far away it is; past deadlines go in the slot about to run.
+static void link_entry(timer_wheel *wheel, timer_entry *entry)
+{
+    uint64_t      delta;
+    int           level;
+    timer_entry **slot;
+
+    if(entry->expires < wheel->now)
+    {
+        entry->expires = wheel->now;
+    }
+    delta = entry->expires - wheel->now;
+
+    level = 0;
+    while(level < TIMER_LEVELS - 1 && delta >> (TIMER_BITS * (level + 1)))
+    {
+        level++;
+    }
+    // further out than the top level reaches: park it at the far edge, it is re-filed on the way down
+    if(delta >> (TIMER_BITS * TIMER_LEVELS))
+    {
+        entry->expires = wheel->now + (1ULL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    slot         = &wheel->slots[level][(entry->expires >> (TIMER_BITS * level)) & TIMER_MASK];
+    entry->next  = *slot;
+    entry->pprev = slot;
+    if(*slot)
+    {
+        (*slot)->pprev = &entry->next;
+    }
+    *slot = entry;
+}
+
+static void unlink_entry(timer_entry *entry)
+{
+    *entry->pprev = entry->next;
+    if(entry->next)
+    {
+        entry->next->pprev = entry->pprev;
+    }
+    entry->next  = NULL;
+    entry->pprev = NULL;
+}
+
+// Moves one slot of a higher level down now that the wheel has reached its span. Returns the index it
+// took, 0 meaning the level has wrapped and the one above is due as well.
+static int cascade(timer_wheel *wheel, int level)
+{
+    int          index = (int)((wheel->now >> (TIMER_BITS * level)) & TIMER_MASK);
+    timer_entry *entry = wheel->slots[level][index];
+
+    wheel->slots[level][index] = NULL;
+    while(entry)
+    {
+        timer_entry *next = entry->next;
+
+        link_entry(wheel, entry);
+        entry = next;
+    }
+    return index;
+}
+
+void timer_init(timer_wheel *wheel, uint64_t now_msec)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now_msec / TIMER_TICK_MSEC;
+}
+
+// Deadlines are rounded up to the next tick so nothing fires early.
+void timer_add(timer_wheel *wheel, timer_entry *entry, uint64_t expires_msec)
+{
+    if(entry->pprev)
+    {
+        timer_cancel(wheel, entry);
+    }
+    entry->expires = (expires_msec + TIMER_TICK_MSEC - 1) / TIMER_TICK_MSEC;
+    link_entry(wheel, entry);
+    wheel->count++;
+}
+
+void timer_cancel(timer_wheel *wheel, timer_entry *entry)
+{
+    if(entry->pprev)
+    {
+        unlink_entry(entry);
+        wheel->count--;
+    }
+}
+
+// Runs every tick up to now_msec, calling func for each entry that expired. An entry is unlinked before
+// func sees it, so func may re-arm or free it. Returns how many expired.
+size_t timer_advance(timer_wheel *wheel, uint64_t now_msec, timer_func func, void *ctx)
+{
+    uint64_t target  = now_msec / TIMER_TICK_MSEC;
+    size_t   expired = 0;
+
+    while(wheel->now <= target)
+    {
+        int index;
+
+        // nothing armed, so there is nothing to cascade or run on the way
+        if(wheel->count == 0)
+        {
+            wheel->now = target + 1;
+            break;
+        }
+
+        index = (int)(wheel->now & TIMER_MASK);
+        for(int level = 1; index == 0 && level < TIMER_LEVELS; level++)
+        {
+            index = cascade(wheel, level);
+        }
+
+        index = (int)(wheel->now & TIMER_MASK);
+        while(wheel->slots[0][index])
+        {
+            timer_entry *entry = wheel->slots[0][index];
+
+            unlink_entry(entry);
+            wheel->count--;
+            expired++;
+            func(entry, ctx);
+        }
+        wheel->now++;
+    }
+    return expired;
+}
+
+// How long a poll may sleep before the wheel has work: the next occupied level 0 slot, or the next
+// cascade when level 0 is empty, never more than limit_msec.
+long timer_next_msec(const timer_wheel *wheel, uint64_t now_msec, long limit_msec)
+{
+    uint64_t due;
+
+    if(wheel->count == 0)
+    {
+        return limit_msec;
+    }
+
+    due = wheel->now;
+    while(!wheel->slots[0][due & TIMER_MASK] && (due & TIMER_MASK) != 0)
+    {
+        due++;
+    }
+
+    due *= TIMER_TICK_MSEC;
+    if(due <= now_msec)
+    {
+        return 0;
+    }
+    return due - now_msec < (uint64_t)limit_msec ? (long)(due - now_msec) : limit_msec;
+}
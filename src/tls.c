@@ -0,0 +1,354 @@
+#include "tls.h"
+#include "networking.h"
+#include "pool.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <openssl/err.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+
+// A relayed connection: the library serves inner's peer as if it were the client, and the relay
+// thread moves plaintext between inner and the TLS session on the real socket.
+typedef struct tls_relay
+{
+    SSL *ssl;
+    int  client;
+    int  inner;
+} tls_relay;
+
+static int   handshake(SSL *ssl, int fd);
+static int   wait_for(SSL *ssl, int result, short *events);
+static void *relay_main(void *arg);
+static void  finish(const worker_t *worker);
+
+SSL_CTX *tls_context(const char *cert, const char *key)
+{
+    SSL_CTX *ctx;
+
+    ctx = SSL_CTX_new(TLS_server_method());
+    if(!ctx)
+    {
+        goto error;
+    }
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+    // OpenSSL hands the session keys to the kernel after the handshake when the cipher allows it
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+    // tickets only: the ticket keys live in the context, which a session cache in one worker would not
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_OFF);
+    if(SSL_CTX_use_certificate_chain_file(ctx, cert) != 1 || SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM) != 1 || SSL_CTX_check_private_key(ctx) != 1)
+    {
+        goto error;
+    }
+    return ctx;
+
+error:
+    ERR_print_errors_fp(stderr);
+    SSL_CTX_free(ctx);
+    return NULL;
+}
+
+// Main dispatches both listeners' connections on the same channel, so the local port tells them apart.
+int tls_is_client(int fd, in_port_t port)
+{
+    struct sockaddr_storage addr;
+    socklen_t               len = sizeof(addr);
+
+    if(getsockname(fd, (struct sockaddr *)&addr, &len) == -1)
+    {
+        return 0;
+    }
+    if(addr.ss_family == AF_INET)
+    {
+        return ntohs(((struct sockaddr_in *)&addr)->sin_port) == port;
+    }
+    if(addr.ss_family == AF_INET6)
+    {
+        return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port) == port;
+    }
+    return 0;
+}
+
+// Handshakes, then serves the connection with the library. When the kernel took over both directions
+// the library gets the socket itself and its sendfile stays zero-copy; otherwise a relay thread does
+// the encryption between the socket and a socketpair the library serves instead. SIGPIPE is held
+// throughout, so a client resetting mid-handshake or mid-response costs the connection, not the worker.
+void tls_serve(SSL_CTX *ctx, worker_t *worker, void (*func)(void *))
+{
+    const struct timespec zero = {0, 0};
+    tls_relay             relay;
+    pthread_t             thread;
+    sigset_t              pipe_mask;
+    sigset_t              all;
+    sigset_t              held;
+    sigset_t              old;
+    SSL                  *ssl;
+    int                   pair[2];
+    int                   err;
+    int                   client = worker->client_fd;
+
+    sigemptyset(&pipe_mask);
+    sigaddset(&pipe_mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_mask, &old);
+
+    ssl = SSL_new(ctx);
+    if(!ssl || SSL_set_fd(ssl, client) != 1 || setSocketNonBlocking(client, &err) == -1 || handshake(ssl, client) == -1)
+    {
+        atomic_fetch_add(&worker->pool->tls_failures, 1);
+        finish(worker);
+        goto done;
+    }
+    atomic_fetch_add(&worker->pool->tls_handshakes, 1);
+    if(SSL_session_reused(ssl))
+    {
+        atomic_fetch_add(&worker->pool->tls_resumed, 1);
+    }
+
+    if(BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+    {
+        atomic_fetch_add(&worker->pool->tls_offloaded, 1);
+        setSocketBlocking(client, &err);
+        func(worker);
+        goto done;
+    }
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("socketpair");
+        finish(worker);
+        goto done;
+    }
+    relay.ssl    = ssl;
+    relay.client = client;
+    relay.inner  = pair[0];
+    fcntl(pair[0], F_SETFL, fcntl(pair[0], F_GETFL) | O_NONBLOCK);
+
+    // the relay takes no signals: shutdown and reloads are the worker's to notice
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &held);
+    if(pthread_create(&thread, NULL, relay_main, &relay) != 0)
+    {
+        perror("pthread_create");
+        close(pair[0]);
+        close(pair[1]);
+        pthread_sigmask(SIG_SETMASK, &held, NULL);
+        finish(worker);
+        goto done;
+    }
+    pthread_sigmask(SIG_SETMASK, &held, NULL);
+
+    // the library closes pair[1] and reports fd_num as it would for the real socket
+    worker->client_fd = pair[1];
+    func(worker);
+    pthread_join(thread, NULL);
+    close(pair[0]);
+    close(client);
+    worker->client_fd = client;
+
+done:
+    // the socket BIO does not own the descriptor, so this only frees the session
+    SSL_free(ssl);
+    while(sigtimedwait(&pipe_mask, NULL, &zero) > 0)
+    {
+    }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static int handshake(SSL *ssl, int fd)
+{
+    uint64_t deadline = pool_now_nsec() + TLS_HANDSHAKE_MSEC * NSEC_PER_MSEC;
+
+    while(1)
+    {
+        struct pollfd pfd;
+        uint64_t      now;
+        int           result = SSL_accept(ssl);
+
+        if(result == 1)
+        {
+            return 0;
+        }
+        pfd.fd = fd;
+        if(wait_for(ssl, result, &pfd.events) == -1)
+        {
+            return -1;
+        }
+        now = pool_now_nsec();
+        if(now >= deadline)
+        {
+            return -1;
+        }
+        result = poll(&pfd, 1, (int)((deadline - now) / NSEC_PER_MSEC) + 1);
+        if(result == 0 || (result == -1 && errno != EINTR))
+        {
+            return -1;
+        }
+    }
+}
+
+// What the socket must become before an SSL call that returned result can make progress; -1 when the
+// session is finished.
+static int wait_for(SSL *ssl, int result, short *events)
+{
+    switch(SSL_get_error(ssl, result))
+    {
+        case SSL_ERROR_WANT_READ:
+            *events = POLLIN;
+            return 0;
+        case SSL_ERROR_WANT_WRITE:
+            *events = POLLOUT;
+            return 0;
+        default:
+            return -1;
+    }
+}
+
+// Runs until the library has closed its end and everything it wrote has been sent, or the client has
+// gone. inner is only closed by the caller after that, so the library never writes to a closed pair.
+// A client that stops reading is given up on after TLS_STALL_MSEC; the library's own deadlines cover
+// one that stops sending, and end with it closing inner.
+static void *relay_main(void *arg)
+{
+    const tls_relay *relay = (const tls_relay *)arg;
+    char             in[TLS_RELAY_BUFFER_SIZE];     // from the client, for the library
+    char             out[TLS_RELAY_BUFFER_SIZE];    // from the library, for the client
+    size_t           in_len       = 0;
+    size_t           in_off       = 0;
+    size_t           out_len      = 0;
+    size_t           out_off      = 0;
+    int              reading      = 1;
+    int              client_alive = 1;
+    int              inner_open   = 1;
+    uint64_t         deadline     = pool_now_nsec() + TLS_STALL_MSEC * NSEC_PER_MSEC;
+
+    while(inner_open || (client_alive && out_off < out_len))
+    {
+        struct pollfd pfds[2];
+        uint64_t      now;
+        int           progress = 0;
+
+        pfds[0].fd     = relay->client;
+        pfds[0].events = 0;
+        pfds[1].fd     = relay->inner;
+        pfds[1].events = 0;
+
+        if(reading && in_off == in_len)
+        {
+            int result = SSL_read(relay->ssl, in, sizeof(in));
+
+            if(result > 0)
+            {
+                in_len   = (size_t)result;
+                in_off   = 0;
+                progress = 1;
+            }
+            else if(wait_for(relay->ssl, result, &pfds[0].events) == -1)
+            {
+                // close_notify or a dead connection: the library sees the end of its request
+                reading = 0;
+                shutdown(relay->inner, SHUT_WR);
+            }
+        }
+        if(in_off < in_len)
+        {
+            ssize_t sent = send(relay->inner, in + in_off, in_len - in_off, MSG_NOSIGNAL);
+
+            if(sent > 0)
+            {
+                in_off += (size_t)sent;
+                progress = 1;
+            }
+            else if(errno == EAGAIN)
+            {
+                pfds[1].events |= POLLOUT;
+            }
+            else if(errno != EINTR)
+            {
+                // the library is done reading; the rest of the request is of no use to it
+                in_off  = in_len;
+                reading = 0;
+            }
+        }
+
+        if(inner_open && out_off == out_len)
+        {
+            ssize_t got = read(relay->inner, out, sizeof(out));
+
+            if(got > 0)
+            {
+                out_len  = (size_t)got;
+                out_off  = 0;
+                progress = 1;
+            }
+            else if(got == 0 || (errno != EAGAIN && errno != EINTR))
+            {
+                inner_open = 0;
+                progress   = 1;
+            }
+            else if(errno == EAGAIN)
+            {
+                pfds[1].events |= POLLIN;
+            }
+        }
+        if(out_off < out_len)
+        {
+            int result = client_alive ? SSL_write(relay->ssl, out + out_off, (int)(out_len - out_off)) : (int)(out_len - out_off);
+
+            if(result > 0)
+            {
+                out_off += (size_t)result;
+                progress = 1;
+            }
+            else if(wait_for(relay->ssl, result, &pfds[0].events) == -1)
+            {
+                // drop what is left, but keep draining the library until it closes
+                client_alive = 0;
+                reading      = 0;
+                shutdown(relay->inner, SHUT_WR);
+            }
+        }
+
+        // only a client that is not taking the response is ours to time out
+        now = pool_now_nsec();
+        if(progress || !client_alive || out_off == out_len)
+        {
+            deadline = now + TLS_STALL_MSEC * NSEC_PER_MSEC;
+        }
+        if(progress)
+        {
+            continue;
+        }
+        if(now >= deadline)
+        {
+            client_alive = 0;
+            reading      = 0;
+            shutdown(relay->inner, SHUT_WR);
+            deadline = now + TLS_STALL_MSEC * NSEC_PER_MSEC;
+            continue;
+        }
+        poll(pfds, 2, (int)((deadline - now) / NSEC_PER_MSEC) + 1);
+    }
+
+    if(client_alive)
+    {
+        SSL_shutdown(relay->ssl);
+    }
+    return NULL;
+}
+
+// The library's ending for a connection it never saw: close it and tell main it is done.
+static void finish(const worker_t *worker)
+{
+    close(worker->client_fd);
+    if(worker->sockfd >= 0)
+    {
+        send_number(worker->sockfd, worker->fd_num);
+    }
+}
@@ -0,0 +1,105 @@
+#include "upgrade.h"
+#include "networking.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define FD_STRING_SIZE 16
+#define BASE_TEN 10
+
+pid_t upgrade_spawn(char *const argv[], int *channel)
+{
+    int   pair[2];
+    pid_t pid;
+
+    if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        perror("upgrade socketpair");
+        return -1;
+    }
+
+    pid = fork();
+    if(pid == -1)
+    {
+        perror("upgrade fork");
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+
+    if(pid == 0)
+    {
+        char     fd_string[FD_STRING_SIZE];
+        sigset_t none;
+
+        // only stdio and the child's end survive the exec; stray copies of client sockets or of the
+        // old dispatch socket would keep connections open after the old generation closed them
+        close_range(STDERR_FILENO + 1, ~0U, CLOSE_RANGE_CLOEXEC);
+        fcntl(pair[1], F_SETFD, 0);
+
+        // the signal mask survives exec, and main blocks SIGUSR2 outside its waits
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        snprintf(fd_string, sizeof(fd_string), "%d", pair[1]);
+        setenv(UPGRADE_ENV, fd_string, 1);
+        execvp(argv[0], argv);
+        perror("upgrade exec");
+        _exit(EXIT_FAILURE);
+    }
+
+    close(pair[1]);
+    *channel = pair[0];
+    return pid;
+}
+
+int upgrade_channel(void)
+{
+    const char *value = getenv(UPGRADE_ENV);
+    char       *end;
+    long        fd;
+
+    if(!value)
+    {
+        return -1;
+    }
+
+    errno = 0;
+    fd    = strtol(value, &end, BASE_TEN);
+    unsetenv(UPGRADE_ENV);
+    if(errno != 0 || *end != '\0' || fd < 0 || fcntl((int)fd, F_GETFD) == -1)
+    {
+        fprintf(stderr, "ignoring bad %s\n", UPGRADE_ENV);
+        return -1;
+    }
+
+    // nothing forked or exec'd from here on should hold the old generation open
+    fcntl((int)fd, F_SETFD, FD_CLOEXEC);
+    return (int)fd;
+}
+
+// Returns 0 once the new generation reports it holds everything it was sent, -1 if it died or stalled.
+int upgrade_wait_ready(int channel, int timeout_msec)
+{
+    struct pollfd pfd;
+    int           result;
+    int           message;
+
+    pfd.fd     = channel;
+    pfd.events = POLLIN;
+    do
+    {
+        result = poll(&pfd, 1, timeout_msec);
+    } while(result == -1 && errno == EINTR);
+
+    if(result <= 0 || recv_number(channel, &message) == -1 || message != UPGRADE_READY)
+    {
+        return -1;
+    }
+    return 0;
+}
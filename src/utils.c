@@ -10,8 +10,37 @@ _Pragma("clang diagnostic ignored \"-Wdisabled-macro-expansion\"")
 
 #define SIG_BUF 50
 
-    int verbose               = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
-volatile sig_atomic_t running = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+    int verbose                         = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+volatile sig_atomic_t running           = 1;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+volatile sig_atomic_t upgrade_requested = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables,-warnings-as-errors)
+
+static const MimeMapping Mime_map[] = {
+    {"txt",  "text/plain; charset=utf-8\r\n"      },
+    {"html", "text/html; charset=utf-8\r\n"       },
+    {"css",  "text/css; charset=utf-8\r\n"        },
+    {"js",   "text/javascript; charset=utf-8\r\n" },
+    {"csv",  "text/csv; charset=utf-8\r\n"        },
+    {"jpeg", "image/jpeg\r\n"                     },
+    {"jpg",  "image/jpeg\r\n"                     },
+    {"png",  "image/png\r\n"                      },
+    {"gif",  "image/gif\r\n"                      },
+    {"json", "application/json; charset=utf-8\r\n"},
+    {"swf",  "application/x-shockwave-flash\r\n"  },
+    {"pdf",  "application/pdf\r\n"                }
+};
+
+// Shared with the pack builder, which renders Content-Type ahead of time.
+const char *mime_to_string(const char *mime)
+{
+    for(size_t i = 0; i < sizeof(Mime_map) / sizeof(Mime_map[0]); i++)
+    {
+        if(strcmp(Mime_map[i].mime, mime) == 0)
+        {
+            return Mime_map[i].name;
+        }
+    }
+    return "text/plain\r\n";
+}
 
 static void handle_signal(int sig)
 {
@@ -20,11 +49,16 @@ static void handle_signal(int sig)
     snprintf(message, sizeof(message), "Caught signal: %d (%s)\n", sig, strsignal(sig));
     write(STDOUT_FILENO, message, strlen(message));
 
-    if(sig == SIGINT)
+    if(sig == SIGINT || sig == SIGTERM)
     {
         running = 0;
         snprintf(message, sizeof(message), "\n%s\n", "Shutting down gracefully...");
     }
+    if(sig == SIGUSR2)
+    {
+        upgrade_requested = 1;
+        snprintf(message, sizeof(message), "\n%s\n", "Handing over to a new server...");
+    }
     write(STDOUT_FILENO, message, strlen(message));
 }
 
@@ -42,4 +76,25 @@ void setup_signal(void)
         perror("sigaction SIGINT");
         exit(EXIT_FAILURE);
     }
+
+    // SIGUSR1 only has to interrupt a worker waiting for its next client so it picks up a new library
+    if(sigaction(SIGUSR1, &sa, NULL) == -1)
+    {
+        perror("sigaction SIGUSR1");
+        exit(EXIT_FAILURE);
+    }
+
+    // SIGUSR2 asks main to hand its listeners to a freshly exec'd server and drain
+    if(sigaction(SIGUSR2, &sa, NULL) == -1)
+    {
+        perror("sigaction SIGUSR2");
+        exit(EXIT_FAILURE);
+    }
+
+    // the monitor retires idle workers with SIGTERM; they finish the request in hand and exit
+    if(sigaction(SIGTERM, &sa, NULL) == -1)
+    {
+        perror("sigaction SIGTERM");
+        exit(EXIT_FAILURE);
+    }
 }
@@ -0,0 +1,554 @@
+#include "wal.h"
+#include "database.h"
+#include "respcache.h"
+#include "utils.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define FNV_OFFSET 2166136261u
+#define FNV_PRIME 16777619u
+#define BATCH_INITIAL 256
+#define NSEC_PER_USEC 1000L
+#define NSEC_PER_SEC 1000000000L
+
+static const char *const wal_modes[] = {"none", "batched", "strict"};
+
+// Each process (workers, applier) opens its own descriptor on first use.
+static int wal_fd = -1;
+
+static uint32_t wal_checksum(const unsigned char *buf, size_t len);
+static int      wal_open(const wal_t *wal, int *err);
+static void     wal_lock(wal_t *wal);
+static int      wal_wait(wal_t *wal, pthread_cond_t *cond, long sec);
+static ssize_t  pwrite_fully(int fd, const unsigned char *buf, size_t len, off_t off);
+static ssize_t  wal_sync(wal_t *wal, int fd, uint64_t lsn, int *err);
+static ssize_t  wal_apply(const wal_t *wal, respcache_t *cache, int fd, off_t from, size_t len, uint64_t *failed, int *err);
+
+static uint32_t wal_checksum(const unsigned char *buf, size_t len)
+{
+    uint32_t hash = FNV_OFFSET;
+
+    for(size_t i = 0; i < len; i++)
+    {
+        hash ^= buf[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+int wal_parse_mode(const char *str, wal_mode *mode)
+{
+    for(size_t i = 0; i < sizeof(wal_modes) / sizeof(wal_modes[0]); i++)
+    {
+        if(strcmp(str, wal_modes[i]) == 0)
+        {
+            *mode = (wal_mode)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// The shared state sits in a memfd so an upgraded server can attach to it, lock and all, while the
+// old generation's workers are still committing.
+wal_t *wal_create(const char *db_name, wal_mode mode, long window_usec, int *fd)
+{
+    wal_t              *wal;
+    pthread_mutexattr_t mutex_attr;
+    pthread_condattr_t  cond_attr;
+
+    *fd = memfd_create("wal", MFD_CLOEXEC);
+    if(*fd == -1 || ftruncate(*fd, (off_t)sizeof(wal_t)) == -1)
+    {
+        perror("wal memfd");
+        goto fail;
+    }
+
+    wal = (wal_t *)mmap(NULL, sizeof(wal_t), PROT_READ | PROT_WRITE, MAP_SHARED, *fd, 0);
+    if(wal == MAP_FAILED)
+    {
+        perror("wal mmap");
+        goto fail;
+    }
+
+    pthread_mutexattr_init(&mutex_attr);
+    pthread_mutexattr_setpshared(&mutex_attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&mutex_attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&wal->lock, &mutex_attr);
+    pthread_mutexattr_destroy(&mutex_attr);
+
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setpshared(&cond_attr, PTHREAD_PROCESS_SHARED);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&wal->synced_cond, &cond_attr);
+    pthread_cond_init(&wal->appended_cond, &cond_attr);
+    pthread_condattr_destroy(&cond_attr);
+
+    wal->mode        = mode;
+    wal->window_usec = window_usec;
+    snprintf(wal->db_name, sizeof(wal->db_name), "%s", db_name);
+    snprintf(wal->path, sizeof(wal->path), "%s%s", db_name, WAL_SUFFIX);
+    return wal;
+
+fail:
+    if(*fd != -1)
+    {
+        close(*fd);
+        *fd = -1;
+    }
+    return NULL;
+}
+
+wal_t *wal_attach(int fd)
+{
+    wal_t *wal;
+
+    wal = (wal_t *)mmap(NULL, sizeof(wal_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if(wal == MAP_FAILED)
+    {
+        perror("wal mmap");
+        return NULL;
+    }
+    return wal;
+}
+
+static int wal_open(const wal_t *wal, int *err)
+{
+    if(wal_fd == -1)
+    {
+        wal_fd = open(wal->path, O_RDWR | O_CREAT | O_CLOEXEC, S_IRUSR | S_IWUSR);
+        if(wal_fd == -1)
+        {
+            perror("wal open");
+            *err = errno;
+        }
+    }
+    return wal_fd;
+}
+
+// Robust mutex: if the owner died mid-commit the counters are still valid, since they only move after the write.
+static void wal_lock(wal_t *wal)
+{
+    if(pthread_mutex_lock(&wal->lock) == EOWNERDEAD)
+    {
+        wal->syncing = 0;
+        pthread_mutex_consistent(&wal->lock);
+    }
+}
+
+static int wal_wait(wal_t *wal, pthread_cond_t *cond, long sec)
+{
+    struct timespec deadline;
+    int             result;
+
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += sec;
+
+    result = pthread_cond_timedwait(cond, &wal->lock, &deadline);
+    if(result == EOWNERDEAD)
+    {
+        wal->syncing = 0;
+        pthread_mutex_consistent(&wal->lock);
+    }
+    return result;
+}
+
+static ssize_t pwrite_fully(int fd, const unsigned char *buf, size_t len, off_t off)
+{
+    size_t written = 0;
+
+    while(written < len)
+    {
+        ssize_t result = pwrite(fd, buf + written, len - written, off + (off_t)written);
+        if(result == -1)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        written += (size_t)result;
+    }
+    return (ssize_t)written;
+}
+
+void wal_batch_init(wal_batch *batch)
+{
+    batch->buf = NULL;
+    batch->len = sizeof(wal_record);
+    batch->cap = 0;
+}
+
+ssize_t wal_batch_add(wal_batch *batch, const char *key, const char *value)
+{
+    wal_record record;
+    uint32_t   sizes[2];
+    size_t     need;
+
+    sizes[0] = (uint32_t)strlen(key) + 1;
+    sizes[1] = (uint32_t)strlen(value) + 1;
+    need     = batch->len + sizeof(sizes) + sizes[0] + sizes[1];
+
+    if(need > batch->cap)
+    {
+        size_t         cap = batch->cap ? batch->cap : BATCH_INITIAL;
+        unsigned char *buf;
+
+        while(cap < need)
+        {
+            cap *= 2;
+        }
+        buf = (unsigned char *)realloc(batch->buf, cap);
+        if(!buf)
+        {
+            return -1;
+        }
+        if(!batch->buf)
+        {
+            memset(buf, 0, sizeof(wal_record));
+        }
+        batch->buf = buf;
+        batch->cap = cap;
+    }
+
+    memcpy(batch->buf + batch->len, sizes, sizeof(sizes));
+    batch->len += sizeof(sizes);
+    memcpy(batch->buf + batch->len, key, sizes[0]);
+    batch->len += sizes[0];
+    memcpy(batch->buf + batch->len, value, sizes[1]);
+    batch->len += sizes[1];
+
+    // the header sits in a byte buffer, so it is read and written whole rather than through a cast
+    memcpy(&record, batch->buf, sizeof(record));
+    record.pairs++;
+    memcpy(batch->buf, &record, sizeof(record));
+    return 0;
+}
+
+void wal_batch_free(wal_batch *batch)
+{
+    free(batch->buf);
+    wal_batch_init(batch);
+}
+
+// Called and returns with the lock held. In batched mode the first waiter becomes the leader,
+// sleeps one commit window so later writers can pile in, then syncs everything appended so far.
+static ssize_t wal_sync(wal_t *wal, int fd, uint64_t lsn, int *err)
+{
+    while(wal->synced_lsn < lsn)
+    {
+        struct timespec window;
+        uint64_t        target;
+        int             result;
+
+        if(wal->mode == WAL_BATCHED && wal->syncing)
+        {
+            if(wal_wait(wal, &wal->synced_cond, WAL_LEADER_TIMEOUT_SEC) == ETIMEDOUT && wal->synced_lsn < lsn)
+            {
+                wal->syncing = 0;    // leader never came back; take over
+            }
+            continue;
+        }
+
+        wal->syncing = 1;
+        pthread_mutex_unlock(&wal->lock);
+
+        if(wal->mode == WAL_BATCHED && wal->window_usec > 0)
+        {
+            window.tv_sec  = wal->window_usec * NSEC_PER_USEC / NSEC_PER_SEC;
+            window.tv_nsec = wal->window_usec * NSEC_PER_USEC % NSEC_PER_SEC;
+            nanosleep(&window, NULL);
+        }
+
+        wal_lock(wal);
+        target = wal->mode == WAL_BATCHED ? wal->end_lsn : lsn;
+        pthread_mutex_unlock(&wal->lock);
+
+        result = fdatasync(fd);
+
+        wal_lock(wal);
+        wal->syncing = 0;
+        if(result == -1)
+        {
+            *err = errno;
+            pthread_cond_broadcast(&wal->synced_cond);
+            return -1;
+        }
+        if(target > wal->synced_lsn)
+        {
+            wal->synced_lsn = target;
+        }
+        wal->syncs++;
+        pthread_cond_broadcast(&wal->synced_cond);
+        pthread_cond_signal(&wal->appended_cond);
+    }
+    return 0;
+}
+
+ssize_t wal_commit(wal_t *wal, wal_batch *batch, int *err)
+{
+    wal_record record;
+    uint64_t   lsn;
+    ssize_t    result;
+    int        fd;
+
+    if(!batch->buf)
+    {
+        return 0;    // nothing to log
+    }
+
+    memcpy(&record, batch->buf, sizeof(record));
+    record.magic    = WAL_RECORD_MAGIC;
+    record.size     = (uint32_t)batch->len;
+    record.checksum = wal_checksum(batch->buf + sizeof(wal_record), batch->len - sizeof(wal_record));
+    memcpy(batch->buf, &record, sizeof(record));
+
+    // under the lock so threads of one worker share a single descriptor
+    wal_lock(wal);
+    fd = wal_open(wal, err);
+    if(fd == -1)
+    {
+        pthread_mutex_unlock(&wal->lock);
+        return -1;
+    }
+    if(pwrite_fully(fd, batch->buf, batch->len, (off_t)(wal->end_lsn - wal->base)) == -1)
+    {
+        *err = errno;
+        pthread_mutex_unlock(&wal->lock);
+        return -1;
+    }
+    wal->end_lsn += batch->len;
+    wal->records++;
+    lsn = wal->end_lsn;
+
+    result = 0;
+    if(wal->mode == WAL_NONE)
+    {
+        wal->synced_lsn = lsn;
+        pthread_cond_signal(&wal->appended_cond);
+    }
+    else
+    {
+        result = wal_sync(wal, fd, lsn, err);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return result;
+}
+
+// Applies every intact record in [from, from + len) of the file and returns how many bytes that covered.
+// Pairs that are malformed or that the store refuses are logged and added to *failed.
+static ssize_t wal_apply(const wal_t *wal, respcache_t *cache, int fd, off_t from, size_t len, uint64_t *failed, int *err)
+{
+    unsigned char *buf;
+    size_t         off;
+    DBO            dbo;
+    char           db_name[PATH_MAX];
+
+    buf = (unsigned char *)malloc(len);
+    if(!buf)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    for(off = 0; off < len;)
+    {
+        ssize_t result = pread(fd, buf + off, len - off, from + (off_t)off);
+        if(result <= 0)
+        {
+            if(result == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        off += (size_t)result;
+    }
+    len = off;
+
+    memcpy(db_name, wal->db_name, sizeof(db_name));
+    dbo.name = db_name;
+    if(database_open(&dbo, err) < 0)
+    {
+        free(buf);
+        return -1;
+    }
+
+    for(off = 0; off + sizeof(wal_record) <= len;)
+    {
+        wal_record record;
+        size_t     pos;
+
+        // records follow each other unpadded, so a header can start at any byte
+        memcpy(&record, buf + off, sizeof(record));
+        if(record.magic != WAL_RECORD_MAGIC || record.size < sizeof(wal_record) || record.size > len - off ||
+           record.checksum != wal_checksum(buf + off + sizeof(wal_record), record.size - sizeof(wal_record)))
+        {
+            break;    // torn tail from a crash mid-append
+        }
+
+        pos = off + sizeof(wal_record);
+        for(uint32_t i = 0; i < record.pairs && pos + sizeof(uint32_t[2]) <= off + record.size; i++)
+        {
+            uint32_t    sizes[2];
+            const char *key;
+            const char *value;
+
+            memcpy(sizes, buf + pos, sizeof(sizes));
+            key   = (const char *)buf + pos + sizeof(sizes);
+            value = key + sizes[0];
+            pos += sizeof(sizes) + sizes[0] + sizes[1];
+
+            if(sizes[0] == 0 || sizes[1] == 0 || pos > off + record.size)
+            {
+                fprintf(stderr, "wal: malformed pair in record at offset %lld, dropping %u pairs\n", (long long)from + (long long)off, record.pairs - i);
+                *failed += record.pairs - i;
+                break;
+            }
+            if(key[sizes[0] - 1] != '\0' || value[sizes[1] - 1] != '\0')
+            {
+                fprintf(stderr, "wal: unterminated pair in record at offset %lld, dropping it\n", (long long)from + (long long)off);
+                (*failed)++;
+                continue;
+            }
+            if(store_string(&dbo, key, value) == -1)
+            {
+                fprintf(stderr, "wal: could not store %s (%u byte value), dropping it\n", key, sizes[1]);
+                (*failed)++;
+                continue;
+            }
+            // the cached response goes only once readers can see what replaces it
+            if(cache)
+            {
+                respcache_invalidate(cache, key);
+            }
+        }
+        off += record.size;
+    }
+
+    database_close(&dbo);
+    free(buf);
+    return (ssize_t)off;
+}
+
+// Runs before any worker exists: replays whatever a previous run left behind, then starts a fresh log.
+ssize_t wal_recover(wal_t *wal, int *err)
+{
+    struct stat file_stat;
+    ssize_t     applied;
+    int         fd;
+
+    fd = wal_open(wal, err);
+    if(fd == -1 || fstat(fd, &file_stat) == -1)
+    {
+        return -1;
+    }
+
+    applied = 0;
+    if(file_stat.st_size > 0)
+    {
+        applied = wal_apply(wal, NULL, fd, 0, (size_t)file_stat.st_size, &wal->failed_stores, err);
+        if(applied == -1)
+        {
+            return -1;
+        }
+        PRINT_VERBOSE("wal: recovered %zd of %lld bytes from %s\n", applied, (long long)file_stat.st_size, wal->path);
+    }
+
+    if(ftruncate(fd, 0) == -1 || fsync(fd) == -1)
+    {
+        *err = errno;
+        return -1;
+    }
+
+    close(fd);
+    wal_fd = -1;
+    return applied;
+}
+
+// Folds synced records into the main store in batches, truncating the log whenever it has fully caught up.
+_Noreturn void wal_applier(wal_t *wal, respcache_t *cache)
+{
+    int err;
+    int fd;
+
+    err = 0;
+    fd  = wal_open(wal, &err);
+    if(fd == -1)
+    {
+        exit(EXIT_FAILURE);
+    }
+
+    // Two appliers replaying overlapping ranges could put an older value back over a newer one. While an
+    // upgrade overlaps two generations the new applier waits here for the old one to exit.
+    while(flock(fd, LOCK_EX) == -1)
+    {
+        if(errno != EINTR || !running)
+        {
+            exit(running ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+    }
+
+    PRINT_VERBOSE("wal applier (PID: %d) started\n", getpid());
+
+    while(running)
+    {
+        uint64_t from;
+        uint64_t to;
+        uint64_t base;
+        uint64_t failed;
+        ssize_t  applied;
+
+        wal_lock(wal);
+        while(running && wal->applied_lsn == wal->synced_lsn)
+        {
+            wal_wait(wal, &wal->appended_cond, WAL_APPLY_INTERVAL_SEC);
+        }
+        from = wal->applied_lsn;
+        to   = wal->synced_lsn;
+        base = wal->base;
+        pthread_mutex_unlock(&wal->lock);
+
+        failed  = 0;
+        applied = from < to ? wal_apply(wal, cache, fd, (off_t)(from - base), (size_t)(to - from), &failed, &err) : 0;
+        if(applied == -1)
+        {
+            fprintf(stderr, "wal apply failed: %s\n", strerror(err));
+            sleep(WAL_APPLY_INTERVAL_SEC);
+            continue;
+        }
+
+        // Only what was read moves applied_lsn, so the log is never truncated past a record that was
+        // not applied; an unreadable one is retried rather than skipped along with everything after it.
+        wal_lock(wal);
+        wal->applied_lsn = from + (uint64_t)applied;
+        wal->failed_stores += failed;
+        if(wal->applied_lsn < to)
+        {
+            wal->bad_records++;
+        }
+        if(wal->applied_lsn == wal->end_lsn && wal->end_lsn - wal->base >= WAL_TRUNCATE_SIZE && ftruncate(fd, 0) == 0)
+        {
+            wal->base = wal->end_lsn;
+        }
+        pthread_mutex_unlock(&wal->lock);
+
+        if(from + (uint64_t)applied < to)
+        {
+            fprintf(stderr, "wal: unreadable record at lsn %llu, retrying\n", (unsigned long long)(from + (uint64_t)applied));
+            sleep(WAL_APPLY_INTERVAL_SEC);
+        }
+    }
+
+    PRINT_VERBOSE("%s\n", "wal applier exiting");
+    exit(EXIT_SUCCESS);
+}
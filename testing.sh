@@ -2,4 +2,13 @@ echo -e "GET /httptest/index.html HTTP/1.0\r\nHost: localhost:8000\r\nConnection
 
 echo -e "GET /httptest/user?user=Tia@gmail.com HTTP/1.0\r\nHost: localhost:8000\r\nConnection: close\r\n\r\n" | nc localhost 8000
 
-gcc -shared -fPIC -I./include -o libmylib.so src/http.c src/fsm.c src/networking.c src/utils.c src/database.c
+gcc -shared -fPIC -I./include -o libmylib.so src/http.c src/h2.c src/hpack.c src/capture.c src/accesslog.c src/respcache.c src/filehint.c src/arena.c src/pack.c src/pathcache.c src/fsm.c src/networking.c src/utils.c src/database.c src/shmdb.c src/bloom.c src/wal.c src/json.c
+
+# unit tests for the parsers that read untrusted input; each prints its failed checks and exits non-zero
+TEST_FLAGS="-std=c17 -D_GNU_SOURCE -g -fsanitize=address,undefined -fno-sanitize-recover=all -I./include"
+gcc $TEST_FLAGS -o wal_test tests/wal_test.c src/wal.c src/database.c src/shmdb.c src/respcache.c src/utils.c -lgdbm_compat -pthread && ./wal_test
+gcc $TEST_FLAGS -o shmdb_test tests/shmdb_test.c src/database.c src/shmdb.c src/respcache.c src/utils.c -lgdbm_compat -pthread && ./shmdb_test
+gcc $TEST_FLAGS -o chunked_test tests/chunked_test.c src/http.c src/h2.c src/hpack.c src/capture.c src/accesslog.c src/respcache.c src/filehint.c src/arena.c src/pack.c src/pathcache.c src/fsm.c src/networking.c src/utils.c src/database.c src/shmdb.c src/bloom.c src/wal.c src/json.c -lgdbm_compat -pthread && ./chunked_test > /dev/null
+gcc $TEST_FLAGS -o json_test tests/json_test.c src/json.c && ./json_test
+gcc $TEST_FLAGS -o hpack_test tests/hpack_test.c src/hpack.c && ./hpack_test
+gcc $TEST_FLAGS -o ratelimit_test tests/ratelimit_test.c src/ratelimit.c && ./ratelimit_test
@@ -0,0 +1,27 @@
+#ifndef CHECK_H
+#define CHECK_H
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Unit tests count failed checks and keep going, so one run reports every broken case.
+#define CHECK(cond)                                                                     \
+    do                                                                                  \
+    {                                                                                   \
+        if(!(cond))                                                                     \
+        {                                                                               \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+            check_failures++;                                                           \
+        }                                                                               \
+    } while(0)
+
+#define CHECK_DONE(name)                                                                     \
+    do                                                                                       \
+    {                                                                                        \
+        fprintf(stderr, "%s: %s\n", (name), check_failures ? "FAILED" : "ok");               \
+        return check_failures ? EXIT_FAILURE : EXIT_SUCCESS;                                 \
+    } while(0)
+
+static int check_failures = 0;    // NOLINT(cppcoreguidelines-avoid-non-const-global-variables)
+
+#endif    // CHECK_H
@@ -0,0 +1,110 @@
+#include "arena.h"
+#include "check.h"
+#include "http.h"
+#include <string.h>
+#include <sys/socket.h>
+
+#define TEST_MAX_BODY 64
+
+static int  read_body(const char *head, const char *sent, size_t sent_len, request_t *request, arena_t *arena);
+static void expect_body(const char *name, const char *body, const char *decoded);
+static void expect_status(const char *name, const char *body, status_t status);
+
+// Runs the READ_BODY state on a chunked POST. The first half of body arrives with the headers, the
+// rest from the socket, so both the staging buffer and the socket reads are covered.
+static int read_body(const char *head, const char *sent, size_t sent_len, request_t *request, arena_t *arena)
+{
+    fsm_state_func perform = fsm_transition(CHECK_REQUEST, READ_BODY, transitions);
+    size_t         early   = sent_len / 2;
+    int            pair[2];
+    int            next;
+
+    if(!perform || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, pair) == -1)
+    {
+        return -1;
+    }
+    memset(request, 0, sizeof(*request));
+    request->arena      = arena;
+    request->max_body   = TEST_MAX_BODY;
+    request->client_fd  = pair[0];
+    request->header_len = strlen(head) - strlen("\r\n\r\n");
+    request->raw_len    = strlen(head) + early;
+    request->raw        = (char *)arena_alloc(arena, request->raw_len + 1);
+    strcpy(request->method, "POST");
+    strcpy(request->version, "HTTP/1.1");
+    memcpy(request->raw, head, strlen(head));
+    memcpy(request->raw + strlen(head), sent, early);
+    request->raw[request->raw_len] = '\0';
+
+    // the peer hangs up after the body, so a short one ends in EOF rather than a wait
+    if(write(pair[1], sent + early, sent_len - early) != (ssize_t)(sent_len - early))
+    {
+        close(pair[0]);
+        close(pair[1]);
+        return -1;
+    }
+    shutdown(pair[1], SHUT_WR);
+    next = perform(request);
+    close(pair[0]);
+    close(pair[1]);
+    return next;
+}
+
+static void expect_body(const char *name, const char *body, const char *decoded)
+{
+    static const char head[] = "POST /httptest/user HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n";
+    request_t         request;
+    arena_t           arena;
+
+    CHECK(arena_init(&arena) == 0);
+    if(read_body(head, body, strlen(body), &request, &arena) != RESPONSE_HANDLER || request.body_len != strlen(decoded) || (request.body_len > 0 && memcmp(request.body, decoded, request.body_len) != 0))
+    {
+        fprintf(stderr, "chunked: %s: body not decoded to \"%s\"\n", name, decoded);
+        check_failures++;
+    }
+    arena_free(&arena);
+}
+
+static void expect_status(const char *name, const char *body, status_t status)
+{
+    static const char head[] = "POST /httptest/user HTTP/1.1\r\nHost: test\r\nTransfer-Encoding: chunked\r\n\r\n";
+    request_t         request;
+    arena_t           arena;
+
+    CHECK(arena_init(&arena) == 0);
+    if(read_body(head, body, strlen(body), &request, &arena) != ERROR_HANDLER || request.status != status)
+    {
+        fprintf(stderr, "chunked: %s: expected status %d, got %d\n", name, (int)status, (int)request.status);
+        check_failures++;
+    }
+    arena_free(&arena);
+}
+
+int main(void)
+{
+    expect_body("two chunks", "5\r\nhello\r\n6\r\n world\r\n0\r\n\r\n", "hello world");
+    expect_body("upper and lower hex", "A\r\n0123456789\r\nb\r\nabcdefghijk\r\n0\r\n\r\n", "0123456789abcdefghijk");
+    expect_body("extensions", "5;name=value\r\nhello\r\n0;last\r\n\r\n", "hello");
+    expect_body("trailers", "5\r\nhello\r\n0\r\nChecksum: abc\r\nOther: x\r\n\r\n", "hello");
+    expect_body("bare LF", "5\nhello\n0\n\n", "hello");
+    expect_body("empty", "0\r\n\r\n", "");
+    expect_body("exactly max", "40\r\n0123456789012345678901234567890123456789012345678901234567890123\r\n0\r\n\r\n", "0123456789012345678901234567890123456789012345678901234567890123");
+
+    expect_status("not hex", "zz\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("empty size", "\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("negative", "-1\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("plus sign", "+5\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("leading blank", " 5\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("0x prefix", "0x5\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("junk after size", "5x\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("overflowing size", "10000000000000000\r\nhello\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("data longer than size", "5\r\nhelloX\r\n0\r\n\r\n", BAD_REQUEST);
+    expect_status("truncated data", "5\r\nhel", BAD_REQUEST);
+    expect_status("no last chunk", "5\r\nhello\r\n", BAD_REQUEST);
+    expect_status("no end of trailers", "5\r\nhello\r\n0\r\n", BAD_REQUEST);
+    expect_status("one over max", "41\r\n01234567890123456789012345678901234567890123456789012345678901234\r\n0\r\n\r\n", PAYLOAD_TOO_LARGE);
+    expect_status("over max in total", "30\r\n012345678901234567890123456789012345678901234567\r\n30\r\n012345678901234567890123456789012345678901234567\r\n0\r\n\r\n", PAYLOAD_TOO_LARGE);
+    expect_status("huge size", "ffffffffffffffff\r\nhello\r\n0\r\n\r\n", PAYLOAD_TOO_LARGE);
+
+    CHECK_DONE("chunked");
+}
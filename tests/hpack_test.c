@@ -0,0 +1,274 @@
+#include "check.h"
+#include "hpack.h"
+#include <string.h>
+
+#define TEST_BLOCK_SIZE 512
+#define TEST_FIELDS_SIZE 1024
+#define RESPONSE_TABLE_SIZE 256
+
+typedef struct fields
+{
+    char   text[TEST_FIELDS_SIZE];
+    size_t len;
+} fields;
+
+typedef struct header
+{
+    const char *name;
+    const char *value;
+} header;
+
+static int    collect(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx);
+static size_t from_hex(const char *hex, uint8_t *out, size_t size);
+static void   expect_block(hpack_decoder *decoder, const char *name, const char *hex, const char *joined, size_t count, size_t table_size);
+static void   test_requests(const char *const *blocks);
+static void   test_responses(const char *const *blocks);
+static void   test_evict_name(void);
+static size_t encode_all(hpack_encoder *encoder, uint8_t *out, size_t size, const header *headers, size_t count);
+static void   test_encode(void);
+static void   test_size_update(void);
+
+// RFC 7541 C.3 and C.4: three requests, plain and Huffman coded, with the default table size.
+static const char *const plain_requests[] = {
+    "828684410f7777772e6578616d706c652e636f6d",
+    "828684be58086e6f2d6361636865",
+    "828785bf400a637573746f6d2d6b65790c637573746f6d2d76616c7565",
+};
+static const char *const huffman_requests[] = {
+    "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+    "828684be5886a8eb10649cbf",
+    "828785bf408825a849e95ba97d7f8925a849e95bb8e8b4bf",
+};
+
+// RFC 7541 C.5 and C.6: three responses against a 256 byte table, so the third evicts.
+static const char *const plain_responses[] = {
+    "4803333032580770726976617465611d4d6f6e2c203231204f637420323031332032303a31333a323120474d54"
+    "6e1768747470733a2f2f7777772e6578616d706c652e636f6d",
+    "4803333037c1c0bf",
+    "88c1611d4d6f6e2c203231204f637420323031332032303a31333a323220474d54c05a04677a69707738666f6f"
+    "3d4153444a4b48514b425a584f5157454f50495541585157454f49553b206d61782d6167653d333630303b2076"
+    "657273696f6e3d31",
+};
+static const char *const huffman_responses[] = {
+    "488264025885aec3771a4b6196d07abe941054d444a8200595040b8166e082a62d1bff6e919d29ad171863c78f"
+    "0b97c8e9ae82ae43d3",
+    "4883640effc1c0bf",
+    "88c16196d07abe941054d444a8200595040b8166e084a62d1bffc05a839bd9ab77ad94e7821dd7f2e6c7b335df"
+    "dfcd5b3960d5af27087f3672c1ab270fb5291f9587316065c003ed4ee5b1063d5007",
+};
+
+static const char *const request_fields[] = {
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\n",
+    ":method: GET\n:scheme: http\n:path: /\n:authority: www.example.com\ncache-control: no-cache\n",
+    ":method: GET\n:scheme: https\n:path: /index.html\n:authority: www.example.com\ncustom-key: custom-value\n",
+};
+static const char *const response_fields[] = {
+    ":status: 302\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+    ":status: 307\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:21 GMT\nlocation: https://www.example.com\n",
+    ":status: 200\ncache-control: private\ndate: Mon, 21 Oct 2013 20:13:22 GMT\nlocation: https://www.example.com\ncontent-encoding: gzip\n"
+    "set-cookie: foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1\n",
+};
+
+static const size_t request_counts[]  = {1, 2, 3};
+static const size_t request_sizes[]   = {57, 110, 164};
+static const size_t response_counts[] = {4, 4, 3};
+static const size_t response_sizes[]  = {222, 222, 215};
+
+static int collect(const char *name, size_t name_len, const char *value, size_t value_len, void *ctx)
+{
+    fields *out = (fields *)ctx;
+
+    if(out->len + name_len + value_len + 3 >= sizeof(out->text))
+    {
+        return -1;
+    }
+    memcpy(out->text + out->len, name, name_len);
+    out->len += name_len;
+    out->text[out->len++] = ':';
+    out->text[out->len++] = ' ';
+    memcpy(out->text + out->len, value, value_len);
+    out->len += value_len;
+    out->text[out->len++] = '\n';
+    out->text[out->len]   = '\0';
+    return 0;
+}
+
+static size_t from_hex(const char *hex, uint8_t *out, size_t size)
+{
+    size_t len = strlen(hex) / 2;
+
+    if(len > size)
+    {
+        return 0;
+    }
+    for(size_t i = 0; i < len; i++)
+    {
+        unsigned int byte;
+
+        if(sscanf(hex + 2 * i, "%2x", &byte) != 1)
+        {
+            return 0;
+        }
+        out[i] = (uint8_t)byte;
+    }
+    return len;
+}
+
+// Decodes one block and checks the fields it gave and the dynamic table it left behind.
+static void expect_block(hpack_decoder *decoder, const char *name, const char *hex, const char *joined, size_t count, size_t table_size)
+{
+    uint8_t block[TEST_BLOCK_SIZE];
+    size_t  len = from_hex(hex, block, sizeof(block));
+    fields  out = {.len = 0};
+
+    out.text[0] = '\0';
+    if(len == 0 || hpack_decode(decoder, block, len, collect, &out) == -1 || strcmp(out.text, joined) != 0)
+    {
+        fprintf(stderr, "hpack: %s: decoded to\n%s", name, out.text);
+        check_failures++;
+    }
+    if(decoder->table.count != count || decoder->table.size != table_size)
+    {
+        fprintf(stderr, "hpack: %s: table holds %zu entries, %zu bytes\n", name, decoder->table.count, decoder->table.size);
+        check_failures++;
+    }
+}
+
+static void test_requests(const char *const *blocks)
+{
+    hpack_decoder decoder;
+
+    CHECK(hpack_decoder_init(&decoder) == 0);
+    for(size_t i = 0; i < sizeof(request_fields) / sizeof(request_fields[0]); i++)
+    {
+        expect_block(&decoder, blocks[i], blocks[i], request_fields[i], request_counts[i], request_sizes[i]);
+    }
+    hpack_decoder_free(&decoder);
+}
+
+static void test_responses(const char *const *blocks)
+{
+    hpack_decoder decoder;
+
+    CHECK(hpack_decoder_init(&decoder) == 0);
+    decoder.table.max_size = RESPONSE_TABLE_SIZE;
+    for(size_t i = 0; i < sizeof(response_fields) / sizeof(response_fields[0]); i++)
+    {
+        expect_block(&decoder, blocks[i], blocks[i], response_fields[i], response_counts[i], response_sizes[i]);
+    }
+    hpack_decoder_free(&decoder);
+}
+
+// C.2: one of each representation, then a literal that takes its name from the oldest dynamic entry
+// and is big enough to evict that very entry. The name must survive the eviction.
+static void test_evict_name(void)
+{
+    hpack_decoder decoder;
+
+    CHECK(hpack_decoder_init(&decoder) == 0);
+    expect_block(&decoder, "C.2.1", "400a637573746f6d2d6b65790d637573746f6d2d686561646572", "custom-key: custom-header\n", 1, 55);
+    expect_block(&decoder, "C.2.2", "040c2f73616d706c652f70617468", ":path: /sample/path\n", 1, 55);
+    expect_block(&decoder, "C.2.3", "100870617373776f726406736563726574", "password: secret\n", 1, 55);
+    expect_block(&decoder, "C.2.4", "82", ":method: GET\n", 1, 55);
+
+    decoder.table.max_size = 100;
+    expect_block(&decoder, "evicted name", "7e0d746869727465656e2063686172", "custom-key: thirteen char\n", 1, 55);
+    expect_block(&decoder, "evicted name, indexed", "be", "custom-key: thirteen char\n", 1, 55);
+    hpack_decoder_free(&decoder);
+}
+
+static size_t encode_all(hpack_encoder *encoder, uint8_t *out, size_t size, const header *headers, size_t count)
+{
+    size_t len = 0;
+
+    for(size_t i = 0; i < count; i++)
+    {
+        size_t part = hpack_encode(encoder, out + len, size - len, headers[i].name, strlen(headers[i].name), headers[i].value, strlen(headers[i].value));
+
+        if(part == 0)
+        {
+            return 0;
+        }
+        len += part;
+    }
+    return len;
+}
+
+// The C.5 responses through our encoder: whatever it chooses to index, a decoder must end up with the
+// same fields and the same table.
+static void test_encode(void)
+{
+    static const header responses[][6] = {
+        {{":status", "302"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"}, {"location", "https://www.example.com"}},
+        {{":status", "307"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:21 GMT"}, {"location", "https://www.example.com"}},
+        {{":status", "200"}, {"cache-control", "private"}, {"date", "Mon, 21 Oct 2013 20:13:22 GMT"}, {"location", "https://www.example.com"}, {"content-encoding", "gzip"}, {"set-cookie", "foo=ASDJKHQKBZXOQWEOPIUAXQWEOIU; max-age=3600; version=1"}},
+    };
+    static const size_t counts[] = {4, 4, 6};
+    hpack_encoder       encoder;
+    hpack_decoder       decoder;
+
+    hpack_encoder_init(&encoder);
+    hpack_encoder_resize(&encoder, RESPONSE_TABLE_SIZE);
+    CHECK(hpack_decoder_init(&decoder) == 0);
+    for(size_t i = 0; i < sizeof(counts) / sizeof(counts[0]); i++)
+    {
+        uint8_t block[TEST_BLOCK_SIZE];
+        size_t  len = encode_all(&encoder, block, sizeof(block), responses[i], counts[i]);
+        fields  out = {.len = 0};
+
+        out.text[0] = '\0';
+        CHECK(len > 0 && hpack_decode(&decoder, block, len, collect, &out) == 0);
+        CHECK(strcmp(out.text, response_fields[i]) == 0);
+        CHECK(decoder.table.count == encoder.table.count && decoder.table.size == encoder.table.size);
+        CHECK(encoder.table.size <= RESPONSE_TABLE_SIZE && decoder.table.max_size == RESPONSE_TABLE_SIZE);
+    }
+    hpack_encoder_free(&encoder);
+    hpack_decoder_free(&decoder);
+}
+
+// A field that does not fit must leave a pending size update pending and the table untouched, so the
+// retry still announces it and the indices it uses still match the peer's.
+static void test_size_update(void)
+{
+    static const header first[]  = {{"server", "tia"}, {"content-type", "text/html"}, {"cache-control", "no-cache"}};
+    static const header second[] = {{"content-type", "text/html"}, {"cache-control", "no-cache"}};
+    hpack_encoder       encoder;
+    hpack_decoder       decoder;
+    uint8_t             block[TEST_BLOCK_SIZE];
+    size_t              len;
+    fields              out = {.len = 0};
+
+    hpack_encoder_init(&encoder);
+    CHECK(hpack_decoder_init(&decoder) == 0);
+    len = encode_all(&encoder, block, sizeof(block), first, sizeof(first) / sizeof(first[0]));
+    CHECK(len > 0 && hpack_decode(&decoder, block, len, collect, &out) == 0);
+    CHECK(encoder.table.count == 3);
+
+    // 64 bytes keeps only cache-control; the size update alone is 2 bytes, the field does not fit in 3
+    hpack_encoder_resize(&encoder, 64);
+    CHECK(hpack_encode(&encoder, block, 3, "content-type", strlen("content-type"), "text/html", strlen("text/html")) == 0);
+    CHECK(encoder.update == 1 && encoder.table.count == 3 && encoder.table.max_size == HPACK_TABLE_SIZE);
+
+    len = encode_all(&encoder, block, sizeof(block), second, sizeof(second) / sizeof(second[0]));
+    CHECK(len > 2 && block[0] == 0x3f && block[1] == 0x21);
+    CHECK(encoder.update == 0 && encoder.table.max_size == 64);
+    out.len     = 0;
+    out.text[0] = '\0';
+    CHECK(hpack_decode(&decoder, block, len, collect, &out) == 0);
+    CHECK(strcmp(out.text, "content-type: text/html\ncache-control: no-cache\n") == 0);
+    CHECK(decoder.table.count == encoder.table.count && decoder.table.size == encoder.table.size);
+    hpack_encoder_free(&encoder);
+    hpack_decoder_free(&decoder);
+}
+
+int main(void)
+{
+    test_requests(plain_requests);
+    test_requests(huffman_requests);
+    test_responses(plain_responses);
+    test_responses(huffman_responses);
+    test_evict_name();
+    test_encode();
+    test_size_update();
+    CHECK_DONE("hpack");
+}
@@ -0,0 +1,203 @@
+#include "check.h"
+#include "json.h"
+#include <string.h>
+
+#define TEST_BUFFER_SIZE 1024
+
+typedef struct pairs
+{
+    char   text[TEST_BUFFER_SIZE];
+    size_t len;
+    int    count;
+    int    stop_after;
+} pairs;
+
+static int     collect(const char *key, size_t k_size, const char *value, size_t v_size, void *ctx);
+static ssize_t parse(const char *json, pairs *out);
+static void    expect_pairs(const char *json, ssize_t count, const char *joined);
+static void    expect_invalid(const char *json);
+static void    test_depth(void);
+static void    test_long_strings(void);
+static void    test_stop(void);
+
+// Joins what the parser hands over as key=value| so a case is one string compare.
+static int collect(const char *key, size_t k_size, const char *value, size_t v_size, void *ctx)
+{
+    pairs *out = (pairs *)ctx;
+
+    CHECK(strlen(key) == k_size && strlen(value) == v_size);
+    if(out->len + k_size + v_size + 2 < sizeof(out->text))
+    {
+        memcpy(out->text + out->len, key, k_size);
+        out->len += k_size;
+        out->text[out->len++] = '=';
+        memcpy(out->text + out->len, value, v_size);
+        out->len += v_size;
+        out->text[out->len++] = '|';
+        out->text[out->len]   = '\0';
+    }
+    out->count++;
+    return out->stop_after > 0 && out->count >= out->stop_after;
+}
+
+// The parser writes into its input, so every case gets a copy of its own.
+static ssize_t parse(const char *json, pairs *out)
+{
+    char   buf[TEST_BUFFER_SIZE];
+    size_t len = strlen(json);
+
+    out->text[0] = '\0';
+    out->len     = 0;
+    out->count   = 0;
+    if(len >= sizeof(buf))
+    {
+        return -1;
+    }
+    memcpy(buf, json, len);
+    return json_parse_object(buf, len, collect, out);
+}
+
+static void expect_pairs(const char *json, ssize_t count, const char *joined)
+{
+    pairs   out = {.stop_after = 0};
+    ssize_t result;
+
+    result = parse(json, &out);
+    if(result != count || strcmp(out.text, joined) != 0)
+    {
+        fprintf(stderr, "json: %s: got %zd \"%s\", expected %zd \"%s\"\n", json, result, out.text, count, joined);
+        check_failures++;
+    }
+}
+
+static void expect_invalid(const char *json)
+{
+    pairs out = {.stop_after = 0};
+
+    if(parse(json, &out) != -1)
+    {
+        fprintf(stderr, "json: %s: accepted\n", json);
+        check_failures++;
+    }
+}
+
+// Nesting is counted from the first container inside a member, up to JSON_MAX_DEPTH.
+static void test_depth(void)
+{
+    char   json[TEST_BUFFER_SIZE];
+    pairs  out = {.stop_after = 0};
+    size_t len;
+
+    for(size_t depth = JSON_MAX_DEPTH; depth <= JSON_MAX_DEPTH + 1; depth++)
+    {
+        len = (size_t)snprintf(json, sizeof(json), "{\"a\":");
+        for(size_t i = 0; i < depth; i++)
+        {
+            json[len++] = '[';
+        }
+        for(size_t i = 0; i < depth; i++)
+        {
+            json[len++] = ']';
+        }
+        json[len++] = '}';
+        json[len]   = '\0';
+        CHECK(parse(json, &out) == (depth == JSON_MAX_DEPTH ? 1 : -1));
+    }
+}
+
+// Long enough for the vector scan to run over several blocks before the byte loop finishes.
+static void test_long_strings(void)
+{
+    char  json[TEST_BUFFER_SIZE];
+    char  value[TEST_BUFFER_SIZE / 2];
+    pairs out = {.stop_after = 0};
+
+    memset(value, 'x', sizeof(value) - 1);
+    value[sizeof(value) - 1] = '\0';
+    snprintf(json, sizeof(json), "{\"k\":\"%s\"}", value);
+    CHECK(parse(json, &out) == 1 && strlen(out.text) == strlen("k=|") + strlen(value));
+
+    // a control byte or quote past the first block must still be found
+    value[100] = '\t';
+    snprintf(json, sizeof(json), "{\"k\":\"%s\"}", value);
+    CHECK(parse(json, &out) == -1);
+    value[100] = '"';
+    snprintf(json, sizeof(json), "{\"k\":\"%s\"}", value);
+    CHECK(parse(json, &out) == -1);
+    value[100] = '\\';
+    value[101] = 'n';
+    snprintf(json, sizeof(json), "{\"k\":\"%s\"}", value);
+    CHECK(parse(json, &out) == 1 && out.text[2 + 100] == '\n' && out.text[2 + 101] == 'x');
+}
+
+static void test_stop(void)
+{
+    pairs out = {.stop_after = 1};
+
+    CHECK(parse("{\"a\":1,\"b\":2}", &out) == -2 && out.count == 1);
+}
+
+int main(void)
+{
+    expect_pairs("{}", 0, "");
+    expect_pairs(" \t\r\n{ } \n", 0, "");
+    expect_pairs("{\"name\":\"bob\",\"age\":42}", 2, "name=bob|age=42|");
+    expect_pairs("{ \"a\" : true , \"b\" : false , \"c\" : null }", 3, "a=true|b=false|c=null|");
+    expect_pairs("{\"n\":-0.5e+10,\"m\":0,\"o\":1E-3,\"p\":-12}", 4, "n=-0.5e+10|m=0|o=1E-3|p=-12|");
+    expect_pairs("{\"o\":{\"x\":[1,2,{\"y\":\"}\"}]},\"z\":[]}", 2, "o={\"x\":[1,2,{\"y\":\"}\"}]}|z=[]|");
+    expect_pairs("{\"e\":\"\\\"\\\\\\/\\b\\f\\n\\r\\t\"}", 1, "e=\"\\/\b\f\n\r\t|");
+    expect_pairs("{\"u\":\"\\u0041\\u00e9\\u20ac\"}", 1, "u=A\xc3\xa9\xe2\x82\xac|");
+    expect_pairs("{\"u\":\"\\uD83D\\uDE00\"}", 1, "u=\xf0\x9f\x98\x80|");
+    expect_pairs("{\"u\":\"\\udbff\\udfff\"}", 1, "u=\xf4\x8f\xbf\xbf|");
+    expect_pairs("{\"k\\u0041\":\"v\"}", 1, "kA=v|");
+    expect_pairs("{\"utf8\":\"caf\xc3\xa9\"}", 1, "utf8=caf\xc3\xa9|");
+
+    expect_invalid("");
+    expect_invalid("[]");
+    expect_invalid("\"a\"");
+    expect_invalid("{");
+    expect_invalid("{\"a\"}");
+    expect_invalid("{\"a\":}");
+    expect_invalid("{\"a\":1,}");
+    expect_invalid("{,\"a\":1}");
+    expect_invalid("{\"a\":1 \"b\":2}");
+    expect_invalid("{\"a\":1}x");
+    expect_invalid("{\"a\":1}{}");
+    expect_invalid("{a:1}");
+    expect_invalid("{'a':1}");
+    expect_invalid("{\"a\":\"unterminated}");
+    expect_invalid("{\"a\":\"tab\there\"}");
+    expect_invalid("{\"a\":\"\\x\"}");
+    expect_invalid("{\"a\":\"\\u12\"}");
+    expect_invalid("{\"a\":\"\\u12G4\"}");
+    expect_invalid("{\"a\":\"\\u0000\"}");
+    expect_invalid("{\"a\":01}");
+    expect_invalid("{\"a\":1.}");
+    expect_invalid("{\"a\":.5}");
+    expect_invalid("{\"a\":1e}");
+    expect_invalid("{\"a\":+1}");
+    expect_invalid("{\"a\":-}");
+    expect_invalid("{\"a\":tru}");
+    expect_invalid("{\"a\":True}");
+    expect_invalid("{\"a\":[1,]}");
+    expect_invalid("{\"a\":[1 2]}");
+    expect_invalid("{\"a\":{\"b\"}}");
+    expect_invalid("{\"a\":{1:2}}");
+    expect_invalid("{\"a\":[}");
+    expect_invalid("{\"a\":[1}");
+    expect_invalid("{\"a\":{\"b\":1]}");
+
+    // surrogates must come as a high and low pair
+    expect_invalid("{\"a\":\"\\uD83D\"}");
+    expect_invalid("{\"a\":\"\\uD83Dx\"}");
+    expect_invalid("{\"a\":\"\\uD83D\\u0041\"}");
+    expect_invalid("{\"a\":\"\\uD83D\\uD83D\"}");
+    expect_invalid("{\"a\":\"\\uDE00\"}");
+    expect_invalid("{\"a\":\"\\uDE00\\uD83D\"}");
+    expect_invalid("{\"a\":\"\\uD83D\\uDE\"}");
+
+    test_depth();
+    test_long_strings();
+    test_stop();
+    CHECK_DONE("json");
+}
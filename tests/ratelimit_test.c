@@ -0,0 +1,221 @@
+#include "check.h"
+#include "ratelimit.h"
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/un.h>
+
+#define NSEC_PER_MSEC 1000000ULL
+#define NSEC_PER_SEC 1000000000ULL
+#define START_NSEC NSEC_PER_SEC
+#define POLL_NSEC 10000ULL
+
+static void              peer(const char *addr, struct sockaddr_storage *storage);
+static ratelimit_verdict admit(ratelimit_table *table, const char *addr, uint64_t now_nsec);
+static void              test_burst(void);
+static void              test_refill(void);
+static void              test_remainder(void);
+static void              test_largest_rate(void);
+static void              test_connections(void);
+static void              test_prefixes(void);
+
+static void peer(const char *addr, struct sockaddr_storage *storage)
+{
+    memset(storage, 0, sizeof(*storage));
+    if(strchr(addr, ':'))
+    {
+        struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)storage;
+
+        in6->sin6_family = AF_INET6;
+        CHECK(inet_pton(AF_INET6, addr, &in6->sin6_addr) == 1);
+    }
+    else
+    {
+        struct sockaddr_in *in = (struct sockaddr_in *)storage;
+
+        in->sin_family = AF_INET;
+        CHECK(inet_pton(AF_INET, addr, &in->sin_addr) == 1);
+    }
+}
+
+static ratelimit_verdict admit(ratelimit_table *table, const char *addr, uint64_t now_nsec)
+{
+    struct sockaddr_storage storage;
+    int                     slot;
+
+    peer(addr, &storage);
+    return ratelimit_admit(table, &storage, now_nsec, &slot);
+}
+
+// A new client may send burst requests at once, then waits for the rate.
+static void test_burst(void)
+{
+    ratelimit_table *table = ratelimit_create(2, 3, 0, RATELIMIT_PREFIX4, RATELIMIT_PREFIX6);
+
+    CHECK(table != NULL);
+    if(!table)
+    {
+        return;
+    }
+    for(int i = 0; i < 3; i++)
+    {
+        CHECK(admit(table, "10.0.0.1", START_NSEC) == RATELIMIT_PASS);
+    }
+    CHECK(admit(table, "10.0.0.1", START_NSEC) == RATELIMIT_RATE);
+    CHECK(admit(table, "10.0.0.2", START_NSEC) == RATELIMIT_PASS);
+    free(table);
+
+    // without a burst the bucket holds one second of the rate
+    table = ratelimit_create(2, 0, 0, RATELIMIT_PREFIX4, RATELIMIT_PREFIX6);
+    CHECK(table != NULL && table->burst == 2);
+    free(table);
+}
+
+// Tokens come back at the rate, and a long absence fills the bucket only up to burst.
+static void test_refill(void)
+{
+    ratelimit_table *table = ratelimit_create(2, 2, 0, RATELIMIT_PREFIX4, RATELIMIT_PREFIX6);
+    uint64_t         now   = START_NSEC;
+
+    CHECK(table != NULL);
+    if(!table)
+    {
+        return;
+    }
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_RATE);
+
+    now += 499 * NSEC_PER_MSEC;
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_RATE);
+    now += 1 * NSEC_PER_MSEC;
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_RATE);
+
+    now += 100 * NSEC_PER_SEC;
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_RATE);
+    free(table);
+}
+
+// At 7 a second a token takes 1/7 s. A client retrying every 10us earns a fraction of a thousandth
+// each time; the fraction must carry over, or the token never comes.
+static void test_remainder(void)
+{
+    ratelimit_table *table = ratelimit_create(7, 1, 0, RATELIMIT_PREFIX4, RATELIMIT_PREFIX6);
+    uint64_t         now   = START_NSEC;
+
+    CHECK(table != NULL);
+    if(!table)
+    {
+        return;
+    }
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    do
+    {
+        now += POLL_NSEC;
+    } while(admit(table, "10.0.0.1", now) == RATELIMIT_RATE && now - START_NSEC < NSEC_PER_SEC);
+
+    CHECK(now - START_NSEC >= NSEC_PER_SEC / 7);
+    CHECK(now - START_NSEC <= NSEC_PER_SEC / 7 + NSEC_PER_MSEC);
+    free(table);
+}
+
+// The largest rate whose bucket still fits in the 32 bit token count.
+static void test_largest_rate(void)
+{
+    uint32_t         rate  = UINT32_MAX / RATELIMIT_SCALE;
+    ratelimit_table *table = ratelimit_create(rate, 0, 0, RATELIMIT_PREFIX4, RATELIMIT_PREFIX6);
+    uint64_t         now   = START_NSEC;
+
+    CHECK(table != NULL);
+    if(!table)
+    {
+        return;
+    }
+    for(int i = 0; i < 3; i++)
+    {
+        CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    }
+    now += NSEC_PER_SEC;
+    CHECK(admit(table, "10.0.0.1", now) == RATELIMIT_PASS);
+    for(size_t i = 0; i < RATELIMIT_SLOTS; i++)
+    {
+        CHECK(table->entries[i].tokens <= (uint64_t)rate * RATELIMIT_SCALE);
+    }
+    free(table);
+}
+
+// Open connections are capped per client and given back on release; a refused one costs nothing.
+static void test_connections(void)
+{
+    ratelimit_table        *table = ratelimit_create(0, 0, 2, RATELIMIT_PREFIX4, RATELIMIT_PREFIX6);
+    struct sockaddr_storage client;
+    struct sockaddr_un      local;
+    int                     slots[3];
+
+    CHECK(table != NULL);
+    if(!table)
+    {
+        return;
+    }
+    peer("10.0.0.1", &client);
+    CHECK(ratelimit_admit(table, &client, START_NSEC, &slots[0]) == RATELIMIT_PASS && slots[0] >= 0);
+    CHECK(ratelimit_admit(table, &client, START_NSEC, &slots[1]) == RATELIMIT_PASS && slots[1] == slots[0]);
+    CHECK(ratelimit_admit(table, &client, START_NSEC, &slots[2]) == RATELIMIT_CONNECTIONS && slots[2] == -1);
+    ratelimit_release(table, slots[0]);
+    CHECK(ratelimit_admit(table, &client, START_NSEC, &slots[2]) == RATELIMIT_PASS);
+    ratelimit_release(table, -1);
+
+    // anything but IP goes through untracked
+    memset(&client, 0, sizeof(client));
+    memset(&local, 0, sizeof(local));
+    local.sun_family = AF_UNIX;
+    memcpy(&client, &local, sizeof(local));
+    CHECK(ratelimit_admit(table, &client, START_NSEC, &slots[0]) == RATELIMIT_PASS && slots[0] == -1);
+    free(table);
+}
+
+// Addresses inside one prefix share a bucket; the next prefix over has its own.
+static void test_prefixes(void)
+{
+    ratelimit_table *table = ratelimit_create(1, 1, 0, 24, 64);
+
+    CHECK(table != NULL);
+    if(!table)
+    {
+        return;
+    }
+    CHECK(admit(table, "192.0.2.1", START_NSEC) == RATELIMIT_PASS);
+    CHECK(admit(table, "192.0.2.200", START_NSEC) == RATELIMIT_RATE);
+    CHECK(admit(table, "192.0.3.1", START_NSEC) == RATELIMIT_PASS);
+
+    CHECK(admit(table, "2001:db8::1", START_NSEC) == RATELIMIT_PASS);
+    CHECK(admit(table, "2001:db8::ffff:1", START_NSEC) == RATELIMIT_RATE);
+    CHECK(admit(table, "2001:db8:0:1::1", START_NSEC) == RATELIMIT_PASS);
+    free(table);
+
+    // a /32 for IPv4 keeps every host apart
+    table = ratelimit_create(1, 1, 0, RATELIMIT_PREFIX4, RATELIMIT_PREFIX6);
+    CHECK(table != NULL);
+    if(!table)
+    {
+        return;
+    }
+    CHECK(admit(table, "192.0.2.1", START_NSEC) == RATELIMIT_PASS);
+    CHECK(admit(table, "192.0.2.2", START_NSEC) == RATELIMIT_PASS);
+    CHECK(admit(table, "192.0.2.1", START_NSEC) == RATELIMIT_RATE);
+    free(table);
+}
+
+int main(void)
+{
+    test_burst();
+    test_refill();
+    test_remainder();
+    test_largest_rate();
+    test_connections();
+    test_prefixes();
+    CHECK_DONE("ratelimit");
+}
@@ -0,0 +1,341 @@
+#include "check.h"
+#include "database.h"
+#include "shmdb.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define KEY_SIZE 32
+#define GROW_KEYS 800
+#define WRITERS 2
+
+typedef struct mapped
+{
+    shmdb_header *header;
+    shmdb_slot   *slots;
+    size_t        size;
+} mapped;
+
+static void        open_db(DBO *dbo, char *name);
+static int         map_table(const char *name, mapped *table);
+static void        unmap_table(mapped *table);
+static shmdb_slot *find_slot(const mapped *table, const char *key);
+static void        count_key(const void *key, size_t k_size, void *ctx);
+static void        test_grow(void);
+static void        test_repair_new(void);
+static void        test_repair_rewrite(void);
+static void        test_replaced(void);
+static void        write_keys(char *name, int writer);
+static void        test_writers(char *name, int inherit);
+
+static void open_db(DBO *dbo, char *name)
+{
+    int err = 0;
+
+    dbo->name = name;
+    CHECK(database_open(dbo, &err) == 0 && err == 0);
+}
+
+// A second mapping of the table file, for poking at slots the way a crashed writer would leave them.
+static int map_table(const char *name, mapped *table)
+{
+    char        path[PATH_MAX];
+    struct stat file_stat;
+    void       *addr;
+    int         fd;
+
+    snprintf(path, sizeof(path), "%s%s", name, SHMDB_SUFFIX);
+    fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &file_stat) == -1)
+    {
+        if(fd != -1)
+        {
+            close(fd);
+        }
+        return -1;
+    }
+    addr = mmap(NULL, (size_t)file_stat.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(addr == MAP_FAILED)
+    {
+        return -1;
+    }
+    table->header = (shmdb_header *)addr;
+    table->slots  = (shmdb_slot *)(void *)((char *)addr + SHMDB_HEADER_SIZE);
+    table->size   = (size_t)file_stat.st_size;
+    return 0;
+}
+
+static void unmap_table(mapped *table)
+{
+    munmap(table->header, table->size);
+}
+
+static shmdb_slot *find_slot(const mapped *table, const char *key)
+{
+    for(uint64_t i = 0; i < table->header->capacity; i++)
+    {
+        shmdb_slot *slot = &table->slots[i];
+
+        if(atomic_load(&slot->seq) != 0 && slot->k_size == strlen(key) + 1 && memcmp(slot->key, key, slot->k_size) == 0)
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+static void count_key(const void *key, size_t k_size, void *ctx)
+{
+    (void)key;
+    (void)k_size;
+    (*(size_t *)ctx)++;
+}
+
+// Past the load factor the table is rehashed into a file twice the size; every key must come along.
+static void test_grow(void)
+{
+    char   name[] = "grow";
+    DBO    dbo;
+    mapped table;
+    size_t keys = 0;
+
+    open_db(&dbo, name);
+    for(int i = 0; i < GROW_KEYS; i++)
+    {
+        char key[KEY_SIZE];
+
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(store_string(&dbo, key, key + strlen("key")) == 0);
+    }
+    for(int i = 0; i < GROW_KEYS; i++)
+    {
+        char  key[KEY_SIZE];
+        char *value;
+
+        snprintf(key, sizeof(key), "key%d", i);
+        value = retrieve_string(&dbo, key);
+        CHECK(value && strcmp(value, key + strlen("key")) == 0);
+        free(value);
+    }
+    CHECK(database_foreach_key(&dbo, count_key, &keys) == 0 && keys == GROW_KEYS);
+    database_close(&dbo);
+
+    CHECK(map_table(name, &table) == 0);
+    CHECK(table.header->capacity == 2 * SHMDB_CAPACITY && atomic_load(&table.header->count) == GROW_KEYS);
+    unmap_table(&table);
+}
+
+// A store that died on a slot that was empty: readers skip it, and the next store gives it back.
+static void test_repair_new(void)
+{
+    char        name[] = "repair_new";
+    DBO         dbo;
+    mapped      table;
+    shmdb_slot *slot;
+    char       *value;
+
+    open_db(&dbo, name);
+    CHECK(store_string(&dbo, "a", "1") == 0);
+    CHECK(map_table(name, &table) == 0);
+
+    slot = find_slot(&table, "a");
+    CHECK(slot != NULL);
+    if(!slot)
+    {
+        unmap_table(&table);
+        return;
+    }
+    slot = &table.slots[(slot - table.slots + 1) % (ptrdiff_t)table.header->capacity];
+    CHECK(atomic_load(&slot->seq) == 0);
+    atomic_store(&slot->seq, 1);
+    atomic_store(&table.header->writing, (uint64_t)(slot - table.slots) + 1);
+
+    value = retrieve_string(&dbo, "a");
+    CHECK(value && strcmp(value, "1") == 0);
+    free(value);
+    CHECK(retrieve_string(&dbo, "missing") == NULL);
+
+    CHECK(store_string(&dbo, "b", "2") == 0);
+    CHECK(atomic_load(&table.header->writing) == 0);
+    CHECK(find_slot(&table, "b") != NULL);
+    CHECK(atomic_load(&slot->seq) == 0 || slot == find_slot(&table, "b"));
+    unmap_table(&table);
+    database_close(&dbo);
+}
+
+// A store that died rewriting a value: the key stays, the torn value does not.
+static void test_repair_rewrite(void)
+{
+    char        name[] = "repair_rewrite";
+    DBO         dbo;
+    mapped      table;
+    shmdb_slot *slot;
+    uint32_t    seq;
+    size_t      size = 1;
+    void       *value;
+
+    open_db(&dbo, name);
+    CHECK(store_string(&dbo, "a", "first") == 0);
+    CHECK(map_table(name, &table) == 0);
+    slot = find_slot(&table, "a");
+    CHECK(slot != NULL);
+    if(!slot)
+    {
+        unmap_table(&table);
+        return;
+    }
+    seq = atomic_load(&slot->seq);
+    CHECK(seq > 1 && !(seq & 1u));
+    atomic_store(&slot->seq, seq + 1);
+    memcpy(slot->value, "torn", strlen("torn"));
+    atomic_store(&table.header->writing, (uint64_t)(slot - table.slots) + 1);
+
+    CHECK(retrieve_string(&dbo, "a") == NULL);
+    CHECK(store_string(&dbo, "b", "2") == 0);
+    CHECK(atomic_load(&slot->seq) == seq + 2);
+
+    value = dbo.backend->fetch(&dbo, "a", strlen("a") + 1, &size);
+    CHECK(value != NULL && size == 0);
+    free(value);
+    unmap_table(&table);
+    database_close(&dbo);
+}
+
+// A grower that died between its rename and flagging the old file: the next store must still find
+// the new file by its inode and write there, not into the unlinked one.
+static void test_replaced(void)
+{
+    char        name[] = "replaced";
+    char        path[] = "replaced" SHMDB_SUFFIX;
+    char        tmp[]  = "replaced" SHMDB_SUFFIX ".copy";
+    DBO         dbo;
+    mapped      table;
+    char       *copy;
+    int         fd;
+
+    open_db(&dbo, name);
+    CHECK(store_string(&dbo, "a", "1") == 0);
+
+    CHECK(map_table(name, &table) == 0);
+    copy = (char *)malloc(table.size);
+    CHECK(copy != NULL);
+    if(!copy)
+    {
+        unmap_table(&table);
+        return;
+    }
+    memcpy(copy, table.header, table.size);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, S_IRUSR | S_IWUSR);
+    CHECK(fd != -1 && write(fd, copy, table.size) == (ssize_t)table.size);
+    close(fd);
+    free(copy);
+    unmap_table(&table);
+    CHECK(rename(tmp, path) == 0);
+
+    CHECK(store_string(&dbo, "b", "2") == 0);
+    CHECK(map_table(name, &table) == 0);
+    CHECK(find_slot(&table, "a") != NULL && find_slot(&table, "b") != NULL);
+    unmap_table(&table);
+    database_close(&dbo);
+}
+
+// Both writers store the same keys, enough of them to grow the table while the other is writing.
+static void write_keys(char *name, int writer)
+{
+    DBO dbo;
+
+    open_db(&dbo, name);
+    for(int i = 0; i < GROW_KEYS; i++)
+    {
+        char key[KEY_SIZE];
+        char value[KEY_SIZE];
+
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(value, sizeof(value), "%d:%d", writer, i);
+        CHECK(store_string(&dbo, key, value) == 0);
+    }
+    database_close(&dbo);
+}
+
+// With the flock held by one writer at a time, each key is inserted once and no slot is left open.
+// With inherit the parent maps the table before forking, as the server does for WAL recovery, so
+// the writers start out on its descriptor and must each open their own.
+static void test_writers(char *name, int inherit)
+{
+    pid_t  pids[WRITERS];
+    DBO    dbo;
+    mapped table;
+    size_t keys = 0;
+
+    if(inherit)
+    {
+        open_db(&dbo, name);
+        database_close(&dbo);
+    }
+    for(int w = 0; w < WRITERS; w++)
+    {
+        pids[w] = fork();
+        if(pids[w] == 0)
+        {
+            write_keys(name, w);
+            _exit(check_failures ? EXIT_FAILURE : EXIT_SUCCESS);
+        }
+        CHECK(pids[w] > 0);
+    }
+    for(int w = 0; w < WRITERS; w++)
+    {
+        int status = 0;
+
+        CHECK(pids[w] > 0 && waitpid(pids[w], &status, 0) == pids[w] && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    open_db(&dbo, name);
+    for(int i = 0; i < GROW_KEYS; i++)
+    {
+        char  key[KEY_SIZE];
+        char  suffix[KEY_SIZE];
+        char *value;
+
+        snprintf(key, sizeof(key), "key%d", i);
+        snprintf(suffix, sizeof(suffix), ":%d", i);
+        value = retrieve_string(&dbo, key);
+        CHECK(value && (value[0] == '0' || value[0] == '1') && strcmp(value + 1, suffix) == 0);
+        free(value);
+    }
+    CHECK(database_foreach_key(&dbo, count_key, &keys) == 0 && keys == GROW_KEYS);
+    database_close(&dbo);
+
+    CHECK(map_table(name, &table) == 0);
+    CHECK(atomic_load(&table.header->count) == GROW_KEYS && atomic_load(&table.header->writing) == 0);
+    for(uint64_t i = 0; i < table.header->capacity; i++)
+    {
+        CHECK(!(atomic_load(&table.slots[i].seq) & 1u));
+    }
+    unmap_table(&table);
+}
+
+int main(void)
+{
+    char dir[]       = "/tmp/shmdb_test_XXXXXX";
+    char writers[]   = "writers";
+    char inherited[] = "inherited";
+
+    // the tables are files, so they are made in a scratch directory rather than next to the sources
+    if(!mkdtemp(dir) || chdir(dir) == -1 || setenv(DB_BACKEND_ENV, "shm", 1) == -1)
+    {
+        perror("shmdb_test setup");
+        return EXIT_FAILURE;
+    }
+    test_writers(writers, 0);
+    test_writers(inherited, 1);
+    test_grow();
+    test_repair_new();
+    test_repair_rewrite();
+    test_replaced();
+    CHECK_DONE("shmdb");
+}